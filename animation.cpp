@@ -0,0 +1,66 @@
+#include <cmath>
+
+#include "cvec.h"
+#include "rigtform.h"
+#include "scenestore.h"
+#include "animation.h"
+
+using namespace std;
+
+void NodeAnimation::apply(SceneStore& scene, double t) const {
+  if (!scene.contains(target))
+    return;
+  const double d = duration();
+  if (loop && d > 0)
+    t = t - d * floor(t / d);
+
+  if (!translation.empty() || !rotation.empty()) {
+    RigTForm local = scene.getLocal(target);
+    if (!translation.empty())
+      local.setTranslation(translation.sample(t));
+    if (!rotation.empty())
+      local.setRotation(rotation.sample(t));
+    scene.setLocal(target, local);
+  }
+  if (!scale.empty())
+    scene.setScale(target, scale.sample(t));
+}
+
+NodeAnimation& Animator::add(const NodeHandle& target) {
+  animations_.push_back(NodeAnimation());
+  animations_.back().target = target;
+  return animations_.back();
+}
+
+namespace {
+
+struct EvaluateContext {
+  const NodeAnimation *animations;
+  SceneStore *scene;
+  double time;
+};
+
+}
+
+void Animator::evaluateChunk(int begin, int end, void *data) {
+  const EvaluateContext& ctx = *static_cast<EvaluateContext*>(data);
+  for (int i = begin; i < end; ++i) {
+    ctx.animations[i].apply(*ctx.scene, ctx.time);
+  }
+}
+
+void Animator::evaluate(JobSystem& js, SceneStore& scene, const double time, const int grain) const {
+  if (animations_.empty())
+    return;
+  EvaluateContext ctx;
+  ctx.animations = &animations_[0];
+  ctx.scene = &scene;
+  ctx.time = time;
+  js.parallelFor(0, animations_.size(), grain, evaluateChunk, &ctx);
+}
+
+void Animator::evaluate(SceneStore& scene, const double time) const {
+  for (size_t i = 0; i < animations_.size(); ++i) {
+    animations_[i].apply(scene, time);
+  }
+}
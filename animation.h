@@ -0,0 +1,135 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include <vector>
+#include <algorithm>
+#include <cassert>
+
+#include "cvec.h"
+#include "quat.h"
+#include "rigtform.h"
+#include "jobsystem.h"
+#include "scenestore.h"
+
+//--------------------------------------------------------------------------------
+// Keyframe animation of scene nodes. A NodeAnimation drives the local
+// transform and scale of one node from up to three key tracks (translation,
+// rotation, scale); an Animator samples all of them for a given time and
+// writes the results into the SceneStore, in parallel over the job system.
+//--------------------------------------------------------------------------------
+
+inline Cvec3 interpolateKeys(const Cvec3& a, const Cvec3& b, const double alpha) {
+  return a * (1 - alpha) + b * alpha;
+}
+
+inline Quat interpolateKeys(const Quat& a, const Quat& b, const double alpha) {
+  return slerp(a, b, alpha);
+}
+
+// Values of one channel at increasing key times, interpolated in between and
+// clamped outside. Lookups remember the last segment found: playback moves
+// forward by a small step each update, so the cached segment or the one after
+// it almost always holds and the binary search is only needed after a jump.
+template <typename T>
+class KeyTrack {
+public:
+  KeyTrack() : cursor_(0) {}
+
+  // Keys must be added in increasing time order
+  void addKey(const double time, const T& value) {
+    assert(times_.empty() || time > times_.back());
+    times_.push_back(time);
+    values_.push_back(value);
+  }
+
+  bool empty() const {
+    return times_.empty();
+  }
+
+  int size() const {
+    return times_.size();
+  }
+
+  // Time of the last key
+  double endTime() const {
+    return times_.empty() ? 0 : times_.back();
+  }
+
+  T sample(const double t) const {
+    assert(!empty());
+    if (t <= times_.front())
+      return values_.front();
+    if (t >= times_.back())
+      return values_.back();
+    const int k = findSegment(t);
+    const double alpha = (t - times_[k]) / (times_[k+1] - times_[k]);
+    return interpolateKeys(values_[k], values_[k+1], alpha);
+  }
+
+private:
+  std::vector<double> times_;
+  std::vector<T> values_;
+  mutable int cursor_;   // first key of the last segment found
+
+  // Index k of the key with times_[k] <= t < times_[k+1]; t must lie
+  // strictly inside the track
+  int findSegment(const double t) const {
+    const int n = times_.size();
+    if (times_[cursor_] <= t && t < times_[cursor_+1])
+      return cursor_;
+    if (cursor_ + 2 < n && times_[cursor_+1] <= t && t < times_[cursor_+2])
+      return ++cursor_;
+    cursor_ = std::upper_bound(times_.begin(), times_.end(), t) - times_.begin() - 1;
+    return cursor_;
+  }
+};
+
+// Animation of a single node. Empty tracks leave that part of the node
+// alone. Looping animations wrap around at the end of their longest track.
+struct NodeAnimation {
+  NodeHandle target;
+  KeyTrack<Cvec3> translation;
+  KeyTrack<Quat> rotation;
+  KeyTrack<Cvec3> scale;
+  bool loop;
+
+  NodeAnimation() : loop(true) {}
+
+  double duration() const {
+    return std::max(translation.endTime(), std::max(rotation.endTime(), scale.endTime()));
+  }
+
+  // Samples the tracks at time t and writes the node's local transform and
+  // scale. Does nothing if the node no longer exists.
+  void apply(SceneStore& scene, double t) const;
+};
+
+class Animator {
+public:
+  // Adds an animation for target and returns it for filling in its keys.
+  // The reference is invalidated by the next add(). At most one animation
+  // may drive a node, since evaluation writes nodes from several threads.
+  NodeAnimation& add(const NodeHandle& target);
+
+  void clear() {
+    animations_.clear();
+  }
+
+  int size() const {
+    return animations_.size();
+  }
+
+  // Samples every animation at time seconds and writes its node. Splits the
+  // animations over the job system in chunks of grain animations.
+  void evaluate(JobSystem& js, SceneStore& scene, const double time, const int grain = 256) const;
+
+  // Single threaded evaluate()
+  void evaluate(SceneStore& scene, const double time) const;
+
+private:
+  std::vector<NodeAnimation> animations_;
+
+  static void evaluateChunk(int begin, int end, void *ctx);
+};
+
+#endif
@@ -5,6 +5,11 @@
 #include <cassert>
 #include <algorithm>
 
+#if defined(__SSE__)
+#   include <xmmintrin.h>
+#   define CVEC_SSE 1
+#endif
+
 
 static const double CS175_PI = 3.14159265358979323846264338327950288;
 static const double CS175_EPS = 1e-8;
@@ -12,6 +17,14 @@ static const double CS175_EPS2 = CS175_EPS * CS175_EPS;
 static const double CS175_EPS3 = CS175_EPS * CS175_EPS * CS175_EPS;
 
 
+// Tag selecting constructors that leave the elements uninitialized, for
+// callers that are about to overwrite all of them
+struct CvecNoInit {};
+
+// Lazily evaluated vector expression, see lazy() below
+template <typename E, typename T, int n>
+class CvecExpr;
+
 template <typename T, int n>
 class Cvec {
   T d_[n];
@@ -23,6 +36,24 @@ public:
     }
   }
 
+  explicit Cvec(CvecNoInit) {}
+
+  // Evaluates a lazy expression in a single pass
+  template <typename E>
+  Cvec(const CvecExpr<E, T, n>& e) {
+    for (int i = 0; i < n; ++i) {
+      d_[i] = e[i];
+    }
+  }
+
+  template <typename E>
+  Cvec& operator = (const CvecExpr<E, T, n>& e) {
+    for (int i = 0; i < n; ++i) {
+      d_[i] = e[i];
+    }
+    return *this;
+  }
+
   Cvec(const T& t) {
     for (int i = 0; i < n; ++i) {
       d_[i] = t;
@@ -72,7 +103,11 @@ public:
   }
 
   Cvec operator - () const {
-    return Cvec(*this) *= -1;
+    Cvec r((CvecNoInit()));
+    for (int i = 0; i < n; ++i) {
+      r.d_[i] = -d_[i];
+    }
+    return r;
   }
 
   Cvec& operator += (const Cvec& v) {
@@ -104,20 +139,34 @@ public:
     return *this;
   }
 
+  // The binary operators write straight into an uninitialized result
+  // rather than copying *this and updating the copy
   Cvec operator + (const Cvec& v) const {
-    return Cvec(*this) += v;
+    Cvec r((CvecNoInit()));
+    for (int i = 0; i < n; ++i) {
+      r.d_[i] = d_[i] + v.d_[i];
+    }
+    return r;
   }
 
   Cvec operator - (const Cvec& v) const {
-    return Cvec(*this) -= v;
+    Cvec r((CvecNoInit()));
+    for (int i = 0; i < n; ++i) {
+      r.d_[i] = d_[i] - v.d_[i];
+    }
+    return r;
   }
 
   Cvec operator * (const T a) const {
-    return Cvec(*this) *= a;
+    Cvec r((CvecNoInit()));
+    for (int i = 0; i < n; ++i) {
+      r.d_[i] = d_[i] * a;
+    }
+    return r;
   }
 
   Cvec operator / (const T a) const {
-    return Cvec(*this) /= a;
+    return *this * (1/a);
   }
 
   // Normalize self and returns self
@@ -159,6 +208,342 @@ inline Cvec<T, n> normalize(const Cvec<T,n>& v) {
   return v / norm(v);
 }
 
+// Single precision 4-vectors are kept in one 16-byte aligned SSE register
+// (a plain aligned array without SSE) so that float math on the render path
+// runs four lanes at a time. Same interface as the generic Cvec.
+template <>
+class Cvec<float, 4> {
+#ifdef CVEC_SSE
+  union {
+    __m128 v_;
+    float d_[4];
+  };
+#else
+  float d_[4] __attribute__((aligned(16)));
+#endif
+
+public:
+  Cvec() {
+#ifdef CVEC_SSE
+    v_ = _mm_setzero_ps();
+#else
+    d_[0] = d_[1] = d_[2] = d_[3] = 0;
+#endif
+  }
+
+  Cvec(const float& t) {
+#ifdef CVEC_SSE
+    v_ = _mm_set1_ps(t);
+#else
+    d_[0] = d_[1] = d_[2] = d_[3] = t;
+#endif
+  }
+
+  Cvec(const float& t0, const float& t1, const float& t2, const float& t3) {
+#ifdef CVEC_SSE
+    v_ = _mm_setr_ps(t0, t1, t2, t3);
+#else
+    d_[0] = t0, d_[1] = t1, d_[2] = t2, d_[3] = t3;
+#endif
+  }
+
+  // either truncate if m < 4, or extend with extendValue
+  template<int m>
+  explicit Cvec(const Cvec<float, m>& v, const float& extendValue = 0.f) {
+    for (int i = 0; i < std::min(m, 4); ++i) {
+      d_[i] = v[i];
+    }
+    for (int i = std::min(m, 4); i < 4; ++i) {
+      d_[i] = extendValue;
+    }
+  }
+
+  explicit Cvec(CvecNoInit) {}
+
+  template <typename E>
+  Cvec(const CvecExpr<E, float, 4>& e) {
+    for (int i = 0; i < 4; ++i) {
+      d_[i] = e[i];
+    }
+  }
+
+  template <typename E>
+  Cvec& operator = (const CvecExpr<E, float, 4>& e) {
+    for (int i = 0; i < 4; ++i) {
+      d_[i] = e[i];
+    }
+    return *this;
+  }
+
+#ifdef CVEC_SSE
+  explicit Cvec(const __m128 v) : v_(v) {}
+
+  __m128 simd() const {
+    return v_;
+  }
+#endif
+
+  float& operator [] (const int i) {
+    return d_[i];
+  }
+
+  const float& operator [] (const int i) const {
+    return d_[i];
+  }
+
+  float& operator () (const int i) {
+    return d_[i];
+  }
+
+  const float& operator () (const int i) const {
+    return d_[i];
+  }
+
+  Cvec operator - () const {
+    return Cvec(*this) *= -1.f;
+  }
+
+#ifdef CVEC_SSE
+  Cvec& operator += (const Cvec& v) {
+    v_ = _mm_add_ps(v_, v.v_);
+    return *this;
+  }
+
+  Cvec& operator -= (const Cvec& v) {
+    v_ = _mm_sub_ps(v_, v.v_);
+    return *this;
+  }
+
+  Cvec& operator *= (const float a) {
+    v_ = _mm_mul_ps(v_, _mm_set1_ps(a));
+    return *this;
+  }
+#else
+  Cvec& operator += (const Cvec& v) {
+    for (int i = 0; i < 4; ++i) {
+      d_[i] += v[i];
+    }
+    return *this;
+  }
+
+  Cvec& operator -= (const Cvec& v) {
+    for (int i = 0; i < 4; ++i) {
+      d_[i] -= v[i];
+    }
+    return *this;
+  }
+
+  Cvec& operator *= (const float a) {
+    for (int i = 0; i < 4; ++i) {
+      d_[i] *= a;
+    }
+    return *this;
+  }
+#endif
+
+  Cvec& operator /= (const float a) {
+    return *this *= 1/a;
+  }
+
+  Cvec operator + (const Cvec& v) const {
+    return Cvec(*this) += v;
+  }
+
+  Cvec operator - (const Cvec& v) const {
+    return Cvec(*this) -= v;
+  }
+
+  Cvec operator * (const float a) const {
+    return Cvec(*this) *= a;
+  }
+
+  Cvec operator / (const float a) const {
+    return Cvec(*this) /= a;
+  }
+
+  // Normalize self and returns self
+  Cvec& normalize();
+};
+
+#ifdef CVEC_SSE
+// Horizontal sum of the four lanes, broadcast to all lanes
+inline __m128 cvecHorizontalSum(const __m128 m) {
+  const __m128 s = _mm_add_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_add_ps(s, _mm_shuffle_ps(s, s, _MM_SHUFFLE(1, 0, 3, 2)));
+}
+
+inline float dot(const Cvec<float,4>& a, const Cvec<float,4>& b) {
+  return _mm_cvtss_f32(cvecHorizontalSum(_mm_mul_ps(a.simd(), b.simd())));
+}
+
+// Cross product of the xyz parts; w of the result is 0
+inline Cvec<float,4> cross(const Cvec<float,4>& a, const Cvec<float,4>& b) {
+  const __m128 a_yzx = _mm_shuffle_ps(a.simd(), a.simd(), _MM_SHUFFLE(3, 0, 2, 1));
+  const __m128 b_yzx = _mm_shuffle_ps(b.simd(), b.simd(), _MM_SHUFFLE(3, 0, 2, 1));
+  const __m128 c = _mm_sub_ps(_mm_mul_ps(a.simd(), b_yzx), _mm_mul_ps(a_yzx, b.simd()));
+  return Cvec<float,4>(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1)));
+}
+
+inline Cvec<float,4>& Cvec<float,4>::normalize() {
+  const __m128 len2 = cvecHorizontalSum(_mm_mul_ps(v_, v_));
+  assert(_mm_cvtss_f32(len2) > CS175_EPS2);
+  v_ = _mm_div_ps(v_, _mm_sqrt_ps(len2));
+  return *this;
+}
+#else
+// Cross product of the xyz parts; w of the result is 0
+inline Cvec<float,4> cross(const Cvec<float,4>& a, const Cvec<float,4>& b) {
+  return Cvec<float,4>(a(1)*b(2)-a(2)*b(1), a(2)*b(0)-a(0)*b(2), a(0)*b(1)-a(1)*b(0), 0);
+}
+
+inline Cvec<float,4>& Cvec<float,4>::normalize() {
+  assert(dot(*this, *this) > CS175_EPS2);
+  return *this /= std::sqrt(dot(*this, *this));
+}
+#endif
+
+//--------------------------------------------------------------------------------
+// Expression templates. Wrapping an operand in lazy() makes +, - and scalar
+// * and / build an expression object instead of a temporary Cvec; the whole
+// expression is then evaluated element by element in one loop when it is
+// assigned to a Cvec. For example
+//
+//   Cvec3 r = lazy(a) * s + lazy(b) * t - c;
+//
+// makes one pass over the elements and no temporaries. Expressions refer to
+// their Cvec operands, so do not keep one around beyond the statement that
+// built it.
+//--------------------------------------------------------------------------------
+
+template <typename E, typename T, int n>
+class CvecExpr {
+  E e_;
+
+public:
+  explicit CvecExpr(const E& e) : e_(e) {}
+
+  T operator [] (const int i) const {
+    return e_[i];
+  }
+
+  Cvec<T, n> eval() const {
+    return Cvec<T, n>(*this);
+  }
+};
+
+template <typename T, int n>
+struct CvecLeaf {
+  const Cvec<T, n>& v;
+
+  explicit CvecLeaf(const Cvec<T, n>& v) : v(v) {}
+
+  T operator [] (const int i) const {
+    return v[i];
+  }
+};
+
+template <typename L, typename R, typename T>
+struct CvecSum {
+  L l;
+  R r;
+
+  CvecSum(const L& l, const R& r) : l(l), r(r) {}
+
+  T operator [] (const int i) const {
+    return l[i] + r[i];
+  }
+};
+
+template <typename L, typename R, typename T>
+struct CvecDifference {
+  L l;
+  R r;
+
+  CvecDifference(const L& l, const R& r) : l(l), r(r) {}
+
+  T operator [] (const int i) const {
+    return l[i] - r[i];
+  }
+};
+
+template <typename E, typename T>
+struct CvecScaled {
+  E e;
+  T a;
+
+  CvecScaled(const E& e, const T a) : e(e), a(a) {}
+
+  T operator [] (const int i) const {
+    return e[i] * a;
+  }
+};
+
+template <typename T, int n>
+inline CvecExpr<CvecLeaf<T, n>, T, n> lazy(const Cvec<T, n>& v) {
+  return CvecExpr<CvecLeaf<T, n>, T, n>(CvecLeaf<T, n>(v));
+}
+
+template <typename A, typename B, typename T, int n>
+inline CvecExpr<CvecSum<CvecExpr<A, T, n>, CvecExpr<B, T, n>, T>, T, n>
+operator + (const CvecExpr<A, T, n>& a, const CvecExpr<B, T, n>& b) {
+  typedef CvecSum<CvecExpr<A, T, n>, CvecExpr<B, T, n>, T> Op;
+  return CvecExpr<Op, T, n>(Op(a, b));
+}
+
+template <typename A, typename T, int n>
+inline CvecExpr<CvecSum<CvecExpr<A, T, n>, CvecLeaf<T, n>, T>, T, n>
+operator + (const CvecExpr<A, T, n>& a, const Cvec<T, n>& b) {
+  typedef CvecSum<CvecExpr<A, T, n>, CvecLeaf<T, n>, T> Op;
+  return CvecExpr<Op, T, n>(Op(a, CvecLeaf<T, n>(b)));
+}
+
+template <typename B, typename T, int n>
+inline CvecExpr<CvecSum<CvecLeaf<T, n>, CvecExpr<B, T, n>, T>, T, n>
+operator + (const Cvec<T, n>& a, const CvecExpr<B, T, n>& b) {
+  typedef CvecSum<CvecLeaf<T, n>, CvecExpr<B, T, n>, T> Op;
+  return CvecExpr<Op, T, n>(Op(CvecLeaf<T, n>(a), b));
+}
+
+template <typename A, typename B, typename T, int n>
+inline CvecExpr<CvecDifference<CvecExpr<A, T, n>, CvecExpr<B, T, n>, T>, T, n>
+operator - (const CvecExpr<A, T, n>& a, const CvecExpr<B, T, n>& b) {
+  typedef CvecDifference<CvecExpr<A, T, n>, CvecExpr<B, T, n>, T> Op;
+  return CvecExpr<Op, T, n>(Op(a, b));
+}
+
+template <typename A, typename T, int n>
+inline CvecExpr<CvecDifference<CvecExpr<A, T, n>, CvecLeaf<T, n>, T>, T, n>
+operator - (const CvecExpr<A, T, n>& a, const Cvec<T, n>& b) {
+  typedef CvecDifference<CvecExpr<A, T, n>, CvecLeaf<T, n>, T> Op;
+  return CvecExpr<Op, T, n>(Op(a, CvecLeaf<T, n>(b)));
+}
+
+template <typename B, typename T, int n>
+inline CvecExpr<CvecDifference<CvecLeaf<T, n>, CvecExpr<B, T, n>, T>, T, n>
+operator - (const Cvec<T, n>& a, const CvecExpr<B, T, n>& b) {
+  typedef CvecDifference<CvecLeaf<T, n>, CvecExpr<B, T, n>, T> Op;
+  return CvecExpr<Op, T, n>(Op(CvecLeaf<T, n>(a), b));
+}
+
+template <typename A, typename T, int n>
+inline CvecExpr<CvecScaled<CvecExpr<A, T, n>, T>, T, n>
+operator * (const CvecExpr<A, T, n>& a, const T s) {
+  typedef CvecScaled<CvecExpr<A, T, n>, T> Op;
+  return CvecExpr<Op, T, n>(Op(a, s));
+}
+
+template <typename A, typename T, int n>
+inline CvecExpr<CvecScaled<CvecExpr<A, T, n>, T>, T, n>
+operator * (const T s, const CvecExpr<A, T, n>& a) {
+  return a * s;
+}
+
+template <typename A, typename T, int n>
+inline CvecExpr<CvecScaled<CvecExpr<A, T, n>, T>, T, n>
+operator / (const CvecExpr<A, T, n>& a, const T s) {
+  return a * (1/s);
+}
+
 // element of type double precision float
 typedef Cvec <double, 2> Cvec2;
 typedef Cvec <double, 3> Cvec3;
@@ -0,0 +1,473 @@
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <cmath>
+
+#include "cvec.h"
+#include "matrix4.h"
+#include "matrix4f.h"
+#include "rigtform.h"
+#include "scenestore.h"
+#include "profiler.h"
+#include "framebuild.h"
+
+using namespace std;
+
+namespace {
+
+struct Plane {
+  double a, b, c, d;
+};
+
+struct BuildContext {
+  const SceneStore *scene;
+  const FrameBuildParams *params;
+  Matrix4f invEyeTransform;
+  bool cameraRelative;
+  Matrix4f eyeRotation;          // invEyeTransform without its translation
+  Cvec3 eyePosition;             // in world coordinates
+  Plane planes[6];
+  const OcclusionBuffer *occlusion;
+  PacketCache::Entry *cache;     // by slot, NULL without a packet cache
+  bool cacheValid;               // cached entries were built for this view
+  DrawPacket *out;
+  vector<int> visible;   // number of packets written by each chunk
+  int culled;
+  int occluded;
+  int recomputed;
+  int reused;
+};
+
+}
+
+// Extracts the clip planes of a projection matrix in eye space (Gribb and
+// Hartmann). A point p is inside when a*x + b*y + c*z + d >= 0 for all six.
+static void extractFrustumPlanes(const Matrix4& proj, Plane planes[6]) {
+  for (int i = 0; i < 3; ++i) {
+    for (int s = 0; s < 2; ++s) {
+      const double sign = s == 0 ? 1 : -1;
+      Plane& p = planes[2*i + s];
+      p.a = proj(3,0) + sign * proj(i,0);
+      p.b = proj(3,1) + sign * proj(i,1);
+      p.c = proj(3,2) + sign * proj(i,2);
+      p.d = proj(3,3) + sign * proj(i,3);
+      const double len = std::sqrt(p.a*p.a + p.b*p.b + p.c*p.c);
+      p.a /= len, p.b /= len, p.c /= len, p.d /= len;
+    }
+  }
+}
+
+// Largest scale factor applied by the linear part of m
+static float maxScale(const Matrix4f& m) {
+  Cvec4f c[3];
+  for (int j = 0; j < 3; ++j) {
+    c[j] = m.column(j);
+    c[j][3] = 0;
+  }
+  return std::sqrt(max(dot(c[0], c[0]), max(dot(c[1], c[1]), dot(c[2], c[2]))));
+}
+
+static bool sphereVisible(const Plane planes[6], const Cvec3& center, const double radius) {
+  const double x = center[0], y = center[1], z = center[2];
+  for (int i = 0; i < 6; ++i) {
+    const Plane& p = planes[i];
+    if (p.a*x + p.b*y + p.c*z + p.d < -radius)
+      return false;
+  }
+  return true;
+}
+
+// Same for the node of model view matrix MVM
+static bool sphereVisible(const Plane planes[6], const Matrix4f& MVM, const double radius) {
+  return sphereVisible(planes, Cvec3(MVM(0,3), MVM(1,3), MVM(2,3)), radius);
+}
+
+// Model view matrix of a slot. The render world and inverse eye matrices
+// are single precision, so far from the origin each translation is off by
+// up to half a float ulp of its distance from the origin, and their product
+// keeps that error however close the node is to the camera. In camera
+// relative mode the camera position is subtracted from the node's double
+// precision world position first, and only the offset is narrowed; the
+// eye's rotation is applied to the float columns as before, skipping the
+// zero fourth components.
+static Matrix4f modelView(const BuildContext& ctx, const SceneStore& scene, const int slot) {
+  const Matrix4f& w = scene.renderWorld(slot);
+  if (!ctx.cameraRelative)
+    return ctx.invEyeTransform * w;
+  const Matrix4f& r = ctx.eyeRotation;
+  const Cvec3 d = scene.world(slot).getTranslation() - ctx.eyePosition;
+  Matrix4f MVM;
+  for (int j = 0; j < 3; ++j) {
+    const Cvec4f& c = w.column(j);
+    MVM.column(j) = r.column(0) * c[0] + r.column(1) * c[1] + r.column(2) * c[2];
+  }
+  const Cvec4f offset = r.column(0) * (float)d[0] + r.column(1) * (float)d[1] + r.column(2) * (float)d[2];
+  MVM.column(3) = Cvec4f(offset[0], offset[1], offset[2], 1);
+  return MVM;
+}
+
+static bool sameMatrix(const Matrix4& a, const Matrix4& b) {
+  return memcmp(&a[0], &b[0], 16 * sizeof(double)) == 0;
+}
+
+static void buildChunk(int begin, int end, void *data) {
+  ProfileScope scope("cull chunk");
+  BuildContext& ctx = *static_cast<BuildContext*>(data);
+  const FrameBuildParams& params = *ctx.params;
+
+  // Chunks write their survivors starting at their own first slot and are
+  // compacted afterwards
+  DrawPacket *out = ctx.out + begin;
+  int n = 0;
+  int culled = 0, occluded = 0, recomputed = 0, reused = 0;
+  const SceneStore& scene = *ctx.scene;
+  for (int i = begin; i < end; ++i) {
+    if (!scene.isAlive(i))
+      continue;
+    const bool selected = scene.handleAt(i) == params.selected;
+    if (ctx.cache) {
+      PacketCache::Entry& e = ctx.cache[i];
+      if (ctx.cacheValid && e.worldVersion == scene.worldVersion(i) && e.selected == selected) {
+        ++reused;
+      }
+      else {
+        ++recomputed;
+        const Matrix4f MVM = modelView(ctx, scene, i);
+        e.worldVersion = scene.worldVersion(i);
+        e.selected = selected;
+        e.radius = scene.radius(i) * maxScale(MVM);
+        e.visible = sphereVisible(ctx.planes, MVM, e.radius);
+        if (e.visible)
+          writeDrawPacket(e.packet, scene.geometry(i), params.shader, MVM,
+                          selected ? params.selectedColor : scene.color(i));
+      }
+      if (!e.visible) {
+        ++culled;
+        continue;
+      }
+      const float *t = e.packet.mvm + 12;
+      if (ctx.occlusion && ctx.occlusion->sphereOccluded(Cvec3(t[0], t[1], t[2]), e.radius)) {
+        ++occluded;
+        continue;
+      }
+      out[n++] = e.packet;
+      continue;
+    }
+
+    ++recomputed;
+    const Matrix4f MVM = modelView(ctx, scene, i);
+    const double radius = scene.radius(i) * maxScale(MVM);
+    if (!sphereVisible(ctx.planes, MVM, radius)) {
+      ++culled;
+      continue;
+    }
+    if (ctx.occlusion && ctx.occlusion->sphereOccluded(Cvec3(MVM(0,3), MVM(1,3), MVM(2,3)), radius)) {
+      ++occluded;
+      continue;
+    }
+    writeDrawPacket(out[n++], scene.geometry(i), params.shader, MVM,
+                    selected ? params.selectedColor : scene.color(i));
+  }
+  ctx.visible[begin / params.grain] = n;
+  __sync_fetch_and_add(&ctx.culled, culled);
+  __sync_fetch_and_add(&ctx.occluded, occluded);
+  __sync_fetch_and_add(&ctx.recomputed, recomputed);
+  __sync_fetch_and_add(&ctx.reused, reused);
+}
+
+
+// Rasterizes the largest occluder candidates in the frustum into the
+// occlusion buffer. Occluders are drawn as boxes, so only cubes qualify.
+// Scale is not inherited, so a node's world radius is its radius times its
+// largest scale factor.
+static void rasterizeOccluders(const SceneStore& scene, const BuildContext& ctx) {
+  ProfileScope scope("occluders");
+  const FrameBuildParams& params = *ctx.params;
+  OcclusionBuffer& buffer = *params.occlusion;
+  buffer.clear(params.projection);
+
+  vector<pair<double, int> > candidates;   // (-size on screen, slot)
+  for (int i = 0, n = scene.numSlots(); i < n; ++i) {
+    if (!scene.isAlive(i) || scene.geometry(i) != GEOMETRY_CUBE)
+      continue;
+    const Cvec3& s = scene.scale(i);
+    const double radius = scene.radius(i) * max(std::abs(s[0]), max(std::abs(s[1]), std::abs(s[2])));
+    if (radius < params.occluderMinRadius)
+      continue;
+    const Matrix4f MVM = modelView(ctx, scene, i);
+    if (!sphereVisible(ctx.planes, MVM, radius))
+      continue;
+    const double dist = std::sqrt(MVM(0,3) * MVM(0,3) + MVM(1,3) * MVM(1,3) + MVM(2,3) * MVM(2,3));
+    candidates.push_back(make_pair(-radius / max(dist, 1e-3), i));
+  }
+  const int count = min((int)candidates.size(), params.maxOccluders);
+  partial_sort(candidates.begin(), candidates.begin() + count, candidates.end());
+  for (int k = 0; k < count; ++k) {
+    buffer.addBox(modelView(ctx, scene, candidates[k].second));
+  }
+  buffer.finish();
+}
+
+int buildObjectPacketsParallel(JobSystem& js, RenderQueue& queue,
+                               SceneStore& scene,
+                               const FrameBuildParams& params) {
+  {
+    ProfileScope scope("transforms");
+    scene.updateWorldTransforms(js, params.grain);
+  }
+
+  const int n = scene.numSlots();
+  if (n == 0)
+    return 0;
+
+  BuildContext ctx;
+  ctx.scene = &scene;
+  ctx.culled = 0;
+  ctx.occluded = 0;
+  ctx.recomputed = 0;
+  ctx.reused = 0;
+  ctx.params = &params;
+  ctx.invEyeTransform = Matrix4f(params.invEyeTransform);
+  ctx.cameraRelative = params.cameraRelative;
+  ctx.eyeRotation = ctx.invEyeTransform;
+  ctx.eyeRotation.column(3) = Cvec4f(0, 0, 0, 1);
+  // The inverse eye matrix is [R^T, -R^T p] for the eye at p rotated by R
+  const Matrix4& invEye = params.invEyeTransform;
+  for (int j = 0; j < 3; ++j) {
+    ctx.eyePosition[j] = -(invEye(0,j) * invEye(0,3) + invEye(1,j) * invEye(1,3) + invEye(2,j) * invEye(2,3));
+  }
+  extractFrustumPlanes(params.projection, ctx.planes);
+  ctx.occlusion = params.occlusion;
+  if (params.occlusion)
+    rasterizeOccluders(scene, ctx);
+  ctx.cache = NULL;
+  ctx.cacheValid = false;
+  if (PacketCache *cache = params.packetCache) {
+    ctx.cacheValid = cache->valid && cache->shader == params.shader &&
+      cache->cameraRelative == params.cameraRelative &&
+      sameMatrix(cache->invEyeTransform, params.invEyeTransform) &&
+      sameMatrix(cache->projection, params.projection) &&
+      cache->selectedColor[0] == params.selectedColor[0] &&
+      cache->selectedColor[1] == params.selectedColor[1] &&
+      cache->selectedColor[2] == params.selectedColor[2];
+    if ((int)cache->entries.size() < n) {
+      PacketCache::Entry none;
+      none.worldVersion = 0;
+      cache->entries.resize(n, none);
+    }
+    cache->valid = true;
+    cache->invEyeTransform = params.invEyeTransform;
+    cache->projection = params.projection;
+    cache->shader = params.shader;
+    cache->cameraRelative = params.cameraRelative;
+    cache->selectedColor = params.selectedColor;
+    ctx.cache = &cache->entries[0];
+  }
+  const int first = queue.size();
+  ctx.out = queue.allocate(n);
+  ctx.visible.resize((n + params.grain - 1) / params.grain);
+
+  {
+    ProfileScope scope("culling");
+    js.parallelFor(0, n, params.grain, buildChunk, &ctx);
+  }
+
+  // Close the gaps left by culled objects
+  ProfileScope scope("compaction");
+  int size = first;
+  for (int c = 0; c < (int)ctx.visible.size(); ++c) {
+    const int src = first + c * params.grain;
+    if (src != size && ctx.visible[c] > 0)
+      memmove(&queue[size], &queue[src], sizeof(DrawPacket) * ctx.visible[c]);
+    size += ctx.visible[c];
+  }
+  queue.shrink(size);
+  queue.occluded += ctx.occluded;
+  queue.recomputed += ctx.recomputed;
+  queue.reused += ctx.reused;
+  return ctx.culled + ctx.occluded;
+}
+
+// World to eye space of a viewer at eye looking at target
+static Matrix4 makeLookAt(const Cvec3& eye, const Cvec3& target) {
+  const Cvec3 f = normalize(target - eye);
+  const Cvec3 up = std::abs(f[1]) > 0.99 ? Cvec3(1, 0, 0) : Cvec3(0, 1, 0);
+  const Cvec3 r = normalize(cross(f, up));
+  const Cvec3 u = cross(r, f);
+  return Matrix4::fromRows(r[0], r[1], r[2], -dot(r, eye),
+                           u[0], u[1], u[2], -dot(u, eye),
+                           -f[0], -f[1], -f[2], dot(f, eye),
+                           0, 0, 0, 1);
+}
+
+ShadowView makeSpotShadowView(const Cvec3& pos, const Cvec3& target, const double radius) {
+  const double maxHalfAngle = 60 * CS175_PI / 180;
+  const double dist = norm(target - pos);
+  const double halfAngle = dist > radius ? std::min(std::asin(radius / dist), maxHalfAngle) : maxHalfAngle;
+  ShadowView v;
+  v.view = makeLookAt(pos, target);
+  v.projection = Matrix4::makeProjection(2 * halfAngle * 180 / CS175_PI, 1,
+                                         -std::max(dist - radius, 0.05), -(dist + radius));
+  return v;
+}
+
+void makeCascadeShadowViews(const Cvec3& sunDirection, const RigTForm& eye,
+                            const double fovy, const double aspectRatio,
+                            const double zNear, const double zFar,
+                            const double casterReach, const int mapSize,
+                            const int numCascades, ShadowView views[], float cascadeEnd[]) {
+  const Matrix4 sunView = makeLookAt(Cvec3(), sunDirection);
+  const double tanY = std::tan(fovy * 0.5 * CS175_PI / 180), tanX = tanY * aspectRatio;
+  const double lambda = 0.75;   // blend of logarithmic and uniform splits
+
+  double d0 = zNear;
+  for (int i = 0; i < numCascades; ++i) {
+    const double t = double(i + 1) / numCascades;
+    const double d1 = lambda * zNear * std::pow(zFar / zNear, t) + (1 - lambda) * (zNear + (zFar - zNear) * t);
+    cascadeEnd[i] = d1;
+
+    // Bounding sphere of the slice, centered on the view axis where it is
+    // equally far from the near and the far corners
+    const double a0 = d0 * d0 * (tanX * tanX + tanY * tanY), a1 = d1 * d1 * (tanX * tanX + tanY * tanY);
+    const double c = std::max(d0, std::min(d1, (d1 * d1 + a1 - d0 * d0 - a0) / (2 * (d1 - d0))));
+    const double r = std::sqrt(std::max((c - d0) * (c - d0) + a0, (d1 - c) * (d1 - c) + a1));
+    const Cvec3 center = Cvec3(sunView * Cvec4(Cvec3(eye * Cvec4(0, 0, -c, 1)), 1));
+
+    const double texel = 2 * r / mapSize;
+    const double x = std::floor(center[0] / texel) * texel, y = std::floor(center[1] / texel) * texel;
+    views[i].view = sunView;
+    views[i].projection = Matrix4::makeOrthographic(x - r, x + r, y - r, y + r,
+                                                    center[2] + r + casterReach, center[2] - r);
+    d0 = d1;
+  }
+}
+
+ShadowCasterCache::ShadowCasterCache(const int settleBuilds)
+  : settleBuilds_(settleBuilds), build_(0) {}
+
+void ShadowCasterCache::build(const SceneStore& scene, const ShadowView views[], const int numViews,
+                              const int shader, ShadowPass passes[]) {
+  ProfileScope scope("shadow casters");
+  ++build_;
+  const int n = scene.numSlots();
+  if ((int)tracked_.size() < n) {
+    Tracked t;
+    t.lastMoved = 0;
+    t.isStatic = false;
+    tracked_.resize(n, t);
+  }
+
+  // Nodes that leave or join the static set invalidate the maps they are in
+  changed_.clear();
+  dynamic_.clear();
+  for (int i = 0; i < (int)tracked_.size(); ++i) {
+    Tracked& t = tracked_[i];
+    if (i >= n || !scene.isAlive(i)) {
+      if (t.isStatic)
+        changed_.push_back(t.bound);
+      t.isStatic = false;
+      t.handle = NodeHandle();
+      continue;
+    }
+    const Matrix4f& world = scene.renderWorld(i);
+    if (t.handle != scene.handleAt(i) || memcmp(world.data(), t.world.data(), 16 * sizeof(float)) != 0) {
+      if (t.isStatic)
+        changed_.push_back(t.bound);
+      t.isStatic = false;
+      t.handle = scene.handleAt(i);
+      t.world = world;
+      t.bound.center = Cvec3(world(0,3), world(1,3), world(2,3));
+      t.bound.radius = scene.radius(i) * maxScale(world);
+      t.lastMoved = build_;
+    } else if (!t.isStatic && build_ - t.lastMoved >= (unsigned)settleBuilds_) {
+      t.isStatic = true;
+      changed_.push_back(t.bound);
+    }
+    if (!t.isStatic)
+      dynamic_.push_back(i);
+  }
+
+  for (int m = 0; m < numViews; ++m) {
+    const ShadowView& v = views[m];
+    MapState& state = maps_[m];
+    ShadowPass& pass = passes[m];
+    Plane planes[6];
+    extractFrustumPlanes(v.projection, planes);
+    const Matrix4f view(v.view);
+
+    bool stale = !state.valid || !sameMatrix(state.view, v.view) || !sameMatrix(state.projection, v.projection);
+    for (int i = 0; i < (int)changed_.size() && !stale; ++i) {
+      stale = sphereVisible(planes, Cvec3(v.view * Cvec4(changed_[i].center, 1)), changed_[i].radius);
+    }
+    if (stale) {
+      state.valid = true;
+      state.view = v.view;
+      state.projection = v.projection;
+      ++state.staticVersion;
+      // The queue being submitted may still hold the old list
+      if (!state.staticCasters || !state.staticCasters.unique())
+        state.staticCasters.reset(new vector<DrawPacket>());
+      state.staticCasters->clear();
+      for (int i = 0; i < n; ++i) {
+        if (!tracked_[i].isStatic)
+          continue;
+        const Matrix4f MVM = view * scene.renderWorld(i);
+        if (sphereVisible(planes, MVM, scene.radius(i) * maxScale(MVM))) {
+          state.staticCasters->push_back(DrawPacket());
+          writeDrawPacket(state.staticCasters->back(), scene.geometry(i), shader, MVM, scene.color(i));
+        }
+      }
+    }
+
+    v.projection.writeToColumnMajorMatrix(pass.proj);
+    pass.staticVersion = state.staticVersion;
+    pass.staticCasters = state.staticCasters;
+    pass.dynamicCasters.clear();
+    for (size_t k = 0; k < dynamic_.size(); ++k) {
+      const int i = dynamic_[k];
+      const Matrix4f MVM = view * scene.renderWorld(i);
+      if (sphereVisible(planes, MVM, scene.radius(i) * maxScale(MVM))) {
+        pass.dynamicCasters.push_back(DrawPacket());
+        writeDrawPacket(pass.dynamicCasters.back(), scene.geometry(i), shader, MVM, scene.color(i));
+      }
+    }
+  }
+}
+
+FramePipeline::FramePipeline(JobSystem& js, BuildFunc build, void *ctx)
+  : js_(js), build_(build), ctx_(ctx), front_(0), pending_(false),
+    frontVersion_(~0u), pendingVersion_(0), hits_(0), misses_(0) {}
+
+void FramePipeline::buildJob(void *data) {
+  FramePipeline *fp = static_cast<FramePipeline*>(data);
+  fp->build_(fp->queues_[1 - fp->front_], fp->ctx_);
+}
+
+void FramePipeline::kick(const unsigned version) {
+  sync();
+  if (pending_ || version == frontVersion_)
+    return;
+  pending_ = true;
+  pendingVersion_ = version;
+  js_.spawn(buildJob, this, &inFlight_);
+}
+
+void FramePipeline::sync() {
+  js_.wait(inFlight_);
+}
+
+RenderQueue& FramePipeline::acquire(const unsigned version) {
+  sync();
+  if (pending_) {
+    ++hits_;
+    pending_ = false;
+    front_ = 1 - front_;
+    frontVersion_ = pendingVersion_;
+  } else if (version != frontVersion_) {
+    build_(queues_[1 - front_], ctx_);
+    ++misses_;
+    front_ = 1 - front_;
+    frontVersion_ = version;
+  }
+  return queues_[front_];
+}
@@ -0,0 +1,214 @@
+#ifndef FRAMEBUILD_H
+#define FRAMEBUILD_H
+
+#include <vector>
+
+#include "cvec.h"
+#include "matrix4.h"
+#include "matrix4f.h"
+#include "rigtform.h"
+#include "jobsystem.h"
+#include "rendercmd.h"
+#include "scenestore.h"
+#include "occlusion.h"
+
+//--------------------------------------------------------------------------------
+// Frame pipeline: the CPU side of a frame (world transforms, frustum culling
+// and draw packet building) run as jobs so they can overlap with GL submission
+// of the previous frame.
+//--------------------------------------------------------------------------------
+
+// Draw packets of the previous build by slot, so the next build can reuse
+// those of nodes whose packet cannot have changed: same view, shader and
+// selection color and camera relative mode, same world version (which any edit of the node or its
+// ancestors bumps) and selection state. Reused nodes skip the model view
+// product, the normal matrix inverse and the frustum test. A cache belongs
+// to one SceneStore.
+struct PacketCache {
+  struct Entry {
+    unsigned worldVersion; // of the slot the packet was built for, 0 for none
+    float radius;          // bounding radius in eye space
+    bool visible;          // inside the frustum; packet is only written if so
+    bool selected;
+    DrawPacket packet;
+  };
+
+  std::vector<Entry> entries;
+  bool valid;            // the view below is that of entries
+  Matrix4 invEyeTransform, projection;
+  int shader;
+  bool cameraRelative;
+  Cvec3f selectedColor;
+
+  PacketCache() : valid(false), shader(0), cameraRelative(false) {}
+};
+
+// Everything object packet building needs to know about the view
+struct FrameBuildParams {
+  Matrix4 invEyeTransform;
+  Matrix4 projection;
+  int shader;
+  NodeHandle selected;
+  Cvec3f selectedColor;
+  int grain;             // pool slots per job
+
+  // Model view matrices are built from node positions relative to the
+  // camera, subtracted in double precision, so objects far from the origin
+  // keep float precision near the camera. Off, they are the single
+  // precision product of the inverse eye and render world matrices.
+  bool cameraRelative;
+
+  // Occlusion culling, off while occlusion is NULL. Nodes with a world
+  // bounding radius of at least occluderMinRadius are occluder candidates,
+  // of which the maxOccluders largest on screen are rasterized.
+  OcclusionBuffer *occlusion;
+  double occluderMinRadius;
+  int maxOccluders;
+
+  // Packets are rebuilt for every node while packetCache is NULL
+  PacketCache *packetCache;
+
+  FrameBuildParams()
+    : shader(0), grain(1024), cameraRelative(true), occlusion(NULL), occluderMinRadius(2), maxOccluders(16), packetCache(NULL) {}
+};
+
+// Updates the scene's world transforms, drops nodes whose bounding sphere is
+// outside the view frustum, or hidden behind the occluders when occlusion
+// culling is on, and appends one cube packet for each survivor. The world
+// update, culling and packet building are split over the job system in
+// chunks of params.grain slots; packet order matches slot order. Returns the
+// number of nodes dropped; the occluded ones among them are also added to
+// queue.occluded.
+// Nodes whose packet was built anew or taken from params.packetCache are
+// counted in queue.recomputed and queue.reused.
+int buildObjectPacketsParallel(JobSystem& js, RenderQueue& queue,
+                               SceneStore& scene,
+                               const FrameBuildParams& params);
+
+// Placement of one shadow map: world to light eye space, and the light's
+// projection, which like the camera's maps nearer to greater depth
+struct ShadowView {
+  Matrix4 view;
+  Matrix4 projection;
+};
+
+// Perspective view from a point light at pos, aimed at the sphere (target,
+// radius) that receivers are expected in. The field of view is capped at
+// 120 degrees for lights close to the sphere.
+ShadowView makeSpotShadowView(const Cvec3& pos, const Cvec3& target, const double radius);
+
+// Splits the camera's view distances [zNear, zFar] (positive) into numCascades
+// slices, more of them close to the eye, and fits an orthographic view along
+// the sun direction (the direction light travels) around each slice's
+// bounding sphere. The sphere only depends on the slice, so cascades keep
+// their size as the camera turns, and they move in whole shadow map texels,
+// which keeps edges from shimmering. Casters up to casterReach in front of
+// a slice are included. cascadeEnd receives the far distance of each slice.
+void makeCascadeShadowViews(const Cvec3& sunDirection, const RigTForm& eye,
+                            const double fovy, const double aspectRatio,
+                            const double zNear, const double zFar,
+                            const double casterReach, const int mapSize,
+                            const int numCascades, ShadowView views[], float cascadeEnd[]);
+
+// Writes the shadow passes of a frame and keeps what can be reused across
+// frames. A node is a static caster once its world transform has not changed
+// for settleBuilds builds. The static casters of a map are listed again, and
+// its staticVersion bumped, only when the map's view changes or a node inside
+// its frustum (before or after moving) turns static or stops being static.
+// Everything else the per-frame work touches is proportional to the dynamic
+// nodes, apart from one comparison of each world matrix.
+class ShadowCasterCache {
+public:
+  explicit ShadowCasterCache(const int settleBuilds = 30);
+
+  // World transforms must be current. Fills passes[0, numViews) with
+  // caster packets using the given shader; the static lists are shared with
+  // the cache, which starts a new list rather than change one still in use.
+  void build(const SceneStore& scene, const ShadowView views[], const int numViews,
+             const int shader, ShadowPass passes[]);
+
+private:
+  struct Bound {
+    Cvec3 center;
+    double radius;
+  };
+
+  struct Tracked {
+    NodeHandle handle;
+    Matrix4f world;
+    Bound bound;
+    unsigned lastMoved;    // build in which the world transform last changed
+    bool isStatic;
+  };
+
+  struct MapState {
+    bool valid;
+    Matrix4 view, projection;
+    unsigned staticVersion;
+    std::tr1::shared_ptr<std::vector<DrawPacket> > staticCasters;
+
+    MapState() : valid(false), staticVersion(0) {}
+  };
+
+  int settleBuilds_;
+  unsigned build_;
+  std::vector<Tracked> tracked_;    // by slot
+  std::vector<Bound> changed_;      // bounds that invalidate cached static maps
+  std::vector<int> dynamic_;        // slots of live non-static nodes
+  MapState maps_[MAX_SHADOW_MAPS];
+};
+
+// Double-buffered render queues, so the scene for frame N+1 is built on a
+// worker while the GL thread submits frame N. Each frame calls acquire() for
+// the queue to submit, then kick() with the scene as the frame's simulation
+// and input left it, then submits. A queue is tagged with the scene version
+// it was built from and is only built when that version has not been built
+// yet, so every build is submitted once. While the scene keeps changing the
+// image trails it by one frame.
+class FramePipeline {
+public:
+  typedef void (*BuildFunc)(RenderQueue& queue, void *ctx);
+
+  FramePipeline(JobSystem& js, BuildFunc build, void *ctx);
+
+  // Returns the queue to submit: the one kicked during the last frame if
+  // there is one, else the last one again if it shows the given version,
+  // else the given version built synchronously
+  RenderQueue& acquire(const unsigned version);
+
+  // Starts building the given version into the other queue, unless the
+  // acquired queue already shows it
+  void kick(const unsigned version);
+
+  // Waits for an in-flight build. Must be called before modifying anything
+  // the build function reads.
+  void sync();
+
+  // Scene version of the queue acquire() returned last
+  unsigned frontVersion() const {
+    return frontVersion_;
+  }
+
+  int hits() const {
+    return hits_;
+  }
+
+  int misses() const {
+    return misses_;
+  }
+
+private:
+  JobSystem& js_;
+  BuildFunc build_;
+  void *ctx_;
+  RenderQueue queues_[2];
+  int front_;                  // queue handed out by acquire()
+  bool pending_;               // the other queue was kicked and not yet acquired
+  unsigned frontVersion_, pendingVersion_;
+  JobCounter inFlight_;
+  int hits_, misses_;
+
+  static void buildJob(void *data);
+};
+
+#endif
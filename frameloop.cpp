@@ -0,0 +1,103 @@
+#include <vector>
+#include <algorithm>
+#include <ostream>
+
+#include "timer.h"
+#include "frameloop.h"
+
+using namespace std;
+
+FrameTimeHistogram::FrameTimeHistogram(const int capacity)
+  : capacity_(capacity), next_(0) {
+  samples_.reserve(capacity);
+}
+
+void FrameTimeHistogram::add(const long long nanos) {
+  if ((int)samples_.size() < capacity_) {
+    samples_.push_back(nanos);
+  } else {
+    samples_[next_] = nanos;
+    next_ = (next_ + 1) % capacity_;
+  }
+}
+
+void FrameTimeHistogram::clear() {
+  samples_.clear();
+  next_ = 0;
+}
+
+long long FrameTimeHistogram::percentile(const double p) const {
+  if (samples_.empty())
+    return 0;
+  vector<long long> sorted(samples_);
+  const int n = sorted.size();
+  int rank = (int)(p / 100 * n + 0.5);
+  rank = std::min(std::max(rank, 1), n) - 1;
+  nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+  return sorted[rank];
+}
+
+long long FrameTimeHistogram::max() const {
+  return samples_.empty() ? 0 : *max_element(samples_.begin(), samples_.end());
+}
+
+double FrameTimeHistogram::meanNanos() const {
+  if (samples_.empty())
+    return 0;
+  double sum = 0;
+  for (size_t i = 0; i < samples_.size(); ++i) {
+    sum += samples_[i];
+  }
+  return sum / samples_.size();
+}
+
+ostream& operator << (ostream& os, const FrameTimeHistogram& h) {
+  return os << "p50 " << nanosToMillis(h.percentile(50))
+            << " p95 " << nanosToMillis(h.percentile(95))
+            << " p99 " << nanosToMillis(h.percentile(99))
+            << " max " << nanosToMillis(h.max());
+}
+
+FrameLoop::FrameLoop(const double step)
+  : maxCatchUp(0.25), step_(step), targetRate_(0), accumulator_(0),
+    frameStart_(0), frames_(0), skipped_(0), lastSkipped_(false) {}
+
+void FrameLoop::setTargetRate(const double hz) {
+  targetRate_ = hz;
+}
+
+int FrameLoop::beginFrame() {
+  const long long now = nowNanos();
+  if (frames_ > 0) {
+    const long long dt = now - frameStart_;
+    frameTimes_.add(dt);
+    accumulator_ = std::min(accumulator_ + dt * 1e-9, maxCatchUp);
+  }
+  frameStart_ = now;
+  ++frames_;
+  lastSkipped_ = false;
+
+  int steps = 0;
+  for (; accumulator_ >= step_; accumulator_ -= step_) {
+    ++steps;
+  }
+  return steps;
+}
+
+void FrameLoop::endFrame() {
+  workTimes_.add(nowNanos() - frameStart_);
+}
+
+void FrameLoop::skipFrame() {
+  frameStart_ = nowNanos();
+  ++skipped_;
+  lastSkipped_ = true;
+}
+
+long long FrameLoop::nanosUntilNextFrame() const {
+  if (frames_ == 0 || (targetRate_ <= 0 && !lastSkipped_))
+    return 0;
+  const double interval = targetRate_ > 0 ? 1 / targetRate_ : step_;
+  const long long due = frameStart_ + (long long)(1e9 * interval);
+  return std::max(due - nowNanos(), 0LL);
+}
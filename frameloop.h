@@ -0,0 +1,114 @@
+#ifndef FRAMELOOP_H
+#define FRAMELOOP_H
+
+#include <vector>
+#include <ostream>
+
+//--------------------------------------------------------------------------------
+// Frame pacing and timing. FrameLoop turns the irregular calls of the GLUT
+// display callback into a paced frame loop: it measures every frame, tells
+// the idle callback how long to wait for a target rate, and converts elapsed
+// time into fixed simulation steps plus an interpolation fraction.
+//--------------------------------------------------------------------------------
+
+// Durations of the most recent frames, for percentiles
+class FrameTimeHistogram {
+public:
+  explicit FrameTimeHistogram(const int capacity = 512);
+
+  void add(const long long nanos);
+  void clear();
+
+  // Number of samples in the window
+  int size() const {
+    return samples_.size();
+  }
+
+  // Nearest-rank percentile of the window in nanoseconds, p in [0, 100];
+  // 0 when empty
+  long long percentile(const double p) const;
+  long long max() const;
+  double meanNanos() const;
+
+private:
+  std::vector<long long> samples_;
+  int capacity_;
+  int next_;           // oldest sample once the window is full
+};
+
+// "p50 x p95 y p99 z max w" in milliseconds
+std::ostream& operator << (std::ostream& os, const FrameTimeHistogram& h);
+
+class FrameLoop {
+public:
+  // step is the fixed simulation step in seconds
+  explicit FrameLoop(const double step = 1.0 / 60.0);
+
+  // Frames per second to pace to, 0 for uncapped
+  void setTargetRate(const double hz);
+
+  double targetRate() const {
+    return targetRate_;
+  }
+
+  double step() const {
+    return step_;
+  }
+
+  // Starts a frame: records the time since the previous one and returns how
+  // many fixed steps the simulation has to advance. At most maxCatchUp
+  // seconds of simulation are made up for after a stall.
+  int beginFrame();
+
+  // Ends the frame started by beginFrame(), recording the CPU time it took
+  void endFrame();
+
+  // Passes on a due frame because it would show the same image as the last
+  // one. The frame interval restarts without a frame time being recorded or
+  // simulation time accumulating. Uncapped, the next frame is due after one
+  // simulation step, so an idle loop polls at the simulation rate.
+  void skipFrame();
+
+  long long skippedFrames() const {
+    return skipped_;
+  }
+
+  // Fraction of a step accumulated beyond the last whole step, in [0, 1).
+  // Render the state interpolated this far from the previous step to the
+  // current one.
+  double alpha() const {
+    return accumulator_ / step_;
+  }
+
+  // Nanoseconds until the next frame is due under the target rate; 0 when
+  // it is due or the loop is uncapped
+  long long nanosUntilNextFrame() const;
+
+  // Interval between the starts of consecutive frames
+  const FrameTimeHistogram& frameTimes() const {
+    return frameTimes_;
+  }
+
+  // Time from beginFrame() to endFrame()
+  const FrameTimeHistogram& workTimes() const {
+    return workTimes_;
+  }
+
+  long long frames() const {
+    return frames_;
+  }
+
+  double maxCatchUp;     // seconds
+
+private:
+  double step_;
+  double targetRate_;
+  double accumulator_;   // seconds not yet consumed by steps
+  long long frameStart_;
+  long long frames_;
+  long long skipped_;
+  bool lastSkipped_;
+  FrameTimeHistogram frameTimes_, workTimes_;
+};
+
+#endif
@@ -3,6 +3,7 @@
 #include <string>
 #include <iostream>
 #include <stdexcept>
+#include <pthread.h>
 
 #include "glsupport.h"
 
@@ -13,17 +14,272 @@
 
 using namespace std;
 
+static bool g_glDebugMode = false;
+static bool g_glDebugOutput = false;      // the KHR_debug callback is installed
+
+// Error messages reported by the debug callback since the last
+// checkGlErrors(). The callback may run on a driver thread.
+static volatile int g_glDebugErrors = 0;
+static string g_glLastDebugError;
+static pthread_mutex_t g_glDebugLock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *debugTypeName(const GLenum type) {
+  switch (type) {
+  case GL_DEBUG_TYPE_ERROR: return "error";
+  case GL_DEBUG_TYPE_DEPRECATED_BEHAVIOR: return "deprecated";
+  case GL_DEBUG_TYPE_UNDEFINED_BEHAVIOR: return "undefined behavior";
+  case GL_DEBUG_TYPE_PORTABILITY: return "portability";
+  case GL_DEBUG_TYPE_PERFORMANCE: return "performance";
+  default: return "other";
+  }
+}
+
+static const char *debugSeverityName(const GLenum severity) {
+  switch (severity) {
+  case GL_DEBUG_SEVERITY_HIGH: return "high";
+  case GL_DEBUG_SEVERITY_MEDIUM: return "medium";
+  case GL_DEBUG_SEVERITY_LOW: return "low";
+  default: return "notification";
+  }
+}
+
+static void APIENTRY glDebugCallback(GLenum source, GLenum type, GLuint id, GLenum severity,
+                                     GLsizei length, const GLchar *message, const void *userParam) {
+  const string text = string("GL ") + debugTypeName(type) + " (" + debugSeverityName(severity) + "): " + message;
+  pthread_mutex_lock(&g_glDebugLock);
+  cerr << text << endl;
+  if (type == GL_DEBUG_TYPE_ERROR) {
+    g_glLastDebugError = text;
+    ++g_glDebugErrors;
+  }
+  pthread_mutex_unlock(&g_glDebugLock);
+}
+
+void initGlErrorReporting(const bool debugMode) {
+  g_glDebugMode = debugMode;
+  g_glDebugOutput = GLEW_KHR_debug;
+  if (!g_glDebugOutput) {
+    if (!debugMode)
+      cerr << "GL_KHR_debug not supported, GL errors are only detected in debug mode" << endl;
+    return;
+  }
+
+  glEnable(GL_DEBUG_OUTPUT);
+  if (debugMode)
+    glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+  else
+    glDisable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+  glDebugMessageCallback(glDebugCallback, NULL);
+
+  // Errors and medium or high severity messages; low severity ones, which
+  // some drivers emit for every buffer upload, only in debug mode
+  glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DONT_CARE, 0, NULL, GL_FALSE);
+  glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_HIGH, 0, NULL, GL_TRUE);
+  glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_MEDIUM, 0, NULL, GL_TRUE);
+  if (debugMode)
+    glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_LOW, 0, NULL, GL_TRUE);
+  glDebugMessageControl(GL_DONT_CARE, GL_DEBUG_TYPE_ERROR, GL_DONT_CARE, 0, NULL, GL_TRUE);
+}
+
+bool glDebugMode() {
+  return g_glDebugMode;
+}
+
 void checkGlErrors() {
-  const GLenum errCode = glGetError();
+  if (g_glDebugMode) {
+    const GLenum errCode = glGetError();
+
+    if (errCode != GL_NO_ERROR) {
+      string error("GL Error: ");
+      error += reinterpret_cast<const char*>(gluErrorString(errCode));
+      cerr << error << endl;
+      throw runtime_error(error);
+    }
+  }
 
-  if (errCode != GL_NO_ERROR) {
-    string error("GL Error: ");
-    error += reinterpret_cast<const char*>(gluErrorString(errCode));
-    cerr << error << endl;
+  if (g_glDebugErrors > 0) {
+    pthread_mutex_lock(&g_glDebugLock);
+    const string error = g_glLastDebugError;
+    g_glDebugErrors = 0;
+    pthread_mutex_unlock(&g_glDebugLock);
     throw runtime_error(error);
   }
 }
 
+void labelGlObject(const GLenum identifier, const GLuint name, const char *label) {
+  if (g_glDebugOutput)
+    glObjectLabel(identifier, name, -1, label);
+}
+
+// Shadow value that matches no real object, so the next call is issued
+static const GLuint UNKNOWN = ~0u;
+
+static int bufferTargetIndex(const GLenum target) {
+  switch (target) {
+  case GL_ARRAY_BUFFER: return 0;
+  case GL_ELEMENT_ARRAY_BUFFER: return 1;
+  case GL_PIXEL_PACK_BUFFER: return 2;
+  case GL_PIXEL_UNPACK_BUFFER: return 3;
+  default: return -1;
+  }
+}
+
+static int textureTargetIndex(const GLenum target) {
+  switch (target) {
+  case GL_TEXTURE_2D: return 0;
+  case GL_TEXTURE_CUBE_MAP: return 1;
+  default: return -1;
+  }
+}
+
+GlStateCache::GlStateCache() {
+  invalidate();
+  resetCounters();
+}
+
+void GlStateCache::invalidate() {
+  program_ = UNKNOWN;
+  for (int i = 0; i < NUM_BUFFER_TARGETS; ++i) {
+    buffers_[i] = UNKNOWN;
+  }
+  vao_ = UNKNOWN;
+  activeUnit_ = UNKNOWN;
+  for (int u = 0; u < NUM_TEXTURE_UNITS; ++u) {
+    for (int t = 0; t < NUM_TEXTURE_TARGETS; ++t) {
+      textures_[u][t] = UNKNOWN;
+    }
+  }
+  invalidateVertexArrayState();
+}
+
+// The element buffer binding and the attribute arrays belong to the vertex
+// array object
+void GlStateCache::invalidateVertexArrayState() {
+  buffers_[bufferTargetIndex(GL_ELEMENT_ARRAY_BUFFER)] = UNKNOWN;
+  for (int i = 0; i < NUM_ATTRIBS; ++i) {
+    attribEnabled_[i] = -1;
+    attribPointers_[i].buffer = UNKNOWN;
+  }
+}
+
+void GlStateCache::useProgram(const GLuint program) {
+  if (change(program_, program))
+    glUseProgram(program);
+}
+
+void GlStateCache::bindBuffer(const GLenum target, const GLuint buffer) {
+  const int t = bufferTargetIndex(target);
+  if (t < 0) {
+    ++issued_;
+    glBindBuffer(target, buffer);
+  } else if (change(buffers_[t], buffer)) {
+    glBindBuffer(target, buffer);
+  }
+}
+
+void GlStateCache::bindVertexArray(const GLuint vao) {
+  if (change(vao_, vao)) {
+    glBindVertexArray(vao);
+    invalidateVertexArrayState();
+  }
+}
+
+void GlStateCache::activeTexture(const GLenum unit) {
+  if (change(activeUnit_, unit))
+    glActiveTexture(unit);
+}
+
+void GlStateCache::bindTexture(const GLenum target, const GLuint texture) {
+  const int u = activeUnit_ - GL_TEXTURE0;
+  const int t = textureTargetIndex(target);
+  if (activeUnit_ == UNKNOWN || u >= NUM_TEXTURE_UNITS || t < 0) {
+    ++issued_;
+    glBindTexture(target, texture);
+  } else if (change(textures_[u][t], texture)) {
+    glBindTexture(target, texture);
+  }
+}
+
+void GlStateCache::enableVertexAttribArray(const GLint index) {
+  if (index < 0)
+    return;
+  if (index >= NUM_ATTRIBS) {
+    ++issued_;
+    glEnableVertexAttribArray(index);
+  } else if (change(attribEnabled_[index], 1)) {
+    glEnableVertexAttribArray(index);
+  }
+}
+
+void GlStateCache::disableVertexAttribArray(const GLint index) {
+  if (index < 0)
+    return;
+  if (index >= NUM_ATTRIBS) {
+    ++issued_;
+    glDisableVertexAttribArray(index);
+  } else if (change(attribEnabled_[index], 0)) {
+    glDisableVertexAttribArray(index);
+  }
+}
+
+void GlStateCache::vertexAttribPointer(const GLint index, const GLint size, const GLenum type,
+                                       const GLboolean normalized, const GLsizei stride,
+                                       const GLvoid *pointer) {
+  if (index < 0)
+    return;
+  const GLuint buffer = buffers_[bufferTargetIndex(GL_ARRAY_BUFFER)];
+  if (index < NUM_ATTRIBS && buffer != UNKNOWN) {
+    AttribPointer& a = attribPointers_[index];
+    if (a.buffer == buffer && a.size == size && a.type == type && a.normalized == normalized &&
+        a.stride == stride && a.pointer == pointer) {
+      ++elided_;
+      return;
+    }
+    a.buffer = buffer;
+    a.size = size;
+    a.type = type;
+    a.normalized = normalized;
+    a.stride = stride;
+    a.pointer = pointer;
+  }
+  ++issued_;
+  glVertexAttribPointer(index, size, type, normalized, stride, pointer);
+}
+
+void GlStateCache::deletedBuffer(const GLuint buffer) {
+  for (int i = 0; i < NUM_BUFFER_TARGETS; ++i) {
+    if (buffers_[i] == buffer)
+      buffers_[i] = 0;
+  }
+  // a new buffer may get the same name
+  for (int i = 0; i < NUM_ATTRIBS; ++i) {
+    if (attribPointers_[i].buffer == buffer)
+      attribPointers_[i].buffer = UNKNOWN;
+  }
+}
+
+void GlStateCache::deletedTexture(const GLuint texture) {
+  for (int u = 0; u < NUM_TEXTURE_UNITS; ++u) {
+    for (int t = 0; t < NUM_TEXTURE_TARGETS; ++t) {
+      if (textures_[u][t] == texture)
+        textures_[u][t] = 0;
+    }
+  }
+}
+
+GlStateCache& glState() {
+  static GlStateCache cache;
+  return cache;
+}
+
+void glStateDeletedBuffer(const GLuint buffer) {
+  glState().deletedBuffer(buffer);
+}
+
+void glStateDeletedTexture(const GLuint texture) {
+  glState().deletedTexture(texture);
+}
+
 // Dump text file into a character vector, throws exception on error
 static void readTextFile(const char *fn, vector<char>& data) {
   // Sets ios::binary bit to prevent end of line translation, so that the
@@ -55,17 +311,41 @@ static void printInfoLog(GLuint obj, const string& filename) {
   }
 }
 
-void readAndCompileSingleShader(GLuint shaderHandle, const char *fn) {
+void readAndCompileSingleShader(GLuint shaderHandle, const char *fn, const char *preludeFn) {
   vector<char> source;
   readTextFile(fn, source);
 
-  const char *ptrs[] = {&source[0]};
-  const GLint lens[] = {source.size()};
-  glShaderSource(shaderHandle, 1, ptrs, lens);   // load the shader sources
+  if (!preludeFn) {
+    const char *ptrs[] = {&source[0]};
+    const GLint lens[] = {static_cast<GLint>(source.size())};
+    glShaderSource(shaderHandle, 1, ptrs, lens);   // load the shader sources
+  } else {
+    vector<char> prelude;
+    readTextFile(preludeFn, prelude);
+
+    // #version must come first, so the shader is split after that line.
+    // The #line directives make compiler messages name source string 1 for
+    // the prelude and 0 for the shader, with line numbers of each file.
+    const string text(source.begin(), source.end());
+    size_t split = 0;
+    if (text.compare(0, 8, "#version") == 0) {
+      const size_t eol = text.find('\n');
+      split = eol == string::npos ? text.size() : eol + 1;
+    }
+    const string version = text.substr(0, split);
+    const string preludeText = "#line 1 1\n" + string(prelude.begin(), prelude.end()) + "\n" +
+      (split > 0 ? "#line 2 0\n" : "#line 1 0\n");
+    const string body = text.substr(split);
+
+    const char *ptrs[] = {version.c_str(), preludeText.c_str(), body.c_str()};
+    const GLint lens[] = {static_cast<GLint>(version.size()), static_cast<GLint>(preludeText.size()),
+                          static_cast<GLint>(body.size())};
+    glShaderSource(shaderHandle, 3, ptrs, lens);
+  }
 
   glCompileShader(shaderHandle);
 
-  printInfoLog(shaderHandle, fn);
+  printInfoLog(shaderHandle, preludeFn ? string(fn) + " with " + preludeFn : string(fn));
 
   GLint compiled = 0;
   glGetShaderiv(shaderHandle, GL_COMPILE_STATUS, &compiled);
@@ -91,12 +371,13 @@ void linkShader(GLuint programHandle, GLuint vs, GLuint fs) {
 }
 
 
-void readAndCompileShader(GLuint programHandle, const char * vertexShaderFileName, const char * fragmentShaderFileName) {
+void readAndCompileShader(GLuint programHandle, const char * vertexShaderFileName, const char * fragmentShaderFileName,
+                          const char *fragmentPreludeFileName) {
   GlShader vs(GL_VERTEX_SHADER);
   GlShader fs(GL_FRAGMENT_SHADER);
 
   readAndCompileSingleShader(vs, vertexShaderFileName);
-  readAndCompileSingleShader(fs, fragmentShaderFileName);
+  readAndCompileSingleShader(fs, fragmentShaderFileName, fragmentPreludeFileName);
 
   linkShader(programHandle, vs, fs);
 }
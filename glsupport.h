@@ -11,21 +11,48 @@
 # include <GL/glut.h>
 #endif
 
-// Check if there has been an error inside OpenGL and if yes, print the error and
-// through a runtime_error exception.
+// Sets up how GL errors are detected; call once after glewInit().
+//
+// By default errors are reported through a GL_KHR_debug callback that runs
+// asynchronously, so nothing in the frame waits on the driver. With
+// debugMode the callback is made synchronous, low severity messages are
+// shown too, and checkGlErrors() also polls glGetError(), which stalls on
+// some drivers.
+void initGlErrorReporting(const bool debugMode);
+
+// True when initGlErrorReporting() was asked for debug mode
+bool glDebugMode();
+
+// Throws a runtime_error if an error has been reported since the last call:
+// by the debug callback, or in debug mode by glGetError(). Without debug
+// mode no GL call is made.
 void checkGlErrors();
 
+// Names a GL object in debug messages and GL debuggers. Does nothing
+// without GL_KHR_debug. Buffers and textures must have been bound once.
+void labelGlObject(const GLenum identifier, const GLuint name, const char *label);
+
 // Reads and compiles a pair of vertex shader and fragment shader files into a
-// GL shader program. Throws runtime_error on error
+// GL shader program. A fragment prelude file, if given, is compiled in front
+// of the fragment shader. Throws runtime_error on error
 void readAndCompileShader(GLuint programHandle,
-                          const char *vertexShaderFileName, const char *fragmentShaderFileName);
+                          const char *vertexShaderFileName, const char *fragmentShaderFileName,
+                          const char *fragmentPreludeFileName = NULL);
 
 // Link two compiled vertex shader and fragment shader into a GL shader program
 void linkShader(GLuint programHandle, GLuint vertexShaderHandle, GLuint fragmentShaderHandle);
 
 // Reads and compiles a single shader (vertex, fragment, etc) file into a GL
-// shader. Throws runtime_error on error
-void readAndCompileSingleShader(GLuint shaderHandle, const char* shaderFileName);
+// shader. The source of a prelude file, if given, goes in front of the
+// shader's, after its #version line, so one prelude serves shaders of
+// different GLSL versions. Throws runtime_error on error
+void readAndCompileSingleShader(GLuint shaderHandle, const char* shaderFileName,
+                                const char *preludeFileName = NULL);
+
+// GL deletes unbind objects, so the wrappers below tell the state cache
+// (glState(), defined further down) when they go away
+void glStateDeletedBuffer(const GLuint buffer);
+void glStateDeletedTexture(const GLuint texture);
 
 // Classes inheriting Noncopyable will not have default compiler generated copy
 // constructor and assignment operator
@@ -80,6 +107,10 @@ public:
     glDeleteProgram(handle_);
   }
 
+  void setLabel(const char *label) {
+    labelGlObject(GL_PROGRAM, handle_, label);
+  }
+
   // Casts to GLuint so can be used directly by glUseProgram and so on
   operator GLuint() const {
     return handle_;
@@ -101,6 +132,12 @@ public:
 
   ~GlTexture() {
     glDeleteTextures(1, &handle_);
+    glStateDeletedTexture(handle_);
+  }
+
+  // The texture must have been bound once
+  void setLabel(const char *label) {
+    labelGlObject(GL_TEXTURE, handle_, label);
   }
 
   // Casts to GLuint so can be used directly by glBindTexture and so on
@@ -123,6 +160,12 @@ public:
 
   ~GlBufferObject() {
     glDeleteBuffers(1, &handle_);
+    glStateDeletedBuffer(handle_);
+  }
+
+  // The buffer must have been bound once
+  void setLabel(const char *label) {
+    labelGlObject(GL_BUFFER, handle_, label);
   }
 
   // Casts to GLuint so can be used directly glBindBuffer and so on
@@ -131,6 +174,146 @@ public:
   }
 };
 
+// Light wrapper around a GL framebuffer object handle that automatically
+// allocates and deallocates. Can be casted to a GLuint.
+class GlFramebufferObject : Noncopyable {
+protected:
+  GLuint handle_;
+
+public:
+  GlFramebufferObject() {
+    glGenFramebuffers(1, &handle_);
+    checkGlErrors();
+  }
+
+  ~GlFramebufferObject() {
+    glDeleteFramebuffers(1, &handle_);
+  }
+
+  // The framebuffer must have been bound once
+  void setLabel(const char *label) {
+    labelGlObject(GL_FRAMEBUFFER, handle_, label);
+  }
+
+  // Casts to GLuint so can be used directly by glBindFramebuffer and so on
+  operator GLuint() const {
+    return handle_;
+  }
+};
+
+// Light wrapper around a GL renderbuffer object handle that automatically
+// allocates and deallocates. Can be casted to a GLuint.
+class GlRenderbufferObject : Noncopyable {
+protected:
+  GLuint handle_;
+
+public:
+  GlRenderbufferObject() {
+    glGenRenderbuffers(1, &handle_);
+    checkGlErrors();
+  }
+
+  ~GlRenderbufferObject() {
+    glDeleteRenderbuffers(1, &handle_);
+  }
+
+  // The renderbuffer must have been bound once
+  void setLabel(const char *label) {
+    labelGlObject(GL_RENDERBUFFER, handle_, label);
+  }
+
+  // Casts to GLuint so can be used directly by glBindRenderbuffer and so on
+  operator GLuint() const {
+    return handle_;
+  }
+};
+
+// Shadow copy of the GL binding state: current program, buffer bindings,
+// vertex array, active texture unit and texture bindings, enabled vertex
+// attribute arrays and attribute pointers. Calls that would not change
+// anything are skipped, so callers can state what they need per draw
+// without paying for redundant driver calls. GL state must only be changed
+// through the cache, or invalidate() called afterwards. Negative attribute
+// indices are ignored like the safe_gl* functions below do.
+class GlStateCache : Noncopyable {
+public:
+  GlStateCache();
+
+  void useProgram(const GLuint program);
+  void bindBuffer(const GLenum target, const GLuint buffer);
+  void bindVertexArray(const GLuint vao);
+  void activeTexture(const GLenum unit);
+  // Binds on the active unit
+  void bindTexture(const GLenum target, const GLuint texture);
+  void enableVertexAttribArray(const GLint index);
+  void disableVertexAttribArray(const GLint index);
+  // Uses the buffer bound to GL_ARRAY_BUFFER, like glVertexAttribPointer
+  void vertexAttribPointer(const GLint index, const GLint size, const GLenum type,
+                           const GLboolean normalized, const GLsizei stride, const GLvoid *pointer);
+
+  void deletedBuffer(const GLuint buffer);
+  void deletedTexture(const GLuint texture);
+
+  // Forgets everything; the next call of each kind is always issued
+  void invalidate();
+
+  // GL calls made and skipped since the last resetCounters()
+  int issued() const {
+    return issued_;
+  }
+
+  int elided() const {
+    return elided_;
+  }
+
+  void resetCounters() {
+    issued_ = elided_ = 0;
+  }
+
+private:
+  enum {
+    NUM_BUFFER_TARGETS = 4,
+    NUM_TEXTURE_UNITS = 16,
+    NUM_TEXTURE_TARGETS = 2,
+    NUM_ATTRIBS = 16
+  };
+
+  struct AttribPointer {
+    GLuint buffer;
+    GLint size;
+    GLenum type;
+    GLboolean normalized;
+    GLsizei stride;
+    const GLvoid *pointer;
+  };
+
+  GLuint program_;
+  GLuint buffers_[NUM_BUFFER_TARGETS];
+  GLuint vao_;
+  GLenum activeUnit_;
+  GLuint textures_[NUM_TEXTURE_UNITS][NUM_TEXTURE_TARGETS];
+  int attribEnabled_[NUM_ATTRIBS];        // 0, 1, or -1 for unknown
+  AttribPointer attribPointers_[NUM_ATTRIBS];
+  int issued_, elided_;
+
+  // Counts the call and returns true if it has to be issued, i.e. when the
+  // shadowed value differs, then updates the shadow
+  template <typename T>
+  bool change(T& shadow, const T value) {
+    if (shadow == value) {
+      ++elided_;
+      return false;
+    }
+    shadow = value;
+    ++issued_;
+    return true;
+  }
+
+  void invalidateVertexArrayState();
+};
+
+// The state cache of the (single) GL context
+GlStateCache& glState();
 
 // Safe versions of various functions that handle GLSL shader attributes
 // and variables: These mainly issue a warning when specified attributes
@@ -0,0 +1,100 @@
+#include <vector>
+
+#include "glsupport.h"
+#include "timer.h"
+#include "profiler.h"
+#include "gpuprofiler.h"
+
+using namespace std;
+
+GpuProfiler::GpuProfiler()
+  : available_(GLEW_ARB_timer_query), current_(0), clockOffset_(0),
+    lastCalibration_(0), dropped_(0) {
+  for (int i = 0; i < NUM_FRAMES; ++i) {
+    sets_[i].used = 0;
+  }
+}
+
+GpuProfiler::~GpuProfiler() {
+  for (int i = 0; i < NUM_FRAMES; ++i) {
+    if (!sets_[i].queries.empty())
+      glDeleteQueries(sets_[i].queries.size(), &sets_[i].queries[0]);
+  }
+}
+
+// The GPU clock drifts against the CPU one, so the offset is refreshed about
+// once a second
+void GpuProfiler::calibrate() {
+  GLint64 gpu = 0;
+  glGetInteger64v(GL_TIMESTAMP, &gpu);
+  const long long cpu = nowNanos();
+  clockOffset_ = cpu - gpu;
+  lastCalibration_ = cpu;
+}
+
+void GpuProfiler::collect(QuerySet& set) {
+  if (set.used == 0)
+    return;
+  GLint ready = 0;
+  glGetQueryObjectiv(set.queries[set.used - 1], GL_QUERY_RESULT_AVAILABLE, &ready);
+  if (ready) {
+    for (size_t i = 0; i < set.scopes.size(); ++i) {
+      const Scope& s = set.scopes[i];
+      if (s.endQuery < 0)
+        continue;
+      GLuint64 begin = 0, end = 0;
+      glGetQueryObjectui64v(set.queries[s.beginQuery], GL_QUERY_RESULT, &begin);
+      glGetQueryObjectui64v(set.queries[s.endQuery], GL_QUERY_RESULT, &end);
+      ProfileEvent e;
+      e.name = s.name;
+      e.begin = (long long)begin + clockOffset_;
+      e.end = (long long)end + clockOffset_;
+      e.depth = s.depth;
+      e.thread = PROFILER_GPU_THREAD;
+      Profiler::instance().addEvent(e);
+    }
+  } else {
+    ++dropped_;
+  }
+  set.used = 0;
+  set.scopes.clear();
+}
+
+void GpuProfiler::beginFrame() {
+  if (!available_ || !Profiler::instance().enabled())
+    return;
+  if (nowNanos() - lastCalibration_ > 1000000000LL)
+    calibrate();
+  current_ = (current_ + 1) % NUM_FRAMES;
+  collect(sets_[current_]);
+  open_.clear();
+}
+
+int GpuProfiler::issueTimestamp() {
+  QuerySet& set = sets_[current_];
+  if (set.used == (int)set.queries.size()) {
+    set.queries.push_back(0);
+    glGenQueries(1, &set.queries.back());
+  }
+  glQueryCounter(set.queries[set.used], GL_TIMESTAMP);
+  return set.used++;
+}
+
+void GpuProfiler::push(const char *name) {
+  if (!available_ || !Profiler::instance().enabled())
+    return;
+  Scope s;
+  s.name = name;
+  s.depth = open_.size();
+  s.beginQuery = issueTimestamp();
+  s.endQuery = -1;
+  open_.push_back(sets_[current_].scopes.size());
+  sets_[current_].scopes.push_back(s);
+}
+
+void GpuProfiler::pop() {
+  if (!available_ || open_.empty())
+    return;
+  sets_[current_].scopes[open_.back()].endQuery = issueTimestamp();
+  open_.pop_back();
+}
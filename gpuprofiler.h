@@ -0,0 +1,86 @@
+#ifndef GPUPROFILER_H
+#define GPUPROFILER_H
+
+#include <vector>
+
+#include "glsupport.h"
+#include "profiler.h"
+
+//--------------------------------------------------------------------------------
+// GPU side of the profiler. Scopes are bracketed with GL_TIMESTAMP queries
+// (glQueryCounter), which unlike GL_TIME_ELAPSED queries may nest. Query sets
+// rotate over several frames and a set is only read back once its results
+// are available, so the CPU never waits on the GPU; a set that is still not
+// done when its turn comes again is dropped. Results are converted to the
+// nowNanos() clock and handed to Profiler::addEvent() as events of
+// PROFILER_GPU_THREAD.
+//--------------------------------------------------------------------------------
+class GpuProfiler : Noncopyable {
+public:
+  GpuProfiler();
+  ~GpuProfiler();
+
+  // False without ARB_timer_query; every call is then a no-op
+  bool available() const {
+    return available_;
+  }
+
+  // Collects the oldest query set if it is ready and starts recording into it
+  void beginFrame();
+
+  void push(const char *name);
+  void pop();
+
+  // Frames whose queries were not ready in time
+  int framesDropped() const {
+    return dropped_;
+  }
+
+private:
+  static const int NUM_FRAMES = 3;   // query sets in flight
+
+  struct Scope {
+    const char *name;
+    int depth;
+    int beginQuery, endQuery;   // indices into the set's queries
+  };
+
+  struct QuerySet {
+    std::vector<GLuint> queries;
+    int used;
+    std::vector<Scope> scopes;
+  };
+
+  bool available_;
+  QuerySet sets_[NUM_FRAMES];
+  int current_;
+  std::vector<int> open_;       // indices of open scopes in the current set
+  long long clockOffset_;       // nowNanos() - GPU timestamp
+  long long lastCalibration_;
+  int dropped_;
+
+  int issueTimestamp();
+  void collect(QuerySet& set);
+  void calibrate();
+};
+
+// Times the GL commands issued in the enclosing C++ scope
+class GpuProfileScope {
+public:
+  GpuProfileScope(GpuProfiler& profiler, const char *name)
+    : profiler_(profiler) {
+    profiler_.push(name);
+  }
+
+  ~GpuProfileScope() {
+    profiler_.pop();
+  }
+
+private:
+  GpuProfiler& profiler_;
+
+  GpuProfileScope(const GpuProfileScope&);
+  const GpuProfileScope& operator= (const GpuProfileScope&);
+};
+
+#endif
@@ -0,0 +1,212 @@
+#include <fstream>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <algorithm>
+
+#include "image.h"
+
+using namespace std;
+
+// Skips whitespace and '#' comments between header fields
+static void skipPpmSpace(istream& is) {
+  for (;;) {
+    const int c = is.peek();
+    if (c == '#') {
+      string comment;
+      getline(is, comment);
+    } else if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+      is.get();
+    } else {
+      return;
+    }
+  }
+}
+
+static int readPpmInt(istream& is, const string& fileName) {
+  skipPpmSpace(is);
+  int v = -1;
+  is >> v;
+  if (!is || v < 0)
+    throw runtime_error("Malformed PPM file " + fileName);
+  return v;
+}
+
+Image readPpm(const string& fileName) {
+  ifstream is(fileName.c_str(), ios::binary);
+  if (!is)
+    throw runtime_error("Cannot open file " + fileName);
+
+  string magic;
+  is >> magic;
+  if (magic != "P6" && magic != "P3")
+    throw runtime_error(fileName + " is not a P3 or P6 PPM file");
+  const int w = readPpmInt(is, fileName);
+  const int h = readPpmInt(is, fileName);
+  const int maxVal = readPpmInt(is, fileName);
+  if (w == 0 || h == 0 || maxVal == 0 || maxVal > 255)
+    throw runtime_error("Unsupported PPM file " + fileName);
+
+  vector<unsigned char> rgb(w * h * 3);
+  if (magic == "P6") {
+    is.get();   // the single whitespace ending the header
+    is.read((char*)&rgb[0], rgb.size());
+  } else {
+    for (size_t i = 0; i < rgb.size(); ++i) {
+      rgb[i] = (unsigned char)std::min(readPpmInt(is, fileName), maxVal);
+    }
+  }
+  if (!is)
+    throw runtime_error("Truncated PPM file " + fileName);
+
+  // PPM rows go top to bottom
+  Image img(w, h);
+  for (int y = 0; y < h; ++y) {
+    const unsigned char *src = &rgb[(h - 1 - y) * w * 3];
+    unsigned char *dst = img.pixel(0, y);
+    for (int x = 0; x < w; ++x, src += 3, dst += 4) {
+      for (int c = 0; c < 3; ++c) {
+        dst[c] = (unsigned char)(src[c] * 255 / maxVal);
+      }
+      dst[3] = 255;
+    }
+  }
+  return img;
+}
+
+// Rows top to bottom, as both file formats store them, each prefixed by
+// filterByte if it is not negative
+static void packRgbRows(const Image& img, const int filterByte, vector<unsigned char>& out) {
+  out.clear();
+  out.reserve(img.height * (img.width * 3 + 1));
+  for (int y = img.height - 1; y >= 0; --y) {
+    if (filterByte >= 0)
+      out.push_back((unsigned char)filterByte);
+    const unsigned char *src = img.pixel(0, y);
+    for (int x = 0; x < img.width; ++x, src += 4) {
+      out.insert(out.end(), src, src + 3);
+    }
+  }
+}
+
+void writePpm(const string& fileName, const Image& img) {
+  ofstream os(fileName.c_str(), ios::binary);
+  if (!os)
+    throw runtime_error("Cannot open " + fileName + " for writing");
+  vector<unsigned char> rgb;
+  packRgbRows(img, -1, rgb);
+  os << "P6\n" << img.width << " " << img.height << "\n255\n";
+  if (!rgb.empty())
+    os.write((const char*)&rgb[0], rgb.size());
+  os.close();
+  if (!os)
+    throw runtime_error("Error writing " + fileName);
+}
+
+static unsigned crc32(const unsigned char *p, const size_t n, unsigned crc = 0) {
+  static unsigned table[256];
+  static bool tableReady = false;
+  if (!tableReady) {
+    for (unsigned i = 0; i < 256; ++i) {
+      unsigned c = i;
+      for (int k = 0; k < 8; ++k) {
+        c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+      }
+      table[i] = c;
+    }
+    tableReady = true;
+  }
+  crc = ~crc;
+  for (size_t i = 0; i < n; ++i) {
+    crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+static void putBigEndian(vector<unsigned char>& out, const unsigned v) {
+  out.push_back(v >> 24);
+  out.push_back(v >> 16);
+  out.push_back(v >> 8);
+  out.push_back(v);
+}
+
+// Length, type, data and CRC of the type and data
+static void writePngChunk(ostream& os, const char type[4], const vector<unsigned char>& data) {
+  vector<unsigned char> chunk;
+  chunk.reserve(data.size() + 12);
+  putBigEndian(chunk, data.size());
+  chunk.insert(chunk.end(), type, type + 4);
+  chunk.insert(chunk.end(), data.begin(), data.end());
+  putBigEndian(chunk, crc32(&chunk[4], data.size() + 4));
+  os.write((const char*)&chunk[0], chunk.size());
+}
+
+void writePng(const string& fileName, const Image& img) {
+  ofstream os(fileName.c_str(), ios::binary);
+  if (!os)
+    throw runtime_error("Cannot open " + fileName + " for writing");
+  static const unsigned char signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+  os.write((const char*)signature, 8);
+
+  vector<unsigned char> header;
+  putBigEndian(header, img.width);
+  putBigEndian(header, img.height);
+  const unsigned char format[5] = {8, 2, 0, 0, 0};   // 8 bit RGB, no interlacing
+  header.insert(header.end(), format, format + 5);
+  writePngChunk(os, "IHDR", header);
+
+  // A zlib stream of stored deflate blocks of at most 65535 bytes each,
+  // then the Adler-32 checksum of the rows
+  vector<unsigned char> rows;
+  packRgbRows(img, 0, rows);
+  vector<unsigned char> z;
+  z.reserve(rows.size() + rows.size() / 65535 * 5 + 16);
+  z.push_back(0x78);
+  z.push_back(0x01);
+  size_t pos = 0;
+  do {
+    const size_t len = std::min(rows.size() - pos, (size_t)65535);
+    z.push_back(pos + len == rows.size() ? 1 : 0);
+    z.push_back(len & 0xff);
+    z.push_back(len >> 8);
+    z.push_back(~len & 0xff);
+    z.push_back((~len >> 8) & 0xff);
+    z.insert(z.end(), rows.begin() + pos, rows.begin() + pos + len);
+    pos += len;
+  } while (pos < rows.size());
+  unsigned a = 1, b = 0;
+  for (size_t i = 0; i < rows.size(); ++i) {
+    a = (a + rows[i]) % 65521;
+    b = (b + a) % 65521;
+  }
+  putBigEndian(z, b << 16 | a);
+  writePngChunk(os, "IDAT", z);
+  writePngChunk(os, "IEND", vector<unsigned char>());
+  os.close();
+  if (!os)
+    throw runtime_error("Error writing " + fileName);
+}
+
+static Image halve(const Image& src) {
+  Image dst(std::max(1, src.width / 2), std::max(1, src.height / 2));
+  for (int y = 0; y < dst.height; ++y) {
+    const int y0 = std::min(2 * y, src.height - 1), y1 = std::min(2 * y + 1, src.height - 1);
+    for (int x = 0; x < dst.width; ++x) {
+      const int x0 = std::min(2 * x, src.width - 1), x1 = std::min(2 * x + 1, src.width - 1);
+      const unsigned char *a = src.pixel(x0, y0), *b = src.pixel(x1, y0);
+      const unsigned char *c = src.pixel(x0, y1), *d = src.pixel(x1, y1);
+      unsigned char *out = dst.pixel(x, y);
+      for (int i = 0; i < 4; ++i) {
+        out[i] = (unsigned char)((a[i] + b[i] + c[i] + d[i] + 2) / 4);
+      }
+    }
+  }
+  return dst;
+}
+
+void buildMipChain(const Image& base, vector<Image>& levels) {
+  levels.push_back(base);
+  while (levels.back().width > 1 || levels.back().height > 1) {
+    levels.push_back(halve(levels.back()));
+  }
+}
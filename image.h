@@ -0,0 +1,51 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <vector>
+#include <string>
+
+//--------------------------------------------------------------------------------
+// CPU side images: 8 bit RGBA pixels, rows stored bottom to top like GL
+// expects them. No GL in here so images can be loaded and filtered on worker
+// threads.
+//--------------------------------------------------------------------------------
+
+struct Image {
+  int width, height;
+  std::vector<unsigned char> pixels;   // width * height * 4 bytes
+
+  Image() : width(0), height(0) {}
+
+  Image(const int w, const int h) : width(w), height(h), pixels(w * h * 4) {}
+
+  size_t bytes() const {
+    return pixels.size();
+  }
+
+  unsigned char *pixel(const int x, const int y) {
+    return &pixels[(y * width + x) * 4];
+  }
+
+  const unsigned char *pixel(const int x, const int y) const {
+    return &pixels[(y * width + x) * 4];
+  }
+};
+
+// Reads a binary (P6) or ASCII (P3) PPM file with a maximum value of at most
+// 255. Alpha is set to opaque. Throws runtime_error on error
+Image readPpm(const std::string& fileName);
+
+// Writes a binary (P6) PPM file, dropping alpha. Throws runtime_error on error
+void writePpm(const std::string& fileName, const Image& img);
+
+// Writes an 8 bit RGB PNG file, dropping alpha. The image data is stored
+// uncompressed, so no zlib is needed; files are about the size of a PPM.
+// Throws runtime_error on error
+void writePng(const std::string& fileName, const Image& img);
+
+// Appends the mip chain of base to levels: base itself, then every level
+// halved with a 2x2 box filter down to 1x1. Odd sizes round down, dropping
+// the last row or column of the larger level.
+void buildMipChain(const Image& base, std::vector<Image>& levels);
+
+#endif
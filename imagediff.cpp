@@ -0,0 +1,111 @@
+#include <cmath>
+#include <algorithm>
+#include <string>
+#include <fstream>
+
+#include "image.h"
+#include "imagediff.h"
+
+using namespace std;
+
+// Largest value of yiqDelta(), between black and white
+static const double MAX_YIQ_DELTA = 35215;
+
+// Squared perceived difference of two RGB pixels, weighted YIQ distance
+static double yiqDelta(const unsigned char *a, const unsigned char *b) {
+  const double dr = a[0] - b[0], dg = a[1] - b[1], db = a[2] - b[2];
+  const double y = dr * 0.29889531 + dg * 0.58662247 + db * 0.11448223;
+  const double i = dr * 0.59597799 - dg * 0.27417610 - db * 0.32180189;
+  const double q = dr * 0.21147017 - dg * 0.52261711 + db * 0.31114694;
+  return 0.5053 * y * y + 0.299 * i * i + 0.1957 * q * q;
+}
+
+// Whether a golden pixel within shift pixels of (x, y) is within limit
+static bool matchesNearby(const Image& image, const Image& golden, const int x, const int y,
+                          const int shift, const double limit) {
+  const unsigned char *p = image.pixel(x, y);
+  for (int gy = max(0, y - shift); gy <= min(golden.height - 1, y + shift); ++gy) {
+    for (int gx = max(0, x - shift); gx <= min(golden.width - 1, x + shift); ++gx) {
+      if (yiqDelta(p, golden.pixel(gx, gy)) <= limit)
+        return true;
+    }
+  }
+  return false;
+}
+
+ImageDiff compareImages(const Image& image, const Image& golden, const DiffTolerance& tolerance,
+                        Image *diff) {
+  ImageDiff r;
+  r.sameSize = image.width == golden.width && image.height == golden.height;
+  if (!r.sameSize) {
+    if (diff)
+      *diff = Image();
+    return r;
+  }
+  if (diff)
+    *diff = Image(golden.width, golden.height);
+
+  const double limit = tolerance.threshold * tolerance.threshold * MAX_YIQ_DELTA;
+  double sum = 0, maxDelta = 0;
+  for (int y = 0; y < image.height; ++y) {
+    for (int x = 0; x < image.width; ++x) {
+      const unsigned char *g = golden.pixel(x, y);
+      const double delta = yiqDelta(image.pixel(x, y), g);
+      sum += delta;
+      maxDelta = max(maxDelta, delta);
+
+      unsigned char mark[4] = {255, 255, 255, 255};
+      if (delta <= limit) {
+        // faded luma of the golden pixel
+        const int luma = (g[0] * 77 + g[1] * 150 + g[2] * 29) >> 8;
+        mark[0] = mark[1] = mark[2] = (unsigned char)(192 + luma / 4);
+      } else if (tolerance.shift > 0 && matchesNearby(image, golden, x, y, tolerance.shift, limit)) {
+        ++r.shifted;
+        mark[2] = 0;
+      } else {
+        ++r.differing;
+        mark[1] = mark[2] = 0;
+      }
+      if (diff) {
+        unsigned char *d = diff->pixel(x, y);
+        d[0] = mark[0], d[1] = mark[1], d[2] = mark[2], d[3] = mark[3];
+      }
+    }
+  }
+
+  const int n = image.width * image.height;
+  r.fraction = n > 0 ? (double)r.differing / n : 0;
+  r.maxDelta = std::sqrt(maxDelta / MAX_YIQ_DELTA);
+  r.rmsDelta = n > 0 ? std::sqrt(sum / n / MAX_YIQ_DELTA) : 0;
+  r.passed = r.fraction <= tolerance.maxFraction;
+  return r;
+}
+
+GoldenResult checkGolden(const Image& image, const string& base, const bool update,
+                         const DiffTolerance& tolerance, ImageDiff& diff) {
+  const string golden = base + ".ppm";
+  if (update || !ifstream(golden.c_str())) {
+    writePpm(golden, image);
+    diff = ImageDiff();
+    return GOLDEN_WRITTEN;
+  }
+  Image picture;
+  diff = compareImages(image, readPpm(golden), tolerance, &picture);
+  if (diff.passed)
+    return GOLDEN_PASSED;
+  writePpm(base + "-actual.ppm", image);
+  if (diff.sameSize)
+    writePpm(base + "-diff.ppm", picture);
+  return GOLDEN_FAILED;
+}
+
+const char *goldenResultName(const GoldenResult result) {
+  switch (result) {
+    case GOLDEN_PASSED:
+      return "pass";
+    case GOLDEN_FAILED:
+      return "FAIL";
+    default:
+      return "written";
+  }
+}
@@ -0,0 +1,62 @@
+#ifndef IMAGEDIFF_H
+#define IMAGEDIFF_H
+
+#include <string>
+
+#include "image.h"
+
+//--------------------------------------------------------------------------------
+// Comparison of rendered images against golden ones, for catching visual
+// regressions. Pixels are compared by perceived color difference rather than
+// per channel: the distance in YIQ space weighted for how strongly the eye
+// notices changes of brightness and hue (Kotsarenko and Ramos, "Measuring
+// perceived color difference using YIQ NTSC transmission color space"),
+// scaled to [0, 1]. A pixel that differs from its golden pixel still matches
+// if a golden pixel close by is near enough, so edges moved by a fraction of
+// a pixel, e.g. by another driver's rasterization rules, are not reported.
+//--------------------------------------------------------------------------------
+
+struct DiffTolerance {
+  double threshold;      // perceived difference up to which pixels match; 0.1 is barely visible
+  int shift;             // golden pixels up to this many pixels away may match
+  double maxFraction;    // fraction of pixels that may differ in an image that passes
+
+  DiffTolerance() : threshold(0.1), shift(1), maxFraction(0.001) {}
+};
+
+struct ImageDiff {
+  bool sameSize;
+  int differing;         // pixels no golden pixel within reach matches
+  int shifted;           // pixels only matched by a neighbour of their golden pixel
+  double fraction;       // differing pixels over all pixels
+  double maxDelta;       // largest and root mean square perceived difference of pixels to their own golden pixel
+  double rmsDelta;
+  bool passed;
+
+  ImageDiff()
+    : sameSize(false), differing(0), shifted(0), fraction(0), maxDelta(0), rmsDelta(0), passed(false) {}
+};
+
+// Compares the RGB of image against golden. Images of different sizes do
+// not pass. If diff is non-NULL it receives a picture of the result: the
+// golden image faded to gray, with differing pixels in red and shifted ones
+// in yellow.
+ImageDiff compareImages(const Image& image, const Image& golden, const DiffTolerance& tolerance,
+                        Image *diff = NULL);
+
+enum GoldenResult {
+  GOLDEN_PASSED,
+  GOLDEN_FAILED,
+  GOLDEN_WRITTEN         // there was no golden image yet, or it was replaced
+};
+
+// Compares image with the golden image <base>.ppm, or writes image there if
+// the file does not exist or update is set. A failing image is kept as
+// <base>-actual.ppm next to the picture of the difference, <base>-diff.ppm.
+GoldenResult checkGolden(const Image& image, const std::string& base, const bool update,
+                         const DiffTolerance& tolerance, ImageDiff& diff);
+
+// "pass", "FAIL" or "written"
+const char *goldenResultName(const GoldenResult result);
+
+#endif
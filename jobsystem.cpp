@@ -0,0 +1,230 @@
+#include <vector>
+#include <deque>
+#include <stdexcept>
+#include <cassert>
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "jobsystem.h"
+
+using namespace std;
+
+// Pool the current thread works for and its index in it, set when a worker
+// starts. Other threads have no pool.
+static __thread const JobSystem *t_pool = NULL;
+static __thread int t_threadIndex = 0;
+
+namespace {
+struct ThreadStart {
+  JobSystem *js;
+  int index;
+};
+}
+
+JobSystem::JobSystem(int numThreads)
+  : creator_(pthread_self()), queued_(0), sleeping_(0), quit_(false) {
+  if (numThreads <= 0)
+    numThreads = max(1, (int)sysconf(_SC_NPROCESSORS_ONLN));
+
+  pthread_mutex_init(&sleepLock_, NULL);
+  pthread_cond_init(&wakeup_, NULL);
+
+  queues_.resize(numThreads);
+  for (int i = 0; i < numThreads; ++i) {
+    queues_[i] = new WorkQueue();
+    pthread_mutex_init(&queues_[i]->lock, NULL);
+    queues_[i]->executed = queues_[i]->stolen = 0;
+  }
+
+  threads_.resize(numThreads - 1);
+  for (int i = 1; i < numThreads; ++i) {
+    ThreadStart *start = new ThreadStart();
+    start->js = this;
+    start->index = i;
+    if (pthread_create(&threads_[i-1], NULL, threadMain, start) != 0)
+      throw runtime_error("pthread_create fails");
+  }
+}
+
+JobSystem::~JobSystem() {
+  pthread_mutex_lock(&sleepLock_);
+  quit_ = true;
+  pthread_cond_broadcast(&wakeup_);
+  pthread_mutex_unlock(&sleepLock_);
+
+  for (size_t i = 0; i < threads_.size(); ++i) {
+    pthread_join(threads_[i], NULL);
+  }
+  for (size_t i = 0; i < queues_.size(); ++i) {
+    pthread_mutex_destroy(&queues_[i]->lock);
+    delete queues_[i];
+  }
+  pthread_cond_destroy(&wakeup_);
+  pthread_mutex_destroy(&sleepLock_);
+}
+
+int JobSystem::threadIndex() const {
+  if (t_pool == this)
+    return t_threadIndex;
+  // any other thread would silently share the creating thread's deque
+  assert(pthread_equal(pthread_self(), creator_) && "job submitted from a thread outside the pool");
+  return 0;
+}
+
+void JobSystem::spawn(JobFunc func, void *data, JobCounter *counter) {
+  Job job;
+  job.func = func;
+  job.data = data;
+  job.counter = counter;
+  if (counter)
+    counter->add(1);
+
+  // Count the job before it becomes visible so queued_ never goes negative
+  __sync_fetch_and_add(&queued_, 1);
+  WorkQueue& q = *queues_[threadIndex()];
+  pthread_mutex_lock(&q.lock);
+  q.jobs.push_back(job);
+  pthread_mutex_unlock(&q.lock);
+
+  // Wake a sleeper if there is one. Both queued_ and sleeping_ are updated
+  // with full barriers, so either we see the sleeper or it sees our job;
+  // signalling under sleepLock_ means it cannot be between check and wait.
+  if (__sync_fetch_and_add(&sleeping_, 0) > 0) {
+    pthread_mutex_lock(&sleepLock_);
+    pthread_cond_signal(&wakeup_);
+    pthread_mutex_unlock(&sleepLock_);
+  }
+}
+
+bool JobSystem::popOrSteal(const int self, Job& job) {
+  if (__sync_fetch_and_add(&queued_, 0) == 0)
+    return false;
+
+  // Own deque first, newest job
+  WorkQueue& own = *queues_[self];
+  pthread_mutex_lock(&own.lock);
+  if (!own.jobs.empty()) {
+    job = own.jobs.back();
+    own.jobs.pop_back();
+    pthread_mutex_unlock(&own.lock);
+    __sync_fetch_and_sub(&queued_, 1);
+    return true;
+  }
+  pthread_mutex_unlock(&own.lock);
+
+  // Then steal the oldest job of someone else, starting at our neighbour so
+  // thieves spread out over victims
+  const int n = queues_.size();
+  for (int k = 1; k < n; ++k) {
+    WorkQueue& victim = *queues_[(self + k) % n];
+    pthread_mutex_lock(&victim.lock);
+    if (!victim.jobs.empty()) {
+      job = victim.jobs.front();
+      victim.jobs.pop_front();
+      pthread_mutex_unlock(&victim.lock);
+      __sync_fetch_and_sub(&queued_, 1);
+      __sync_fetch_and_add(&own.stolen, 1);
+      return true;
+    }
+    pthread_mutex_unlock(&victim.lock);
+  }
+  return false;
+}
+
+void JobSystem::execute(const int self, const Job& job) {
+  job.func(job.data);
+  __sync_fetch_and_add(&queues_[self]->executed, 1);
+  if (job.counter)
+    job.counter->done();
+}
+
+void JobSystem::wait(const JobCounter& counter) {
+  const int self = threadIndex();
+  Job job;
+  while (!counter.finished()) {
+    if (popOrSteal(self, job))
+      execute(self, job);
+    else
+      sched_yield();
+  }
+}
+
+void JobSystem::workerLoop(const int self) {
+  Job job;
+  for (;;) {
+    if (popOrSteal(self, job)) {
+      execute(self, job);
+      continue;
+    }
+    pthread_mutex_lock(&sleepLock_);
+    __sync_fetch_and_add(&sleeping_, 1);
+    while (!quit_ && __sync_fetch_and_add(&queued_, 0) == 0)
+      pthread_cond_wait(&wakeup_, &sleepLock_);
+    __sync_fetch_and_sub(&sleeping_, 1);
+    const bool quit = quit_;
+    pthread_mutex_unlock(&sleepLock_);
+    if (quit)
+      return;
+  }
+}
+
+void *JobSystem::threadMain(void *arg) {
+  ThreadStart *start = static_cast<ThreadStart*>(arg);
+  JobSystem *js = start->js;
+  t_pool = js;
+  t_threadIndex = start->index;
+  delete start;
+  js->workerLoop(t_threadIndex);
+  return NULL;
+}
+
+void JobSystem::runForChunk(void *data) {
+  const ForChunk *c = static_cast<const ForChunk*>(data);
+  c->body(c->begin, c->end, c->ctx);
+}
+
+void JobSystem::parallelFor(int begin, int end, int grain, ForBody body, void *ctx) {
+  if (end <= begin)
+    return;
+  grain = max(1, grain);
+  if (end - begin <= grain || queues_.size() == 1) {
+    body(begin, end, ctx);
+    return;
+  }
+
+  const int numChunks = (end - begin + grain - 1) / grain;
+  vector<ForChunk> chunks(numChunks);
+  for (int i = 0; i < numChunks; ++i) {
+    chunks[i].body = body;
+    chunks[i].ctx = ctx;
+    chunks[i].begin = begin + i * grain;
+    chunks[i].end = min(end, chunks[i].begin + grain);
+  }
+
+  // Spawn all but the first chunk and run that one here; waiting then helps
+  // with whatever has not been stolen yet
+  JobCounter counter;
+  for (int i = numChunks - 1; i > 0; --i) {
+    spawn(runForChunk, &chunks[i], &counter);
+  }
+  runForChunk(&chunks[0]);
+  wait(counter);
+}
+
+long long JobSystem::jobsExecuted() const {
+  long long r = 0;
+  for (size_t i = 0; i < queues_.size(); ++i) {
+    r += __sync_fetch_and_add(&queues_[i]->executed, 0);
+  }
+  return r;
+}
+
+long long JobSystem::jobsStolen() const {
+  long long r = 0;
+  for (size_t i = 0; i < queues_.size(); ++i) {
+    r += __sync_fetch_and_add(&queues_[i]->stolen, 0);
+  }
+  return r;
+}
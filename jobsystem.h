@@ -0,0 +1,118 @@
+#ifndef JOBSYSTEM_H
+#define JOBSYSTEM_H
+
+#include <vector>
+#include <deque>
+
+#include <pthread.h>
+
+//--------------------------------------------------------------------------------
+// A small work-stealing job system. Every thread of the pool, plus the thread
+// that created the JobSystem, owns a deque of jobs: it pushes and pops at the
+// back (LIFO, cache friendly) while idle threads steal from the front of other
+// deques. Jobs are plain function pointers so no allocation is needed to run
+// one. Completion is tracked with JobCounters, and waiting on a counter runs
+// other jobs instead of blocking (fork/join).
+//--------------------------------------------------------------------------------
+
+// Number of outstanding jobs of a fork/join group. Incremented when a job is
+// spawned and decremented when it finishes.
+class JobCounter {
+  volatile int pending_;
+
+  JobCounter(const JobCounter&);
+  const JobCounter& operator= (const JobCounter&);
+
+public:
+  JobCounter() : pending_(0) {}
+
+  void add(const int n) {
+    __sync_fetch_and_add(&pending_, n);
+  }
+
+  void done() {
+    __sync_fetch_and_sub(&pending_, 1);
+  }
+
+  bool finished() const {
+    return __sync_fetch_and_add(const_cast<volatile int*>(&pending_), 0) == 0;
+  }
+};
+
+typedef void (*JobFunc)(void *data);
+
+struct Job {
+  JobFunc func;
+  void *data;
+  JobCounter *counter;
+};
+
+// Body of a parallelFor: processes indices [begin, end)
+typedef void (*ForBody)(int begin, int end, void *ctx);
+
+class JobSystem {
+public:
+  // Creates numThreads - 1 worker threads; the calling thread is the last
+  // member of the pool and runs jobs while it waits. numThreads <= 0 uses one
+  // thread per online core.
+  explicit JobSystem(int numThreads = 0);
+  ~JobSystem();
+
+  int numThreads() const {
+    return (int)queues_.size();
+  }
+
+  // Index of the calling thread within the pool, 0 for the creating thread.
+  // Only threads of the pool and the creating thread may call spawn, wait
+  // and parallelFor; they share deques with nobody else.
+  int threadIndex() const;
+
+  // Queues a job on the calling thread's deque. If counter is non-NULL it is
+  // incremented now and decremented once func has returned.
+  void spawn(JobFunc func, void *data, JobCounter *counter);
+
+  // Runs queued jobs until counter reaches zero
+  void wait(const JobCounter& counter);
+
+  // Calls body on chunks of at most grain indices covering [begin, end) and
+  // returns once all of them are done. Chunks run concurrently.
+  void parallelFor(int begin, int end, int grain, ForBody body, void *ctx);
+
+  // Number of jobs executed and stolen since construction, summed over threads
+  long long jobsExecuted() const;
+  long long jobsStolen() const;
+
+private:
+  struct WorkQueue {
+    pthread_mutex_t lock;
+    std::deque<Job> jobs;
+    volatile long long executed, stolen;   // read by other threads
+  };
+
+  struct ForChunk {
+    ForBody body;
+    void *ctx;
+    int begin, end;
+  };
+
+  std::vector<WorkQueue*> queues_;
+  std::vector<pthread_t> threads_;
+  pthread_t creator_;
+  volatile int queued_;   // jobs sitting in any deque
+  volatile int sleeping_; // workers blocked on wakeup_
+  volatile bool quit_;
+  pthread_mutex_t sleepLock_;
+  pthread_cond_t wakeup_;
+
+  JobSystem(const JobSystem&);
+  const JobSystem& operator= (const JobSystem&);
+
+  bool popOrSteal(const int self, Job& job);
+  void execute(const int self, const Job& job);
+  void workerLoop(const int self);
+
+  static void *threadMain(void *arg);
+  static void runForChunk(void *data);
+};
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef LANES_H
+#define LANES_H
+
+#include <cmath>
+#include <algorithm>
+
+#include "cvec.h"
+
+//--------------------------------------------------------------------------------
+// Lane-wise operations on Cvec4f that the vector interface does not have,
+// for code that works on four pixels or rays at a time: products, quotients,
+// minimums and comparisons per lane, on SSE registers when available.
+// Results are exact (no approximate reciprocals), so they do not differ
+// between processors.
+//--------------------------------------------------------------------------------
+
+inline Cvec4f mulLanes(const Cvec4f& a, const Cvec4f& b) {
+#ifdef CVEC_SSE
+  return Cvec4f(_mm_mul_ps(a.simd(), b.simd()));
+#else
+  return Cvec4f(a[0] * b[0], a[1] * b[1], a[2] * b[2], a[3] * b[3]);
+#endif
+}
+
+inline Cvec4f divLanes(const Cvec4f& a, const Cvec4f& b) {
+#ifdef CVEC_SSE
+  return Cvec4f(_mm_div_ps(a.simd(), b.simd()));
+#else
+  return Cvec4f(a[0] / b[0], a[1] / b[1], a[2] / b[2], a[3] / b[3]);
+#endif
+}
+
+inline Cvec4f maxLanes(const Cvec4f& a, const Cvec4f& b) {
+#ifdef CVEC_SSE
+  return Cvec4f(_mm_max_ps(a.simd(), b.simd()));
+#else
+  return Cvec4f(std::max(a[0], b[0]), std::max(a[1], b[1]), std::max(a[2], b[2]), std::max(a[3], b[3]));
+#endif
+}
+
+inline Cvec4f minLanes(const Cvec4f& a, const Cvec4f& b) {
+#ifdef CVEC_SSE
+  return Cvec4f(_mm_min_ps(a.simd(), b.simd()));
+#else
+  return Cvec4f(std::min(a[0], b[0]), std::min(a[1], b[1]), std::min(a[2], b[2]), std::min(a[3], b[3]));
+#endif
+}
+
+// 1 / sqrt, computed exactly rather than with the approximate rsqrt
+// instruction, whose results differ between processors
+inline Cvec4f invSqrtLanes(const Cvec4f& a) {
+#ifdef CVEC_SSE
+  return Cvec4f(_mm_div_ps(_mm_set1_ps(1), _mm_sqrt_ps(a.simd())));
+#else
+  return Cvec4f(1 / std::sqrt(a[0]), 1 / std::sqrt(a[1]), 1 / std::sqrt(a[2]), 1 / std::sqrt(a[3]));
+#endif
+}
+
+// Bit i set where lane i of a is greater than (or equal to, if orEqual) b
+inline int greaterLanes(const Cvec4f& a, const Cvec4f& b, const bool orEqual) {
+#ifdef CVEC_SSE
+  return _mm_movemask_ps(orEqual ? _mm_cmpge_ps(a.simd(), b.simd()) : _mm_cmpgt_ps(a.simd(), b.simd()));
+#else
+  int bits = 0;
+  for (int i = 0; i < 4; ++i) {
+    if (orEqual ? a[i] >= b[i] : a[i] > b[i])
+      bits |= 1 << i;
+  }
+  return bits;
+#endif
+}
+
+inline Cvec4f loadLanes(const float *p) {
+#ifdef CVEC_SSE
+  return Cvec4f(_mm_loadu_ps(p));
+#else
+  return Cvec4f(p[0], p[1], p[2], p[3]);
+#endif
+}
+
+// Four 3-vectors, one per lane
+struct Vec3Lanes {
+  Cvec4f x, y, z;
+
+  void normalize() {
+    const Cvec4f s = invSqrtLanes(mulLanes(x, x) + mulLanes(y, y) + mulLanes(z, z));
+    x = mulLanes(x, s), y = mulLanes(y, s), z = mulLanes(z, s);
+  }
+};
+
+inline Cvec4f dotLanes(const Vec3Lanes& a, const Vec3Lanes& b) {
+  return mulLanes(a.x, b.x) + mulLanes(a.y, b.y) + mulLanes(a.z, b.z);
+}
+
+inline Vec3Lanes crossLanes(const Vec3Lanes& a, const Vec3Lanes& b) {
+  Vec3Lanes r;
+  r.x = mulLanes(a.y, b.z) - mulLanes(a.z, b.y);
+  r.y = mulLanes(a.z, b.x) - mulLanes(a.x, b.z);
+  r.z = mulLanes(a.x, b.y) - mulLanes(a.y, b.x);
+  return r;
+}
+
+// max(0, n . normalize(light - pos)), the point light term of the shaders
+inline Cvec4f pointLightLanes(const Vec3Lanes& n, const Vec3Lanes& pos, const float light[3]) {
+  Vec3Lanes l;
+  l.x = Cvec4f(light[0]) - pos.x;
+  l.y = Cvec4f(light[1]) - pos.y;
+  l.z = Cvec4f(light[2]) - pos.z;
+  l.normalize();
+  return maxLanes(dotLanes(n, l), Cvec4f(0));
+}
+
+#endif
@@ -0,0 +1,515 @@
+////////////////////////////////////////////////////////////////////////
+//
+//   Benchmarks of the math and geometry headers. Common Cvec and Matrix4
+//   expression patterns each have an eager variant (plain operators, one
+//   temporary per operator) and a fused variant (lazy() expression
+//   templates or the direct-writing Matrix4 factories); the last pattern
+//   compares composing rigid transforms as 4x4 matrices with composing
+//   them as RigTForms. Single operations (normalize, cross, Matrix4
+//   product, inv, transpose, normalMatrix, writeToColumnMajorMatrix) and
+//   geometrymaker's makeCube and makeSphere are timed on their own. Every
+//   variant is a separate non-inlined bench_* function so its code size
+//   can be compared with `make math-bench-size`.
+//
+//   Each benchmark runs g_numWarmup untimed times, then g_numRepetitions
+//   timed ones; results are the median and the median absolute deviation
+//   (MAD) of those, which outliers from interrupts or frequency changes
+//   barely move.
+//
+//   Usage: math-bench [-json <file>] [-compare <baseline.json>] [-threshold <fraction>]
+//
+//     -json <file>         also writes the results as JSON, e.g. to keep as
+//                          a baseline
+//     -compare <file>      compares the medians with a JSON file written by
+//                          -json and exits with status 1 if any benchmark
+//                          regressed: slower by more than the threshold
+//                          (default 0.1, 10%) and by more than 3 MADs
+//
+////////////////////////////////////////////////////////////////////////
+
+#include <vector>
+#include <map>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <stdexcept>
+
+#include "cvec.h"
+#include "matrix4.h"
+#include "rigtform.h"
+#include "geometrymaker.h"
+#include "timer.h"
+
+using namespace std;
+
+#define BENCH_FUNC __attribute__((noinline))
+
+static const int g_numElements = 4096;
+static const int g_numWarmup = 20;
+static const int g_numRepetitions = 200;
+static const int g_numShapes = 64;          // meshes generated per geometry benchmark call
+static const int g_sphereSlices = 24, g_sphereStacks = 12;
+
+// --------- Patterns
+
+BENCH_FUNC void bench_axpby_eager(const Cvec3 *a, const Cvec3 *b, double s, double t, Cvec3 *out, int n) {
+  for (int i = 0; i < n; ++i) {
+    out[i] = a[i] * s + b[i] * t;
+  }
+}
+
+BENCH_FUNC void bench_axpby_lazy(const Cvec3 *a, const Cvec3 *b, double s, double t, Cvec3 *out, int n) {
+  for (int i = 0; i < n; ++i) {
+    out[i] = lazy(a[i]) * s + lazy(b[i]) * t;
+  }
+}
+
+BENCH_FUNC void bench_sum4_eager(const Cvec4 *a, const Cvec4 *b, const Cvec4 *c, const Cvec4 *d, Cvec4 *out, int n) {
+  for (int i = 0; i < n; ++i) {
+    out[i] = a[i] + b[i] + c[i] + d[i];
+  }
+}
+
+BENCH_FUNC void bench_sum4_lazy(const Cvec4 *a, const Cvec4 *b, const Cvec4 *c, const Cvec4 *d, Cvec4 *out, int n) {
+  for (int i = 0; i < n; ++i) {
+    out[i] = lazy(a[i]) + b[i] + c[i] + d[i];
+  }
+}
+
+BENCH_FUNC void bench_lerp_eager(const Cvec3 *a, const Cvec3 *b, double t, Cvec3 *out, int n) {
+  for (int i = 0; i < n; ++i) {
+    out[i] = a[i] + (b[i] - a[i]) * t;
+  }
+}
+
+BENCH_FUNC void bench_lerp_lazy(const Cvec3 *a, const Cvec3 *b, double t, Cvec3 *out, int n) {
+  for (int i = 0; i < n; ++i) {
+    out[i] = a[i] + (lazy(b[i]) - a[i]) * t;
+  }
+}
+
+// How Matrix4 factories and products used to be written: start from the
+// identity or zero and overwrite or accumulate
+static Matrix4 legacyMakeTranslation(const Cvec3& t) {
+  Matrix4 r;
+  for (int i = 0; i < 3; ++i) {
+    r(i,3) = t[i];
+  }
+  return r;
+}
+
+static Matrix4 legacyMakeZRotation(const double c, const double s) {
+  Matrix4 r;
+  r(0,0) = r(1,1) = c;
+  r(0,1) = -s;
+  r(1,0) = s;
+  return r;
+}
+
+static Matrix4 legacyMultiply(const Matrix4& a, const Matrix4& m) {
+  Matrix4 r(0);
+  for (int i = 0; i < 4; ++i) {
+    for (int j = 0; j < 4; ++j) {
+      for (int k = 0; k < 4; ++k) {
+        r(i,k) += a(i,j) * m(j,k);
+      }
+    }
+  }
+  return r;
+}
+
+BENCH_FUNC void bench_trs_legacy(const Cvec3 *t, const double *c, const double *s, Matrix4 *out, int n) {
+  for (int i = 0; i < n; ++i) {
+    out[i] = legacyMultiply(legacyMakeTranslation(t[i]), legacyMakeZRotation(c[i], s[i]));
+  }
+}
+
+BENCH_FUNC void bench_trs_direct(const Cvec3 *t, const double *c, const double *s, Matrix4 *out, int n) {
+  for (int i = 0; i < n; ++i) {
+    out[i] = Matrix4::makeTranslation(t[i]) * Matrix4::makeZRotation(c[i], s[i]);
+  }
+}
+
+BENCH_FUNC void bench_compose_matrix(const Matrix4 *a, const Matrix4 *b, Matrix4 *out, int n) {
+  for (int i = 0; i < n; ++i) {
+    out[i] = a[i] * b[i];
+  }
+}
+
+BENCH_FUNC void bench_compose_rbt(const RigTForm *a, const RigTForm *b, RigTForm *out, int n) {
+  for (int i = 0; i < n; ++i) {
+    out[i] = a[i] * b[i];
+  }
+}
+
+BENCH_FUNC void bench_normalize(const Cvec3 *a, Cvec3 *out, int n) {
+  for (int i = 0; i < n; ++i) {
+    out[i] = normalize(a[i]);
+  }
+}
+
+BENCH_FUNC void bench_cross(const Cvec3 *a, const Cvec3 *b, Cvec3 *out, int n) {
+  for (int i = 0; i < n; ++i) {
+    out[i] = cross(a[i], b[i]);
+  }
+}
+
+BENCH_FUNC void bench_matrix_multiply(const Matrix4 *a, const Matrix4 *b, Matrix4 *out, int n) {
+  for (int i = 0; i < n; ++i) {
+    out[i] = a[i] * b[i];
+  }
+}
+
+BENCH_FUNC void bench_inv(const Matrix4 *a, Matrix4 *out, int n) {
+  for (int i = 0; i < n; ++i) {
+    out[i] = inv(a[i]);
+  }
+}
+
+BENCH_FUNC void bench_transpose(const Matrix4 *a, Matrix4 *out, int n) {
+  for (int i = 0; i < n; ++i) {
+    out[i] = transpose(a[i]);
+  }
+}
+
+BENCH_FUNC void bench_normal_matrix(const Matrix4 *a, Matrix4 *out, int n) {
+  for (int i = 0; i < n; ++i) {
+    out[i] = normalMatrix(a[i]);
+  }
+}
+
+BENCH_FUNC void bench_write_column_major(const Matrix4 *a, float *out, int n) {
+  for (int i = 0; i < n; ++i) {
+    a[i].writeToColumnMajorMatrix(out + 16 * i);
+  }
+}
+
+// n meshes into buffers sized for one, as initCubes() and initSpheres() do
+BENCH_FUNC void bench_make_cube(GenericVertex *vtx, unsigned short *idx, int n) {
+  for (int i = 0; i < n; ++i) {
+    makeCube(1, vtx, idx);
+  }
+}
+
+BENCH_FUNC void bench_make_sphere(GenericVertex *vtx, unsigned short *idx, int n) {
+  for (int i = 0; i < n; ++i) {
+    makeSphere(0.5, g_sphereSlices, g_sphereStacks, vtx, idx);
+  }
+}
+
+// --------- Harness
+
+struct BenchResult {
+  string name;
+  double median, mad, best;   // ns per element
+};
+
+static vector<BenchResult> g_results;
+
+// Runs f g_numWarmup times untimed, then times g_numRepetitions calls.
+// Records the median, MAD and best time per element under the given name.
+template <typename F>
+static const BenchResult& measure(const string& name, F f, const int elements) {
+  for (int r = 0; r < g_numWarmup; ++r) {
+    f();
+  }
+  vector<double> samples(g_numRepetitions);
+  for (int r = 0; r < g_numRepetitions; ++r) {
+    const long long t0 = nowNanos();
+    f();
+    samples[r] = double(nowNanos() - t0) / elements;
+  }
+  sort(samples.begin(), samples.end());
+  BenchResult result;
+  result.name = name;
+  result.median = samples[g_numRepetitions / 2];
+  result.best = samples[0];
+  for (int r = 0; r < g_numRepetitions; ++r) {
+    samples[r] = std::abs(samples[r] - result.median);
+  }
+  nth_element(samples.begin(), samples.begin() + g_numRepetitions / 2, samples.end());
+  result.mad = samples[g_numRepetitions / 2];
+  g_results.push_back(result);
+  return g_results.back();
+}
+
+// Times both variants of a pattern and prints them side by side
+template <typename F, typename G>
+static void measurePair(const char *pattern, F eager, G fused) {
+  const double e = measure(string(pattern) + " eager", eager, g_numElements).median;
+  const double f = measure(string(pattern) + " fused", fused, g_numElements).median;
+  cout << setw(12) << pattern << setw(12) << fixed << setprecision(3) << e
+       << setw(12) << f << setw(10) << setprecision(2) << e / f << "\n";
+}
+
+template <typename F>
+static void measureOp(const char *name, F f, const int elements) {
+  const BenchResult& r = measure(name, f, elements);
+  cout << setw(20) << name << setw(12) << fixed << setprecision(3) << r.median
+       << setw(10) << r.mad << setw(12) << r.best << "\n";
+}
+
+struct Data {
+  vector<Cvec3> a3, b3, out3;
+  vector<Cvec4> a4, b4, c4, d4, out4;
+  vector<double> c, s;
+  vector<Matrix4> outm, am, bm;
+  vector<RigTForm> ar, br, outr;
+  vector<float> outf;
+  vector<GenericVertex> vtx;
+  vector<unsigned short> idx;
+
+  Data() : a3(g_numElements), b3(g_numElements), out3(g_numElements),
+           a4(g_numElements), b4(g_numElements), c4(g_numElements), d4(g_numElements), out4(g_numElements),
+           c(g_numElements), s(g_numElements), outm(g_numElements),
+           am(g_numElements), bm(g_numElements), ar(g_numElements), br(g_numElements), outr(g_numElements),
+           outf(16 * g_numElements) {
+    for (int i = 0; i < g_numElements; ++i) {
+      a3[i] = Cvec3(i, 2*i, 3*i);
+      b3[i] = Cvec3(1, i, -i);
+      a4[i] = Cvec4(i, 1, 2, 3);
+      b4[i] = Cvec4(1, i, 2, 3);
+      c4[i] = Cvec4(1, 2, i, 3);
+      d4[i] = Cvec4(1, 2, 3, i);
+      c[i] = std::cos(i * 0.01);
+      s[i] = std::sin(i * 0.01);
+      ar[i] = RigTForm(a3[i], Quat::makeZRotation(i) * Quat::makeXRotation(0.5 * i));
+      br[i] = RigTForm(b3[i], Quat::makeYRotation(i));
+      am[i] = rigTFormToMatrix(ar[i]);
+      bm[i] = rigTFormToMatrix(br[i]);
+    }
+    a3[0] = Cvec3(1, 0, 0);   // normalize() asserts on zero length
+
+    int vbLen, ibLen, cubeVbLen, cubeIbLen;
+    getSphereVbIbLen(g_sphereSlices, g_sphereStacks, vbLen, ibLen);
+    getCubeVbIbLen(cubeVbLen, cubeIbLen);
+    vtx.assign(std::max(vbLen, cubeVbLen), GenericVertex(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0));
+    idx.resize(std::max(ibLen, cubeIbLen));
+  }
+};
+
+// Binds arguments so measure() can call the pattern with none
+struct AxpbyCall {
+  Data *d;
+  void (*f)(const Cvec3*, const Cvec3*, double, double, Cvec3*, int);
+  void operator () () const { f(&d->a3[0], &d->b3[0], 0.5, 0.25, &d->out3[0], g_numElements); }
+};
+
+struct Sum4Call {
+  Data *d;
+  void (*f)(const Cvec4*, const Cvec4*, const Cvec4*, const Cvec4*, Cvec4*, int);
+  void operator () () const { f(&d->a4[0], &d->b4[0], &d->c4[0], &d->d4[0], &d->out4[0], g_numElements); }
+};
+
+struct LerpCall {
+  Data *d;
+  void (*f)(const Cvec3*, const Cvec3*, double, Cvec3*, int);
+  void operator () () const { f(&d->a3[0], &d->b3[0], 0.3, &d->out3[0], g_numElements); }
+};
+
+struct TrsCall {
+  Data *d;
+  void (*f)(const Cvec3*, const double*, const double*, Matrix4*, int);
+  void operator () () const { f(&d->a3[0], &d->c[0], &d->s[0], &d->outm[0], g_numElements); }
+};
+
+struct ComposeMatrixCall {
+  Data *d;
+  void operator () () const { bench_compose_matrix(&d->am[0], &d->bm[0], &d->outm[0], g_numElements); }
+};
+
+struct ComposeRbtCall {
+  Data *d;
+  void operator () () const { bench_compose_rbt(&d->ar[0], &d->br[0], &d->outr[0], g_numElements); }
+};
+
+struct Vec3UnaryCall {
+  Data *d;
+  void (*f)(const Cvec3*, Cvec3*, int);
+  void operator () () const { f(&d->a3[0], &d->out3[0], g_numElements); }
+};
+
+struct Vec3BinaryCall {
+  Data *d;
+  void (*f)(const Cvec3*, const Cvec3*, Cvec3*, int);
+  void operator () () const { f(&d->a3[0], &d->b3[0], &d->out3[0], g_numElements); }
+};
+
+struct MatrixBinaryCall {
+  Data *d;
+  void (*f)(const Matrix4*, const Matrix4*, Matrix4*, int);
+  void operator () () const { f(&d->am[0], &d->bm[0], &d->outm[0], g_numElements); }
+};
+
+struct MatrixUnaryCall {
+  Data *d;
+  void (*f)(const Matrix4*, Matrix4*, int);
+  void operator () () const { f(&d->am[0], &d->outm[0], g_numElements); }
+};
+
+struct WriteColumnMajorCall {
+  Data *d;
+  void operator () () const { bench_write_column_major(&d->am[0], &d->outf[0], g_numElements); }
+};
+
+struct MeshCall {
+  Data *d;
+  void (*f)(GenericVertex*, unsigned short*, int);
+  void operator () () const { f(&d->vtx[0], &d->idx[0], g_numShapes); }
+};
+
+// --------- JSON results and baselines
+
+static void writeJson(const string& filename) {
+  ofstream f(filename.c_str());
+  f << "{\n  \"elements\": " << g_numElements << ",\n  \"warmup\": " << g_numWarmup
+    << ",\n  \"repetitions\": " << g_numRepetitions << ",\n  \"unit\": \"ns per element\",\n"
+    << "  \"results\": [\n" << setprecision(6);
+  for (size_t i = 0; i < g_results.size(); ++i) {
+    const BenchResult& r = g_results[i];
+    f << "    {\"name\": \"" << r.name << "\", \"median\": " << r.median << ", \"mad\": " << r.mad
+      << ", \"best\": " << r.best << "}" << (i + 1 < g_results.size() ? "," : "") << "\n";
+  }
+  f << "  ]\n}\n";
+  f.close();
+  if (!f)
+    throw runtime_error("Error writing " + filename);
+}
+
+// Number following "key": on the line, or -1
+static double jsonNumber(const string& line, const char *key) {
+  const size_t pos = line.find(string("\"") + key + "\": ");
+  return pos == string::npos ? -1 : atof(line.c_str() + pos + strlen(key) + 4);
+}
+
+// Reads a file written by writeJson(), one result per line
+static void readBaseline(const string& filename, map<string, BenchResult>& baseline) {
+  ifstream f(filename.c_str());
+  if (!f)
+    throw runtime_error("Cannot open baseline " + filename);
+  string line;
+  while (getline(f, line)) {
+    const size_t begin = line.find("\"name\": \"");
+    if (begin == string::npos)
+      continue;
+    const size_t end = line.find('"', begin + 9);
+    BenchResult r;
+    r.name = line.substr(begin + 9, end - begin - 9);
+    r.median = jsonNumber(line, "median");
+    r.mad = jsonNumber(line, "mad");
+    r.best = jsonNumber(line, "best");
+    if (end == string::npos || r.median < 0 || r.mad < 0)
+      throw runtime_error("Malformed result in " + filename + ": " + line);
+    baseline[r.name] = r;
+  }
+  if (baseline.empty())
+    throw runtime_error(filename + " holds no results");
+}
+
+// Prints the change of every median against the baseline and returns the
+// number of regressions: slower by more than the threshold and by more than
+// 3 MADs of the noisier of the two runs
+static int compareWithBaseline(const string& filename, const double threshold) {
+  map<string, BenchResult> baseline;
+  readBaseline(filename, baseline);
+
+  cout << "\nagainst " << filename << " (regression: more than " << setprecision(0) << fixed
+       << threshold * 100 << "% and 3 MADs slower)\n";
+  cout << setw(20) << "benchmark" << setw(12) << "baseline" << setw(12) << "now"
+       << setw(10) << "change" << "\n";
+  int regressions = 0;
+  for (size_t i = 0; i < g_results.size(); ++i) {
+    const BenchResult& r = g_results[i];
+    cout << setw(20) << r.name;
+    const map<string, BenchResult>::const_iterator b = baseline.find(r.name);
+    if (b == baseline.end()) {
+      cout << setw(12) << "-" << setw(12) << setprecision(3) << r.median << "   (new)\n";
+      continue;
+    }
+    const double base = b->second.median;
+    const double change = base > 0 ? r.median / base - 1 : 0;
+    const bool regressed = change > threshold &&
+      r.median - base > 3 * std::max(r.mad, b->second.mad);
+    regressions += regressed;
+    cout << setw(12) << setprecision(3) << base << setw(12) << r.median
+         << setw(9) << setprecision(1) << showpos << change * 100 << "%" << noshowpos
+         << (regressed ? "  REGRESSION" : "") << "\n";
+  }
+  return regressions;
+}
+
+int main(int argc, char *argv[]) {
+  try {
+    string jsonFile, baselineFile;
+    double threshold = 0.1;
+    for (int i = 1; i < argc; ++i) {
+      if (i + 1 < argc && strcmp(argv[i], "-json") == 0)
+        jsonFile = argv[++i];
+      else if (i + 1 < argc && strcmp(argv[i], "-compare") == 0)
+        baselineFile = argv[++i];
+      else if (i + 1 < argc && strcmp(argv[i], "-threshold") == 0)
+        threshold = atof(argv[++i]);
+      else
+        throw runtime_error(string("Unknown argument ") + argv[i] +
+                            ", use -json <file>, -compare <baseline.json> or -threshold <fraction>");
+    }
+
+    Data d;
+    cout << "ns per element, median of " << g_numRepetitions << " runs after " << g_numWarmup
+         << " warmup runs, over " << g_numElements << " elements\n";
+    cout << setw(12) << "pattern" << setw(12) << "eager" << setw(12) << "fused" << setw(10) << "speedup" << "\n";
+
+    AxpbyCall axpby[2] = {{&d, bench_axpby_eager}, {&d, bench_axpby_lazy}};
+    measurePair("a*s+b*t", axpby[0], axpby[1]);
+
+    Sum4Call sum4[2] = {{&d, bench_sum4_eager}, {&d, bench_sum4_lazy}};
+    measurePair("a+b+c+d", sum4[0], sum4[1]);
+
+    LerpCall lerp[2] = {{&d, bench_lerp_eager}, {&d, bench_lerp_lazy}};
+    measurePair("a+(b-a)*t", lerp[0], lerp[1]);
+
+    TrsCall trs[2] = {{&d, bench_trs_legacy}, {&d, bench_trs_direct}};
+    measurePair("T*Rz", trs[0], trs[1]);
+
+    // eager is the matrix product, fused the RigTForm composition
+    ComposeMatrixCall composeMatrix = {&d};
+    ComposeRbtCall composeRbt = {&d};
+    measurePair("rbt*rbt", composeMatrix, composeRbt);
+
+    cout << "\nsingle operations, ns per element (per mesh for make*)\n";
+    cout << setw(20) << "operation" << setw(12) << "median" << setw(10) << "MAD" << setw(12) << "best" << "\n";
+    Vec3UnaryCall normalizeCall = {&d, bench_normalize};
+    measureOp("normalize", normalizeCall, g_numElements);
+    Vec3BinaryCall crossCall = {&d, bench_cross};
+    measureOp("cross", crossCall, g_numElements);
+    MatrixBinaryCall multiplyCall = {&d, bench_matrix_multiply};
+    measureOp("Matrix4 *", multiplyCall, g_numElements);
+    MatrixUnaryCall matrixCalls[3] = {{&d, bench_inv}, {&d, bench_transpose}, {&d, bench_normal_matrix}};
+    measureOp("inv", matrixCalls[0], g_numElements);
+    measureOp("transpose", matrixCalls[1], g_numElements);
+    measureOp("normalMatrix", matrixCalls[2], g_numElements);
+    WriteColumnMajorCall writeCall = {&d};
+    measureOp("writeToColumnMajor", writeCall, g_numElements);
+
+    MeshCall meshCalls[2] = {{&d, bench_make_cube}, {&d, bench_make_sphere}};
+    measureOp("makeCube", meshCalls[0], g_numShapes);
+    measureOp("makeSphere 24x12", meshCalls[1], g_numShapes);
+
+    if (!jsonFile.empty()) {
+      writeJson(jsonFile);
+      cout << "Wrote " << jsonFile << "\n";
+    }
+    if (!baselineFile.empty() && compareWithBaseline(baselineFile, threshold) > 0)
+      return 1;
+    return 0;
+  }
+  catch (const runtime_error& e) {
+    cout << "Exception caught: " << e.what() << endl;
+    return 2;
+  }
+}
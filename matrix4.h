@@ -52,6 +52,24 @@ public:
     }
   }
 
+  // Leaves the elements uninitialized, for callers that overwrite all of them
+  explicit Matrix4(CvecNoInit) {}
+
+  // Builds a matrix from its elements in row-major order
+  static Matrix4 fromRows(
+    const double a00, const double a01, const double a02, const double a03,
+    const double a10, const double a11, const double a12, const double a13,
+    const double a20, const double a21, const double a22, const double a23,
+    const double a30, const double a31, const double a32, const double a33) {
+    Matrix4 r((CvecNoInit()));
+    double *d = r.d_;
+    d[0] = a00, d[1] = a01, d[2] = a02, d[3] = a03;
+    d[4] = a10, d[5] = a11, d[6] = a12, d[7] = a13;
+    d[8] = a20, d[9] = a21, d[10] = a22, d[11] = a23;
+    d[12] = a30, d[13] = a31, d[14] = a32, d[15] = a33;
+    return r;
+  }
+
   template <class T>
   Matrix4& readFromColumnMajorMatrix(const T m[]) {
     for (int i = 0; i < 16; ++i) {
@@ -62,9 +80,10 @@ public:
 
   template <class T>
   void writeToColumnMajorMatrix(T m[]) const {
-    Matrix4 t = transpose(*this);
-    for (int i = 0; i < 16; ++i) {
-      m[i] = T(t.d_[i]);
+    for (int i = 0; i < 4; ++i) {
+      for (int j = 0; j < 4; ++j) {
+        m[(j << 2) + i] = T(d_[(i << 2) + j]);
+      }
     }
   }
 
@@ -106,22 +125,20 @@ public:
   }
 
   Cvec4 operator * (const Cvec4& v) const {
-    Cvec4 r(0);
+    Cvec4 r((CvecNoInit()));
     for (int i = 0; i < 4; ++i) {
-      for (int j = 0; j < 4; ++j) {
-        r[i] += (*this)(i,j) * v(j);
-      }
+      const double *row = d_ + (i << 2);
+      r[i] = row[0] * v(0) + row[1] * v(1) + row[2] * v(2) + row[3] * v(3);
     }
     return r;
   }
 
   Matrix4 operator * (const Matrix4& m) const {
-    Matrix4 r(0);
+    Matrix4 r((CvecNoInit()));
     for (int i = 0; i < 4; ++i) {
-      for (int j = 0; j < 4; ++j) {
-        for (int k = 0; k < 4; ++k) {
-          r(i,k) += (*this)(i,j) * m(j,k);
-        }
+      const double *row = d_ + (i << 2);
+      for (int k = 0; k < 4; ++k) {
+        r(i,k) = row[0] * m(0,k) + row[1] * m(1,k) + row[2] * m(2,k) + row[3] * m(3,k);
       }
     }
     return r;
@@ -140,44 +157,42 @@ public:
     return makeZRotation(std::cos(ang * CS175_PI/180), std::sin(ang * CS175_PI/180));
   }
 
+  // The factories below write every element exactly once instead of
+  // building an identity and overwriting part of it
+
   static Matrix4 makeXRotation(const double c, const double s) {
-    Matrix4 r;
-    r(1,1) = r(2,2) = c;
-    r(1,2) = -s;
-    r(2,1) = s;
-    return r;
+    return fromRows(1, 0,  0, 0,
+                    0, c, -s, 0,
+                    0, s,  c, 0,
+                    0, 0,  0, 1);
   }
 
   static Matrix4 makeYRotation(const double c, const double s) {
-    Matrix4 r;
-    r(0,0) = r(2,2) = c;
-    r(0,2) = s;
-    r(2,0) = -s;
-    return r;
+    return fromRows( c, 0, s, 0,
+                     0, 1, 0, 0,
+                    -s, 0, c, 0,
+                     0, 0, 0, 1);
   }
 
   static Matrix4 makeZRotation(const double c, const double s) {
-    Matrix4 r;
-    r(0,0) = r(1,1) = c;
-    r(0,1) = -s;
-    r(1,0) = s;
-    return r;
+    return fromRows(c, -s, 0, 0,
+                    s,  c, 0, 0,
+                    0,  0, 1, 0,
+                    0,  0, 0, 1);
   }
 
   static Matrix4 makeTranslation(const Cvec3& t) {
-    Matrix4 r;
-    for (int i = 0; i < 3; ++i) {
-      r(i,3) = t[i];
-    }
-    return r;
+    return fromRows(1, 0, 0, t[0],
+                    0, 1, 0, t[1],
+                    0, 0, 1, t[2],
+                    0, 0, 0, 1);
   }
 
   static Matrix4 makeScale(const Cvec3& s) {
-    Matrix4 r;
-    for (int i = 0; i < 3; ++i) {
-      r(i,i) = s[i];
-    }
-    return r;
+    return fromRows(s[0], 0, 0, 0,
+                    0, s[1], 0, 0,
+                    0, 0, s[2], 0,
+                    0, 0, 0, 1);
   }
 
   static Matrix4 makeProjection(
@@ -222,6 +237,23 @@ public:
     return r;
   }
 
+  // Parallel projection of the box [left, right] x [bottom, top] x [farClip, nearClip].
+  // Like the perspective ones, the clip planes are negative z values and the
+  // near plane maps to depth 1
+  static Matrix4 makeOrthographic(
+    const double left, const double right,
+    const double bottom, const double top,
+    const double nearClip, const double farClip) {
+    Matrix4 r;
+    r(0,0) = 2.0 / (right - left);
+    r(0,3) = -(right + left) / (right - left);
+    r(1,1) = 2.0 / (top - bottom);
+    r(1,3) = -(top + bottom) / (top - bottom);
+    r(2,2) = 2.0 / (nearClip - farClip);
+    r(2,3) = -(nearClip + farClip) / (nearClip - farClip);
+    return r;
+  }
+
 };
 
 inline bool isAffine(const Matrix4& m) {
@@ -267,7 +299,7 @@ inline Matrix4 inv(const Matrix4& m) {
 }
 
 inline Matrix4 transpose(const Matrix4& m) {
-  Matrix4 r(0);
+  Matrix4 r((CvecNoInit()));
   for (int i = 0; i < 4; ++i) {
     for (int j = 0; j < 4; ++j) {
       r(i,j) = m(j,i);
@@ -0,0 +1,138 @@
+#ifndef MATRIX4F_H
+#define MATRIX4F_H
+
+#include <cassert>
+#include <cmath>
+#include <cstring>
+
+#include "cvec.h"
+#include "matrix4.h"
+
+// A single precision 4x4 matrix for the render path. Unlike Matrix4 the layout
+// is column-major, i.e. exactly what glUniformMatrix4fv expects, and each
+// column is a 16-byte aligned Cvec4f, so products run on SSE registers.
+// Keep using Matrix4 where double precision matters; convert once at the
+// boundary.
+class Matrix4f {
+  Cvec4f c_[4]; // columns
+
+public:
+  // identity
+  Matrix4f() {
+    for (int j = 0; j < 4; ++j) {
+      c_[j][j] = 1;
+    }
+  }
+
+  // Narrows and transposes a row-major double precision matrix
+  explicit Matrix4f(const Matrix4& m) {
+    for (int j = 0; j < 4; ++j) {
+      c_[j] = Cvec4f(m(0,j), m(1,j), m(2,j), m(3,j));
+    }
+  }
+
+  Matrix4f(const Cvec4f& c0, const Cvec4f& c1, const Cvec4f& c2, const Cvec4f& c3) {
+    c_[0] = c0, c_[1] = c1, c_[2] = c2, c_[3] = c3;
+  }
+
+  float& operator () (const int row, const int col) {
+    return c_[col][row];
+  }
+
+  const float& operator () (const int row, const int col) const {
+    return c_[col][row];
+  }
+
+  Cvec4f& column(const int j) {
+    return c_[j];
+  }
+
+  const Cvec4f& column(const int j) const {
+    return c_[j];
+  }
+
+  // 16 column-major floats, can be handed to GL directly
+  const float *data() const {
+    return &c_[0][0];
+  }
+
+  void writeToColumnMajorMatrix(float m[]) const {
+    std::memcpy(m, data(), 16 * sizeof(float));
+  }
+
+  Matrix4 toMatrix4() const {
+    Matrix4 r;
+    for (int i = 0; i < 4; ++i) {
+      for (int j = 0; j < 4; ++j) {
+        r(i,j) = (*this)(i,j);
+      }
+    }
+    return r;
+  }
+
+  Cvec4f operator * (const Cvec4f& v) const {
+#ifdef CVEC_SSE
+    const __m128 x = _mm_set1_ps(v[0]), y = _mm_set1_ps(v[1]);
+    const __m128 z = _mm_set1_ps(v[2]), w = _mm_set1_ps(v[3]);
+    return Cvec4f(_mm_add_ps(
+      _mm_add_ps(_mm_mul_ps(c_[0].simd(), x), _mm_mul_ps(c_[1].simd(), y)),
+      _mm_add_ps(_mm_mul_ps(c_[2].simd(), z), _mm_mul_ps(c_[3].simd(), w))));
+#else
+    return c_[0] * v[0] + c_[1] * v[1] + c_[2] * v[2] + c_[3] * v[3];
+#endif
+  }
+
+  Matrix4f operator * (const Matrix4f& m) const {
+    return Matrix4f((*this) * m.c_[0], (*this) * m.c_[1],
+                    (*this) * m.c_[2], (*this) * m.c_[3]);
+  }
+
+  Matrix4f& operator *= (const Matrix4f& m) {
+    return *this = *this * m;
+  }
+};
+
+inline bool isAffine(const Matrix4f& m) {
+  return std::abs(m(3,3)-1) + std::abs(m(3,2)) + std::abs(m(3,1)) + std::abs(m(3,0)) < CS175_EPS;
+}
+
+// Normal matrix of an affine matrix, as normalMatrix() in matrix4.h: the
+// inverse transpose of the linear part, computed as its cofactors over the
+// determinant (cross products of the columns), with no translation.
+inline Matrix4f normalMatrix(const Matrix4f& m) {
+  const Cvec4f c0(m.column(0)[0], m.column(0)[1], m.column(0)[2], 0);
+  const Cvec4f c1(m.column(1)[0], m.column(1)[1], m.column(1)[2], 0);
+  const Cvec4f c2(m.column(2)[0], m.column(2)[1], m.column(2)[2], 0);
+  const Cvec4f x12 = cross(c1, c2);
+  const float det = dot(c0, x12);
+  assert(std::abs(det) > CS175_EPS3);
+  const float invDet = 1 / det;
+  return Matrix4f(x12 * invDet, cross(c2, c0) * invDet, cross(c0, c1) * invDet,
+                  Cvec4f(0, 0, 0, 1));
+}
+
+// Inverse of an affine matrix, assumes the last row is [0,0,0,1]
+inline Matrix4f inv(const Matrix4f& m) {
+  assert(isAffine(m));
+  // the inverse linear part is the transpose of the normal matrix
+  const Matrix4f n = normalMatrix(m);
+  Matrix4f r(Cvec4f(n(0,0), n(0,1), n(0,2), 0),
+             Cvec4f(n(1,0), n(1,1), n(1,2), 0),
+             Cvec4f(n(2,0), n(2,1), n(2,2), 0),
+             Cvec4f(0, 0, 0, 1));
+  const Cvec4f t = r * m.column(3);
+  r.column(3) = Cvec4f(-t[0], -t[1], -t[2], 1);
+  return r;
+}
+
+inline Matrix4f transpose(const Matrix4f& m) {
+  Matrix4f r;
+  for (int i = 0; i < 4; ++i) {
+    for (int j = 0; j < 4; ++j) {
+      r(i,j) = m(j,i);
+    }
+  }
+  return r;
+}
+
+#endif
@@ -5,8 +5,13 @@
 ////////////////////////////////////////////////////////////////////////
 
 #include <cstddef>
+#include <cmath>
+#include <algorithm>
 #include <vector>
 #include <string>
+#include <sstream>
+#include <iomanip>
+#include <fstream>
 #include <memory>
 #include <stdexcept>
 #if __GNUG__
@@ -22,10 +27,26 @@
 
 #include "cvec.h"
 #include "matrix4.h"
+#include "quat.h"
+#include "rigtform.h"
 #include "glsupport.h"
 #include "geometrymaker.h"
 
 #include "visobj.h"
+#include "timer.h"
+#include "rendercmd.h"
+#include "jobsystem.h"
+#include "framebuild.h"
+#include "animation.h"
+#include "frameloop.h"
+#include "profiler.h"
+#include "gpuprofiler.h"
+#include "texture.h"
+#include "shadowmap.h"
+#include "scenefile.h"
+#include "snapshot.h"
+#include "imagediff.h"
+#include "readback.h"
 
 using namespace std;
 using namespace tr1;
@@ -43,6 +64,16 @@ using namespace tr1;
 #define KEY_A_LOWER 97
 #define KEY_S_LOWER 115
 #define KEY_D_LOWER 100
+#define KEY_I_LOWER 105
+#define KEY_P_LOWER 112
+#define KEY_F_LOWER 102
+#define KEY_G_LOWER 103
+#define KEY_O_LOWER 111
+#define KEY_K_LOWER 107
+#define KEY_L_LOWER 108
+#define KEY_U_LOWER 117
+#define KEY_X_LOWER 120
+#define KEY_Z_LOWER 122
 
 
 // G L O B A L S ///////////////////////////////////////////////////
@@ -80,6 +111,14 @@ static bool g_mouseLClickButton, g_mouseRClickButton, g_mouseMClickButton;
 static int g_mouseClickX, g_mouseClickY; // coordinates for mouse click event
 static int g_activeShader = 0;
 
+// Every program gets the same attribute locations, so arrays enabled for one
+// program are known when switching to another
+enum {
+  ATTRIB_POSITION = 0,
+  ATTRIB_NORMAL,
+  ATTRIB_TEXCOORD
+};
+
 struct ShaderState {
   GlProgram program;
 
@@ -89,13 +128,25 @@ struct ShaderState {
   GLint h_uModelViewMatrix;
   GLint h_uNormalMatrix;
   GLint h_uColor;
+  GLint h_uTexUnit0;          // only in textured shaders, -1 otherwise
+
+  // Shadow receiving, only in the lit shaders
+  GLint h_uNumShadowMaps, h_uSunMode;
+  GLint h_uShadowMap[MAX_SHADOW_MAPS], h_uShadowMatrix[MAX_SHADOW_MAPS];
+  GLint h_uCascadeEnd, h_uShadowTexel;
 
   // Handles to vertex attributes
   GLint h_aPosition;
   GLint h_aNormal;
+  GLint h_aTexCoord;          // only in textured shaders, -1 otherwise
 
-  ShaderState(const char* vsfn, const char* fsfn) {
-    readAndCompileShader(program, vsfn, fsfn);
+  ShaderState(const char* vsfn, const char* fsfn, const char *preludefn) {
+    // takes effect when readAndCompileShader links
+    glBindAttribLocation(program, ATTRIB_POSITION, "aPosition");
+    glBindAttribLocation(program, ATTRIB_NORMAL, "aNormal");
+    glBindAttribLocation(program, ATTRIB_TEXCOORD, "aTexCoord");
+    readAndCompileShader(program, vsfn, fsfn, preludefn);
+    program.setLabel(fsfn);
 
     const GLuint h = program; // short hand
 
@@ -106,10 +157,21 @@ struct ShaderState {
     h_uModelViewMatrix = safe_glGetUniformLocation(h, "uModelViewMatrix");
     h_uNormalMatrix = safe_glGetUniformLocation(h, "uNormalMatrix");
     h_uColor = safe_glGetUniformLocation(h, "uColor");
+    h_uTexUnit0 = glGetUniformLocation(h, "uTexUnit0");
+    h_uNumShadowMaps = glGetUniformLocation(h, "uNumShadowMaps");
+    h_uSunMode = glGetUniformLocation(h, "uSunMode");
+    for (int i = 0; i < MAX_SHADOW_MAPS; ++i) {
+      const string n = string(1, '0' + i);
+      h_uShadowMap[i] = glGetUniformLocation(h, ("uShadowMap" + n).c_str());
+      h_uShadowMatrix[i] = glGetUniformLocation(h, ("uShadowMatrix" + n).c_str());
+    }
+    h_uCascadeEnd = glGetUniformLocation(h, "uCascadeEnd");
+    h_uShadowTexel = glGetUniformLocation(h, "uShadowTexel");
 
     // Retrieve handles to vertex attributes
     h_aPosition = safe_glGetAttribLocation(h, "aPosition");
     h_aNormal = safe_glGetAttribLocation(h, "aNormal");
+    h_aTexCoord = glGetAttribLocation(h, "aTexCoord");
 
     if (!g_Gl2Compatible)
       glBindFragDataLocation(h, 0, "fragColor");
@@ -118,14 +180,22 @@ struct ShaderState {
 
 };
 
-static const int g_numShaders = 2;
-static const char * const g_shaderFiles[g_numShaders][2] = {
-  {"./shaders/basic-gl3.vshader", "./shaders/diffuse-gl3.fshader"},
-  {"./shaders/basic-gl3.vshader", "./shaders/solid-gl3.fshader"}
+static const int g_numShaders = 3;
+static const int g_texturedShader = 2;    // diffuse times texture unit 0
+static const int g_depthShader = 1;       // draws shadow casters, color writes are off
+// vertex shader, fragment shader and the fragment prelude it needs, if any.
+// The lit shaders share their lighting and shadow functions, which are
+// written for both GLSL versions.
+static const char * const g_lightingPrelude = "./shaders/lighting.fshader";
+static const char * const g_shaderFiles[g_numShaders][3] = {
+  {"./shaders/basic-gl3.vshader", "./shaders/diffuse-gl3.fshader", g_lightingPrelude},
+  {"./shaders/basic-gl3.vshader", "./shaders/solid-gl3.fshader", NULL},
+  {"./shaders/textured-gl3.vshader", "./shaders/textured-gl3.fshader", g_lightingPrelude}
 };
-static const char * const g_shaderFilesGl2[g_numShaders][2] = {
-  {"./shaders/basic-gl2.vshader", "./shaders/diffuse-gl2.fshader"},
-  {"./shaders/basic-gl2.vshader", "./shaders/solid-gl2.fshader"}
+static const char * const g_shaderFilesGl2[g_numShaders][3] = {
+  {"./shaders/basic-gl2.vshader", "./shaders/diffuse-gl2.fshader", g_lightingPrelude},
+  {"./shaders/basic-gl2.vshader", "./shaders/solid-gl2.fshader", NULL},
+  {"./shaders/textured-gl2.vshader", "./shaders/textured-gl2.fshader", g_lightingPrelude}
 };
 static vector<shared_ptr<ShaderState> > g_shaderStates; // our global shader states
 
@@ -134,25 +204,28 @@ static vector<shared_ptr<ShaderState> > g_shaderStates; // our global shader sta
 // Macro used to obtain relative offset of a field within a struct
 #define FIELD_OFFSET(StructType, field) ((GLvoid*)offsetof(StructType, field))
 
-// A vertex with floating point position and normal
-struct VertexPN {
+// A vertex with floating point position, normal and texture coordinates
+struct VertexPNX {
   Cvec3f p, n;
+  Cvec2f x;
 
-  VertexPN() {}
-  VertexPN(float x, float y, float z,
-           float nx, float ny, float nz)
-    : p(x,y,z), n(nx, ny, nz)
+  VertexPNX() {}
+  VertexPNX(float x, float y, float z,
+            float nx, float ny, float nz,
+            float u, float v)
+    : p(x,y,z), n(nx, ny, nz), x(u, v)
   {}
 
   // Define copy constructor and assignment operator from GenericVertex so we can
   // use make* functions from geometrymaker.h
-  VertexPN(const GenericVertex& v) {
+  VertexPNX(const GenericVertex& v) {
     *this = v;
   }
 
-  VertexPN& operator = (const GenericVertex& v) {
+  VertexPNX& operator = (const GenericVertex& v) {
     p = v.pos;
     n = v.normal;
+    x = v.tex;
     return *this;
   }
 };
@@ -161,54 +234,225 @@ struct Geometry {
   GlBufferObject vbo, ibo;
   int vboLen, iboLen;
 
-  Geometry(VertexPN *vtx, unsigned short *idx, int vboLen, int iboLen) {
+  Geometry(VertexPNX *vtx, unsigned short *idx, int vboLen, int iboLen) {
     this->vboLen = vboLen;
     this->iboLen = iboLen;
 
     // Now create the VBO and IBO
-    glBindBuffer(GL_ARRAY_BUFFER, vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(VertexPN) * vboLen, vtx, GL_STATIC_DRAW);
+    glState().bindBuffer(GL_ARRAY_BUFFER, vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(VertexPNX) * vboLen, vtx, GL_STATIC_DRAW);
 
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+    glState().bindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
     glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned short) * iboLen, idx, GL_STATIC_DRAW);
   }
 
+  // Names the buffers in GL debug messages
+  void setLabel(const string& name) {
+    vbo.setLabel((name + " vbo").c_str());
+    ibo.setLabel((name + " ibo").c_str());
+  }
+
+  // Binds through the state cache, so consecutive draws of the same
+  // geometry only issue the draw call. The attribute arrays are left enabled,
+  // except texture coordinates under shaders without them, which would
+  // otherwise keep pointing into the last textured geometry.
   void draw(const ShaderState& curSS) {
+    GlStateCache& gl = glState();
+
     // Enable the attributes used by our shader
-    safe_glEnableVertexAttribArray(curSS.h_aPosition);
-    safe_glEnableVertexAttribArray(curSS.h_aNormal);
+    gl.enableVertexAttribArray(curSS.h_aPosition);
+    gl.enableVertexAttribArray(curSS.h_aNormal);
+    if (curSS.h_aTexCoord >= 0)
+      gl.enableVertexAttribArray(curSS.h_aTexCoord);
+    else
+      gl.disableVertexAttribArray(ATTRIB_TEXCOORD);
 
     // bind vbo
-    glBindBuffer(GL_ARRAY_BUFFER, vbo);
-    safe_glVertexAttribPointer(curSS.h_aPosition, 3, GL_FLOAT, GL_FALSE, sizeof(VertexPN), FIELD_OFFSET(VertexPN, p));
-    safe_glVertexAttribPointer(curSS.h_aNormal, 3, GL_FLOAT, GL_FALSE, sizeof(VertexPN), FIELD_OFFSET(VertexPN, n));
+    gl.bindBuffer(GL_ARRAY_BUFFER, vbo);
+    gl.vertexAttribPointer(curSS.h_aPosition, 3, GL_FLOAT, GL_FALSE, sizeof(VertexPNX), FIELD_OFFSET(VertexPNX, p));
+    gl.vertexAttribPointer(curSS.h_aNormal, 3, GL_FLOAT, GL_FALSE, sizeof(VertexPNX), FIELD_OFFSET(VertexPNX, n));
+    gl.vertexAttribPointer(curSS.h_aTexCoord, 2, GL_FLOAT, GL_FALSE, sizeof(VertexPNX), FIELD_OFFSET(VertexPNX, x));
 
     // bind ibo
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+    gl.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
 
     // draw!
     glDrawElements(GL_TRIANGLES, iboLen, GL_UNSIGNED_SHORT, 0);
-
-    // Disable the attributes used by our shader
-    safe_glDisableVertexAttribArray(curSS.h_aPosition);
-    safe_glDisableVertexAttribArray(curSS.h_aNormal);
   }
 };
 
 
-// Vertex buffer and index buffer associated with the ground and cube geometry
+// Vertex buffer and index buffer associated with the ground, cube and sphere
+// geometry. The sphere has diameter 1, like the cube's edges.
 static shared_ptr<Geometry> g_ground, g_cube, g_sphere;
+static const int g_sphereSlices = 24, g_sphereStacks = 12;
+
+// Geometry looked up by the render backend, indexed by GeometryId
+static shared_ptr<Geometry> g_geometries[NUM_GEOMETRIES];
+
+// --------- Render commands
+
+static RenderStats g_renderStats;
+static bool g_dumpRenderStats = false;  // print RenderStats to stderr every frame
+static bool g_glDebug = false;          // -gldebug: synchronous debug output and glGetError() checks
+
+static shared_ptr<JobSystem> g_jobSystem;
+static shared_ptr<FramePipeline> g_framePipeline;
+
+// GPU timer queries, created once GL is up; CPU scopes use the global Profiler
+static shared_ptr<GpuProfiler> g_gpuProfiler;
+static const char g_traceFile[] = "trace.json";   // written when a capture stops
+
+// --------- Textures
+
+// Streamed from disk by a loader thread; what is not resident yet is drawn
+// with coarser mip levels or plain white
+static shared_ptr<TextureManager> g_textures;
+static const size_t g_textureResidentBudget = 64 << 20;
+static const size_t g_textureUploadBudget = 256 << 10;    // per frame
+static TextureId g_groundTexture = NO_TEXTURE;
+static const float g_groundTexRepeat = 4.0;                // world units per texture repeat
+
+// --------- Shadows
+
+// Point light maps are aimed at the ground; in sun mode ('l') the
+// directional light's cascades cover the view frustum instead. Shadow
+// textures sit on the units after the material textures.
+static bool g_shadowsEnabled = false;        // set once GL support is known
+static bool g_sunMode = false;
+static const Cvec3 g_sunDirection = normalize(Cvec3(-0.4, -1.0, -0.6));  // direction light travels
+static const int g_numCascades = MAX_SHADOW_MAPS;
+static const int g_shadowMapSize = 1024;
+static const int g_shadowUnit = 1;
+static const double g_casterReach = 30;      // sun casters this far in front of a cascade
+static ShadowCasterCache g_shadowCasters;
+static vector<shared_ptr<ShadowMap> > g_shadowMaps;
+
+// --------- Occlusion culling
+
+// Large objects are rasterized into a CPU depth buffer each frame and hide
+// what is fully behind them ('u' toggles). Only the frame build touches it.
+// Off by default: on the CPU it costs more than the submission it saves
+// (see scene-bench occlusion), and its GPU side gain is unmeasured.
+static bool g_occlusionCulling = false;
+static OcclusionBuffer g_occlusion;
+
+// Model view matrices from camera relative positions, which keeps far away
+// scenes from jittering ('g' toggles, for comparison)
+static bool g_cameraRelative = true;
+
+// Packets of the last build; objects whose world matrix, color and selection
+// did not change since keep theirs while the camera stays put
+static PacketCache g_packetCache;
+
+// Bumped whenever something read by buildRenderQueue changes, so the frame
+// pipeline knows whether the scene needs building again
+static unsigned g_sceneVersion = 0;
+
+// Scene version of the image on screen. While nothing else is in motion
+// (see frameChanged()), a due frame of the same version is skipped and the
+// last image stays up.
+static unsigned g_presentedVersion = ~0u;
+
+// --------- Frame loop
+
+// The idle callback keeps frames coming at the target rate (0 is uncapped);
+// the simulation advances in fixed steps of the loop, however long frames
+// take, so playback does not depend on the frame rate
+static FrameLoop g_frameLoop(1.0 / 60.0);
+static const double g_targetRates[] = {60, 30, 120, 0};  // cycled with 'f'
+static const int g_numTargetRates = 4;
+static int g_targetRate = 0;
+
+static bool g_showOverlay = true;
+static long long g_lastStatsDump = 0;
+
+// --------- Animation
+
+static Animator g_animator;
+static bool g_animate = true;
+static double g_animTime = 0;                    // seconds of animation simulated
 
 // --------- Scene
 
-static const Matrix4 default_camera =
-  Matrix4::makeTranslation(Cvec3(0.0, 0.25, 7.0));
+static const RigTForm default_camera =
+  RigTForm(Cvec3(0.0, 0.25, 7.0));
 
 static const Cvec3 g_light1(2.0, 3.0, 14.0), g_light2(-2, -3.0, -5.0);  // define two lights positions in world space
-static Matrix4 g_eyeTransform = default_camera;
+static RigTForm g_eyeTransform = default_camera;
+
+// The components of all VisObj instances live in this store; v holds the
+// objects in creation order, which is the order space cycles through them
+static SceneStore g_scene;
+static std::vector<VisObj> v;
+
+// The scene file (-scene <file>) is streamed in over the first frames, a
+// bounded number of nodes per frame, while a background thread parses it
+static string g_sceneFile = "./scenes/chair.scene";
+static const int g_sceneInsertBudget = 20000;
+static shared_ptr<SceneLoader> g_sceneLoader;
+static long long g_sceneLoadStart = 0;
+
+// z saves a checkpoint: a snapshot the first time, then a delta of what
+// changed since per press; x restores the snapshot and replays the deltas.
+// -record <name> saves a snapshot once the scene is loaded and a delta every
+// frame after it; -replay <name> plays such a recording back instead of
+// loading and animating the scene, then prints frame stats and exits.
+static const string g_checkpointName = "checkpoint";
+static shared_ptr<SnapshotWriter> g_checkpointWriter;
+static shared_ptr<ofstream> g_checkpointDeltas;
+static string g_recordName, g_replayName;
+static shared_ptr<SnapshotWriter> g_recorder;
+static shared_ptr<ofstream> g_recordDeltas;
+static shared_ptr<DeltaReader> g_replay;
+
+// --------- Regression runs
+
+// -regress <dir> renders the reference views below into an offscreen target
+// of a fixed size once the scene and its textures are in, times each and
+// compares it with the golden image <dir>/<view>.ppm, then prints a report
+// and exits, with status 1 if any view failed. Views without a golden image
+// write one; -update rewrites all of them. Rendering offscreen keeps the
+// pixels independent of the window's size, format and whether it is covered.
+struct ReferenceView {
+  const char *name;
+  RigTForm eye;
+  bool sunMode;
+};
 
-// A vector to hold all of the new pointers to VisObj instnaces
-static std::vector<VisObj*> v;
+static const ReferenceView g_referenceViews[] = {
+  {"front", RigTForm(Cvec3(0.0, 0.25, 7.0)), false},
+  {"side", RigTForm(Cvec3(7.0, 0.25, 0.0), Quat::makeYRotation(90)), false},
+  {"above", RigTForm(Cvec3(0.0, 6.0, 5.0), Quat::makeXRotation(-50)), false},
+  {"sun", RigTForm(Cvec3(0.0, 0.25, 7.0)), true},
+};
+static const int g_numReferenceViews = 4;
+static const int g_regressWidth = 640, g_regressHeight = 480;
+static const int g_regressWarmupFrames = 10;
+static const int g_regressTimedFrames = 50;
+
+struct RegressionRun {
+  string dir;
+  bool update;
+  int quietFrames;       // frames since the scene and its textures stopped changing
+  int view;              // next view to render
+  vector<double> frameMs;
+  vector<ImageDiff> diffs;
+  vector<GoldenResult> results;
+  bool failed;
+  shared_ptr<OffscreenTarget> target;
+  shared_ptr<PixelReadback> readback;
+
+  RegressionRun() : update(false), quietFrames(0), view(0), failed(false) {}
+};
+
+static string g_regressDir;
+static bool g_regressUpdate = false;
+static shared_ptr<RegressionRun> g_regression;
+
+// Where the scene is drawn: the window, or the offscreen target of a
+// regression run
+static GLuint g_sceneFramebuffer = 0;
 
 static int selected_object = 0;
 
@@ -218,94 +462,92 @@ static const Cvec3f black_color = Cvec3f(0, 0, 0);
 static const Cvec3f white_color = Cvec3f(1, 1, 1);
 
 // Start the slected object matrix equal to the first object in the array
-static VisObj *selectedObj = NULL;
+static VisObj selectedObj;
 
 ///////////////// END OF G L O B A L S //////////////////////////////////////////////////
 
-static void initObjects(){
-  // init some objects
-  VisObj *toAdd = new VisObj(
-  Matrix4::makeTranslation(Cvec3(0,0.5,0)),
-  default_color,
-  NULL);
-
-  v.push_back(toAdd);
-
-  VisObj *toAdd2 = new VisObj(
-  Matrix4::makeScale(Cvec3(1, 1, 1))
-  * Matrix4::makeTranslation(Cvec3(1, 0, 0)),
-  default_color,
-  toAdd);
-  v.push_back(toAdd2);
-
-  VisObj *toAdd3 = new VisObj(
-  Matrix4::makeZRotation(45)
-  * Matrix4::makeTranslation(Cvec3(1, -1, 0)),
-  white_color,
-  toAdd);
-  v.push_back(toAdd3);
-
-  VisObj *toAdd4 = new VisObj(
-  Matrix4::makeScale(Cvec3(7, 7, 1))
-  * Matrix4::makeTranslation(Cvec3(0, 0, -1)),
-  black_color,
-  NULL);
-  v.push_back(toAdd4);
-
-  VisObj *toAdd5 = new VisObj(
-  Matrix4::makeScale(Cvec3(1, 1, 1))
-  * Matrix4::makeTranslation(Cvec3(0, 3, -0.7))
-  * Matrix4::makeZRotation(45),
-  default_color,
-  NULL);
-  v.push_back(toAdd5);
-
-  selectedObj = v[selected_object];
+// Rebuilds v from the live slots of the scene after it was restored, and
+// selects the object the view state names
+static void adoptRestoredScene(const ViewState& view) {
+  v.clear();
+  for (int i = 0, n = g_scene.numSlots(); i < n; ++i) {
+    if (g_scene.isAlive(i))
+      v.push_back(VisObj(&g_scene, g_scene.handleAt(i)));
+  }
+  g_eyeTransform = view.eye;
+  selected_object = v.empty() ? 0 : std::min(std::max(view.selected, 0), (int)v.size() - 1);
+  selectedObj = v.empty() ? VisObj() : v[selected_object];
+}
+
+// Starts loading the scene file; see streamScene(). A replay restores its
+// snapshot instead.
+static void initObjects() {
+  if (!g_replayName.empty()) {
+    ViewState view;
+    restoreSnapshot(g_replayName + ".snap", g_scene, view);
+    g_replay.reset(new DeltaReader(g_replayName + ".delta"));
+    adoptRestoredScene(view);
+    g_animate = false;
+    return;
+  }
+  g_sceneLoadStart = nowNanos();
+  g_sceneLoader.reset(new SceneLoader(g_sceneFile));
+}
+
+// The cube above the chair (node 4 of the default scene) bobs up and down
+// while spinning about z. Runs once the scene file is loaded.
+static void initAnimations() {
+  if (v.size() < 5)
+    return;
+  NodeAnimation& a = g_animator.add(v[4].getHandle());
+  const double period = 4;
+  const int numKeys = 8;
+  for (int k = 0; k <= numKeys; ++k) {
+    const double t = period * k / numKeys;
+    a.translation.addKey(t, Cvec3(0, 3 + 0.3 * std::sin(2 * CS175_PI * k / numKeys), -0.7));
+    a.rotation.addKey(t, Quat::makeZRotation(45 + 360.0 * k / numKeys));
+  }
 }
 
 static void initGround() {
-  // A x-z plane at y = g_groundY of dimension [-g_groundSize, g_groundSize]^2
-  VertexPN vtx[4] = {
-    VertexPN(-g_groundSize, g_groundY, -g_groundSize, 0, 1, 0),
-    VertexPN(-g_groundSize, g_groundY,  g_groundSize, 0, 1, 0),
-    VertexPN( g_groundSize, g_groundY,  g_groundSize, 0, 1, 0),
-    VertexPN( g_groundSize, g_groundY, -g_groundSize, 0, 1, 0),
+  // A x-z plane at y = g_groundY of dimension [-g_groundSize, g_groundSize]^2,
+  // the texture repeating every g_groundTexRepeat units
+  const float t = g_groundSize / g_groundTexRepeat;
+  VertexPNX vtx[4] = {
+    VertexPNX(-g_groundSize, g_groundY, -g_groundSize, 0, 1, 0, -t, -t),
+    VertexPNX(-g_groundSize, g_groundY,  g_groundSize, 0, 1, 0, -t,  t),
+    VertexPNX( g_groundSize, g_groundY,  g_groundSize, 0, 1, 0,  t,  t),
+    VertexPNX( g_groundSize, g_groundY, -g_groundSize, 0, 1, 0,  t, -t),
   };
   unsigned short idx[] = {0, 1, 2, 0, 2, 3};
   g_ground.reset(new Geometry(&vtx[0], &idx[0], 4, 6));
 }
 
+static void initSpheres() {
+  int ibLen, vbLen;
+  getSphereVbIbLen(g_sphereSlices, g_sphereStacks, vbLen, ibLen);
+
+  // Temporary storage for sphere geometry
+  vector<VertexPNX> vtx(vbLen);
+  vector<unsigned short> idx(ibLen);
+
+  makeSphere(0.5, g_sphereSlices, g_sphereStacks, vtx.begin(), idx.begin());
+  g_sphere.reset(new Geometry(&vtx[0], &idx[0], vbLen, ibLen));
+}
+
 static void initCubes() {
   int ibLen, vbLen;
   getCubeVbIbLen(vbLen, ibLen);
 
 
   // Temporary storage for cube geometry
-  vector<VertexPN> vtx(vbLen);
+  vector<VertexPNX> vtx(vbLen);
   vector<unsigned short> idx(ibLen);
 
   makeCube(1, vtx.begin(), idx.begin());
   g_cube.reset(new Geometry(&vtx[0], &idx[0], vbLen, ibLen));
 }
 
-// takes a projection matrix and send to the the shaders
-static void sendProjectionMatrix(const ShaderState& curSS, const Matrix4& projMatrix) {
-  GLfloat glmatrix[16];
-  projMatrix.writeToColumnMajorMatrix(glmatrix); // send projection matrix
-  safe_glUniformMatrix4fv(curSS.h_uProjMatrix, glmatrix);
-}
-
-
-// takes MVM and its normal matrix to the shaders
-static void sendModelViewNormalMatrix(const ShaderState& curSS, const Matrix4& MVM, const Matrix4& NMVM) {
-  GLfloat glmatrix[16];
-  MVM.writeToColumnMajorMatrix(glmatrix); // send MVM
-  safe_glUniformMatrix4fv(curSS.h_uModelViewMatrix, glmatrix);
-
-  NMVM.writeToColumnMajorMatrix(glmatrix); // send NMVM
-  safe_glUniformMatrix4fv(curSS.h_uNormalMatrix, glmatrix);
-}
-
 // update g_frustFovY from g_frustMinFov, g_windowWidth, and g_windowHeight
 static void updateFrustFovY() {
   if (g_windowWidth >= g_windowHeight)
@@ -321,58 +563,641 @@ static Matrix4 makeProjectionMatrix() {
            g_frustFovY, g_windowWidth / static_cast <double> (g_windowHeight),
            g_frustNear, g_frustFar);
 }
-static void drawStuff() {
-  // short hand for current shader state
-  const ShaderState& curSS = *g_shaderStates[g_activeShader];
 
-  // build & send proj. matrix to vshader
+// Shadow views and caster lists of the frame, plus the matrices receivers
+// use to find themselves in each map. World transforms must be current.
+static void buildShadowPasses(RenderQueue& queue) {
+  FrameGlobals& globals = queue.globals;
+  ShadowView views[MAX_SHADOW_MAPS];
+  int numViews;
+  if (g_sunMode) {
+    numViews = g_numCascades;
+    makeCascadeShadowViews(g_sunDirection, g_eyeTransform,
+                           g_frustFovY, g_windowWidth / static_cast <double> (g_windowHeight),
+                           -g_frustNear, -g_frustFar, g_casterReach, g_shadowMapSize,
+                           numViews, views, globals.cascadeEnd);
+  } else {
+    // receivers are on or above the ground
+    const Cvec3 target(0, g_groundY, 0);
+    const double radius = g_groundSize * std::sqrt(2.0);
+    numViews = 2;
+    views[0] = makeSpotShadowView(g_light1, target, radius);
+    views[1] = makeSpotShadowView(g_light2, target, radius);
+  }
+  g_shadowCasters.build(g_scene, views, numViews, g_depthShader, queue.shadows);
+
+  // NDC to texture coordinates and depth range
+  const Matrix4 bias = Matrix4::makeTranslation(Cvec3(0.5, 0.5, 0.5)) * Matrix4::makeScale(Cvec3(0.5, 0.5, 0.5));
+  const Matrix4 eyeTransform = rigTFormToMatrix(g_eyeTransform);
+  for (int i = 0; i < numViews; ++i) {
+    (bias * views[i].projection * views[i].view * eyeTransform).writeToColumnMajorMatrix(globals.shadowMatrix[i]);
+  }
+  globals.numShadowMaps = numViews;
+}
+
+// Scene traversal: turns the scene into draw packets. Does not touch GL, and
+// runs on a worker thread while the frame pipeline submits the last queue.
+static void buildRenderQueue(RenderQueue& queue, void *) {
+  ProfileScope scope("build queue");
+  const long long t0 = nowNanos();
+  queue.clear();
+
+  // build proj. matrix and lights
   const Matrix4 projmat = makeProjectionMatrix();
-  sendProjectionMatrix(curSS, projmat);
+  FrameGlobals& globals = queue.globals;
+  globals.shader = g_activeShader;
+  projmat.writeToColumnMajorMatrix(globals.proj);
 
-  const Matrix4 eyeTransform = g_eyeTransform;
-  const Matrix4 invEyeTransform = inv(eyeTransform);
+  // the camera stays a rigid transform until here
+  const Matrix4 invEyeTransform = rigTFormToMatrix(inv(g_eyeTransform));
 
-  const Cvec3 eyeLight1 = Cvec3(invEyeTransform * Cvec4(g_light1, 1));
+  const Cvec3 eyeLight1 = g_sunMode
+    ? Cvec3(invEyeTransform * Cvec4(-g_sunDirection, 0))
+    : Cvec3(invEyeTransform * Cvec4(g_light1, 1));
   const Cvec3 eyeLight2 = Cvec3(invEyeTransform * Cvec4(g_light2, 1));
-  safe_glUniform3f(curSS.h_uLight, eyeLight1[0], eyeLight1[1], eyeLight1[2]);
-  safe_glUniform3f(curSS.h_uLight2, eyeLight2[0], eyeLight2[1], eyeLight2[2]);
+  globals.sunMode = g_sunMode;
+  for (int i = 0; i < 3; ++i) {
+    globals.eyeLight1[i] = eyeLight1[i];
+    globals.eyeLight2[i] = eyeLight2[i];
+  }
 
-  // draw ground
-  // ===========
+  // ground
   const Matrix4 groundTransform = Matrix4();  // identity
-  Matrix4 MVM = invEyeTransform * groundTransform;
-  Matrix4 NMVM = normalMatrix(MVM);
-  sendModelViewNormalMatrix(curSS, MVM, NMVM);
-  safe_glUniform3f(curSS.h_uColor, 0.1, 0.95, 0.1); // set color
-  g_ground->draw(curSS);
-
-  // draw the chair
-  for (int i = 0; i < v.size(); ++i) {
-    MVM = invEyeTransform * v[i] -> getTransform();
-    NMVM = normalMatrix(MVM);
-    sendModelViewNormalMatrix(curSS, MVM, NMVM);
-    if (v[i] != selectedObj) {
-        safe_glUniform3f(curSS.h_uColor, v[i] -> getColor()[0], v[i] -> getColor()[1], v[i] -> getColor()[2]);
+  DrawPacket& ground = *queue.allocate(1);
+  writeDrawPacket(ground, GEOMETRY_GROUND, g_texturedShader,
+                  invEyeTransform * groundTransform, Cvec3f(0.6, 0.95, 0.6));
+  ground.texture = g_groundTexture;
+
+  // the chair
+  FrameBuildParams params;
+  params.invEyeTransform = invEyeTransform;
+  params.projection = projmat;
+  params.shader = g_activeShader;
+  params.selected = selectedObj.getHandle();
+  params.selectedColor = selected_color;
+  params.cameraRelative = g_cameraRelative;
+  params.occlusion = g_occlusionCulling ? &g_occlusion : NULL;
+  params.packetCache = &g_packetCache;
+  queue.culled = buildObjectPacketsParallel(*g_jobSystem, queue, g_scene, params);
+  if (g_shadowsEnabled)
+    buildShadowPasses(queue);
+  queue.buildNanos = nowNanos() - t0;
+}
+
+// Makes the shader current and sets the per-frame uniforms, which programs
+// do not share
+static void useShader(const ShaderState& ss, const FrameGlobals& globals) {
+  glState().useProgram(ss.program);
+  safe_glUniformMatrix4fv(ss.h_uProjMatrix, globals.proj);
+  safe_glUniform3f(ss.h_uLight, globals.eyeLight1[0], globals.eyeLight1[1], globals.eyeLight1[2]);
+  safe_glUniform3f(ss.h_uLight2, globals.eyeLight2[0], globals.eyeLight2[1], globals.eyeLight2[2]);
+  safe_glUniform1i(ss.h_uTexUnit0, 0);
+
+  // samplers get their units even without shadows, as a shadow sampler may
+  // not share a unit with the material texture
+  safe_glUniform1i(ss.h_uNumShadowMaps, globals.numShadowMaps);
+  safe_glUniform1i(ss.h_uSunMode, globals.sunMode);
+  for (int i = 0; i < MAX_SHADOW_MAPS; ++i) {
+    safe_glUniform1i(ss.h_uShadowMap[i], g_shadowUnit + i);
+    if (i < globals.numShadowMaps)
+      safe_glUniformMatrix4fv(ss.h_uShadowMatrix[i], globals.shadowMatrix[i]);
+  }
+  if (globals.sunMode)
+    safe_glUniform3f(ss.h_uCascadeEnd, globals.cascadeEnd[0], globals.cascadeEnd[1], globals.cascadeEnd[2]);
+  safe_glUniform1f(ss.h_uShadowTexel, 1.0f / g_shadowMapSize);
+}
+
+static void drawShadowCasters(const vector<DrawPacket>& casters, const ShaderState& ss) {
+  for (size_t i = 0; i < casters.size(); ++i) {
+    safe_glUniformMatrix4fv(ss.h_uModelViewMatrix, casters[i].mvm);
+    g_geometries[casters[i].geometry]->draw(ss);
+  }
+  g_renderStats.shadowCastersDrawn += casters.size();
+}
+
+// Depth-only passes into the shadow maps of the queue. A map's cached static
+// casters are only redrawn when the builder changed them; moving casters are
+// drawn every frame over a copy of the cached map.
+static void renderShadowMaps(const RenderQueue& queue) {
+  ProfileScope scope("shadows");
+  GpuProfileScope gpuScope(*g_gpuProfiler, "shadow pass");
+  const FrameGlobals& globals = queue.globals;
+  g_renderStats.shadowStaticRedraws = 0;
+  g_renderStats.shadowCastersDrawn = 0;
+  if (globals.numShadowMaps == 0)
+    return;
+
+  const ShaderState& ss = *g_shaderStates[g_depthShader];
+  glState().useProgram(ss.program);
+  glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+  glEnable(GL_POLYGON_OFFSET_FILL);
+  glPolygonOffset(-2.0f, -4.0f);    // pushes caster depth away from the light, i.e. lower here
+
+  for (int i = 0; i < globals.numShadowMaps; ++i) {
+    const ShadowPass& pass = queue.shadows[i];
+    ShadowMap& map = *g_shadowMaps[i];
+    safe_glUniformMatrix4fv(ss.h_uProjMatrix, pass.proj);
+    if (!map.isCached(pass.staticVersion)) {
+      map.beginStatic(pass.staticVersion);
+      drawShadowCasters(*pass.staticCasters, ss);
+      ++g_renderStats.shadowStaticRedraws;
+    }
+    if (pass.dynamicCasters.empty()) {
+      map.useStatic();
     } else {
-      safe_glUniform3f(curSS.h_uColor, selected_color[0], selected_color[1], selected_color[2]);
+      map.beginDynamic();
+      drawShadowCasters(pass.dynamicCasters, ss);
+    }
+  }
+
+  ShadowMap::end(g_sceneFramebuffer);
+  glViewport(0, 0, g_windowWidth, g_windowHeight);
+  glDisable(GL_POLYGON_OFFSET_FILL);
+  glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+  GlStateCache& gl = glState();
+  for (int i = 0; i < globals.numShadowMaps; ++i) {
+    gl.activeTexture(GL_TEXTURE0 + g_shadowUnit + i);
+    gl.bindTexture(GL_TEXTURE_2D, g_shadowMaps[i]->texture());
+  }
+}
+
+// Render backend: issues the GL calls for a queue built by buildRenderQueue
+static void submitRenderQueue(const RenderQueue& queue) {
+  ProfileScope scope("submission");
+  GpuProfileScope gpuScope(*g_gpuProfiler, "scene pass");
+  const FrameGlobals& globals = queue.globals;
+  int shader = globals.shader;
+  useShader(*g_shaderStates[shader], globals);
+
+  for (int i = 0, n = queue.size(); i < n; ++i) {
+    const DrawPacket& p = queue[i];
+    if (p.shader != shader) {
+      shader = p.shader;
+      useShader(*g_shaderStates[shader], globals);
     }
-    g_cube->draw(curSS);
+    const ShaderState& curSS = *g_shaderStates[shader];
+    if (p.texture != NO_TEXTURE)
+      g_textures->bind(p.texture, 0);
+    safe_glUniformMatrix4fv(curSS.h_uModelViewMatrix, p.mvm);
+    safe_glUniformMatrix4fv(curSS.h_uNormalMatrix, p.nmvm);
+    safe_glUniform3f(curSS.h_uColor, p.color[0], p.color[1], p.color[2]);
+    g_geometries[p.geometry]->draw(curSS);
+  }
+}
+
+// Must be called by anything that modifies state read by buildRenderQueue,
+// before modifying it
+static void beginSceneEdit() {
+  g_framePipeline->sync();
+  ++g_sceneVersion;
+}
+
+// Inserts the next nodes of the scene file, adding them to v. The animation
+// starts once the whole file is in.
+static void streamScene() {
+  if (!g_sceneLoader)
+    return;
+  ProfileScope scope("scene streaming");
+  beginSceneEdit();
+  const int first = g_sceneLoader->nodesInserted();
+  bool failed = false;
+  try {
+    g_sceneLoader->insert(g_scene, g_sceneInsertBudget);
+  }
+  catch (const runtime_error& e) {
+    cerr << "Scene load failed: " << e.what() << endl;
+    failed = true;
+  }
+  for (int i = first; i < g_sceneLoader->nodesInserted(); ++i) {
+    v.push_back(VisObj(&g_scene, g_sceneLoader->handle(i)));
+  }
+  if (first == 0 && !v.empty())
+    selectedObj = v[selected_object];
+  if (!failed && !g_sceneLoader->finished())
+    return;
+
+  if (!failed) {
+    const double ms = nanosToMillis(nowNanos() - g_sceneLoadStart);
+    cerr << "Loaded " << v.size() << " nodes from " << g_sceneFile << " in " << ms << " ms" << endl;
+  }
+  g_sceneLoader.reset();
+  initAnimations();
+}
+
+static ViewState currentView() {
+  ViewState view;
+  view.eye = g_eyeTransform;
+  view.selected = selected_object;
+  return view;
+}
+
+// Writes a checkpoint: a snapshot the first time, a delta after that
+static void saveCheckpoint() {
+  if (g_sceneLoader) {
+    cout << "The scene is still loading\n";
+    return;
+  }
+  if (!g_checkpointWriter) {
+    g_checkpointWriter.reset(new SnapshotWriter(g_scene));
+    g_checkpointWriter->writeSnapshot(g_checkpointName + ".snap", currentView());
+    g_checkpointDeltas.reset(new ofstream((g_checkpointName + ".delta").c_str(), ios::binary));
+    SnapshotWriter::writeDeltaStreamHeader(*g_checkpointDeltas);
+    g_checkpointDeltas->flush();
+    cout << "Wrote " << g_checkpointName << ".snap, press z again to add deltas\n";
+    return;
+  }
+  const int slots = g_checkpointWriter->writeDelta(*g_checkpointDeltas, currentView());
+  g_checkpointDeltas->flush();
+  cout << "Checkpoint delta of " << slots << " nodes written to " << g_checkpointName << ".delta\n";
+}
+
+// Restores the snapshot and every delta written since
+static void restoreCheckpoint() {
+  if (!g_checkpointWriter) {
+    cout << "No checkpoint yet, press z first\n";
+    return;
+  }
+  beginSceneEdit();
+  ViewState view;
+  restoreSnapshot(g_checkpointName + ".snap", g_scene, view);
+  DeltaReader deltas(g_checkpointName + ".delta");
+  while (deltas.applyNext(g_scene, view)) {}
+  adoptRestoredScene(view);
+  g_checkpointWriter->markSaved();
+  cout << "Restored checkpoint, " << deltas.deltasApplied() << " deltas applied\n";
+}
+
+// Once the scene is loaded, saves the snapshot of a recording, then a delta
+// every frame
+static void recordFrame() {
+  if (g_recordName.empty() || g_sceneLoader)
+    return;
+  ProfileScope scope("recording");
+  if (!g_recorder) {
+    g_recorder.reset(new SnapshotWriter(g_scene));
+    g_recorder->writeSnapshot(g_recordName + ".snap", currentView());
+    g_recordDeltas.reset(new ofstream((g_recordName + ".delta").c_str(), ios::binary));
+    SnapshotWriter::writeDeltaStreamHeader(*g_recordDeltas);
+    cerr << "Recording to " << g_recordName << ".snap and " << g_recordName << ".delta" << endl;
+    return;
+  }
+  g_recorder->writeDelta(*g_recordDeltas, currentView());
+}
+
+// Names the error checking mode in the timings printed by replays and
+// regression runs, so runs with and without -gldebug are told apart
+static const char *glErrorCheckingName() {
+  return g_glDebug ? "synchronous" : "asynchronous";
+}
+
+// Applies the next frame of a replay; at the end of the recording prints
+// the frame times and exits
+static void replayFrame() {
+  ProfileScope scope("replay");
+  beginSceneEdit();
+  ViewState view = currentView();
+  if (!g_replay->applyNext(g_scene, view)) {
+    cerr << "Replayed " << g_replay->deltasApplied() << " frames of " << g_replayName
+         << " with " << glErrorCheckingName() << " GL error checking\n"
+         << g_renderStats << "\n"
+         << "  frame ms " << g_frameLoop.frameTimes() << "\n"
+         << "  cpu ms   " << g_frameLoop.workTimes() << endl;
+    exit(0);
+  }
+  g_eyeTransform = view.eye;
+  if (!v.empty()) {
+    selected_object = std::min(std::max(view.selected, 0), (int)v.size() - 1);
+    selectedObj = v[selected_object];
+  }
+}
+
+// Runs the fixed simulation steps due this frame. Animation state is a
+// function of time, so rendering the state interpolated between the last two
+// steps is sampling at the matching time in between.
+static void updateSimulation(const int steps) {
+  if (!g_animate)
+    return;
+  ProfileScope scope("animation");
+  g_animTime += steps * g_frameLoop.step();
+  beginSceneEdit();
+  g_animator.evaluate(*g_jobSystem, g_scene,
+                      g_animTime - g_frameLoop.step() * (1 - g_frameLoop.alpha()));
+}
+
+static void drawText(const int x, const int y, const string& text) {
+  glWindowPos2i(x, y);
+  for (size_t i = 0; i < text.size(); ++i) {
+    glutBitmapCharacter(GLUT_BITMAP_8_BY_13, text[i]);
+  }
+}
+
+// Frame timing and render stats in the top left corner, drawn with GLUT
+// bitmap fonts through the fixed function raster position
+static void drawOverlay() {
+  ProfileScope scope("overlay");
+  GpuProfileScope gpuScope(*g_gpuProfiler, "overlay pass");
+  const FrameTimeHistogram& frames = g_frameLoop.frameTimes();
+  const double meanMs = nanosToMillis((long long)frames.meanNanos());
+  const double rate = g_frameLoop.targetRate();
+  vector<string> lines;
+
+  ostringstream os;
+  os << fixed << setprecision(1) << (meanMs > 0 ? 1000 / meanMs : 0) << " fps, target ";
+  if (rate > 0)
+    os << setprecision(0) << rate << " Hz";
+  else
+    os << "uncapped";
+  lines.push_back(os.str());
+
+  os.str("");
+  os << setprecision(2) << "frame ms " << frames;
+  lines.push_back(os.str());
+
+  os.str("");
+  os << "cpu ms   " << g_frameLoop.workTimes();
+  lines.push_back(os.str());
+
+  os.str("");
+  os << g_renderStats.packets << " packets, " << g_renderStats.culled << " culled ("
+     << g_renderStats.occluded << " occluded), build "
+     << nanosToMillis(g_renderStats.buildNanos) << " ms, submit "
+     << nanosToMillis(g_renderStats.submitNanos) << " ms";
+  lines.push_back(os.str());
+
+  os.str("");
+  os << "objects " << g_renderStats.recomputed << " recomputed, " << g_renderStats.reused
+     << " reused, " << g_renderStats.skipped << " frames skipped";
+  lines.push_back(os.str());
+
+  os.str("");
+  os << "gl state calls " << g_renderStats.glCallsIssued << " issued, "
+     << g_renderStats.glCallsElided << " elided";
+  lines.push_back(os.str());
+
+  os.str("");
+  os << "textures " << g_renderStats.texturesResident << " resident, "
+     << g_renderStats.textureBytesResident / 1024 << " KiB, "
+     << g_renderStats.textureBytesUploaded / 1024 << " KiB uploaded";
+  lines.push_back(os.str());
+
+  os.str("");
+  os << "shadow casters " << g_renderStats.shadowCastersDrawn << " drawn, "
+     << g_renderStats.shadowStaticRedraws << " cached maps redrawn";
+  lines.push_back(os.str());
+
+  // the top two levels of the profile
+  const vector<ProfileNode>& profile = Profiler::instance().lastFrame();
+  for (size_t i = 0; i < profile.size(); ++i) {
+    const ProfileNode& n = profile[i];
+    if (n.depth > 1)
+      continue;
+    os.str("");
+    os << string(2 * n.depth, ' ') << n.name
+       << (n.thread == PROFILER_GPU_THREAD ? " [gpu] " : " ")
+       << nanosToMillis(n.totalNanos) << " ms";
+    lines.push_back(os.str());
+  }
+
+  glState().useProgram(0);
+  glDisable(GL_DEPTH_TEST);
+  glColor3f(1, 1, 1);
+  for (size_t i = 0; i < lines.size(); ++i) {
+    drawText(8, g_windowHeight - 18 - 15 * i, lines[i]);
+  }
+  glEnable(GL_DEPTH_TEST);
+}
+
+// With 'i' on, prints the render stats and frame time percentiles about once
+// a second
+static void dumpStats() {
+  const long long now = nowNanos();
+  if (!g_dumpRenderStats || now - g_lastStatsDump < 1000000000LL)
+    return;
+  g_lastStatsDump = now;
+  cerr << g_renderStats << "\n"
+       << "  frame ms " << g_frameLoop.frameTimes() << "\n"
+       << "  cpu ms   " << g_frameLoop.workTimes() << "\n";
+  printProfile(cerr, Profiler::instance().lastFrame());
+  cerr << flush;
+}
+
+// The frame pipeline's queue for this frame: the one built on the workers
+// during the last frame, or the current scene built here if none was
+static const RenderQueue& acquireRenderQueue() {
+  ProfileScope scope("acquire");
+  const int misses = g_framePipeline->misses();
+  const RenderQueue& queue = g_framePipeline->acquire(g_sceneVersion);
+  g_renderStats.prebuilt = g_framePipeline->misses() == misses;
+  g_presentedVersion = g_framePipeline->frontVersion();
+  return queue;
+}
+
+// Builds the scene as the frame's simulation and input left it on the
+// workers, while the GL thread submits the acquired queue
+static void kickRenderQueue() {
+  g_framePipeline->kick(g_sceneVersion);
+}
+
+static void drawStuff(const RenderQueue& queue) {
+  const long long t0 = nowNanos();
+  renderShadowMaps(queue);
+  submitRenderQueue(queue);
+  const long long t1 = nowNanos();
+
+  ++g_renderStats.frame;
+  g_renderStats.packets = queue.size();
+  g_renderStats.culled = queue.culled;
+  g_renderStats.occluded = queue.occluded;
+  g_renderStats.recomputed = queue.recomputed;
+  g_renderStats.reused = queue.reused;
+  g_renderStats.skipped = g_frameLoop.skippedFrames();
+  g_renderStats.buildNanos = queue.buildNanos;
+  g_renderStats.submitNanos = t1 - t0;
+  g_renderStats.glCallsIssued = glState().issued();
+  g_renderStats.glCallsElided = glState().elided();
+  g_renderStats.texturesResident = g_textures->texturesResident();
+  g_renderStats.textureBytesResident = g_textures->residentBytes();
+  g_renderStats.textureBytesUploaded = g_textures->bytesUploaded();
+}
+
+// Checks the oldest pending readback of a regression run against its golden
+// image
+static void checkReadback() {
+  RegressionRun& r = *g_regression;
+  const int view = (int)r.diffs.size();
+  Image image;
+  r.readback->collect(image);
+  ImageDiff diff;
+  const GoldenResult result =
+    checkGolden(image, r.dir + "/" + g_referenceViews[view].name, r.update, DiffTolerance(), diff);
+  r.diffs.push_back(diff);
+  r.results.push_back(result);
+  r.failed |= result == GOLDEN_FAILED;
+}
+
+static void printRegressionReport() {
+  const RegressionRun& r = *g_regression;
+  cout << "Regression run of " << g_sceneFile << " against " << r.dir << ", "
+       << g_regressWidth << "x" << g_regressHeight << ", " << g_regressTimedFrames
+       << " frames per view, " << glErrorCheckingName() << " GL error checking\n"
+       << "view       ms/frame  differing  shifted  max delta  rms delta  result\n";
+  for (int i = 0; i < g_numReferenceViews; ++i) {
+    const ImageDiff& d = r.diffs[i];
+    cout << left << setw(10) << g_referenceViews[i].name << right << fixed
+         << setprecision(2) << setw(9) << r.frameMs[i]
+         << setw(11) << d.differing << setw(9) << d.shifted
+         << setprecision(3) << setw(11) << d.maxDelta << setw(11) << d.rmsDelta
+         << "  " << goldenResultName(r.results[i]) << "\n";
+  }
+  cout << (r.failed ? "Regression run failed" : "Regression run passed")
+       << ", images in " << r.dir << endl;
+}
+
+// A frame of a regression run. Until the scene has loaded and its textures
+// have stopped streaming, frames are drawn as usual; after that each frame
+// renders one reference view: warm-up frames, then timed ones bracketed by
+// glFinish. The view's pixels are read back asynchronously and collected
+// once the next view's warm-up frames are queued. Everything is drawn
+// offscreen and blitted to the window so the run can be watched. The frames
+// of a view go through the frame pipeline like any other, so the first one
+// may still show the previous view; the warm-up frames absorb that.
+static void regressionFrame(const RenderQueue& queue) {
+  RegressionRun& r = *g_regression;
+  glBindFramebuffer(GL_FRAMEBUFFER, g_sceneFramebuffer);
+  glViewport(0, 0, g_windowWidth, g_windowHeight);
+
+  if (r.view == g_numReferenceViews) {
+    checkReadback();
+    printRegressionReport();
+    exit(r.failed ? 1 : 0);
+  }
+
+  r.quietFrames = g_sceneLoader || g_textures->streaming() ? 0 : r.quietFrames + 1;
+  if (r.quietFrames < 2) {
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    drawStuff(queue);
+    r.target->blitToWindow();
+    return;
+  }
+
+  const ReferenceView& view = g_referenceViews[r.view];
+  beginSceneEdit();
+  g_eyeTransform = view.eye;
+  g_sunMode = view.sunMode;
+
+  for (int i = 0; i < g_regressWarmupFrames; ++i) {
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    const RenderQueue& warmup = acquireRenderQueue();
+    kickRenderQueue();
+    drawStuff(warmup);
+  }
+  if (r.readback->pending() > 0)
+    checkReadback();
+
+  glFinish();
+  const long long t0 = nowNanos();
+  for (int i = 0; i < g_regressTimedFrames; ++i) {
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    const RenderQueue& timed = acquireRenderQueue();
+    kickRenderQueue();
+    drawStuff(timed);
   }
+  glFinish();
+  r.frameMs.push_back(nanosToMillis(nowNanos() - t0) / g_regressTimedFrames);
 
+  r.readback->request();
+  r.target->blitToWindow();
+  ++r.view;
 }
 
 static void display() {
-  glUseProgram(g_shaderStates[g_activeShader]->program);
-  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);                   // clear framebuffer color&depth
+  glState().resetCounters();
+  g_gpuProfiler->beginFrame();
+  {
+    ProfileScope scope("frame");
+    const int steps = g_frameLoop.beginFrame();
+
+    // The queue built during the last frame is submitted below, while the
+    // workers build the scene as this frame's simulation leaves it
+    const RenderQueue& queue = acquireRenderQueue();
+    if (g_replay) {
+      replayFrame();
+    }
+    else {
+      streamScene();
+      updateSimulation(steps);
+      recordFrame();
+    }
+    kickRenderQueue();
+    {
+      ProfileScope textureScope("texture streaming");
+      g_textures->update();
+    }
 
-  drawStuff();
+    if (g_regression) {
+      GpuProfileScope gpuScope(*g_gpuProfiler, "frame");
+      regressionFrame(queue);
+    }
+    else {
+      GpuProfileScope gpuScope(*g_gpuProfiler, "frame");
+      glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);                   // clear framebuffer color&depth
 
-  glutSwapBuffers();                                    // show the back buffer (where we rendered stuff)
+      drawStuff(queue);
+      if (g_showOverlay)
+        drawOverlay();
+    }
+
+    ProfileScope swapScope("swap");
+    glutSwapBuffers();                                    // show the back buffer (where we rendered stuff)
+  }
 
   checkGlErrors();
+  g_frameLoop.endFrame();
+  Profiler::instance().endFrame();
+  dumpStats();
+}
+
+// Starts a profiler capture, or stops the running one and writes it out
+static void toggleTraceCapture() {
+  Profiler& profiler = Profiler::instance();
+  if (!profiler.capturing()) {
+    profiler.startCapture();
+    cout << "Capturing profile, press k again to stop\n";
+    return;
+  }
+  profiler.stopCapture();
+  ofstream f(g_traceFile);
+  profiler.writeChromeTrace(f);
+  cout << "Wrote " << g_traceFile << (f ? "" : " (failed)") << ", open it in chrome://tracing\n";
+}
+
+// Whether the next frame could look different from the one on screen:
+// the scene or view was edited, or something changes it every frame
+static bool frameChanged() {
+  return g_sceneVersion != g_presentedVersion || g_sceneLoader || g_replay || g_regression ||
+    (g_animate && g_animator.size() > 0) || g_textures->streaming();
+}
+
+// Requests the next frame once it is due, or skips it when it would show the
+// same image. Waits in slices of at most a millisecond so input is still
+// handled promptly while pacing. Window system redraws (expose events) call
+// display() directly and always draw.
+static void idle() {
+  const long long left = g_frameLoop.nanosUntilNextFrame();
+  if (left > 0)
+    sleepNanos(std::min(left, 1000000LL));
+  else if (frameChanged())
+    glutPostRedisplay();
+  else
+    g_frameLoop.skipFrame();
 }
 
 static void reshape(const int w, const int h) {
+  // a regression run renders at its own size whatever the window's
+  if (g_regression)
+    return;
+  beginSceneEdit();
   g_windowWidth = w;
   g_windowHeight = h;
   glViewport(0, 0, w, h);
@@ -409,82 +1234,152 @@ static void mouse(const int button, const int state, const int x, const int y) {
 
 // Camera pan with the arrow keys
 static void special_keyboard(int key, int x, int y) {
+    if (g_replay || g_regression)
+      return;
     switch (key) {
         case GLUT_KEY_UP: // pan camera up
             cout << "Up key pressed\n";
+            beginSceneEdit();
             g_eyeTransform =
-              g_eyeTransform * Matrix4::makeXRotation(10);
+              g_eyeTransform * RigTForm(Quat::makeXRotation(10));
             break;
         case GLUT_KEY_DOWN: // pan camera down
             cout << "Down key pressed\n";
+            beginSceneEdit();
             g_eyeTransform =
-              g_eyeTransform * Matrix4::makeXRotation(-10);
+              g_eyeTransform * RigTForm(Quat::makeXRotation(-10));
             break;
         case GLUT_KEY_LEFT: // pan camera left
             cout << "Left key pressed\n";
+            beginSceneEdit();
             g_eyeTransform =
-              g_eyeTransform * Matrix4::makeYRotation(10);
+              g_eyeTransform * RigTForm(Quat::makeYRotation(10));
             break;
         case GLUT_KEY_RIGHT: // pan camera right
             cout << "Right key pressed\n";
+            beginSceneEdit();
             g_eyeTransform =
-              g_eyeTransform * Matrix4::makeYRotation(-10);
+              g_eyeTransform * RigTForm(Quat::makeYRotation(-10));
             break;
     }
     glutPostRedisplay();
 }
 
 void keyboard(unsigned char key, int x, int y) {
+  // A replay or regression run only takes the keys that do not change the
+  // scene. Only the cases that change what buildRenderQueue reads start a
+  // scene edit, so the other keys keep the image, which need not be built
+  // again, and the packet cache.
+  if ((g_replay || g_regression) && key != KEY_ESC && key != KEY_O_LOWER && key != KEY_I_LOWER && key != KEY_K_LOWER)
+    return;
   switch (key) {
     case KEY_ESC:
         cout << "ESC key pressed, exiting...\n";
         exit(0);
     case KEY_SPACE: // cycle through selected object
+        if (v.empty())
+          break;
+        beginSceneEdit();
         if (selected_object == v.size()-1) {
           selected_object = 0;
         } else {
           selected_object ++;
         }
         selectedObj = v[selected_object];
-        //selectedObj -> setColor(selected_color);
+        //selectedObj.setColor(selected_color);
         cout << "The object selected is: " << selected_object << "\n";
         break;
     case KEY_R_UPPER: // Rotate positively
+        if (v.empty())
+          break;
         cout << "R key pressed\n";
-        selectedObj -> setTransform(Matrix4::makeZRotation(45));
+        beginSceneEdit();
+        selectedObj.setTransform(RigTForm(Quat::makeZRotation(45)));
         break;
     case KEY_R_LOWER: // Rotate negatively
+        if (v.empty())
+          break;
         cout << "r key pressed\n";
-        selectedObj -> setTransform(Matrix4::makeZRotation(-45));
+        beginSceneEdit();
+        selectedObj.setTransform(RigTForm(Quat::makeZRotation(-45)));
         break;
     case KEY_C_LOWER:
         cout << "Resetting camera...\n";
+        beginSceneEdit();
         g_eyeTransform = default_camera;
         break;
     case KEY_T_UPPER:
 
+        break;
+    case KEY_I_LOWER:
+        g_dumpRenderStats = !g_dumpRenderStats;
+        cout << "Render stats " << (g_dumpRenderStats ? "on" : "off") << "\n";
+        return;
+    case KEY_P_LOWER:
+        g_animate = !g_animate;
+        cout << "Animation " << (g_animate ? "playing" : "paused") << "\n";
+        return;
+    case KEY_F_LOWER:
+        g_targetRate = (g_targetRate + 1) % g_numTargetRates;
+        g_frameLoop.setTargetRate(g_targetRates[g_targetRate]);
+        cout << "Target frame rate " << g_targetRates[g_targetRate] << " (0 is uncapped)\n";
+        break;
+    case KEY_O_LOWER:
+        g_showOverlay = !g_showOverlay;
+        break;
+    case KEY_K_LOWER:
+        toggleTraceCapture();
+        return;
+    case KEY_L_LOWER:
+        beginSceneEdit();
+        g_sunMode = !g_sunMode;
+        cout << (g_sunMode ? "Directional light, cascaded shadow maps\n" : "Point lights\n");
+        break;
+    case KEY_U_LOWER:
+        beginSceneEdit();
+        g_occlusionCulling = !g_occlusionCulling;
+        cout << "Occlusion culling " << (g_occlusionCulling ? "on" : "off") << "\n";
+        break;
+    case KEY_G_LOWER:
+        beginSceneEdit();
+        g_cameraRelative = !g_cameraRelative;
+        cout << "Camera relative rendering " << (g_cameraRelative ? "on" : "off") << "\n";
+        break;
+    case KEY_Z_LOWER:
+        // reads the scene, so the next frame's build must be done with it
+        g_framePipeline->sync();
+        saveCheckpoint();
+        return;
+    case KEY_X_LOWER:
+        restoreCheckpoint();
         break;
     case KEY_W_LOWER:
         cout << "w key pressed\n";
+        beginSceneEdit();
         g_eyeTransform =
-        g_eyeTransform * Matrix4::makeTranslation(Cvec3(0, 0, -1));
+        g_eyeTransform * RigTForm(Cvec3(0, 0, -1));
         break;
     case KEY_A_LOWER:
         cout << "a key pressed\n";
+        beginSceneEdit();
         g_eyeTransform =
-        g_eyeTransform * Matrix4::makeTranslation(Cvec3(-1, 0, 0));
+        g_eyeTransform * RigTForm(Cvec3(-1, 0, 0));
         break;
     case KEY_S_LOWER:
         cout << "w key pressed\n";
+        beginSceneEdit();
           g_eyeTransform =
-          g_eyeTransform * Matrix4::makeTranslation(Cvec3(0, 0, 1));
+          g_eyeTransform * RigTForm(Cvec3(0, 0, 1));
         break;
     case KEY_D_LOWER:
         cout << "d key pressed\n";
+        beginSceneEdit();
         g_eyeTransform =
-        g_eyeTransform * Matrix4::makeTranslation(Cvec3(1, 0, 0));
+        g_eyeTransform * RigTForm(Cvec3(1, 0, 0));
         break;
   }
+  // Keys that leave the image as it is return above instead, so they do not
+  // force a frame that frameChanged() would have skipped
   glutPostRedisplay();
 }
 
@@ -500,6 +1395,7 @@ static void initGlutState(int argc, char * argv[]) {
   glutMouseFunc(mouse);                                   // mouse click callback
   glutSpecialFunc(special_keyboard);
   glutKeyboardFunc(keyboard);
+  glutIdleFunc(idle);                                     // paces the frame loop
 }
 
 static void initGLState() {
@@ -520,27 +1416,123 @@ static void initShaders() {
   g_shaderStates.resize(g_numShaders);
   for (int i = 0; i < g_numShaders; ++i) {
     if (g_Gl2Compatible)
-      g_shaderStates[i].reset(new ShaderState(g_shaderFilesGl2[i][0], g_shaderFilesGl2[i][1]));
+      g_shaderStates[i].reset(new ShaderState(g_shaderFilesGl2[i][0], g_shaderFilesGl2[i][1], g_shaderFilesGl2[i][2]));
     else
-      g_shaderStates[i].reset(new ShaderState(g_shaderFiles[i][0], g_shaderFiles[i][1]));
+      g_shaderStates[i].reset(new ShaderState(g_shaderFiles[i][0], g_shaderFiles[i][1], g_shaderFiles[i][2]));
   }
 }
 
+static void initJobs() {
+  g_jobSystem.reset(new JobSystem());
+  g_framePipeline.reset(new FramePipeline(*g_jobSystem, buildRenderQueue, NULL));
+  cerr << "Job system running on " << g_jobSystem->numThreads() << " threads" << endl;
+}
+
+static void initShadows() {
+  g_shadowsEnabled = shadowMapsSupported();
+  if (!g_shadowsEnabled) {
+    cerr << "Framebuffer objects not supported, shadows disabled" << endl;
+    return;
+  }
+  for (int i = 0; i < MAX_SHADOW_MAPS; ++i) {
+    g_shadowMaps.push_back(shared_ptr<ShadowMap>(new ShadowMap(g_shadowMapSize)));
+  }
+}
+
+static void initProfiler() {
+  g_gpuProfiler.reset(new GpuProfiler());
+  if (!g_gpuProfiler->available())
+    cerr << "ARB_timer_query not supported, GPU scopes disabled" << endl;
+}
+
+// Sets up the offscreen target of a -regress run; animation stays off so
+// every run renders the same frames
+static void initRegression() {
+  if (g_regressDir.empty())
+    return;
+  if (!shadowMapsSupported())
+    throw runtime_error("-regress needs framebuffer objects");
+  g_regression.reset(new RegressionRun());
+  g_regression->dir = g_regressDir;
+  g_regression->update = g_regressUpdate;
+  g_regression->target.reset(new OffscreenTarget(g_regressWidth, g_regressHeight));
+  g_regression->readback.reset(new PixelReadback(g_regressWidth, g_regressHeight));
+  g_sceneFramebuffer = g_regression->target->framebuffer();
+  g_animate = false;
+  updateFrustFovY();
+}
+
+static void initTextures() {
+  g_textures.reset(new TextureManager(g_textureResidentBudget, g_textureUploadBudget));
+  g_groundTexture = g_textures->add("./textures/ground.ppm");
+}
+
 static void initGeometry() {
   initGround();
   initCubes();
+  initSpheres();
+  g_ground->setLabel("ground");
+  g_cube->setLabel("cube");
+  g_sphere->setLabel("sphere");
+  g_geometries[GEOMETRY_GROUND] = g_ground;
+  g_geometries[GEOMETRY_CUBE] = g_cube;
+  g_geometries[GEOMETRY_SPHERE] = g_sphere;
+}
+
+// -scene <file> picks the scene file to load; -record <name> and
+// -replay <name> record or play back <name>.snap and <name>.delta;
+// -regress <dir> [-update] runs the reference views against <dir>
+static void parseSceneFlag(int argc, char * argv[]) {
+  for (int i = 1; i < argc; ++i) {
+    if (string(argv[i]) == "-update")
+      g_regressUpdate = true;
+    if (i + 1 == argc)
+      break;
+    if (string(argv[i]) == "-scene")
+      g_sceneFile = argv[i + 1];
+    else if (string(argv[i]) == "-record")
+      g_recordName = argv[i + 1];
+    else if (string(argv[i]) == "-replay")
+      g_replayName = argv[i + 1];
+    else if (string(argv[i]) == "-regress")
+      g_regressDir = argv[i + 1];
+  }
+  if (!g_regressDir.empty()) {
+    g_windowWidth = g_regressWidth;
+    g_windowHeight = g_regressHeight;
+  }
+}
+
+// -gldebug turns on synchronous GL debug output and glGetError() polling
+static bool parseGlDebugFlag(int argc, char * argv[]) {
+  for (int i = 1; i < argc; ++i) {
+    if (string(argv[i]) == "-gldebug")
+      return true;
+  }
+  return false;
 }
 
 int main(int argc, char * argv[]) {
   try {
+    g_glDebug = parseGlDebugFlag(argc, argv);
+    parseSceneFlag(argc, argv);
     initGlutState(argc,argv);
 
     glewInit(); // load the OpenGL extensions
+    initGlErrorReporting(g_glDebug);
+    cerr << "GL error checking: " << (g_glDebug ? "debug (synchronous, glGetError polling)" : "asynchronous") << endl;
 
     initGLState();
     initShaders();
     initGeometry();
     initObjects();
+    initJobs();
+    initTextures();
+    initShadows();
+    initProfiler();
+    initRegression();
+    // Replays and regression runs run uncapped, so the frame times measure the work
+    g_frameLoop.setTargetRate(g_replay || g_regression ? 0 : g_targetRates[g_targetRate]);
     glutMainLoop();
     return 0;
   }
@@ -0,0 +1,160 @@
+#include <vector>
+#include <cfloat>
+#include <cmath>
+#include <algorithm>
+
+#include "cvec.h"
+#include "matrix4.h"
+#include "matrix4f.h"
+#include "occlusion.h"
+
+using namespace std;
+
+// Nothing drawn: farther than anything in the frustum
+static const float EMPTY_DEPTH = -FLT_MAX;
+
+// Corners of the unit cube are numbered by bits: x | y << 1 | z << 2. Each
+// face is listed as a loop of corners and split into two triangles.
+static const int g_boxFaces[6][4] = {
+  {0, 2, 6, 4}, {1, 3, 7, 5},
+  {0, 1, 5, 4}, {2, 3, 7, 6},
+  {0, 1, 3, 2}, {4, 5, 7, 6}
+};
+
+OcclusionBuffer::OcclusionBuffer(const int width, const int height)
+  : width_(width), height_(height),
+    tilesX_((width + TILE - 1) / TILE), tilesY_((height + TILE - 1) / TILE),
+    depth_(width * height, EMPTY_DEPTH), tileMin_(tilesX_ * tilesY_, EMPTY_DEPTH),
+    occluders_(0) {}
+
+void OcclusionBuffer::clear(const Matrix4& projection) {
+  projection_ = Matrix4f(projection);
+  std::fill(depth_.begin(), depth_.end(), EMPTY_DEPTH);
+  std::fill(tileMin_.begin(), tileMin_.end(), EMPTY_DEPTH);
+  occluders_ = 0;
+}
+
+bool OcclusionBuffer::addBox(const Matrix4f& MVM) {
+  const Matrix4f MVP = projection_ * MVM;
+  Cvec3f screen[8];
+  for (int i = 0; i < 8; ++i) {
+    const Cvec4f p = MVP * Cvec4f(i & 1 ? 0.5f : -0.5f, i & 2 ? 0.5f : -0.5f, i & 4 ? 0.5f : -0.5f, 1);
+    if (p[3] <= 1e-5f)
+      return false;
+    const float invW = 1 / p[3];
+    screen[i] = Cvec3f((p[0] * invW + 1) * 0.5f * width_, (p[1] * invW + 1) * 0.5f * height_, p[2] * invW);
+  }
+  for (int f = 0; f < 6; ++f) {
+    const int *q = g_boxFaces[f];
+    drawTriangle(screen[q[0]], screen[q[1]], screen[q[2]]);
+    drawTriangle(screen[q[0]], screen[q[2]], screen[q[3]]);
+  }
+  ++occluders_;
+  return true;
+}
+
+// Edge function rasterization at pixel centers with z interpolated linearly
+// in screen space, which is exact for NDC z. Both windings are drawn, so
+// faces need not be culled.
+void OcclusionBuffer::drawTriangle(const Cvec3f& a, const Cvec3f& b0, const Cvec3f& c0) {
+  float area = (b0[0] - a[0]) * (c0[1] - a[1]) - (b0[1] - a[1]) * (c0[0] - a[0]);
+  if (std::abs(area) < 1e-8f)
+    return;
+  const bool flip = area < 0;
+  const Cvec3f& b = flip ? c0 : b0;
+  const Cvec3f& c = flip ? b0 : c0;
+  area = std::abs(area);
+
+  const int x0 = std::max(0, (int)std::floor(std::min(a[0], std::min(b[0], c[0]))));
+  const int x1 = std::min(width_ - 1, (int)std::ceil(std::max(a[0], std::max(b[0], c[0]))));
+  const int y0 = std::max(0, (int)std::floor(std::min(a[1], std::min(b[1], c[1]))));
+  const int y1 = std::min(height_ - 1, (int)std::ceil(std::max(a[1], std::max(b[1], c[1]))));
+
+  const float invArea = 1 / area;
+  for (int y = y0; y <= y1; ++y) {
+    const float py = y + 0.5f;
+    float *row = &depth_[y * width_];
+    for (int x = x0; x <= x1; ++x) {
+      const float px = x + 0.5f;
+      // barycentric weights of a, b and c
+      const float wa = (c[0] - b[0]) * (py - b[1]) - (c[1] - b[1]) * (px - b[0]);
+      const float wb = (a[0] - c[0]) * (py - c[1]) - (a[1] - c[1]) * (px - c[0]);
+      const float wc = (b[0] - a[0]) * (py - a[1]) - (b[1] - a[1]) * (px - a[0]);
+      if (wa < 0 || wb < 0 || wc < 0)
+        continue;
+      const float z = (wa * a[2] + wb * b[2] + wc * c[2]) * invArea;
+      row[x] = std::max(row[x], z);
+    }
+  }
+}
+
+void OcclusionBuffer::finish() {
+  for (int ty = 0; ty < tilesY_; ++ty) {
+    for (int tx = 0; tx < tilesX_; ++tx) {
+      float m = FLT_MAX;
+      for (int y = ty * TILE; y < std::min(height_, (ty + 1) * TILE); ++y) {
+        for (int x = tx * TILE; x < std::min(width_, (tx + 1) * TILE); ++x) {
+          m = std::min(m, depth_[y * width_ + x]);
+        }
+      }
+      tileMin_[ty * tilesX_ + tx] = m;
+    }
+  }
+}
+
+bool OcclusionBuffer::sphereOccluded(const Cvec3& center, const double radius) const {
+  if (occluders_ == 0)
+    return false;
+  // the nearest point of the sphere must be in front of the eye
+  const double nearZ = center[2] + radius;
+  if (nearZ > -1e-3)
+    return false;
+
+  // Screen rectangle of the sphere's bounding cube. Projection is linear
+  // before the divide, so over the cube each clip coordinate ranges over the
+  // projected center plus or minus the summed magnitudes of the projected
+  // half edges, which are scaled columns of the projection; dividing the
+  // x and y ranges by the w range bounds the cube's screen footprint.
+  const float r = radius;
+  const Cvec4f c = projection_ * Cvec4f(center[0], center[1], center[2], 1);
+  const Cvec4f& px = projection_.column(0);
+  const Cvec4f& py = projection_.column(1);
+  const Cvec4f& pz = projection_.column(2);
+  const float dx = (std::abs(px[0]) + std::abs(py[0]) + std::abs(pz[0])) * r;
+  const float dy = (std::abs(px[1]) + std::abs(py[1]) + std::abs(pz[1])) * r;
+  const float dw = (std::abs(px[3]) + std::abs(py[3]) + std::abs(pz[3])) * r;
+  if (c[3] - dw <= 1e-5f)
+    return false;
+  const float invW0 = 1 / (c[3] - dw), invW1 = 1 / (c[3] + dw);
+  const float nx0 = c[0] - dx, nx1 = c[0] + dx, ny0 = c[1] - dy, ny1 = c[1] + dy;
+  const float hw = 0.5f * width_, hh = 0.5f * height_;
+  const float minX = (nx0 * (nx0 < 0 ? invW0 : invW1) + 1) * hw;
+  const float maxX = (nx1 * (nx1 < 0 ? invW1 : invW0) + 1) * hw;
+  const float minY = (ny0 * (ny0 < 0 ? invW0 : invW1) + 1) * hh;
+  const float maxY = (ny1 * (ny1 < 0 ? invW1 : invW0) + 1) * hh;
+  if (maxX < 0 || maxY < 0 || minX >= width_ || minY >= height_)
+    return false;
+  // clamped to the screen first, so truncation rounds down
+  const int x0 = (int)std::max(minX, 0.f), x1 = std::min(width_ - 1, (int)maxX);
+  const int y0 = (int)std::max(minY, 0.f), y1 = std::min(height_ - 1, (int)maxY);
+
+  // depth of the sphere's nearest point; projected z and w do not depend on x or y
+  const Cvec4f nearClip = c + pz * r;
+  const float z = nearClip[2] / nearClip[3];
+
+  for (int ty = y0 / TILE; ty <= y1 / TILE; ++ty) {
+    for (int tx = x0 / TILE; tx <= x1 / TILE; ++tx) {
+      if (tileMin_[ty * tilesX_ + tx] > z)
+        continue;   // every occluder texel of the tile is nearer
+      const int ya = std::max(y0, ty * TILE), yb = std::min(y1, ty * TILE + TILE - 1);
+      const int xa = std::max(x0, tx * TILE), xb = std::min(x1, tx * TILE + TILE - 1);
+      for (int y = ya; y <= yb; ++y) {
+        for (int x = xa; x <= xb; ++x) {
+          if (depth_[y * width_ + x] <= z)
+            return false;
+        }
+      }
+    }
+  }
+  return true;
+}
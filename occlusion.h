@@ -0,0 +1,63 @@
+#ifndef OCCLUSION_H
+#define OCCLUSION_H
+
+#include <vector>
+
+#include "cvec.h"
+#include "matrix4.h"
+#include "matrix4f.h"
+
+//--------------------------------------------------------------------------------
+// Software occlusion culling. A few large occluders are rasterized each frame
+// into a small CPU depth buffer, and bounding spheres are tested against it
+// before their draw packets are written. The buffer keeps a per-tile minimum
+// (the farthest occluder depth in each 8x8 tile) so most tests resolve a whole
+// tile at once; only tiles the sphere is not clearly behind are checked per
+// pixel. Depths are NDC z, and like the GL depth buffer of the viewer, nearer
+// is greater.
+//--------------------------------------------------------------------------------
+class OcclusionBuffer {
+public:
+  OcclusionBuffer(const int width = 256, const int height = 128);
+
+  int width() const {
+    return width_;
+  }
+
+  int height() const {
+    return height_;
+  }
+
+  // Empties the buffer for a frame seen through the given projection
+  void clear(const Matrix4& projection);
+
+  // Rasterizes the cube [-0.5, 0.5]^3 under model view matrix MVM. Boxes
+  // reaching behind the near plane are skipped, which only loses occlusion.
+  // Returns whether the box was drawn.
+  bool addBox(const Matrix4f& MVM);
+
+  // Updates the tile minimums; call after the last addBox()
+  void finish();
+
+  // True when the sphere, given in eye space, is hidden behind the occluders
+  // wherever it covers the screen. Coverage is sampled at pixel centers.
+  bool sphereOccluded(const Cvec3& center, const double radius) const;
+
+  int occluders() const {
+    return occluders_;
+  }
+
+private:
+  static const int TILE = 8;
+
+  int width_, height_;
+  int tilesX_, tilesY_;
+  Matrix4f projection_;
+  std::vector<float> depth_;
+  std::vector<float> tileMin_;
+  int occluders_;
+
+  void drawTriangle(const Cvec3f& a, const Cvec3f& b, const Cvec3f& c);
+};
+
+#endif
@@ -0,0 +1,224 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <vector>
+#include <cassert>
+
+// Reference to an object living in a Pool. Each slot of a pool carries a
+// generation that is bumped when its object is destroyed, so a handle to a
+// destroyed object is detected instead of silently aliasing the slot's next
+// occupant. The default constructed handle is null.
+struct PoolHandle {
+  unsigned index;
+  unsigned generation;  // 0 is never used by a live object
+
+  PoolHandle() : index(0), generation(0) {}
+  PoolHandle(const unsigned i, const unsigned g) : index(i), generation(g) {}
+
+  bool isNull() const {
+    return generation == 0;
+  }
+
+  bool operator == (const PoolHandle& h) const {
+    return index == h.index && generation == h.generation;
+  }
+
+  bool operator != (const PoolHandle& h) const {
+    return !(*this == h);
+  }
+};
+
+// Bookkeeping shared by every slot based container: which slots are in use,
+// their generations and an intrusive free list. Containers keep their own
+// per-slot data in arrays indexed by slot and grow them when allocate()
+// returns a slot past their current size.
+class SlotAllocator {
+  std::vector<unsigned> generations_;
+  std::vector<int> nextFree_;  // next free slot if a slot is free, -1 otherwise
+  std::vector<char> alive_;
+  int freeHead_;
+  int size_;
+
+public:
+  SlotAllocator() : freeHead_(-1), size_(0) {}
+
+  void reserve(const int n) {
+    generations_.reserve(n);
+    nextFree_.reserve(n);
+    alive_.reserve(n);
+  }
+
+  PoolHandle allocate() {
+    ++size_;
+    if (freeHead_ < 0) {
+      generations_.push_back(1);
+      nextFree_.push_back(-1);
+      alive_.push_back(true);
+      return PoolHandle(generations_.size() - 1, 1);
+    }
+    const int i = freeHead_;
+    freeHead_ = nextFree_[i];
+    nextFree_[i] = -1;
+    alive_[i] = true;
+    return PoolHandle(i, generations_[i]);
+  }
+
+  void release(const PoolHandle& h) {
+    assert(contains(h));
+    kill(h.index);
+    nextFree_[h.index] = freeHead_;
+    freeHead_ = h.index;
+    --size_;
+  }
+
+  // Invalidates every handle in one linear pass, keeping all slots for reuse
+  void clear() {
+    freeHead_ = -1;
+    for (int i = generations_.size() - 1; i >= 0; --i) {
+      if (alive_[i])
+        kill(i);
+      nextFree_[i] = freeHead_;
+      freeHead_ = i;
+    }
+    size_ = 0;
+  }
+
+  bool contains(const PoolHandle& h) const {
+    return h.index < generations_.size() && alive_[h.index] &&
+      generations_[h.index] == h.generation;
+  }
+
+  int size() const {
+    return size_;
+  }
+
+  int numSlots() const {
+    return generations_.size();
+  }
+
+  bool isAlive(const int slot) const {
+    return alive_[slot];
+  }
+
+  PoolHandle handleAt(const int slot) const {
+    return PoolHandle(slot, generations_[slot]);
+  }
+
+  // Free slots in the order allocate() would hand them out
+  void freeSlots(std::vector<int>& out) const {
+    out.clear();
+    for (int i = freeHead_; i >= 0; i = nextFree_[i]) {
+      out.push_back(i);
+    }
+  }
+
+  // Restoring saved state: resize() to the saved slot count (new slots are
+  // dead), restore() each slot, then setFreeSlots() with the saved free list
+  void resize(const int numSlots) {
+    generations_.resize(numSlots, 1);
+    nextFree_.resize(numSlots, -1);
+    alive_.resize(numSlots, false);
+  }
+
+  void restore(const int slot, const unsigned generation, const bool alive) {
+    generations_[slot] = generation;
+    alive_[slot] = alive;
+  }
+
+  void setFreeSlots(const std::vector<int>& slots) {
+    freeHead_ = -1;
+    for (int k = (int)slots.size() - 1; k >= 0; --k) {
+      nextFree_[slots[k]] = freeHead_;
+      freeHead_ = slots[k];
+    }
+    size_ = 0;
+    for (size_t i = 0; i < alive_.size(); ++i) {
+      size_ += alive_[i] ? 1 : 0;
+    }
+  }
+
+private:
+  void kill(const int i) {
+    alive_[i] = false;
+    if (++generations_[i] == 0)  // skip the null generation on wrap around
+      generations_[i] = 1;
+  }
+};
+
+// Objects of type T stored contiguously in an array of slots. Free slots are
+// kept in an intrusive free list, so create and destroy are O(1) and reuse
+// memory; iterating over slots 0..numSlots()-1 walks memory linearly.
+//
+// Handles are stable across growth, but raw pointers returned by get() are
+// only valid until the next create().
+template <class T>
+class Pool {
+  SlotAllocator slots_;
+  std::vector<T> values_;
+
+public:
+  void reserve(const int n) {
+    slots_.reserve(n);
+    values_.reserve(n);
+  }
+
+  PoolHandle create(const T& value) {
+    const PoolHandle h = slots_.allocate();
+    if (h.index < values_.size())
+      values_[h.index] = value;
+    else
+      values_.push_back(value);
+    return h;
+  }
+
+  void destroy(const PoolHandle& h) {
+    slots_.release(h);
+  }
+
+  // Bulk teardown: invalidates every handle in one linear pass and keeps the
+  // memory for reuse
+  void clear() {
+    slots_.clear();
+  }
+
+  bool contains(const PoolHandle& h) const {
+    return slots_.contains(h);
+  }
+
+  // Returns NULL if the handle is null or its object has been destroyed
+  T *get(const PoolHandle& h) {
+    return contains(h) ? &values_[h.index] : NULL;
+  }
+
+  const T *get(const PoolHandle& h) const {
+    return contains(h) ? &values_[h.index] : NULL;
+  }
+
+  // Number of live objects
+  int size() const {
+    return slots_.size();
+  }
+
+  // Slot level access for linear iteration; dead slots must be skipped
+  int numSlots() const {
+    return slots_.numSlots();
+  }
+
+  bool isAlive(const int slot) const {
+    return slots_.isAlive(slot);
+  }
+
+  T& at(const int slot) {
+    return values_[slot];
+  }
+
+  const T& at(const int slot) const {
+    return values_[slot];
+  }
+
+  PoolHandle handleAt(const int slot) const {
+    return slots_.handleAt(slot);
+  }
+};
+
+#endif
@@ -0,0 +1,170 @@
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+#include <ostream>
+#include <iomanip>
+#include <pthread.h>
+
+#include "timer.h"
+#include "profiler.h"
+
+using namespace std;
+
+// Events kept by one capture; later ones are dropped
+static const size_t g_maxCapturedEvents = 1 << 20;
+
+struct Profiler::ThreadLog {
+  int thread;
+  pthread_mutex_t lock;                   // guards events, which endFrame() drains
+  vector<ProfileEvent> events;
+  vector<pair<const char*, long long> > open;   // only touched by the owning thread
+};
+
+// Logs are never freed, so events of threads that have exited are still
+// collected
+__thread Profiler::ThreadLog *Profiler::currentLog_ = NULL;
+
+Profiler& Profiler::instance() {
+  static Profiler profiler;
+  return profiler;
+}
+
+Profiler::Profiler()
+  : enabled_(true), capturing_(false), captureStart_(0) {
+  pthread_mutex_init(&registryLock_, NULL);
+}
+
+Profiler::ThreadLog& Profiler::threadLog() {
+  if (!currentLog_) {
+    ThreadLog *log = new ThreadLog();
+    pthread_mutex_init(&log->lock, NULL);
+    pthread_mutex_lock(&registryLock_);
+    log->thread = threads_.size();
+    threads_.push_back(log);
+    pthread_mutex_unlock(&registryLock_);
+    currentLog_ = log;
+  }
+  return *currentLog_;
+}
+
+void Profiler::begin(const char *name) {
+  threadLog().open.push_back(make_pair(name, nowNanos()));
+}
+
+void Profiler::end() {
+  ThreadLog& log = threadLog();
+  ProfileEvent e;
+  e.end = nowNanos();
+  e.name = log.open.back().first;
+  e.begin = log.open.back().second;
+  log.open.pop_back();
+  e.depth = log.open.size();
+  e.thread = log.thread;
+  pthread_mutex_lock(&log.lock);
+  log.events.push_back(e);
+  pthread_mutex_unlock(&log.lock);
+}
+
+void Profiler::addEvent(const ProfileEvent& event) {
+  pthread_mutex_lock(&registryLock_);
+  external_.push_back(event);
+  pthread_mutex_unlock(&registryLock_);
+}
+
+// Parents start no later than their children and are shallower
+static bool eventBefore(const ProfileEvent& a, const ProfileEvent& b) {
+  if (a.thread != b.thread)
+    return a.thread < b.thread;
+  if (a.begin != b.begin)
+    return a.begin < b.begin;
+  return a.depth < b.depth;
+}
+
+void Profiler::endFrame() {
+  vector<ProfileEvent> events;
+  pthread_mutex_lock(&registryLock_);
+  events.swap(external_);
+  for (size_t t = 0; t < threads_.size(); ++t) {
+    ThreadLog& log = *threads_[t];
+    pthread_mutex_lock(&log.lock);
+    events.insert(events.end(), log.events.begin(), log.events.end());
+    log.events.clear();
+    pthread_mutex_unlock(&log.lock);
+  }
+  pthread_mutex_unlock(&registryLock_);
+
+  if (capturing_) {
+    const size_t room = g_maxCapturedEvents - std::min(captured_.size(), g_maxCapturedEvents);
+    captured_.insert(captured_.end(), events.begin(), events.begin() + std::min(room, events.size()));
+  }
+
+  // Rebuild each event's path from the names of the scopes enclosing it on
+  // its thread
+  sort(events.begin(), events.end(), eventBefore);
+  lastFrame_.clear();
+  map<string, int> index;
+  vector<string> stack;
+  int thread = 0;
+  for (size_t i = 0; i < events.size(); ++i) {
+    const ProfileEvent& e = events[i];
+    if (i == 0 || e.thread != thread) {
+      stack.clear();
+      thread = e.thread;
+    }
+    stack.resize(e.depth + 1);
+    stack[e.depth] = (e.depth > 0 ? stack[e.depth - 1] + "/" : string()) + e.name;
+
+    map<string, int>::iterator it = index.find(stack[e.depth]);
+    if (it == index.end()) {
+      ProfileNode n;
+      n.path = stack[e.depth];
+      n.name = e.name;
+      n.depth = e.depth;
+      n.thread = e.thread;
+      n.totalNanos = 0;
+      n.calls = 0;
+      it = index.insert(make_pair(n.path, (int)lastFrame_.size())).first;
+      lastFrame_.push_back(n);
+    }
+    lastFrame_[it->second].totalNanos += e.end - e.begin;
+    ++lastFrame_[it->second].calls;
+  }
+}
+
+void Profiler::startCapture() {
+  captured_.clear();
+  captureStart_ = nowNanos();
+  capturing_ = true;
+}
+
+void Profiler::stopCapture() {
+  capturing_ = false;
+}
+
+void Profiler::writeChromeTrace(ostream& os) const {
+  os << "{\"traceEvents\":[\n";
+  os << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << PROFILER_GPU_THREAD
+     << ",\"args\":{\"name\":\"GPU\"}}";
+  for (size_t i = 0; i < captured_.size(); ++i) {
+    const ProfileEvent& e = captured_[i];
+    // microseconds relative to the start of the capture
+    os << ",\n{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << e.thread
+       << fixed << setprecision(3)
+       << ",\"ts\":" << (e.begin - captureStart_) * 1e-3
+       << ",\"dur\":" << (e.end - e.begin) * 1e-3 << "}";
+  }
+  os << "\n]}\n";
+}
+
+void printProfile(ostream& os, const vector<ProfileNode>& nodes) {
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    const ProfileNode& n = nodes[i];
+    os << string(2 * n.depth + 2, ' ') << n.name
+       << (n.thread == PROFILER_GPU_THREAD ? " [gpu]" : "")
+       << " " << fixed << setprecision(3) << nanosToMillis(n.totalNanos) << " ms";
+    if (n.calls > 1)
+      os << " (" << n.calls << " calls)";
+    os << "\n";
+  }
+}
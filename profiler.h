@@ -0,0 +1,123 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <vector>
+#include <string>
+#include <ostream>
+#include <pthread.h>
+
+//--------------------------------------------------------------------------------
+// Hierarchical frame profiler. Code marks scopes with ProfileScope; every
+// thread records into its own log, and once per frame endFrame() collects the
+// logs into a tree of per-scope totals (frame -> transforms -> culling -> ...).
+// Scopes measured elsewhere, like GPU timer queries, are added as finished
+// events. While capturing, all events are kept and can be written as Chrome
+// trace JSON.
+//--------------------------------------------------------------------------------
+
+// Pseudo thread id of events timed on the GPU
+static const int PROFILER_GPU_THREAD = -1;
+
+struct ProfileEvent {
+  const char *name;      // must outlive the profiler, use string literals
+  long long begin, end;  // nowNanos() clock
+  int depth;             // number of enclosing scopes on the same thread
+  int thread;
+};
+
+// Totals of one scope path over a frame
+struct ProfileNode {
+  std::string path;      // names of the enclosing scopes and this one, '/' separated
+  const char *name;
+  int depth;
+  int thread;            // thread of the first event, PROFILER_GPU_THREAD for GPU scopes
+  long long totalNanos;
+  int calls;
+};
+
+class Profiler {
+public:
+  static Profiler& instance();
+
+  void setEnabled(const bool enabled) {
+    enabled_ = enabled;
+  }
+
+  bool enabled() const {
+    return enabled_;
+  }
+
+  // Opens and closes a scope on the calling thread; use ProfileScope
+  void begin(const char *name);
+  void end();
+
+  // Records a scope that was timed elsewhere
+  void addEvent(const ProfileEvent& event);
+
+  // Gathers the events finished since the last call into lastFrame() and,
+  // while capturing, into the capture. Scopes still open carry over to the
+  // frame they finish in.
+  void endFrame();
+
+  // Per scope totals of the last frame, parents before their children
+  const std::vector<ProfileNode>& lastFrame() const {
+    return lastFrame_;
+  }
+
+  void startCapture();
+  void stopCapture();
+
+  bool capturing() const {
+    return capturing_;
+  }
+
+  // Writes the captured events in the Chrome trace event format, for
+  // chrome://tracing or Perfetto
+  void writeChromeTrace(std::ostream& os) const;
+
+private:
+  struct ThreadLog;
+
+  volatile bool enabled_;
+  bool capturing_;
+  long long captureStart_;
+  pthread_mutex_t registryLock_;
+  std::vector<ThreadLog*> threads_;
+  std::vector<ProfileEvent> external_;   // added with addEvent(), under registryLock_
+  std::vector<ProfileEvent> captured_;
+  std::vector<ProfileNode> lastFrame_;
+
+  static __thread ThreadLog *currentLog_;
+
+  Profiler();
+  Profiler(const Profiler&);
+  const Profiler& operator= (const Profiler&);
+
+  ThreadLog& threadLog();
+};
+
+// Indented tree of a frame's totals, in milliseconds
+void printProfile(std::ostream& os, const std::vector<ProfileNode>& nodes);
+
+// Times the enclosing C++ scope
+class ProfileScope {
+public:
+  explicit ProfileScope(const char *name)
+    : active_(Profiler::instance().enabled()) {
+    if (active_)
+      Profiler::instance().begin(name);
+  }
+
+  ~ProfileScope() {
+    if (active_)
+      Profiler::instance().end();
+  }
+
+private:
+  bool active_;
+
+  ProfileScope(const ProfileScope&);
+  const ProfileScope& operator= (const ProfileScope&);
+};
+
+#endif
@@ -0,0 +1,200 @@
+#ifndef QUAT_H
+#define QUAT_H
+
+#include <iostream>
+#include <cassert>
+#include <cmath>
+
+#include "cvec.h"
+#include "matrix4.h"
+
+// A unit quaternion representing a 3D rotation. Composing rotations as
+// quaternions costs 16 multiplies instead of 64 for 4x4 matrices, and drift
+// is removed by renormalizing instead of re-orthogonalizing a matrix.
+class Quat {
+  Cvec4 q_;  // layout is: q_[0]==w, q_[1]==x, q_[2]==y, q_[3]==z
+
+public:
+  double operator [] (const int i) const {
+    return q_[i];
+  }
+
+  double& operator [] (const int i) {
+    return q_[i];
+  }
+
+  double operator () (const int i) const {
+    return q_[i];
+  }
+
+  double& operator () (const int i) {
+    return q_[i];
+  }
+
+  Quat()
+    : q_(1, 0, 0, 0)
+  {}
+
+  Quat(const double w, const Cvec3& v)
+    : q_(w, v[0], v[1], v[2])
+  {}
+
+  Quat(const double w, const double x, const double y, const double z)
+    : q_(w, x, y, z)
+  {}
+
+  Quat& operator += (const Quat& a) {
+    q_ += a.q_;
+    return *this;
+  }
+
+  Quat& operator -= (const Quat& a) {
+    q_ -= a.q_;
+    return *this;
+  }
+
+  Quat& operator *= (const double a) {
+    q_ *= a;
+    return *this;
+  }
+
+  Quat& operator /= (const double a) {
+    q_ /= a;
+    return *this;
+  }
+
+  Quat operator + (const Quat& a) const {
+    return Quat(*this) += a;
+  }
+
+  Quat operator - (const Quat& a) const {
+    return Quat(*this) -= a;
+  }
+
+  Quat operator * (const double a) const {
+    return Quat(*this) *= a;
+  }
+
+  Quat operator / (const double a) const {
+    return Quat(*this) /= a;
+  }
+
+  // Hamilton product, written out so no Cvec3 temporaries are made
+  Quat operator * (const Quat& a) const {
+    const double w = q_[0], x = q_[1], y = q_[2], z = q_[3];
+    return Quat(w*a.q_[0] - x*a.q_[1] - y*a.q_[2] - z*a.q_[3],
+                w*a.q_[1] + x*a.q_[0] + y*a.q_[3] - z*a.q_[2],
+                w*a.q_[2] - x*a.q_[3] + y*a.q_[0] + z*a.q_[1],
+                w*a.q_[3] + x*a.q_[2] - y*a.q_[1] + z*a.q_[0]);
+  }
+
+  // Rotates the vector part of a; the w component is passed through
+  Cvec4 operator * (const Cvec4& a) const {
+    // v + 2w(u x v) + 2u x (u x v) with u the vector part, valid for unit
+    // quaternions
+    const double w = q_[0], x = q_[1], y = q_[2], z = q_[3];
+    const double tx = 2 * (y*a[2] - z*a[1]);
+    const double ty = 2 * (z*a[0] - x*a[2]);
+    const double tz = 2 * (x*a[1] - y*a[0]);
+    return Cvec4(a[0] + w*tx + y*tz - z*ty,
+                 a[1] + w*ty + z*tx - x*tz,
+                 a[2] + w*tz + x*ty - y*tx,
+                 a[3]);
+  }
+
+  static Quat makeXRotation(const double ang) {
+    Quat r;
+    const double h = 0.5 * ang * CS175_PI/180;
+    r.q_[1] = std::sin(h);
+    r.q_[0] = std::cos(h);
+    return r;
+  }
+
+  static Quat makeYRotation(const double ang) {
+    Quat r;
+    const double h = 0.5 * ang * CS175_PI/180;
+    r.q_[2] = std::sin(h);
+    r.q_[0] = std::cos(h);
+    return r;
+  }
+
+  static Quat makeZRotation(const double ang) {
+    Quat r;
+    const double h = 0.5 * ang * CS175_PI/180;
+    r.q_[3] = std::sin(h);
+    r.q_[0] = std::cos(h);
+    return r;
+  }
+};
+
+inline double dot(const Quat& q, const Quat& p) {
+  double s = 0.0;
+  for (int i = 0; i < 4; ++i) {
+    s += q(i) * p(i);
+  }
+  return s;
+}
+
+inline double norm2(const Quat& q) {
+  return dot(q, q);
+}
+
+inline Quat inv(const Quat& q) {
+  const double n = norm2(q);
+  assert(n > CS175_EPS2);
+  return Quat(q(0), -q(1), -q(2), -q(3)) * (1.0/n);
+}
+
+inline Quat normalize(const Quat& q) {
+  return q / std::sqrt(norm2(q));
+}
+
+// Pulls a nearly unit quaternion back to unit length with one Newton step
+// for 1/sqrt(n) around n = 1: no sqrt or division, and enough to keep
+// repeated products from drifting.
+inline Quat renormalize(const Quat& q) {
+  return q * (0.5 * (3 - norm2(q)));
+}
+
+inline Matrix4 quatToMatrix(const Quat& q) {
+  Matrix4 r;
+  const double n = norm2(q);
+  if (n < CS175_EPS2)
+    return Matrix4(0);
+
+  const double two_over_n = 2/n;
+  r(0, 0) -= (q(2)*q(2) + q(3)*q(3)) * two_over_n;
+  r(0, 1) += (q(1)*q(2) - q(0)*q(3)) * two_over_n;
+  r(0, 2) += (q(1)*q(3) + q(2)*q(0)) * two_over_n;
+  r(1, 0) += (q(1)*q(2) + q(0)*q(3)) * two_over_n;
+  r(1, 1) -= (q(1)*q(1) + q(3)*q(3)) * two_over_n;
+  r(1, 2) += (q(2)*q(3) - q(1)*q(0)) * two_over_n;
+  r(2, 0) += (q(1)*q(3) - q(2)*q(0)) * two_over_n;
+  r(2, 1) += (q(2)*q(3) + q(1)*q(0)) * two_over_n;
+  r(2, 2) -= (q(1)*q(1) + q(2)*q(2)) * two_over_n;
+
+  assert(isAffine(r));
+  return r;
+}
+
+// Normalized linear interpolation: cheap, constant speed only approximately.
+// Takes the short way around.
+inline Quat nlerp(const Quat& q0, const Quat& q1, const double alpha) {
+  const Quat q1s = dot(q0, q1) < 0 ? q1 * -1.0 : q1;
+  return normalize(q0 * (1 - alpha) + q1s * alpha);
+}
+
+// Spherical linear interpolation: constant angular speed. Takes the short
+// way around and falls back to nlerp for nearly equal rotations.
+inline Quat slerp(const Quat& q0, const Quat& q1, const double alpha) {
+  double c = dot(q0, q1);
+  const Quat q1s = c < 0 ? q1 * -1.0 : q1;
+  c = std::abs(c);
+  if (c > 1 - 1e-6)
+    return nlerp(q0, q1s, alpha);
+  const double theta = std::acos(c);
+  const double s = std::sin(theta);
+  return q0 * (std::sin((1 - alpha) * theta) / s) + q1s * (std::sin(alpha * theta) / s);
+}
+
+#endif
@@ -0,0 +1,615 @@
+#include <vector>
+#include <cmath>
+#include <cstring>
+#include <cassert>
+#include <algorithm>
+
+#include "cvec.h"
+#include "matrix4.h"
+#include "rigtform.h"
+#include "jobsystem.h"
+#include "scenestore.h"
+#include "image.h"
+#include "lanes.h"
+#include "timer.h"
+#include "profiler.h"
+#include "softraster.h"
+#include "raytrace.h"
+
+using namespace std;
+
+// Bins the surface area heuristic sorts primitive centroids into
+static const int SAH_BINS = 16;
+
+// Leaves are split while they hold more primitives than this, whatever the
+// heuristic says
+static const int MAX_LEAF_HARD = 16;
+
+// Deepest BVH traversal stack; binned splits keep trees far shallower
+static const int MAX_STACK = 128;
+
+// Shadow rays start this fraction of the way to the light, so they do not
+// hit the surface they leave
+static const float SHADOW_BIAS = 1e-4f;
+
+// Distance of rays that hit nothing
+static const float NO_HIT = 1e30f;
+
+// --------- BVH construction
+
+namespace {
+struct Box {
+  float lo[3], hi[3];
+
+  Box() {
+    for (int i = 0; i < 3; ++i) {
+      lo[i] = NO_HIT;
+      hi[i] = -NO_HIT;
+    }
+  }
+
+  void grow(const float lower[3], const float upper[3]) {
+    for (int i = 0; i < 3; ++i) {
+      lo[i] = min(lo[i], lower[i]);
+      hi[i] = max(hi[i], upper[i]);
+    }
+  }
+
+  void grow(const Box& b) {
+    grow(b.lo, b.hi);
+  }
+
+  // Half the surface area, 0 for an empty box
+  float area() const {
+    const float dx = hi[0] - lo[0], dy = hi[1] - lo[1], dz = hi[2] - lo[2];
+    return dx < 0 ? 0 : dx * dy + dy * dz + dz * dx;
+  }
+};
+
+struct BuildItem {
+  int node, first, count;
+
+  BuildItem(const int n, const int f, const int c) : node(n), first(f), count(c) {}
+};
+
+// Twice the centroid of a primitive along one axis; only compared and binned
+inline float centroid(const vector<float>& bounds, const int i, const int axis) {
+  return bounds[6 * i + axis] + bounds[6 * i + 3 + axis];
+}
+
+// Bin of a primitive's centroid
+struct CentroidBin {
+  const vector<float> *bounds;
+  int axis;
+  float lo, scale;
+
+  CentroidBin(const vector<float>& b, const int a, const float l, const float s)
+    : bounds(&b), axis(a), lo(l), scale(s) {}
+
+  int operator() (const int i) const {
+    return min(SAH_BINS - 1, (int)((centroid(*bounds, i, axis) - lo) * scale));
+  }
+};
+
+struct BinBelow {
+  CentroidBin bin;
+  int split;
+
+  BinBelow(const CentroidBin& b, const int s) : bin(b), split(s) {}
+
+  bool operator() (const int i) const {
+    return bin(i) < split;
+  }
+};
+}
+
+void RayTracer::buildBvh(const vector<float>& bounds, const int maxLeaf,
+                         vector<BvhNode>& nodes, vector<int>& order) {
+  const int n = (int)bounds.size() / 6;
+  nodes.clear();
+  order.resize(n);
+  for (int i = 0; i < n; ++i) {
+    order[i] = i;
+  }
+  if (n == 0)
+    return;
+
+  vector<BuildItem> stack(1, BuildItem(0, 0, n));
+  nodes.resize(1);
+  while (!stack.empty()) {
+    const BuildItem item = stack.back();
+    stack.pop_back();
+
+    Box box, centroids;
+    for (int k = item.first; k < item.first + item.count; ++k) {
+      const int i = order[k];
+      box.grow(&bounds[6 * i], &bounds[6 * i + 3]);
+      const float c[3] = {centroid(bounds, i, 0), centroid(bounds, i, 1), centroid(bounds, i, 2)};
+      centroids.grow(c, c);
+    }
+    BvhNode& node = nodes[item.node];
+    for (int a = 0; a < 3; ++a) {
+      node.lo[a] = box.lo[a];
+      node.hi[a] = box.hi[a];
+    }
+    node.first = item.first;
+    node.count = (short)item.count;
+    node.axis = 0;
+    if (item.count <= maxLeaf)
+      continue;
+
+    int axis = 0;
+    for (int a = 1; a < 3; ++a) {
+      if (centroids.hi[a] - centroids.lo[a] > centroids.hi[axis] - centroids.lo[axis])
+        axis = a;
+    }
+    const float extent = centroids.hi[axis] - centroids.lo[axis];
+
+    int mid;
+    if (extent > 0) {
+      // Sweep the bins from both ends for the split of least area times
+      // primitives; keep the leaf if that costs more than testing them all
+      const CentroidBin bin(bounds, axis, centroids.lo[axis], SAH_BINS / extent);
+      Box binBox[SAH_BINS];
+      int binCount[SAH_BINS] = {0};
+      for (int k = item.first; k < item.first + item.count; ++k) {
+        const int i = order[k], b = bin(i);
+        binBox[b].grow(&bounds[6 * i], &bounds[6 * i + 3]);
+        ++binCount[b];
+      }
+      float rightArea[SAH_BINS];
+      int rightCount[SAH_BINS];
+      Box right;
+      for (int b = SAH_BINS - 1, count = 0; b > 0; --b) {
+        right.grow(binBox[b]);
+        count += binCount[b];
+        rightArea[b] = right.area();
+        rightCount[b] = count;
+      }
+      Box left;
+      int leftCount = 0, best = -1;
+      float bestCost = 0;
+      for (int b = 1; b < SAH_BINS; ++b) {
+        left.grow(binBox[b - 1]);
+        leftCount += binCount[b - 1];
+        if (leftCount == 0 || rightCount[b] == 0)
+          continue;
+        const float cost = left.area() * leftCount + rightArea[b] * rightCount[b];
+        if (best < 0 || cost < bestCost) {
+          best = b;
+          bestCost = cost;
+        }
+      }
+      if (best < 0) {
+        mid = item.first + item.count / 2;
+      } else {
+        if (bestCost >= (item.count - 1) * box.area() && item.count <= MAX_LEAF_HARD)
+          continue;
+        mid = (int)(std::partition(&order[item.first], &order[item.first] + item.count,
+                                   BinBelow(bin, best)) - &order[0]);
+      }
+    } else {
+      // All centroids in one place: any split is as good as another
+      if (item.count <= MAX_LEAF_HARD)
+        continue;
+      mid = item.first + item.count / 2;
+    }
+
+    const int child = (int)nodes.size();
+    nodes.resize(child + 2);
+    nodes[item.node].first = child;
+    nodes[item.node].count = 0;
+    nodes[item.node].axis = (short)axis;
+    stack.push_back(BuildItem(child + 1, mid, item.first + item.count - mid));
+    stack.push_back(BuildItem(child, item.first, mid - item.first));
+  }
+}
+
+// --------- Packet traversal
+
+// Bit i set where ray i crosses the box within [tMin, tMax]. Slab distances
+// are (plane - origin) / dir, computed as plane * invDir - origin * invDir.
+static inline int boxLanes(const float lo[3], const float hi[3], const Vec3Lanes& invDir,
+                           const Vec3Lanes& originInvDir, const Cvec4f& tMin, const Cvec4f& tMax) {
+  const Cvec4f x0 = invDir.x * lo[0] - originInvDir.x, x1 = invDir.x * hi[0] - originInvDir.x;
+  const Cvec4f y0 = invDir.y * lo[1] - originInvDir.y, y1 = invDir.y * hi[1] - originInvDir.y;
+  const Cvec4f z0 = invDir.z * lo[2] - originInvDir.z, z1 = invDir.z * hi[2] - originInvDir.z;
+  const Cvec4f enter = maxLanes(maxLanes(minLanes(x0, x1), minLanes(y0, y1)), maxLanes(minLanes(z0, z1), tMin));
+  const Cvec4f leave = minLanes(minLanes(maxLanes(x0, x1), maxLanes(y0, y1)), minLanes(maxLanes(z0, z1), tMax));
+  return greaterLanes(leave, enter, true);
+}
+
+static inline const Cvec4f& laneAxis(const Vec3Lanes& v, const int axis) {
+  return axis == 0 ? v.x : axis == 1 ? v.y : v.z;
+}
+
+// Sets the ray's inverse directions and their products with its origin.
+// Zero direction components get +-NO_HIT rather than infinity, so slab
+// distances stay finite.
+static inline void setInverse(const Vec3Lanes& origin, const Vec3Lanes& dir,
+                              Vec3Lanes& invDir, Vec3Lanes& originInvDir) {
+  const Cvec4f one(1), lo(-NO_HIT), hi(NO_HIT);
+  invDir.x = minLanes(maxLanes(divLanes(one, dir.x), lo), hi);
+  invDir.y = minLanes(maxLanes(divLanes(one, dir.y), lo), hi);
+  invDir.z = minLanes(maxLanes(divLanes(one, dir.z), lo), hi);
+  originInvDir.x = mulLanes(origin.x, invDir.x);
+  originInvDir.y = mulLanes(origin.y, invDir.y);
+  originInvDir.z = mulLanes(origin.z, invDir.z);
+}
+
+static inline int firstLane(const int bits) {
+  int lane = 0;
+  while (!(bits >> lane & 1)) {
+    ++lane;
+  }
+  return lane;
+}
+
+void RayTracer::traceScene(const RayLanes& ray, int active, const bool anyHit, HitLanes& hit) const {
+  if (nodes_.empty())
+    return;
+  int stack[MAX_STACK];
+  int top = 0;
+  stack[top++] = 0;
+  while (top > 0) {
+    const BvhNode& node = nodes_[stack[--top]];
+    if (node.count == 0) {
+      // Push the children the rays enter, the nearer one last so it is
+      // visited first, as seen by the first active ray
+      const BvhNode& a = nodes_[node.first], & b = nodes_[node.first + 1];
+      const int enterA = boxLanes(a.lo, a.hi, ray.invDir, ray.originInvDir, ray.tMin, hit.t) & active;
+      const int enterB = boxLanes(b.lo, b.hi, ray.invDir, ray.originInvDir, ray.tMin, hit.t) & active;
+      assert(top + 2 <= MAX_STACK);
+      if (enterA && enterB) {
+        const bool forward = laneAxis(ray.dir, node.axis)[firstLane(active)] > 0;
+        stack[top++] = forward ? node.first + 1 : node.first;
+        stack[top++] = forward ? node.first : node.first + 1;
+      } else if (enterA) {
+        stack[top++] = node.first;
+      } else if (enterB) {
+        stack[top++] = node.first + 1;
+      }
+      continue;
+    }
+    // Hits found since the leaf was pushed may have moved past it
+    if (!(boxLanes(node.lo, node.hi, ray.invDir, ray.originInvDir, ray.tMin, hit.t) & active))
+      continue;
+
+    for (int k = node.first; k < node.first + node.count; ++k) {
+      // The rays in the instance's object space. The transform is affine, so
+      // distances along them stay those in world space.
+      const Instance& in = instances_[k];
+      const float *m = in.toObject;
+      RayLanes local;
+      local.origin.x = ray.origin.x * m[0] + ray.origin.y * m[1] + ray.origin.z * m[2] + Cvec4f(m[3]);
+      local.origin.y = ray.origin.x * m[4] + ray.origin.y * m[5] + ray.origin.z * m[6] + Cvec4f(m[7]);
+      local.origin.z = ray.origin.x * m[8] + ray.origin.y * m[9] + ray.origin.z * m[10] + Cvec4f(m[11]);
+      local.dir.x = ray.dir.x * m[0] + ray.dir.y * m[1] + ray.dir.z * m[2];
+      local.dir.y = ray.dir.x * m[4] + ray.dir.y * m[5] + ray.dir.z * m[6];
+      local.dir.z = ray.dir.x * m[8] + ray.dir.y * m[9] + ray.dir.z * m[10];
+      setInverse(local.origin, local.dir, local.invDir, local.originInvDir);
+      local.tMin = ray.tMin;
+      traceMesh(meshes_[in.mesh], local, active, anyHit, k, hit);
+      if (!active)
+        return;
+    }
+  }
+}
+
+void RayTracer::traceMesh(const Mesh& mesh, const RayLanes& ray, int& active, const bool anyHit,
+                          const int instance, HitLanes& hit) const {
+  int stack[MAX_STACK];
+  int top = 0;
+  stack[top++] = 0;
+  while (top > 0) {
+    const BvhNode& node = mesh.nodes[stack[--top]];
+    if (node.count == 0) {
+      // Push the children the rays enter, the nearer one last so it is
+      // visited first, as seen by the first active ray
+      const BvhNode& a = mesh.nodes[node.first], & b = mesh.nodes[node.first + 1];
+      const int enterA = boxLanes(a.lo, a.hi, ray.invDir, ray.originInvDir, ray.tMin, hit.t) & active;
+      const int enterB = boxLanes(b.lo, b.hi, ray.invDir, ray.originInvDir, ray.tMin, hit.t) & active;
+      assert(top + 2 <= MAX_STACK);
+      if (enterA && enterB) {
+        const bool forward = laneAxis(ray.dir, node.axis)[firstLane(active)] > 0;
+        stack[top++] = forward ? node.first + 1 : node.first;
+        stack[top++] = forward ? node.first : node.first + 1;
+      } else if (enterA) {
+        stack[top++] = node.first;
+      } else if (enterB) {
+        stack[top++] = node.first + 1;
+      }
+      continue;
+    }
+    // Hits found since the leaf was pushed may have moved past it
+    if (!(boxLanes(node.lo, node.hi, ray.invDir, ray.originInvDir, ray.tMin, hit.t) & active))
+      continue;
+
+    for (int k = node.first; k < node.first + node.count; ++k) {
+      // Moller-Trumbore, four rays against one triangle
+      const MeshTriangle& tri = mesh.triangles[k];
+      Vec3Lanes e1, e2, s;
+      e1.x = Cvec4f(tri.e1[0]), e1.y = Cvec4f(tri.e1[1]), e1.z = Cvec4f(tri.e1[2]);
+      e2.x = Cvec4f(tri.e2[0]), e2.y = Cvec4f(tri.e2[1]), e2.z = Cvec4f(tri.e2[2]);
+      s.x = ray.origin.x - Cvec4f(tri.v0[0]);
+      s.y = ray.origin.y - Cvec4f(tri.v0[1]);
+      s.z = ray.origin.z - Cvec4f(tri.v0[2]);
+      const Vec3Lanes p = crossLanes(ray.dir, e2), q = crossLanes(s, e1);
+      const Cvec4f invDet = divLanes(Cvec4f(1), dotLanes(e1, p));
+      const Cvec4f u = mulLanes(dotLanes(s, p), invDet);
+      const Cvec4f v = mulLanes(dotLanes(ray.dir, q), invDet);
+      const Cvec4f t = mulLanes(dotLanes(e2, q), invDet);
+      const int bits = active & greaterLanes(u, Cvec4f(0), true) & greaterLanes(v, Cvec4f(0), true) &
+        greaterLanes(Cvec4f(1), u + v, true) & greaterLanes(t, ray.tMin, false) & greaterLanes(hit.t, t, false);
+      if (!bits)
+        continue;
+      for (int l = 0; l < 4; ++l) {
+        if (bits >> l & 1) {
+          hit.t[l] = t[l], hit.u[l] = u[l], hit.v[l] = v[l];
+          hit.instance[l] = instance;
+          hit.triangle[l] = k;
+        }
+      }
+      if (anyHit) {
+        active &= ~bits;
+        if (!active)
+          return;
+      }
+    }
+  }
+}
+
+// --------- RayTracer
+
+RayTracer::RayTracer(JobSystem& js, const int width, const int height, const int tileSize)
+  : js_(js), width_(width), height_(height), tileSize_(tileSize),
+    tilesX_((width + tileSize - 1) / tileSize), tilesY_((height + tileSize - 1) / tileSize),
+    image_(width, height), meshes_(NUM_GEOMETRIES), origin_(0, 0, 0),
+    clearColor_(128.f / 255, 200.f / 255, 1), shadowRays_(0) {
+  assert(tileSize % 2 == 0);
+}
+
+void RayTracer::setMesh(const int geometry, const vector<RasterVertex>& vertices,
+                        const vector<unsigned short>& indices) {
+  if (geometry >= (int)meshes_.size())
+    meshes_.resize(geometry + 1);
+  Mesh& mesh = meshes_[geometry];
+  mesh.vertices = vertices;
+
+  const int n = (int)indices.size() / 3;
+  vector<float> bounds(6 * n);
+  for (int t = 0; t < n; ++t) {
+    for (int a = 0; a < 3; ++a) {
+      const float c0 = vertices[indices[3 * t]].p[a], c1 = vertices[indices[3 * t + 1]].p[a],
+        c2 = vertices[indices[3 * t + 2]].p[a];
+      bounds[6 * t + a] = min(c0, min(c1, c2));
+      bounds[6 * t + 3 + a] = max(c0, max(c1, c2));
+    }
+  }
+  vector<int> order;
+  buildBvh(bounds, 4, mesh.nodes, order);
+
+  mesh.triangles.resize(n);
+  for (int k = 0; k < n; ++k) {
+    MeshTriangle& tri = mesh.triangles[k];
+    const unsigned short *index = &indices[3 * order[k]];
+    const Cvec3f& v0 = vertices[index[0]].p, & v1 = vertices[index[1]].p, & v2 = vertices[index[2]].p;
+    for (int a = 0; a < 3; ++a) {
+      tri.v0[a] = v0[a];
+      tri.e1[a] = v1[a] - v0[a];
+      tri.e2[a] = v2[a] - v0[a];
+      tri.index[a] = index[a];
+    }
+  }
+}
+
+void RayTracer::build(const SceneStore& scene, const Cvec3& origin) {
+  ProfileScope scope("ray trace build");
+  const long long t0 = nowNanos();
+  origin_ = origin;
+
+  vector<Instance> instances;
+  vector<float> bounds;
+  instances.reserve(scene.size());
+  bounds.reserve(6 * scene.size());
+  for (int slot = 0; slot < scene.numSlots(); ++slot) {
+    if (!scene.isAlive(slot))
+      continue;
+    const int g = scene.geometry(slot);
+    if (g >= (int)meshes_.size() || meshes_[g].nodes.empty())
+      continue;
+
+    const RigTForm& world = scene.world(slot);
+    const Matrix4 toWorld = rigTFormToMatrix(RigTForm(world.getTranslation() - origin, world.getRotation())) *
+      Matrix4::makeScale(scene.scale(slot));
+    const Matrix4 toObject = inv(toWorld);
+    Instance in;
+    for (int r = 0; r < 3; ++r) {
+      for (int c = 0; c < 4; ++c) {
+        in.toObject[4 * r + c] = (float)toObject(r, c);
+      }
+      in.color[r] = scene.color(slot)[r];
+    }
+    in.mesh = g;
+    instances.push_back(in);
+
+    // World bounds of the corners of the mesh's bounds
+    const BvhNode& root = meshes_[g].nodes[0];
+    Box box;
+    for (int corner = 0; corner < 8; ++corner) {
+      const Cvec4 p = toWorld * Cvec4(corner & 1 ? root.hi[0] : root.lo[0], corner & 2 ? root.hi[1] : root.lo[1],
+                                      corner & 4 ? root.hi[2] : root.lo[2], 1);
+      const float f[3] = {(float)p[0], (float)p[1], (float)p[2]};
+      box.grow(f, f);
+    }
+    bounds.insert(bounds.end(), box.lo, box.lo + 3);
+    bounds.insert(bounds.end(), box.hi, box.hi + 3);
+  }
+
+  vector<int> order;
+  buildBvh(bounds, 1, nodes_, order);
+  instances_.resize(order.size());
+  for (size_t k = 0; k < order.size(); ++k) {
+    instances_[k] = instances[order[k]];
+  }
+
+  stats_ = RayTraceStats();
+  stats_.instances = (int)instances_.size();
+  stats_.instanceNodes = (int)nodes_.size();
+  stats_.buildNanos = nowNanos() - t0;
+}
+
+void RayTracer::render(const RayTraceView& view) {
+  ProfileScope scope("ray trace");
+  const Matrix4 eye = rigTFormToMatrix(view.eye);
+  const double tanHalf = std::tan(view.fovy * CS175_PI / 360), aspect = width_ / (double)height_;
+  const Cvec3 eyePos = view.eye.getTranslation() - origin_;
+  const Cvec3 light1 = view.light1 - origin_, light2 = view.light2 - origin_;
+  for (int a = 0; a < 3; ++a) {
+    eye_[a] = (float)eyePos[a];
+    forward_[a] = (float)-eye(a, 2);
+    right_[a] = (float)(eye(a, 0) * tanHalf * aspect);
+    up_[a] = (float)(eye(a, 1) * tanHalf);
+    light_[0][a] = (float)light1[a];
+    light_[1][a] = (float)light2[a];
+  }
+  shadowRays_ = 0;
+
+  const long long t0 = nowNanos();
+  js_.parallelFor(0, tilesX_ * tilesY_, 1, traceJob, this);
+  stats_.traceNanos = nowNanos() - t0;
+  stats_.primaryRays = (long long)width_ * height_;
+  stats_.shadowRays = shadowRays_;
+}
+
+void RayTracer::traceJob(int begin, int end, void *data) {
+  ProfileScope scope("trace tiles");
+  RayTracer& r = *static_cast<RayTracer*>(data);
+  long long shadowRays = 0;
+  for (int tile = begin; tile < end; ++tile) {
+    r.traceTile(tile, shadowRays);
+  }
+  __sync_fetch_and_add(&r.shadowRays_, shadowRays);
+}
+
+void RayTracer::traceTile(const int tile, long long& shadowRays) {
+  const int x0 = (tile % tilesX_) * tileSize_, y0 = (tile / tilesX_) * tileSize_;
+  const int x1 = min(width_, x0 + tileSize_), y1 = min(height_, y0 + tileSize_);
+
+  unsigned char clear[4];
+  for (int c = 0; c < 3; ++c) {
+    clear[c] = (unsigned char)(min(max(clearColor_[c], 0.f), 1.f) * 255 + 0.5f);
+  }
+  clear[3] = 255;
+
+  for (int y = y0; y < y1; y += 2) {
+    for (int x = x0; x < x1; x += 2) {
+      // Lane l is pixel (x + l % 2, y + l / 2)
+      RayLanes ray;
+      int active = 0;
+      for (int l = 0; l < 4; ++l) {
+        const int px = x + (l & 1), py = y + (l >> 1);
+        if (px < width_ && py < height_)
+          active |= 1 << l;
+        const float sx = 2 * (px + 0.5f) / width_ - 1, sy = 2 * (py + 0.5f) / height_ - 1;
+        ray.dir.x[l] = forward_[0] + right_[0] * sx + up_[0] * sy;
+        ray.dir.y[l] = forward_[1] + right_[1] * sx + up_[1] * sy;
+        ray.dir.z[l] = forward_[2] + right_[2] * sx + up_[2] * sy;
+      }
+      ray.origin.x = Cvec4f(eye_[0]);
+      ray.origin.y = Cvec4f(eye_[1]);
+      ray.origin.z = Cvec4f(eye_[2]);
+      setInverse(ray.origin, ray.dir, ray.invDir, ray.originInvDir);
+      ray.tMin = Cvec4f(0);
+      HitLanes hit;
+      hit.t = Cvec4f(NO_HIT);
+      for (int l = 0; l < 4; ++l) {
+        hit.instance[l] = hit.triangle[l] = -1;
+      }
+      traceScene(ray, active, false, hit);
+
+      // World position and interpolated normal of the hits. Normals go to
+      // world space through the transpose of the world to object transform.
+      int hitBits = 0;
+      Vec3Lanes pos, n;
+      n.z = Cvec4f(1);
+      for (int l = 0; l < 4; ++l) {
+        if (!(active >> l & 1) || hit.instance[l] < 0)
+          continue;
+        hitBits |= 1 << l;
+        const Instance& in = instances_[hit.instance[l]];
+        const Mesh& mesh = meshes_[in.mesh];
+        const MeshTriangle& tri = mesh.triangles[hit.triangle[l]];
+        const float u = hit.u[l], v = hit.v[l];
+        const Cvec3f on = mesh.vertices[tri.index[0]].n * (1 - u - v) + mesh.vertices[tri.index[1]].n * u +
+          mesh.vertices[tri.index[2]].n * v;
+        const float *m = in.toObject;
+        n.x[l] = m[0] * on[0] + m[4] * on[1] + m[8] * on[2];
+        n.y[l] = m[1] * on[0] + m[5] * on[1] + m[9] * on[2];
+        n.z[l] = m[2] * on[0] + m[6] * on[1] + m[10] * on[2];
+        pos.x[l] = ray.origin.x[l] + hit.t[l] * ray.dir.x[l];
+        pos.y[l] = ray.origin.y[l] + hit.t[l] * ray.dir.y[l];
+        pos.z[l] = ray.origin.z[l] + hit.t[l] * ray.dir.z[l];
+      }
+
+      Cvec4f intensity(0);
+      if (hitBits) {
+        n.normalize();
+        for (int k = 0; k < 2; ++k) {
+          // Shadow rays run from the hit to the light, t in (SHADOW_BIAS, 1)
+          RayLanes shadow;
+          shadow.origin = pos;
+          shadow.dir.x = Cvec4f(light_[k][0]) - pos.x;
+          shadow.dir.y = Cvec4f(light_[k][1]) - pos.y;
+          shadow.dir.z = Cvec4f(light_[k][2]) - pos.z;
+          Vec3Lanes toLight = shadow.dir;
+          toLight.normalize();
+          Cvec4f diffuse = maxLanes(dotLanes(n, toLight), Cvec4f(0));
+          const int lit = hitBits & greaterLanes(diffuse, Cvec4f(0), false);
+          if (!lit)
+            continue;
+          setInverse(shadow.origin, shadow.dir, shadow.invDir, shadow.originInvDir);
+          shadow.tMin = Cvec4f(SHADOW_BIAS);
+          HitLanes blocker;
+          blocker.t = Cvec4f(1);
+          for (int l = 0; l < 4; ++l) {
+            blocker.instance[l] = blocker.triangle[l] = -1;
+          }
+          traceScene(shadow, lit, true, blocker);
+          for (int l = 0; l < 4; ++l) {
+            if (lit >> l & 1) {
+              ++shadowRays;
+              if (blocker.instance[l] >= 0)
+                diffuse[l] = 0;
+            }
+          }
+          intensity += diffuse;
+        }
+      }
+
+      for (int l = 0; l < 4; ++l) {
+        if (!(active >> l & 1))
+          continue;
+        unsigned char *out = image_.pixel(x + (l & 1), y + (l >> 1));
+        if (!(hitBits >> l & 1)) {
+          memcpy(out, clear, 4);
+          continue;
+        }
+        const float *color = instances_[hit.instance[l]].color;
+        for (int c = 0; c < 3; ++c) {
+          out[c] = (unsigned char)(min(color[c] * intensity[l], 1.f) * 255 + 0.5f);
+        }
+        out[3] = 255;
+      }
+    }
+  }
+}
+
+void setViewerMeshes(RayTracer& r, const float groundY, const float groundSize) {
+  vector<RasterVertex> vtx;
+  vector<unsigned short> idx;
+  for (int g = 0; g < NUM_GEOMETRIES; ++g) {
+    makeViewerMesh(g, groundY, groundSize, vtx, idx);
+    r.setMesh(g, vtx, idx);
+  }
+}
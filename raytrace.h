@@ -0,0 +1,162 @@
+#ifndef RAYTRACE_H
+#define RAYTRACE_H
+
+#include <vector>
+
+#include "cvec.h"
+#include "rigtform.h"
+#include "jobsystem.h"
+#include "scenestore.h"
+#include "image.h"
+#include "lanes.h"
+#include "softraster.h"
+
+//--------------------------------------------------------------------------------
+// CPU ray tracer for offline stills of a SceneStore. Acceleration is two
+// level: every mesh gets a bounding volume hierarchy (BVH) of its triangles
+// in its own frame, built once, and the scene gets a BVH over its nodes,
+// each an instance of one mesh under the node's world transform and scale.
+// The cube mesh is stored once however many nodes draw it, and a changed
+// scene only needs the instance level rebuilt.
+//
+// Every pixel casts a primary ray and, from what it hits, a shadow ray to
+// each of the two point lights. Shading is that of the diffuse shader with
+// exact shadows in place of shadow maps. Rays travel in packets of four, the
+// 2x2 pixels of a quad, through both levels: boxes and triangles are tested
+// against all four rays at once in SSE lanes, and a node is entered when any
+// of them hits it. The image is split in tiles traced as jobs, which idle
+// threads of the job system steal from each other.
+//--------------------------------------------------------------------------------
+
+// Camera and lights of a ray traced image, in world space
+struct RayTraceView {
+  RigTForm eye;
+  double fovy;                   // vertical field of view in degrees
+  Cvec3 light1, light2;
+
+  RayTraceView() : fovy(60) {}
+};
+
+// Counters and timings of the last build and render
+struct RayTraceStats {
+  int instances;
+  int instanceNodes;             // nodes of the instance BVH
+  long long primaryRays, shadowRays;
+  long long buildNanos, traceNanos;
+
+  RayTraceStats()
+    : instances(0), instanceNodes(0), primaryRays(0), shadowRays(0), buildNanos(0), traceNanos(0) {}
+};
+
+class RayTracer {
+public:
+  // Renders width x height images with the given job system, tracing
+  // tileSize pixels square tiles as jobs; tileSize must be even.
+  RayTracer(JobSystem& js, const int width, const int height, const int tileSize = 16);
+
+  // Mesh instanced for nodes of the given GeometryId, as an indexed triangle
+  // list. Builds its BVH.
+  void setMesh(const int geometry, const std::vector<RasterVertex>& vertices,
+               const std::vector<unsigned short>& indices);
+
+  void setClearColor(const Cvec3f& color) {
+    clearColor_ = color;
+  }
+
+  // Builds the instance BVH over the scene's live nodes; world transforms
+  // must be current. Instances are placed relative to origin, subtracted in
+  // double precision like camera relative model view matrices, so pass a
+  // point near the camera for scenes far from the world origin.
+  void build(const SceneStore& scene, const Cvec3& origin);
+
+  // Traces the scene of the last build
+  void render(const RayTraceView& view);
+
+  // RGBA, rows bottom to top
+  const Image& image() const {
+    return image_;
+  }
+
+  const RayTraceStats& stats() const {
+    return stats_;
+  }
+
+private:
+  // Bounds of a subtree. Inner nodes have two children, first and first + 1,
+  // split along axis; leaves hold count primitives from first on.
+  struct BvhNode {
+    float lo[3], hi[3];
+    int first;
+    short count;
+    short axis;
+  };
+
+  // Triangle ready for intersection: a corner and the edges from it, and the
+  // vertex indices for interpolating normals
+  struct MeshTriangle {
+    float v0[3], e1[3], e2[3];
+    unsigned short index[3];
+  };
+
+  struct Mesh {
+    std::vector<RasterVertex> vertices;
+    std::vector<MeshTriangle> triangles;   // in BVH leaf order
+    std::vector<BvhNode> nodes;
+  };
+
+  // World to object transform, rows of a 3x4 matrix, and the node's look
+  struct Instance {
+    float toObject[12];
+    int mesh;
+    float color[3];
+  };
+
+  // Four rays, one per lane, and the part of each that counts as a hit.
+  // invDir and originInvDir speed up box tests.
+  struct RayLanes {
+    Vec3Lanes origin, dir, invDir, originInvDir;
+    Cvec4f tMin;
+  };
+
+  // Nearest hit per lane so far: t along the ray, the instance and triangle
+  // hit (-1 for none) and the barycentric coordinates of the hit on it
+  struct HitLanes {
+    Cvec4f t, u, v;
+    int instance[4], triangle[4];
+  };
+
+  JobSystem& js_;
+  int width_, height_, tileSize_, tilesX_, tilesY_;
+  Image image_;
+  std::vector<Mesh> meshes_;
+  std::vector<Instance> instances_;      // in BVH leaf order
+  std::vector<BvhNode> nodes_;
+  Cvec3 origin_;
+  Cvec3f clearColor_;
+  RayTraceStats stats_;
+
+  // View of the image being rendered, relative to origin_, read by the jobs
+  Cvec3f eye_, forward_, right_, up_;   // right and up reach the image edges at distance 1
+  Cvec3f light_[2];
+  long long shadowRays_;
+
+  // Builds a BVH over primitives with the given bounds, six floats (lo,
+  // hi) each, with at most maxLeaf per leaf where the surface area heuristic
+  // allows. order receives the primitives in leaf order.
+  static void buildBvh(const std::vector<float>& bounds, const int maxLeaf,
+                       std::vector<BvhNode>& nodes, std::vector<int>& order);
+
+  static void traceJob(int begin, int end, void *data);
+  void traceTile(const int tile, long long& shadowRays);
+  void traceScene(const RayLanes& ray, int active, const bool anyHit, HitLanes& hit) const;
+  void traceMesh(const Mesh& mesh, const RayLanes& ray, int& active, const bool anyHit,
+                 const int instance, HitLanes& hit) const;
+
+  RayTracer(const RayTracer&);
+  const RayTracer& operator= (const RayTracer&);
+};
+
+// Gives the ray tracer the viewer's meshes, see makeViewerMesh()
+void setViewerMeshes(RayTracer& r, const float groundY, const float groundSize);
+
+#endif
@@ -0,0 +1,81 @@
+#include <cstring>
+#include <stdexcept>
+
+#include "glsupport.h"
+#include "image.h"
+#include "readback.h"
+
+using namespace std;
+
+OffscreenTarget::OffscreenTarget(const int width, const int height)
+  : width_(width), height_(height) {
+  glBindRenderbuffer(GL_RENDERBUFFER, color_);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+  color_.setLabel("offscreen color");
+  glBindRenderbuffer(GL_RENDERBUFFER, depth_);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+  depth_.setLabel("offscreen depth");
+  glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo_);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color_);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth_);
+  const GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  if (status != GL_FRAMEBUFFER_COMPLETE)
+    throw runtime_error("offscreen framebuffer is incomplete");
+  fbo_.setLabel("offscreen");
+  checkGlErrors();
+}
+
+void OffscreenTarget::blitToWindow() const {
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo_);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+  glBlitFramebuffer(0, 0, width_, height_, 0, 0, width_, height_, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+PixelReadback::PixelReadback(const int width, const int height)
+  : width_(width), height_(height), next_(0), pending_(0) {
+  GlStateCache& gl = glState();
+  for (int i = 0; i < 2; ++i) {
+    gl.bindBuffer(GL_PIXEL_PACK_BUFFER, pbos_[i]);
+    glBufferData(GL_PIXEL_PACK_BUFFER, width * height * 4, NULL, GL_STREAM_READ);
+    pbos_[i].setLabel("readback");
+  }
+  gl.bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  checkGlErrors();
+}
+
+void PixelReadback::request() {
+  if (pending_ == 2)
+    throw runtime_error("PixelReadback: two requests are already outstanding");
+  GlStateCache& gl = glState();
+  gl.bindBuffer(GL_PIXEL_PACK_BUFFER, pbos_[next_]);
+  glReadPixels(0, 0, width_, height_, GL_RGBA, GL_UNSIGNED_BYTE, NULL);   // offset 0 into the buffer
+  gl.bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  next_ ^= 1;
+  ++pending_;
+}
+
+bool PixelReadback::collect(Image& img) {
+  if (pending_ == 0)
+    return false;
+  const int oldest = (next_ + 2 - pending_) & 1;
+  --pending_;
+
+  img = Image(width_, height_);
+  GlStateCache& gl = glState();
+  gl.bindBuffer(GL_PIXEL_PACK_BUFFER, pbos_[oldest]);
+  const void *src = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+  if (!src) {
+    gl.bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    throw runtime_error("PixelReadback: cannot map the pixel buffer");
+  }
+  memcpy(&img.pixels[0], src, img.bytes());
+  const bool intact = glUnmapBuffer(GL_PIXEL_PACK_BUFFER) == GL_TRUE;
+  gl.bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  if (!intact)
+    throw runtime_error("PixelReadback: pixel buffer was lost while mapped");
+  return true;
+}
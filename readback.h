@@ -0,0 +1,74 @@
+#ifndef READBACK_H
+#define READBACK_H
+
+#include "glsupport.h"
+#include "image.h"
+
+//--------------------------------------------------------------------------------
+// Offscreen rendering and framebuffer readback, for comparing rendered
+// frames against golden images without a visible window in the loop.
+//
+// Reading pixels straight into client memory makes glReadPixels wait until
+// the GPU has finished the frame. PixelReadback reads into one of two pixel
+// buffer objects instead, which returns at once, and maps the buffer later,
+// by when the copy has normally completed, so frames keep streaming while
+// the previous one is read back.
+//--------------------------------------------------------------------------------
+
+// Color (8 bit RGBA) and depth framebuffer of a fixed size. Needs framebuffer
+// objects (GL 3.0 or ARB_framebuffer_object); throws runtime_error if the
+// framebuffer is incomplete.
+class OffscreenTarget : Noncopyable {
+public:
+  OffscreenTarget(const int width, const int height);
+
+  int width() const {
+    return width_;
+  }
+
+  int height() const {
+    return height_;
+  }
+
+  // For glBindFramebuffer
+  GLuint framebuffer() const {
+    return fbo_;
+  }
+
+  // Copies the color buffer to the lower left corner of the window's back
+  // buffer, so a run can be watched
+  void blitToWindow() const;
+
+private:
+  int width_, height_;
+  GlRenderbufferObject color_, depth_;
+  GlFramebufferObject fbo_;
+};
+
+// Asynchronous readback of width x height pixels from the lower left corner
+// of the framebuffer bound for reading, through two pixel buffer objects
+class PixelReadback : Noncopyable {
+public:
+  PixelReadback(const int width, const int height);
+
+  // Requests still to be collected, at most 2
+  int pending() const {
+    return pending_;
+  }
+
+  // Starts copying the pixels into the next buffer. At most two requests
+  // may be outstanding.
+  void request();
+
+  // Waits for the oldest outstanding request, if it has not completed yet,
+  // and copies its pixels into img: RGBA, rows bottom to top. Returns false
+  // if nothing was requested.
+  bool collect(Image& img);
+
+private:
+  int width_, height_;
+  GlBufferObject pbos_[2];
+  int next_, pending_;
+};
+
+#endif
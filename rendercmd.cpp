@@ -0,0 +1,52 @@
+#include <ostream>
+
+#include "cvec.h"
+#include "matrix4.h"
+#include "matrix4f.h"
+#include "timer.h"
+#include "rendercmd.h"
+
+using namespace std;
+
+ostream& operator << (ostream& os, const RenderStats& stats) {
+  return os << "frame " << stats.frame
+            << ": " << stats.packets << " packets"
+            << ", " << stats.culled << " culled"
+            << " (" << stats.occluded << " occluded)"
+            << ", objects " << stats.recomputed << " recomputed / " << stats.reused << " reused"
+            << ", " << stats.skipped << " frames skipped"
+            << (stats.prebuilt ? ", prebuilt" : "")
+            << ", build " << nanosToMillis(stats.buildNanos) << " ms"
+            << ", submit " << nanosToMillis(stats.submitNanos) << " ms"
+            << ", gl state calls " << stats.glCallsIssued << " issued / "
+            << stats.glCallsElided << " elided"
+            << ", shadow casters " << stats.shadowCastersDrawn << " drawn, "
+            << stats.shadowStaticRedraws << " cached maps redrawn"
+            << ", textures " << stats.texturesResident << " resident ("
+            << stats.textureBytesResident / 1024 << " KiB), "
+            << stats.textureBytesUploaded / 1024 << " KiB uploaded";
+}
+
+void writeDrawPacket(DrawPacket& p, const int geometry, const int shader,
+                     const Matrix4& MVM, const Cvec3f& color) {
+  p.geometry = geometry;
+  p.shader = shader;
+  p.texture = -1;
+  MVM.writeToColumnMajorMatrix(p.mvm);
+  normalMatrix(MVM).writeToColumnMajorMatrix(p.nmvm);
+  for (int i = 0; i < 3; ++i) {
+    p.color[i] = color[i];
+  }
+}
+
+void writeDrawPacket(DrawPacket& p, const int geometry, const int shader,
+                     const Matrix4f& MVM, const Cvec3f& color) {
+  p.geometry = geometry;
+  p.shader = shader;
+  p.texture = -1;
+  MVM.writeToColumnMajorMatrix(p.mvm);
+  normalMatrix(MVM).writeToColumnMajorMatrix(p.nmvm);
+  for (int i = 0; i < 3; ++i) {
+    p.color[i] = color[i];
+  }
+}
@@ -0,0 +1,170 @@
+#ifndef RENDERCMD_H
+#define RENDERCMD_H
+
+#include <vector>
+#include <algorithm>
+#include <cassert>
+#include <iosfwd>
+#if __GNUG__
+#   include <tr1/memory>
+#endif
+
+#include "cvec.h"
+#include "matrix4.h"
+#include "matrix4f.h"
+
+//--------------------------------------------------------------------------------
+// Render command layer: scene traversal writes compact draw packets into a
+// RenderQueue and a backend (see object-scene-test.cpp) turns them into GL
+// calls. Nothing in here touches GL, so packets can be built on any thread.
+//--------------------------------------------------------------------------------
+
+// Ids understood by the backend when it looks up geometry and shaders
+enum GeometryId {
+  GEOMETRY_GROUND = 0,
+  GEOMETRY_CUBE,
+  GEOMETRY_SPHERE,
+  NUM_GEOMETRIES
+};
+
+// One draw call worth of state. Plain old data so it can be memcpy'd and
+// written from worker threads. Matrices are column-major, ready for
+// glUniformMatrix4fv.
+struct DrawPacket {
+  unsigned short geometry;
+  unsigned short shader;
+  short texture;         // TextureId bound to unit 0, -1 for none
+  float mvm[16];
+  float nmvm[16];
+  float color[3];
+};
+
+// Shadow maps a frame may use: one per point light, or the cascades of
+// the directional light
+enum {
+  MAX_SHADOW_MAPS = 3
+};
+
+// Per-frame state shared by every packet of a queue
+struct FrameGlobals {
+  unsigned short shader;
+  float proj[16];
+  float eyeLight1[3], eyeLight2[3];  // in sun mode eyeLight1 is the direction to the sun
+  bool sunMode;
+  int numShadowMaps;
+  float shadowMatrix[MAX_SHADOW_MAPS][16];  // eye space to shadow map texture coordinates and depth
+  float cascadeEnd[MAX_SHADOW_MAPS];        // sun mode: eye space distance where each cascade ends
+};
+
+// Depth-only draws of one shadow map. Casters that have not moved in a while
+// are static: their list is kept by the builder and only changes, along with
+// staticVersion, when the set inside the map's frustum does, so the backend
+// can keep a cached map of them and draw just the dynamic casters on top.
+struct ShadowPass {
+  float proj[16];
+  unsigned staticVersion;
+  std::tr1::shared_ptr<const std::vector<DrawPacket> > staticCasters;  // shared with the builder
+  std::vector<DrawPacket> dynamicCasters;
+
+  ShadowPass() : staticVersion(0) {}
+};
+
+// A linear buffer of draw packets. Storage is reused between frames so
+// steady-state building does not allocate.
+class RenderQueue {
+  std::vector<DrawPacket> packets_;
+  int size_;
+
+public:
+  FrameGlobals globals;
+  ShadowPass shadows[MAX_SHADOW_MAPS];   // the first globals.numShadowMaps are used
+  int culled;            // objects the builder dropped before packet writing
+  int occluded;          // of those, hidden behind occluders
+  int recomputed;        // objects whose packet and visibility were computed
+  int reused;            // objects whose packet and visibility were cached
+  long long buildNanos;  // time the builder spent on this queue
+
+  RenderQueue() : size_(0), culled(0), occluded(0), recomputed(0), reused(0), buildNanos(0) {
+    globals.numShadowMaps = 0;
+  }
+
+  void clear() {
+    size_ = 0;
+    culled = 0;
+    occluded = 0;
+    recomputed = 0;
+    reused = 0;
+    buildNanos = 0;
+    globals.numShadowMaps = 0;
+    for (int i = 0; i < MAX_SHADOW_MAPS; ++i) {
+      shadows[i].dynamicCasters.clear();
+    }
+  }
+
+  // Appends n uninitialized packets and returns a pointer to the first one.
+  // Distinct ranges may then be filled from different threads.
+  DrawPacket *allocate(const int n) {
+    if (size_ + n > (int)packets_.size())
+      packets_.resize(std::max(size_ + n, 2 * (int)packets_.size()));
+    DrawPacket *r = &packets_[size_];
+    size_ += n;
+    return r;
+  }
+
+  // Drops packets at the end of the queue, e.g. slots left unused after culling
+  void shrink(const int newSize) {
+    assert(newSize <= size_);
+    size_ = newSize;
+  }
+
+  int size() const {
+    return size_;
+  }
+
+  const DrawPacket& operator [] (const int i) const {
+    return packets_[i];
+  }
+
+  DrawPacket& operator [] (const int i) {
+    return packets_[i];
+  }
+};
+
+// Counters and timings for one frame of the render command layer
+struct RenderStats {
+  int frame;
+  int packets;
+  int culled;
+  int occluded;
+  int recomputed;        // objects whose packets were built anew and reused
+  int reused;
+  long long skipped;     // frames skipped so far because nothing changed
+  bool prebuilt;         // queue was built ahead of time by the frame pipeline
+  long long buildNanos;
+  long long submitNanos;
+  int glCallsIssued;     // state changes made and skipped by the GL state cache
+  int glCallsElided;
+  int shadowStaticRedraws;   // cached shadow maps re-rendered this frame
+  int shadowCastersDrawn;
+  int texturesResident;  // texture streaming state after this frame's uploads
+  size_t textureBytesResident;
+  size_t textureBytesUploaded;
+
+  RenderStats() : frame(0), packets(0), culled(0), occluded(0), recomputed(0), reused(0), skipped(0), prebuilt(false), buildNanos(0), submitNanos(0),
+                  glCallsIssued(0), glCallsElided(0), shadowStaticRedraws(0), shadowCastersDrawn(0),
+                  texturesResident(0),
+                  textureBytesResident(0), textureBytesUploaded(0) {}
+};
+
+std::ostream& operator << (std::ostream& os, const RenderStats& stats);
+
+// Fills in an untextured draw packet from a model-view matrix (the normal
+// matrix is derived from it) and a color
+void writeDrawPacket(DrawPacket& p, const int geometry, const int shader,
+                     const Matrix4& MVM, const Cvec3f& color);
+
+// Same for a single precision model-view matrix, which is copied as is
+void writeDrawPacket(DrawPacket& p, const int geometry, const int shader,
+                     const Matrix4f& MVM, const Cvec3f& color);
+
+#endif
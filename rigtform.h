@@ -0,0 +1,109 @@
+#ifndef RIGTFORM_H
+#define RIGTFORM_H
+
+#include <iostream>
+#include <cassert>
+
+#include "matrix4.h"
+#include "quat.h"
+
+// A rigid body transform: rotation r followed by translation t, mapping a
+// point p to r*p + t. Composition and inversion stay exact rigid motions and
+// cost a fraction of the equivalent 4x4 products; convert with
+// rigTFormToMatrix() only when uploading.
+class RigTForm {
+  Cvec3 t_; // translation component
+  Quat r_;  // rotation component represented as a quaternion
+
+public:
+  RigTForm() : t_(0) {
+    assert(norm2(Quat(1,0,0,0) - r_) < CS175_EPS2);
+  }
+
+  RigTForm(const Cvec3& t, const Quat& r)
+    : t_(t), r_(r)
+  {}
+
+  explicit RigTForm(const Cvec3& t)
+    : t_(t)
+  {}
+
+  explicit RigTForm(const Quat& r)
+    : t_(0), r_(r)
+  {}
+
+  Cvec3 getTranslation() const {
+    return t_;
+  }
+
+  Quat getRotation() const {
+    return r_;
+  }
+
+  RigTForm& setTranslation(const Cvec3& t) {
+    t_ = t;
+    return *this;
+  }
+
+  RigTForm& setRotation(const Quat& r) {
+    r_ = r;
+    return *this;
+  }
+
+  // Points (w = 1) are rotated and translated, vectors (w = 0) only rotated
+  Cvec4 operator * (const Cvec4& a) const {
+    return r_ * a + Cvec4(t_, 0) * a[3];
+  }
+
+  // The rotation is renormalized so repeated composition does not drift
+  RigTForm operator * (const RigTForm& a) const {
+    const Cvec4 t = r_ * Cvec4(a.t_[0], a.t_[1], a.t_[2], 0);
+    return RigTForm(Cvec3(t_[0] + t[0], t_[1] + t[1], t_[2] + t[2]), renormalize(r_ * a.r_));
+  }
+};
+
+inline RigTForm inv(const RigTForm& tform) {
+  const Quat rinv = inv(tform.getRotation());
+  return RigTForm(-Cvec3(rinv * Cvec4(tform.getTranslation(), 0)), rinv);
+}
+
+inline RigTForm transFact(const RigTForm& tform) {
+  return RigTForm(tform.getTranslation());
+}
+
+inline RigTForm linFact(const RigTForm& tform) {
+  return RigTForm(tform.getRotation());
+}
+
+inline Matrix4 rigTFormToMatrix(const RigTForm& tform) {
+  Matrix4 m = quatToMatrix(tform.getRotation());
+  const Cvec3 t = tform.getTranslation();
+  for (int i = 0; i < 3; ++i) {
+    m(i,3) = t[i];
+  }
+  return m;
+}
+
+// Linear interpolation of the translations and slerp of the rotations
+inline RigTForm interpolate(const RigTForm& a, const RigTForm& b, const double alpha) {
+  return RigTForm(a.getTranslation() * (1 - alpha) + b.getTranslation() * alpha,
+                  slerp(a.getRotation(), b.getRotation(), alpha));
+}
+
+// Applies tform to n points. The rotation is expanded to a 3x3 matrix once,
+// leaving a branch-free multiply-add loop per point that the compiler can
+// vectorize.
+inline void transformPoints(const RigTForm& tform, const Cvec3 *in, Cvec3 *out, const int n) {
+  const Matrix4 m = rigTFormToMatrix(tform);
+  const double m00 = m(0,0), m01 = m(0,1), m02 = m(0,2), m03 = m(0,3);
+  const double m10 = m(1,0), m11 = m(1,1), m12 = m(1,2), m13 = m(1,3);
+  const double m20 = m(2,0), m21 = m(2,1), m22 = m(2,2), m23 = m(2,3);
+  for (int i = 0; i < n; ++i) {
+    const double x = in[i][0], y = in[i][1], z = in[i][2];
+    out[i] = Cvec3(m00*x + m01*y + m02*z + m03,
+                   m10*x + m11*y + m12*z + m13,
+                   m20*x + m21*y + m22*z + m23);
+  }
+}
+
+#endif
@@ -0,0 +1,1415 @@
+////////////////////////////////////////////////////////////////////////
+//
+//   Headless benchmark harness for the CPU side of the renderer. Builds
+//   synthetic scenes from VisObj and runs the frame pipeline stages
+//   without a GL context.
+//
+//   Usage: scene-bench [benchmark [args ...]]
+//
+//   Benchmarks:
+//     pipeline [threads ...]   frame pipeline scaling over thread counts
+//     pool                     heap allocated vs. pooled vs. structure-of-arrays
+//                              nodes: create/destroy churn and traversal
+//     anim [threads ...]       keyframe evaluation of 10k animated nodes, in
+//                              playback order and at random times
+//     shadow [moving ...]      shadow caster lists of 100k nodes with the given
+//                              numbers of them moving every frame
+//     hierarchy                world transform propagation of wide shallow
+//                              trees and deep chains: full, incremental and
+//                              per-node queries, cached and uncached
+//     reuse [moving ...]       frame build of 100k nodes with the given numbers
+//                              of them moving under a still camera, with and
+//                              without the packet cache
+//     precision [distance ...] frame build of 100k nodes moved the given
+//                              distances from the origin, with the camera
+//                              next to them: eye space error and time of the
+//                              double precision, single precision and camera
+//                              relative model view matrices
+//     occlusion [threads ...]  frame build and simulated submission of the
+//                              pipeline scene with three large pillars in
+//                              front, occlusion culling off and on
+//     raster [threads ...]     software rasterizer frames of a generated scene
+//                              of 10k cubes and spheres over thread counts:
+//                              speedup, triangles and pixels per second;
+//                              writes the image to raster.ppm and raster.png
+//     trace [threads ...]      ray traced frames of the raster scene with
+//                              shadows over thread counts: rays per second
+//                              and speedup; writes the image to trace.png
+//     load [nodes ...]         writes synthetic scenes of the given sizes as
+//                              text and binary scene files and streams them
+//                              back in
+//     snapshot [moving ...]    snapshot of 100k nodes, then deltas of frames
+//                              with the given numbers of nodes moving, and a
+//                              replay of them through the frame build
+//     replay <name>            replays the viewer recording <name>.snap plus
+//                              <name>.delta (object-scene-test -record) through
+//                              the frame build
+//     regress <dir> [update]   software rasterized and ray traced reference
+//                              views checked against golden images in <dir>:
+//                              frame time and pixel difference per view, exit
+//                              status 1 if any differ; missing golden images
+//                              are written, update rewrites them
+//
+//     sweep [key=v1,v2 ...]    frame build and submission of generated scenes
+//                              over every combination of the given parameters
+//                              (objects, depth, branching, moving, layout,
+//                              threads), one CSV row each
+//     generate <file> [key=value ...]
+//                              writes a generated scene (objects, depth,
+//                              branching, layout) to a scene file, binary if
+//                              the name ends in .scnb
+//
+//   With no arguments every benchmark but replay, regress and generate runs
+//   with its defaults.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <stdexcept>
+#include <cstdio>
+#include <map>
+
+#include <sched.h>
+#include <unistd.h>
+
+#include "cvec.h"
+#include "matrix4.h"
+#include "rigtform.h"
+#include "visobj.h"
+#include "timer.h"
+#include "rendercmd.h"
+#include "jobsystem.h"
+#include "framebuild.h"
+#include "animation.h"
+#include "scenefile.h"
+#include "snapshot.h"
+#include "scenegen.h"
+#include "profiler.h"
+#include "softraster.h"
+#include "raytrace.h"
+#include "image.h"
+#include "imagediff.h"
+
+using namespace std;
+
+static const int g_numObjects = 100000;
+static const int g_numFrames = 20;
+static const int g_numAnimated = 10000;
+static const int g_numAnimSteps = 600;
+
+// Deterministic pseudo random numbers in [0, 1), so every run sees the same scene
+static double random01(unsigned& state) {
+  state = state * 1664525u + 1013904223u;
+  return (state >> 8) * (1.0 / 16777216.0);
+}
+
+// Local transform and color of a random node of the synthetic scenes:
+// placed in a 200x200x200 box around the origin, or next to its parent
+struct RandomNode {
+  RigTForm local;
+  Cvec3f color;
+
+  RandomNode(unsigned& rng, const bool hasParent) {
+    const Cvec3 t(random01(rng) * 200 - 100, random01(rng) * 200 - 100, random01(rng) * 200 - 100);
+    local = RigTForm(hasParent ? Cvec3(1, 0, 0) : t, Quat::makeZRotation(random01(rng) * 360));
+    color = Cvec3f(random01(rng), random01(rng), random01(rng));
+  }
+};
+
+// Scatters n cubes. Every fourth object is parented to the one before it,
+// giving some shallow hierarchy.
+static void makeSyntheticScene(const int n, SceneStore& scene) {
+  unsigned rng = 12345;
+  scene.reserve(n);
+  NodeHandle last;
+  for (int i = 0; i < n; ++i) {
+    const NodeHandle parent = (i % 4 == 3) ? last : NodeHandle();
+    const RandomNode r(rng, !parent.isNull());
+    last = VisObj(&scene, r.local, r.color, parent).getHandle();
+  }
+}
+
+// Times world transform update, culling and packet building of the whole
+// scene for each thread count
+static void benchFramePipeline(const vector<int>& threadCounts) {
+  SceneStore objs;
+  makeSyntheticScene(g_numObjects, objs);
+
+  FrameBuildParams params;
+  params.invEyeTransform = inv(Matrix4::makeTranslation(Cvec3(0, 0, 150)));
+  params.projection = Matrix4::makeProjection(60, 16.0 / 9.0, -0.1, -500);
+
+  cout << "frame pipeline: " << objs.size() << " objects, " << g_numFrames << " frames\n";
+  cout << setw(8) << "threads" << setw(12) << "ms/frame" << setw(10) << "speedup"
+       << setw(10) << "packets" << setw(10) << "culled" << setw(10) << "stolen" << "\n";
+
+  double base = 0;
+  for (size_t k = 0; k < threadCounts.size(); ++k) {
+    JobSystem js(threadCounts[k]);
+    RenderQueue queue;
+    int culled = 0;
+
+    // one warm-up frame sizes the queue
+    buildObjectPacketsParallel(js, queue, objs, params);
+
+    const long long t0 = nowNanos();
+    for (int f = 0; f < g_numFrames; ++f) {
+      queue.clear();
+      culled = buildObjectPacketsParallel(js, queue, objs, params);
+    }
+    const double ms = nanosToMillis(nowNanos() - t0) / g_numFrames;
+    if (k == 0)
+      base = ms;
+
+    cout << setw(8) << js.numThreads() << setw(12) << fixed << setprecision(3) << ms
+         << setw(10) << setprecision(2) << base / ms
+         << setw(10) << queue.size() << setw(10) << culled
+         << setw(10) << js.jobsStolen() << "\n";
+  }
+}
+
+// Nodes allocated one by one on the heap, the layout initObjects() used
+// before scene nodes were pooled
+struct HeapNode {
+  RigTForm local;
+  Cvec3f color;
+  HeapNode *parent;
+
+  HeapNode(const RandomNode& r, HeapNode *parent)
+    : local(r.local), color(r.color), parent(parent) {}
+
+  RigTForm getTransform() const {
+    return parent ? parent->getTransform() * local : local;
+  }
+};
+
+// Nodes of an array-of-structures pool, referring to their parent by handle
+struct PoolNode {
+  RigTForm local;
+  Cvec3f color;
+  PoolHandle parent;
+
+  PoolNode(const RandomNode& r, const PoolHandle parent)
+    : local(r.local), color(r.color), parent(parent) {}
+
+  RigTForm getTransform(const Pool<PoolNode>& pool) const {
+    const PoolNode *p = parent.isNull() ? NULL : pool.get(parent);
+    return p ? p->getTransform(pool) * local : local;
+  }
+};
+
+static void printPoolRow(const char *layout, const long long churn, const long long traverse,
+                         const double checksum) {
+  cout << setw(8) << layout << setw(12) << fixed << setprecision(3) << nanosToMillis(churn)
+       << setw(14) << nanosToMillis(traverse) << "   (checksum " << checksum << ")\n";
+}
+
+// Create/destroy churn: every round replaces a random tenth of the nodes
+// (copies of one prototype, so only allocation is timed), then the world
+// transforms of all nodes are computed. Nodes 4k+3 are children of 4k+2, and
+// only parents are replaced.
+static void benchPool() {
+  const int n = g_numObjects;
+  const int rounds = 50;
+  const int churn = n / 10;
+
+  cout << "pool: " << n << " nodes, " << rounds << " rounds destroying and creating " << churn << "\n";
+  cout << setw(8) << "layout" << setw(12) << "churn ms" << setw(14) << "traverse ms" << "\n";
+
+  // Individually heap allocated nodes
+  {
+    unsigned rng = 777;
+    vector<HeapNode*> objs;
+    for (int i = 0; i < n; ++i) {
+      objs.push_back(new HeapNode(RandomNode(rng, i % 4 == 3), (i % 4 == 3) ? objs[i-1] : NULL));
+    }
+    const RandomNode proto(rng, false);
+
+    const long long t0 = nowNanos();
+    for (int r = 0; r < rounds; ++r) {
+      for (int k = 0; k < churn; ++k) {
+        const int i = (int)(random01(rng) * (n / 4)) * 4 + 2;
+        delete objs[i];
+        objs[i] = new HeapNode(proto, NULL);
+        objs[i+1]->parent = objs[i];
+      }
+    }
+    const long long t1 = nowNanos();
+    double sum = 0;
+    for (int i = 0; i < n; ++i) {
+      sum += objs[i]->getTransform().getTranslation()[0];
+    }
+    const long long t2 = nowNanos();
+    printPoolRow("heap", t1 - t0, t2 - t1, sum);
+
+    for (int i = 0; i < n; ++i) {
+      delete objs[i];
+    }
+  }
+
+  // Array-of-structures pool
+  {
+    unsigned rng = 777;
+    Pool<PoolNode> objs;
+    vector<PoolHandle> handles;
+    for (int i = 0; i < n; ++i) {
+      handles.push_back(objs.create(PoolNode(RandomNode(rng, i % 4 == 3), (i % 4 == 3) ? handles[i-1] : PoolHandle())));
+    }
+    const PoolNode proto(RandomNode(rng, false), PoolHandle());
+
+    const long long t0 = nowNanos();
+    for (int r = 0; r < rounds; ++r) {
+      for (int k = 0; k < churn; ++k) {
+        const int i = (int)(random01(rng) * (n / 4)) * 4 + 2;
+        objs.destroy(handles[i]);
+        handles[i] = objs.create(proto);
+        objs.get(handles[i+1])->parent = handles[i];
+      }
+    }
+    const long long t1 = nowNanos();
+    double sum = 0;
+    for (int i = 0, m = objs.numSlots(); i < m; ++i) {
+      if (objs.isAlive(i))
+        sum += objs.at(i).getTransform(objs).getTranslation()[0];
+    }
+    const long long t2 = nowNanos();
+    printPoolRow("pool", t1 - t0, t2 - t1, sum);
+  }
+
+  // Structure-of-arrays scene store, which is what VisObj uses
+  {
+    unsigned rng = 777;
+    SceneStore scene;
+    vector<NodeHandle> handles;
+    for (int i = 0; i < n; ++i) {
+      const RandomNode r(rng, i % 4 == 3);
+      handles.push_back(scene.create(r.local, Cvec3(1, 1, 1), r.color, (i % 4 == 3) ? handles[i-1] : NodeHandle(), VISOBJ_CUBE_RADIUS));
+    }
+    const RandomNode proto(rng, false);
+
+    const long long t0 = nowNanos();
+    for (int r = 0; r < rounds; ++r) {
+      for (int k = 0; k < churn; ++k) {
+        const int i = (int)(random01(rng) * (n / 4)) * 4 + 2;
+        scene.destroy(handles[i]);
+        handles[i] = scene.create(proto.local, Cvec3(1, 1, 1), proto.color, NodeHandle(), VISOBJ_CUBE_RADIUS);
+        scene.setParent(handles[i+1], handles[i]);
+      }
+    }
+    const long long t1 = nowNanos();
+    scene.updateWorldTransforms();
+    double sum = 0;
+    for (int i = 0, m = scene.numSlots(); i < m; ++i) {
+      if (scene.isAlive(i))
+        sum += scene.world(i).getTranslation()[0];
+    }
+    const long long t2 = nowNanos();
+    printPoolRow("soa", t1 - t0, t2 - t1, sum);
+
+    // What a frame usually does instead of churning: move a few nodes and
+    // update. Only they and their children are recomputed, where the other
+    // layouts have nothing to go by but recomputing everything.
+    for (int k = 0; k < 100; ++k) {
+      const NodeHandle h = handles[(int)(random01(rng) * (n / 4)) * 4 + 2];
+      scene.setLocal(h, scene.getLocal(h) * RigTForm(Cvec3(0, 0.1, 0)));
+    }
+    const long long t3 = nowNanos();
+    const int recomputed = scene.updateWorldTransforms();
+    const long long t4 = nowNanos();
+    cout << "soa world update after moving 100 nodes: " << nanosToMillis(t4 - t3) << " ms, "
+         << recomputed << " recomputed\n";
+
+    scene.clear();
+    cout << "bulk clear of the soa store: " << nanosToMillis(nowNanos() - t4) << " ms\n";
+  }
+}
+
+// Gives every node of the scene an animation with 16 keys per track
+static void makeSyntheticAnimations(const SceneStore& scene, Animator& animator) {
+  unsigned rng = 4242;
+  const int numKeys = 16;
+  for (int i = 0, n = scene.numSlots(); i < n; ++i) {
+    if (!scene.isAlive(i))
+      continue;
+    NodeAnimation& a = animator.add(scene.handleAt(i));
+    const Cvec3 base = scene.local(i).getTranslation();
+    double t = 0;
+    for (int k = 0; k < numKeys; ++k) {
+      a.translation.addKey(t, base + Cvec3(random01(rng), random01(rng), random01(rng)));
+      a.rotation.addKey(t, Quat::makeZRotation(random01(rng) * 360) * Quat::makeXRotation(random01(rng) * 360));
+      a.scale.addKey(t, Cvec3(1, 1, 1) * (0.5 + random01(rng)));
+      t += 0.1 + random01(rng) * 0.4;
+    }
+  }
+}
+
+// Times Animator::evaluate() on each thread count, once stepping through time
+// at 60Hz like the viewer does (the key lookups hit their cached segment)
+// and once at random times (every lookup falls back to binary search)
+static void benchAnimation(const vector<int>& threadCounts) {
+  SceneStore scene;
+  makeSyntheticScene(g_numAnimated, scene);
+  Animator animator;
+  makeSyntheticAnimations(scene, animator);
+
+  vector<double> randomTimes(g_numAnimSteps);
+  unsigned rng = 99;
+  for (int f = 0; f < g_numAnimSteps; ++f) {
+    randomTimes[f] = random01(rng) * 8;
+  }
+
+  cout << "animation: " << animator.size() << " animated nodes, " << g_numAnimSteps << " steps\n";
+  cout << setw(8) << "threads" << setw(14) << "ms/playback" << setw(10) << "speedup"
+       << setw(14) << "ms/random" << setw(10) << "speedup" << "\n";
+
+  double basePlayback = 0, baseRandom = 0;
+  for (size_t k = 0; k < threadCounts.size(); ++k) {
+    JobSystem js(threadCounts[k]);
+
+    const long long t0 = nowNanos();
+    for (int f = 0; f < g_numAnimSteps; ++f) {
+      animator.evaluate(js, scene, f / 60.0);
+    }
+    const long long t1 = nowNanos();
+    for (int f = 0; f < g_numAnimSteps; ++f) {
+      animator.evaluate(js, scene, randomTimes[f]);
+    }
+    const long long t2 = nowNanos();
+
+    const double playback = nanosToMillis(t1 - t0) / g_numAnimSteps;
+    const double random = nanosToMillis(t2 - t1) / g_numAnimSteps;
+    if (k == 0) {
+      basePlayback = playback;
+      baseRandom = random;
+    }
+    cout << setw(8) << js.numThreads() << setw(14) << fixed << setprecision(3) << playback
+         << setw(10) << setprecision(2) << basePlayback / playback
+         << setw(14) << setprecision(3) << random
+         << setw(10) << setprecision(2) << baseRandom / random << "\n";
+  }
+}
+
+// Builds the caster lists of one shadow map over the synthetic scene while a
+// number of nodes move every frame, after everything has settled. Casters
+// drawn counts what the GL side renders: the dynamic casters, plus the
+// static ones on frames whose cached map was invalidated.
+static void benchShadowCasters(const vector<int>& movingCounts) {
+  SceneStore scene;
+  makeSyntheticScene(g_numObjects, scene);
+  scene.updateWorldTransforms();
+  const ShadowView view = makeSpotShadowView(Cvec3(0, 300, 10), Cvec3(0, 0, 0), 175);
+
+  cout << "shadow casters: " << scene.size() << " nodes, " << g_numFrames << " frames\n";
+  cout << setw(8) << "moving" << setw(12) << "ms/frame" << setw(10) << "dynamic"
+       << setw(10) << "redraws" << setw(16) << "casters/frame" << setw(16) << "uncached" << "\n";
+
+  for (size_t k = 0; k < movingCounts.size(); ++k) {
+    const int moving = std::min(movingCounts[k], scene.size());
+    ShadowCasterCache cache(30);
+    ShadowPass pass;
+    for (int f = 0; f < 31; ++f) {
+      cache.build(scene, &view, 1, 0, &pass);
+    }
+    const int uncached = pass.staticCasters->size();
+
+    long long nanos = 0;
+    long long drawn = 0;
+    unsigned version = pass.staticVersion;
+    int redraws = 0;
+    for (int f = 0; f < g_numFrames; ++f) {
+      for (int i = 0; i < moving; ++i) {
+        const NodeHandle h = scene.handleAt((long long)i * scene.numSlots() / moving);
+        scene.setLocal(h, scene.getLocal(h) * RigTForm(Cvec3(0.01, 0, 0)));
+      }
+      scene.updateWorldTransforms();
+      const long long t0 = nowNanos();
+      cache.build(scene, &view, 1, 0, &pass);
+      nanos += nowNanos() - t0;
+      drawn += pass.dynamicCasters.size();
+      if (pass.staticVersion != version) {
+        version = pass.staticVersion;
+        drawn += pass.staticCasters->size();
+        ++redraws;
+      }
+    }
+    cout << setw(8) << moving << setw(12) << fixed << setprecision(3) << nanosToMillis(nanos) / g_numFrames
+         << setw(10) << pass.dynamicCasters.size() << setw(10) << redraws
+         << setw(16) << drawn / g_numFrames << setw(16) << uncached << "\n";
+  }
+}
+
+// CPU side of the viewer's submitRenderQueue without GL: walks the packets
+// in order, tracking shader and texture changes, and copies the uniforms
+// each draw would upload into a staging buffer. Returns the state changes.
+static int simulateSubmission(const RenderQueue& queue, vector<float>& staging) {
+  ProfileScope scope("submission");
+  const int floatsPerDraw = 16 + 16 + 3;
+  staging.resize((size_t)queue.size() * floatsPerDraw);
+  int shader = -1, texture = -2, changes = 0;   // no packet has these
+  float *out = staging.empty() ? NULL : &staging[0];
+  for (int i = 0, n = queue.size(); i < n; ++i) {
+    const DrawPacket& p = queue[i];
+    if (p.shader != shader || p.texture != texture) {
+      shader = p.shader;
+      texture = p.texture;
+      ++changes;
+    }
+    memcpy(out, p.mvm, sizeof(p.mvm));
+    memcpy(out + 16, p.nmvm, sizeof(p.nmvm));
+    memcpy(out + 32, p.color, sizeof(p.color));
+    out += floatsPerDraw;
+  }
+  return changes;
+}
+
+// The pipeline benchmark's scene and view with three tall pillars standing
+// between the camera and most of the scene
+static void benchOcclusion(const vector<int>& threadCounts) {
+  SceneStore objs;
+  makeSyntheticScene(g_numObjects, objs);
+  for (int i = -1; i <= 1; ++i) {
+    VisObj(&objs, RigTForm(Cvec3(i * 45, 0, 105)), Cvec3f(0.5, 0.5, 0.5), NodeHandle(), Cvec3(24, 220, 4));
+  }
+
+  OcclusionBuffer occlusion;
+  FrameBuildParams params;
+  params.invEyeTransform = inv(Matrix4::makeTranslation(Cvec3(0, 0, 150)));
+  params.projection = Matrix4::makeProjection(60, 16.0 / 9.0, -0.1, -500);
+
+  cout << "occlusion: " << objs.size() << " objects, " << g_numFrames << " frames\n";
+  cout << setw(8) << "threads" << setw(11) << "occlusion" << setw(10) << "build ms"
+       << setw(11) << "submit ms" << setw(10) << "total ms"
+       << setw(10) << "packets" << setw(10) << "frustum" << setw(10) << "occluded" << "\n";
+
+  // Submission is simulated like the sweep does, so it only counts the CPU
+  // side; the GPU and driver work saved per dropped draw comes on top
+  vector<float> staging;
+  for (size_t k = 0; k < threadCounts.size(); ++k) {
+    JobSystem js(threadCounts[k]);
+    for (int on = 0; on < 2; ++on) {
+      params.occlusion = on ? &occlusion : NULL;
+      RenderQueue queue;
+      int culled = 0;
+      buildObjectPacketsParallel(js, queue, objs, params);
+      simulateSubmission(queue, staging);
+
+      long long buildNanos = 0, submitNanos = 0;
+      for (int f = 0; f < g_numFrames; ++f) {
+        const long long t0 = nowNanos();
+        queue.clear();
+        culled = buildObjectPacketsParallel(js, queue, objs, params);
+        const long long t1 = nowNanos();
+        simulateSubmission(queue, staging);
+        buildNanos += t1 - t0;
+        submitNanos += nowNanos() - t1;
+      }
+      const double buildMs = nanosToMillis(buildNanos) / g_numFrames;
+      const double submitMs = nanosToMillis(submitNanos) / g_numFrames;
+      cout << setw(8) << js.numThreads() << setw(11) << (on ? "on" : "off")
+           << setw(10) << fixed << setprecision(3) << buildMs << setw(11) << submitMs
+           << setw(10) << buildMs + submitMs << setw(10) << queue.size()
+           << setw(10) << culled - queue.occluded << setw(10) << queue.occluded << "\n";
+    }
+  }
+}
+
+static unsigned imageChecksum(const Image& img) {
+  unsigned hash = 2166136261u;
+  for (size_t i = 0; i < img.pixels.size(); ++i) {
+    hash = (hash ^ img.pixels[i]) * 16777619u;
+  }
+  return hash;
+}
+
+// Builds the packets of scene seen from eye into queue, lit by the viewer's
+// two point lights
+static void buildLitQueue(JobSystem& js, SceneStore& scene, const RigTForm& eye,
+                          const int width, const int height, RenderQueue& queue) {
+  FrameBuildParams params;
+  params.invEyeTransform = rigTFormToMatrix(inv(eye));
+  params.projection = Matrix4::makeProjection(60, (double)width / height, -0.1, -200);
+  queue.clear();
+  buildObjectPacketsParallel(js, queue, scene, params);
+  FrameGlobals& globals = queue.globals;
+  params.projection.writeToColumnMajorMatrix(globals.proj);
+  const Cvec3 light1 = Cvec3(params.invEyeTransform * Cvec4(2, 3, 14, 1));
+  const Cvec3 light2 = Cvec3(params.invEyeTransform * Cvec4(-2, -3, -5, 1));
+  for (int i = 0; i < 3; ++i) {
+    globals.eyeLight1[i] = light1[i];
+    globals.eyeLight2[i] = light2[i];
+  }
+  globals.sunMode = false;
+}
+
+// Renders a generated scene with the software rasterizer on each thread
+// count. The image must come out the same on all of them.
+static void benchSoftRaster(const vector<int>& threadCounts) {
+  static const int width = 1280, height = 720;
+  SceneGenParams gen;
+  gen.numObjects = 10000;
+  gen.extent = 30;
+  SceneStore scene;
+  GeneratedScene generated;
+  generateScene(gen, scene, generated);
+
+  // one queue for every run
+  JobSystem buildJs(1);
+  RenderQueue queue;
+  buildLitQueue(buildJs, scene, RigTForm(Cvec3(0, 0, 60)), width, height, queue);
+
+  cout << "software raster: " << queue.size() << " packets, " << width << "x" << height << ", "
+       << g_numFrames << " frames\n";
+  cout << setw(8) << "threads" << setw(10) << "ms/frame" << setw(12) << "geometry" << setw(10) << "raster"
+       << setw(10) << "speedup" << setw(12) << "Mtris/s" << setw(12) << "Mpixels/s" << setw(12) << "triangles"
+       << setw(10) << "drawn"
+       << setw(12) << "pixels" << setw(8) << "same" << "\n";
+  unsigned first = 0;
+  double firstMs = 0;
+  for (size_t k = 0; k < threadCounts.size(); ++k) {
+    JobSystem js(threadCounts[k]);
+    SoftRasterizer raster(js, width, height);
+    setViewerMeshes(raster, -2, 10);
+    raster.render(queue);   // warm-up sizes the bins
+    long long geometryNanos = 0, rasterNanos = 0;
+    for (int f = 0; f < g_numFrames; ++f) {
+      raster.render(queue);
+      geometryNanos += raster.stats().geometryNanos;
+      rasterNanos += raster.stats().rasterNanos;
+    }
+    const SoftRasterStats& stats = raster.stats();
+    const double ms = nanosToMillis(geometryNanos + rasterNanos) / g_numFrames;
+    const unsigned checksum = imageChecksum(raster.image());
+    if (k == 0) {
+      first = checksum;
+      firstMs = ms;
+      writePpm("raster.ppm", raster.image());
+      writePng("raster.png", raster.image());
+    }
+    cout << setw(8) << js.numThreads() << setw(10) << fixed << setprecision(2) << ms
+         << setw(12) << nanosToMillis(geometryNanos) / g_numFrames
+         << setw(10) << nanosToMillis(rasterNanos) / g_numFrames << setw(10) << firstMs / ms
+         << setw(12) << stats.triangles / ms / 1000 << setw(12) << stats.pixelsShaded / ms / 1000
+         << setw(12) << stats.triangles << setw(10) << stats.trianglesDrawn
+         << setw(12) << stats.pixelsShaded << setw(8) << (checksum == first ? "yes" : "NO") << "\n";
+  }
+}
+
+// Ray traces the raster benchmark's scene from the same camera, lit by the
+// viewer's two point lights with shadow rays to both
+static void benchRayTrace(const vector<int>& threadCounts) {
+  static const int width = 1280, height = 720, frames = 3;
+  SceneGenParams gen;
+  gen.numObjects = 10000;
+  gen.extent = 30;
+  SceneStore scene;
+  GeneratedScene generated;
+  generateScene(gen, scene, generated);
+  scene.updateWorldTransforms();
+
+  RayTraceView view;
+  view.eye = RigTForm(Cvec3(0, 0, 60));
+  view.light1 = Cvec3(2, 3, 14);
+  view.light2 = Cvec3(-2, -3, -5);
+
+  cout << "ray trace: " << scene.size() << " objects, " << width << "x" << height << ", "
+       << frames << " frames\n";
+  cout << setw(8) << "threads" << setw(10) << "build ms" << setw(10) << "ms/frame" << setw(12) << "Mrays/s"
+       << setw(10) << "speedup" << setw(12) << "primary" << setw(12) << "shadow" << setw(8) << "same" << "\n";
+  unsigned first = 0;
+  double firstMs = 0;
+  for (size_t k = 0; k < threadCounts.size(); ++k) {
+    JobSystem js(threadCounts[k]);
+    RayTracer tracer(js, width, height);
+    setViewerMeshes(tracer, -2, 10);
+    tracer.build(scene, view.eye.getTranslation());
+    long long traceNanos = 0;
+    for (int f = 0; f < frames; ++f) {
+      tracer.render(view);
+      traceNanos += tracer.stats().traceNanos;
+    }
+    const RayTraceStats& stats = tracer.stats();
+    const double ms = nanosToMillis(traceNanos) / frames;
+    const unsigned checksum = imageChecksum(tracer.image());
+    if (k == 0) {
+      first = checksum;
+      firstMs = ms;
+      writePng("trace.png", tracer.image());
+    }
+    cout << setw(8) << js.numThreads() << setw(10) << fixed << setprecision(2) << nanosToMillis(stats.buildNanos)
+         << setw(10) << ms << setw(12) << (stats.primaryRays + stats.shadowRays) / ms / 1000
+         << setw(10) << firstMs / ms << setw(12) << stats.primaryRays << setw(12) << stats.shadowRays
+         << setw(8) << (checksum == first ? "yes" : "NO") << "\n";
+  }
+}
+
+// Renders reference views of a generated scene with the software rasterizer
+// and the ray tracer, and checks each against its golden image in dir, the
+// way object-scene-test -regress does with GL. Missing golden images are
+// written; update rewrites all of them.
+static bool benchRegression(const string& dir, const bool update) {
+  static const int width = 640, height = 480, frames = 3;
+  SceneGenParams gen;
+  gen.numObjects = 2000;
+  gen.extent = 15;
+  SceneStore scene;
+  GeneratedScene generated;
+  generateScene(gen, scene, generated);
+  scene.updateWorldTransforms();
+
+  struct View {
+    const char *name;
+    RigTForm eye;
+    bool traced;
+  };
+  const View views[] = {
+    {"raster-front", RigTForm(Cvec3(0, 0, 40)), false},
+    {"raster-side", RigTForm(Cvec3(40, 0, 0), Quat::makeYRotation(90)), false},
+    {"raster-above", RigTForm(Cvec3(0, 30, 25), Quat::makeXRotation(-50)), false},
+    {"trace-front", RigTForm(Cvec3(0, 0, 40)), true},
+  };
+  const int numViews = 4;
+
+  JobSystem js(4);
+  SoftRasterizer raster(js, width, height);
+  setViewerMeshes(raster, -2, 10);
+  RayTracer tracer(js, width, height);
+  setViewerMeshes(tracer, -2, 10);
+
+  cout << "regression: " << scene.size() << " objects, " << width << "x" << height << ", "
+       << frames << " frames per view, golden images in " << dir << "\n";
+  cout << left << setw(14) << "view" << right << setw(10) << "ms/frame" << setw(11) << "differing"
+       << setw(9) << "shifted" << setw(11) << "max delta" << setw(11) << "rms delta" << "  result\n";
+  bool failed = false;
+  for (int v = 0; v < numViews; ++v) {
+    const View& view = views[v];
+    long long nanos = 0;
+    const Image *image;
+    if (view.traced) {
+      RayTraceView traceView;
+      traceView.eye = view.eye;
+      traceView.light1 = Cvec3(2, 3, 14);
+      traceView.light2 = Cvec3(-2, -3, -5);
+      tracer.build(scene, view.eye.getTranslation());
+      for (int f = 0; f < frames; ++f) {
+        tracer.render(traceView);
+        nanos += tracer.stats().traceNanos;
+      }
+      image = &tracer.image();
+    } else {
+      RenderQueue queue;
+      buildLitQueue(js, scene, view.eye, width, height, queue);
+      for (int f = 0; f < frames; ++f) {
+        raster.render(queue);
+        nanos += raster.stats().geometryNanos + raster.stats().rasterNanos;
+      }
+      image = &raster.image();
+    }
+
+    ImageDiff diff;
+    const GoldenResult result = checkGolden(*image, dir + "/" + view.name, update, DiffTolerance(), diff);
+    failed |= result == GOLDEN_FAILED;
+    cout << left << setw(14) << view.name << right << fixed << setprecision(2)
+         << setw(10) << nanosToMillis(nanos) / frames
+         << setw(11) << diff.differing << setw(9) << diff.shifted
+         << setprecision(3) << setw(11) << diff.maxDelta << setw(11) << diff.rmsDelta
+         << "  " << goldenResultName(result) << "\n";
+  }
+  cout << (failed ? "regression failed\n" : "regression passed\n");
+  return !failed;
+}
+
+// Round trips synthetic scenes through both scene file formats. The file is
+// streamed in the way the viewer does it, polling for parsed chunks, so
+// "first" is how long a scene of that size takes to start appearing.
+static void benchSceneLoad(const vector<int>& nodeCounts) {
+  cout << "scene load:\n";
+  cout << setw(10) << "nodes" << setw(8) << "format" << setw(10) << "MB" << setw(12) << "first ms"
+       << setw(12) << "total ms" << setw(14) << "nodes/s" << "\n";
+
+  for (size_t k = 0; k < nodeCounts.size(); ++k) {
+    SceneStore scene;
+    makeSyntheticScene(nodeCounts[k], scene);
+    for (int binary = 0; binary < 2; ++binary) {
+      const string file = binary ? "scene-bench.scnb" : "scene-bench.scene";
+      saveScene(scene, file, binary);
+      ifstream f(file.c_str(), ios::binary | ios::ate);
+      const double mb = f.tellg() / (1024.0 * 1024.0);
+      f.close();
+
+      SceneStore loaded;
+      const long long t0 = nowNanos();
+      long long first = 0;
+      {
+        SceneLoader loader(file);
+        while (!loader.finished()) {
+          if (loader.insert(loaded, 20000) == 0)
+            sched_yield();
+          else if (first == 0)
+            first = nowNanos() - t0;
+        }
+      }
+      const long long total = nowNanos() - t0;
+      remove(file.c_str());
+      if (loaded.size() != scene.size())
+        throw runtime_error("scene load: node count mismatch");
+
+      cout << setw(10) << loaded.size() << setw(8) << (binary ? "binary" : "text")
+           << setw(10) << fixed << setprecision(1) << mb
+           << setw(12) << setprecision(2) << nanosToMillis(first)
+           << setw(12) << nanosToMillis(total)
+           << setw(14) << setprecision(0) << loaded.size() / (total * 1e-9) << "\n";
+    }
+  }
+}
+
+static double timeWorldUpdate(SceneStore& scene, int& recomputed) {
+  const long long t0 = nowNanos();
+  recomputed = scene.updateWorldTransforms();
+  return nanosToMillis(nowNanos() - t0);
+}
+
+static void printHierarchyRow(const char *what, const double ms, const int recomputed) {
+  cout << setw(24) << what << setw(10) << fixed << setprecision(3) << ms << setw(12) << recomputed << "\n";
+}
+
+// Builds numTrees trees of treeSize nodes each, either a root with
+// treeSize - 1 children (wide) or a chain (deep), and times world transform
+// propagation: everything new, nothing changed, one leaf or one root moved,
+// then the world transform of every node of the moved tree queried one by
+// one, walking the ancestry each time and from the cache
+static void benchHierarchyShape(const bool deep, const int numTrees, const int treeSize) {
+  SceneStore scene;
+  scene.reserve(numTrees * treeSize);
+  vector<NodeHandle> roots;
+  vector<vector<NodeHandle> > trees(numTrees);
+  unsigned rng = 31337;
+  for (int t = 0; t < numTrees; ++t) {
+    const RandomNode r(rng, false);
+    NodeHandle parent = scene.create(r.local, Cvec3(1, 1, 1), r.color, NodeHandle(), VISOBJ_CUBE_RADIUS);
+    trees[t].push_back(parent);
+    for (int k = 1; k < treeSize; ++k) {
+      const RigTForm local(Cvec3(0.1, 0, 0), Quat::makeZRotation(random01(rng) * 10));
+      const NodeHandle h = scene.create(local, Cvec3(1, 1, 1), r.color, deep ? parent : trees[t][0], VISOBJ_CUBE_RADIUS);
+      trees[t].push_back(h);
+      parent = h;
+    }
+  }
+
+  cout << "hierarchy: " << (deep ? "deep, " : "wide, ") << numTrees << " trees of " << treeSize
+       << (deep ? " nodes in a chain" : " nodes, a root and its children") << "\n";
+  cout << setw(24) << "" << setw(10) << "ms" << setw(12) << "recomputed" << "\n";
+  int n;
+  double ms = timeWorldUpdate(scene, n);
+  printHierarchyRow("full update", ms, n);
+  ms = timeWorldUpdate(scene, n);
+  printHierarchyRow("nothing changed", ms, n);
+  const vector<NodeHandle>& moved = trees[numTrees / 2];
+  scene.setLocal(moved.back(), scene.getLocal(moved.back()) * RigTForm(Cvec3(0, 0.1, 0)));
+  ms = timeWorldUpdate(scene, n);
+  printHierarchyRow("one leaf moved", ms, n);
+  scene.setLocal(moved[0], scene.getLocal(moved[0]) * RigTForm(Cvec3(0, 0.1, 0)));
+  ms = timeWorldUpdate(scene, n);
+  printHierarchyRow("one root moved", ms, n);
+
+  // Queries of the moved tree after moving its root again: the uncached
+  // ones multiply out every node's whole ancestry, the cached ones
+  // recompute the stale part of each node's ancestry (the root once, then
+  // each node, with its render matrix) and a second round only checks
+  // versions
+  scene.setLocal(moved[0], scene.getLocal(moved[0]) * RigTForm(Cvec3(0, 0.1, 0)));
+  double sum = 0;
+  long long t0 = nowNanos();
+  for (size_t k = 0; k < moved.size(); ++k) {
+    sum += scene.computeWorld(moved[k]).getTranslation()[0];
+  }
+  const double uncachedMs = nanosToMillis(nowNanos() - t0);
+  const double uncachedSum = sum;
+  t0 = nowNanos();
+  for (size_t k = 0; k < moved.size(); ++k) {
+    sum -= scene.getWorld(moved[k]).getTranslation()[0];
+  }
+  const double cachedMs = nanosToMillis(nowNanos() - t0);
+  double again = 0;
+  t0 = nowNanos();
+  for (size_t k = 0; k < moved.size(); ++k) {
+    again += scene.getWorld(moved[k]).getTranslation()[0];
+  }
+  const double againMs = nanosToMillis(nowNanos() - t0);
+  sum += again - uncachedSum;
+  cout << setw(24) << "world of each node" << "   " << moved.size() << " queries: uncached "
+       << uncachedMs << " ms, cached " << cachedMs << " ms, cached again " << againMs
+       << " ms (difference " << setprecision(1) << scientific
+       << sum << ")\n";
+  cout.unsetf(ios::floatfield);
+
+  // Moving a leaf to another tree keeps it where it is
+  const NodeHandle leaf = moved.back();
+  const Cvec3 before = scene.getWorld(leaf).getTranslation();
+  scene.setParentKeepWorld(leaf, trees[0].back());
+  const Cvec3 after = scene.getWorld(leaf).getTranslation();
+  cout << setw(24) << "reparent, world kept" << "   " << (norm(after - before) < 1e-9 ? "yes" : "NO") << "\n";
+}
+
+static void benchHierarchy() {
+  benchHierarchyShape(false, 100, 1000);
+  benchHierarchyShape(true, 100, 1000);
+}
+
+// Packets equal field by field; padding bytes are left undefined
+static bool sameQueue(const RenderQueue& a, const RenderQueue& b) {
+  if (a.size() != b.size())
+    return false;
+  for (int i = 0; i < a.size(); ++i) {
+    const DrawPacket& p = a[i];
+    const DrawPacket& q = b[i];
+    if (p.geometry != q.geometry || p.shader != q.shader || p.texture != q.texture ||
+        memcmp(p.mvm, q.mvm, sizeof(p.mvm)) != 0 || memcmp(p.nmvm, q.nmvm, sizeof(p.nmvm)) != 0 ||
+        memcmp(p.color, q.color, sizeof(p.color)) != 0)
+      return false;
+  }
+  return true;
+}
+
+// Moves the given number of nodes per frame under a still camera and times
+// the world transform update, then the rest of the frame build without a
+// packet cache and with one, which rebuilds only the packets of the moving
+// nodes and their descendants
+static void benchPacketCache(const vector<int>& movingCounts) {
+  SceneStore scene;
+  makeSyntheticScene(g_numObjects, scene);
+  JobSystem js(1);
+  FrameBuildParams params;
+  params.invEyeTransform = inv(Matrix4::makeTranslation(Cvec3(0, 0, 150)));
+  params.projection = Matrix4::makeProjection(60, 16.0 / 9.0, -0.1, -500);
+
+  cout << "packet reuse: " << scene.size() << " objects, still camera, " << g_numFrames << " frames\n";
+  cout << setw(8) << "moving" << setw(10) << "world ms" << setw(14) << "uncached ms" << setw(12) << "cached ms"
+       << setw(12) << "recomputed" << setw(10) << "reused" << setw(8) << "match" << "\n";
+
+  for (size_t k = 0; k < movingCounts.size(); ++k) {
+    const int moving = std::min(movingCounts[k], scene.size());
+    PacketCache cache;
+    RenderQueue uncached, cached;
+    long long worldNanos = 0, uncachedNanos = 0, cachedNanos = 0;
+    bool match = true;
+    for (int f = -1; f < g_numFrames; ++f) {
+      for (int i = 0; i < moving; ++i) {
+        const NodeHandle h = scene.handleAt((long long)i * scene.numSlots() / moving);
+        scene.setLocal(h, scene.getLocal(h) * RigTForm(Cvec3(0.01, 0, 0)));
+      }
+      uncached.clear();
+      cached.clear();
+      const long long tw = nowNanos();
+      scene.updateWorldTransforms();
+      const long long t0 = nowNanos();
+      params.packetCache = NULL;
+      buildObjectPacketsParallel(js, uncached, scene, params);
+      const long long t1 = nowNanos();
+      params.packetCache = &cache;
+      buildObjectPacketsParallel(js, cached, scene, params);
+      const long long t2 = nowNanos();
+
+      // frame -1 fills the cache
+      if (f >= 0) {
+        worldNanos += t0 - tw;
+        uncachedNanos += t1 - t0;
+        cachedNanos += t2 - t1;
+      }
+      match = match && sameQueue(cached, uncached);
+    }
+    cout << setw(8) << moving << setw(10) << fixed << setprecision(3) << nanosToMillis(worldNanos) / g_numFrames
+         << setw(14) << nanosToMillis(uncachedNanos) / g_numFrames
+         << setw(12) << nanosToMillis(cachedNanos) / g_numFrames
+         << setw(12) << cached.recomputed << setw(10) << cached.reused
+         << setw(8) << (match ? "yes" : "NO") << "\n";
+  }
+}
+
+// Largest and mean distance between the eye space positions of the packets
+// and the double precision reference, in scene units. Packets are in slot
+// order, one per live node.
+static void packetError(const vector<DrawPacket>& packets, const vector<Cvec3>& reference,
+                        double& maxError, double& meanError) {
+  maxError = meanError = 0;
+  for (size_t k = 0; k < packets.size(); ++k) {
+    const float *t = packets[k].mvm + 12;
+    const double e = norm(Cvec3(t[0], t[1], t[2]) - reference[k]);
+    maxError = std::max(maxError, e);
+    meanError += e;
+  }
+  meanError /= std::max<size_t>(packets.size(), 1);
+}
+
+// The synthetic scene moved distance units away from the origin along x and
+// z, viewed from 600 units away so that nothing is culled. Every frame
+// builds the model view matrices three ways: in double precision with a
+// double 4x4 inverse per node for the normal matrix, narrowed only for the
+// packet; as the frame build's single precision product of the inverse eye
+// and render world matrices; and camera relative.
+static void benchPrecision(const vector<int>& distances) {
+  JobSystem js(1);
+  cout << "precision: " << g_numObjects << " objects at a distance from the origin, "
+       << g_numFrames << " frames\n";
+  cout << setw(10) << "distance" << setw(10) << "mode" << setw(10) << "ms" << setw(14) << "max error"
+       << setw(14) << "mean error" << "\n";
+  for (size_t k = 0; k < distances.size(); ++k) {
+    const Cvec3 offset(distances[k], 0, distances[k]);
+    SceneStore scene;
+    makeSyntheticScene(g_numObjects, scene);
+    for (int i = 0, n = scene.numSlots(); i < n; ++i) {
+      if (scene.parentSlot(i) < 0)
+        scene.setLocal(scene.handleAt(i), RigTForm(offset) * scene.local(i));
+    }
+    scene.updateWorldTransforms();
+
+    const RigTForm eye(offset + Cvec3(0, 0, 600));
+    const RigTForm invEye = inv(eye);
+    FrameBuildParams params;
+    params.invEyeTransform = rigTFormToMatrix(invEye);
+    params.projection = Matrix4::makeProjection(60, 16.0 / 9.0, -0.1, -2000);
+    vector<Cvec3> reference;
+    vector<DrawPacket> packets;
+    for (int i = 0, n = scene.numSlots(); i < n; ++i) {
+      if (scene.isAlive(i))
+        reference.push_back((invEye * scene.world(i)).getTranslation());
+    }
+    packets.resize(reference.size());
+
+    for (int mode = 0; mode < 3; ++mode) {
+      RenderQueue queue;
+      params.cameraRelative = mode == 2;
+      const long long t0 = nowNanos();
+      for (int f = 0; f < g_numFrames; ++f) {
+        if (mode == 0) {
+          int p = 0;
+          for (int i = 0, n = scene.numSlots(); i < n; ++i) {
+            if (!scene.isAlive(i))
+              continue;
+            const Matrix4 MVM = params.invEyeTransform * rigTFormToMatrix(scene.world(i)) *
+              Matrix4::makeScale(scene.scale(i));
+            writeDrawPacket(packets[p++], scene.geometry(i), 0, MVM, scene.color(i));
+          }
+        }
+        else {
+          queue.clear();
+          buildObjectPacketsParallel(js, queue, scene, params);
+        }
+      }
+      const double ms = nanosToMillis(nowNanos() - t0) / g_numFrames;
+      if (mode != 0) {
+        if (queue.size() != (int)packets.size())
+          throw runtime_error("precision: some nodes were culled");
+        for (int i = 0; i < queue.size(); ++i) {
+          packets[i] = queue[i];
+        }
+      }
+      double maxError, meanError;
+      packetError(packets, reference, maxError, meanError);
+      static const char *const modeNames[3] = {"double", "float", "relative"};
+      cout << setw(10) << distances[k] << setw(10) << modeNames[mode] << setw(10) << fixed << setprecision(3) << ms
+           << setw(14) << scientific << setprecision(2) << maxError << setw(14) << meanError << "\n";
+      cout.unsetf(ios::floatfield);
+    }
+  }
+}
+
+// Snapshots the synthetic scene, records a delta per frame while the given
+// numbers of nodes move, then restores the snapshot into an empty scene and
+// replays the deltas through the frame build. The replayed scene must match
+// the recorded one exactly.
+static void benchSnapshot(const vector<int>& movingCounts) {
+  const string snapFile = "scene-bench.snap", deltaFile = "scene-bench.delta";
+  SceneStore scene;
+  makeSyntheticScene(g_numObjects, scene);
+  scene.updateWorldTransforms();
+  ViewState view;
+  view.eye = RigTForm(Cvec3(0, 0, 150));
+  SnapshotWriter writer(scene);
+
+  long long t0 = nowNanos();
+  writer.writeSnapshot(snapFile, view);
+  const double writeMs = nanosToMillis(nowNanos() - t0);
+  const double mb = MappedFile(snapFile).size() / (1024.0 * 1024.0);
+  {
+    SceneStore restored;
+    ViewState restoredView;
+    t0 = nowNanos();
+    restoreSnapshot(snapFile, restored, restoredView);
+    const double restoreMs = nanosToMillis(nowNanos() - t0);
+    cout << "snapshot: " << scene.size() << " nodes, " << fixed << setprecision(1) << mb << " MB, write "
+         << setprecision(2) << writeMs << " ms, mapped restore " << restoreMs << " ms"
+         << (sceneChecksum(restored) == sceneChecksum(scene) ? "" : ", MISMATCH") << "\n";
+  }
+
+  JobSystem js(1);
+  FrameBuildParams params;
+  params.projection = Matrix4::makeProjection(60, 16.0 / 9.0, -0.1, -500);
+  cout << "deltas: " << g_numFrames << " frames\n";
+  cout << setw(8) << "moving" << setw(14) << "KB/frame" << setw(14) << "write ms" << setw(14) << "apply ms"
+       << setw(14) << "build ms" << setw(8) << "match" << "\n";
+
+  for (size_t k = 0; k < movingCounts.size(); ++k) {
+    const int moving = std::min(movingCounts[k], scene.size());
+    writer.writeSnapshot(snapFile, view);
+    long long writeNanos = 0;
+    {
+      ofstream deltas(deltaFile.c_str(), ios::binary);
+      SnapshotWriter::writeDeltaStreamHeader(deltas);
+      for (int f = 0; f < g_numFrames; ++f) {
+        for (int i = 0; i < moving; ++i) {
+          const NodeHandle h = scene.handleAt((long long)i * scene.numSlots() / moving);
+          scene.setLocal(h, scene.getLocal(h) * RigTForm(Cvec3(0.01, 0, 0)));
+        }
+        view.eye = view.eye * RigTForm(Cvec3(0, 0, -0.1));
+        t0 = nowNanos();
+        writer.writeDelta(deltas, view);
+        writeNanos += nowNanos() - t0;
+      }
+    }
+    const double kb = (MappedFile(deltaFile).size() - 8) / 1024.0 / g_numFrames;
+
+    SceneStore replayed;
+    ViewState replayedView;
+    restoreSnapshot(snapFile, replayed, replayedView);
+    DeltaReader reader(deltaFile);
+    RenderQueue queue;
+    long long applyNanos = 0, buildNanos = 0;
+    for (;;) {
+      t0 = nowNanos();
+      if (!reader.applyNext(replayed, replayedView))
+        break;
+      const long long t1 = nowNanos();
+      params.invEyeTransform = rigTFormToMatrix(inv(replayedView.eye));
+      queue.clear();
+      buildObjectPacketsParallel(js, queue, replayed, params);
+      applyNanos += t1 - t0;
+      buildNanos += nowNanos() - t1;
+    }
+    const bool match = sceneChecksum(replayed) == sceneChecksum(scene) &&
+      reader.deltasApplied() == g_numFrames;
+
+    cout << setw(8) << moving << setw(14) << setprecision(1) << kb
+         << setw(14) << setprecision(3) << nanosToMillis(writeNanos) / g_numFrames
+         << setw(14) << nanosToMillis(applyNanos) / g_numFrames
+         << setw(14) << nanosToMillis(buildNanos) / g_numFrames
+         << setw(8) << (match ? "yes" : "NO") << "\n";
+  }
+  remove(snapFile.c_str());
+  remove(deltaFile.c_str());
+}
+
+// Replays a recording made by the viewer, one delta per frame, through the
+// frame build with the viewer's default projection
+static void benchReplay(const string& name) {
+  SceneStore scene;
+  ViewState view;
+  restoreSnapshot(name + ".snap", scene, view);
+  DeltaReader reader(name + ".delta");
+
+  JobSystem js;
+  FrameBuildParams params;
+  params.projection = Matrix4::makeProjection(60, 1324.0 / 772.0, -0.1, -50);
+  RenderQueue queue;
+  vector<double> buildMs;
+  long long applyNanos = 0;
+  for (;;) {
+    const long long t0 = nowNanos();
+    if (!reader.applyNext(scene, view))
+      break;
+    const long long t1 = nowNanos();
+    params.invEyeTransform = rigTFormToMatrix(inv(view.eye));
+    queue.clear();
+    buildObjectPacketsParallel(js, queue, scene, params);
+    applyNanos += t1 - t0;
+    buildMs.push_back(nanosToMillis(nowNanos() - t1));
+  }
+  if (buildMs.empty())
+    throw runtime_error(name + ".delta holds no frames");
+
+  const int frames = buildMs.size();
+  double mean = 0;
+  for (int i = 0; i < frames; ++i) {
+    mean += buildMs[i] / frames;
+  }
+  sort(buildMs.begin(), buildMs.end());
+  cout << "replay " << name << ": " << scene.size() << " nodes, " << frames << " frames, checksum "
+       << hex << sceneChecksum(scene) << dec << "\n";
+  cout << fixed << setprecision(3) << "apply ms/frame " << nanosToMillis(applyNanos) / frames
+       << ", build ms mean " << mean << " p50 " << buildMs[frames / 2]
+       << " p95 " << buildMs[frames * 95 / 100] << " max " << buildMs.back() << "\n";
+}
+
+static double scopeMillis(const vector<ProfileNode>& frame, const char *path) {
+  for (size_t i = 0; i < frame.size(); ++i) {
+    if (frame[i].path == path)
+      return nanosToMillis(frame[i].totalNanos);
+  }
+  return 0;
+}
+
+static vector<string> splitList(const string& s) {
+  vector<string> r;
+  size_t begin = 0;
+  for (;;) {
+    const size_t end = s.find(',', begin);
+    r.push_back(s.substr(begin, end == string::npos ? string::npos : end - begin));
+    if (end == string::npos)
+      return r;
+    begin = end + 1;
+  }
+}
+
+// Parameters of the sweep and of generate: key=value or key=v1,v2,... over
+// the defaults. Keys outside the defaults are an error.
+static void parseSweepArgs(const int argc, char *argv[], map<string, vector<string> >& axes) {
+  for (int i = 0; i < argc; ++i) {
+    const string arg = argv[i];
+    const size_t eq = arg.find('=');
+    if (eq == string::npos || axes.find(arg.substr(0, eq)) == axes.end())
+      throw runtime_error("Unknown parameter " + arg);
+    axes[arg.substr(0, eq)] = splitList(arg.substr(eq + 1));
+  }
+}
+
+static SceneGenParams makeGenParams(const string& objects, const string& depth, const string& branching,
+                                    const string& moving, const string& layout) {
+  SceneGenParams gen;
+  gen.numObjects = atoi(objects.c_str());
+  gen.depth = atoi(depth.c_str());
+  gen.branching = atoi(branching.c_str());
+  gen.movingFraction = atof(moving.c_str());
+  if (!parseSceneLayout(layout, gen.layout))
+    throw runtime_error("Unknown layout " + layout + ", use uniform, clustered or grid");
+  return gen;
+}
+
+// Per frame: moves the moving objects, builds the frame (world transforms,
+// culling, packets) and runs the CPU side of submission. Prints one CSV row
+// of means over g_numFrames for every combination of the parameters, so
+// features can be compared on identical workloads.
+static void benchSweep(const int argc, char *argv[]) {
+  map<string, vector<string> > axes;
+  axes["objects"] = splitList("10000,100000");
+  axes["depth"] = splitList("0,3");
+  axes["branching"] = splitList("4");
+  axes["moving"] = splitList("0,0.1");
+  axes["layout"] = splitList("uniform,clustered,grid");
+  axes["threads"] = splitList("1");
+  parseSweepArgs(argc, argv, axes);
+
+  const char *const keys[] = {"objects", "depth", "branching", "moving", "layout", "threads"};
+  const int numKeys = 6;
+  size_t numPoints = 1;
+  for (int k = 0; k < numKeys; ++k) {
+    numPoints *= axes[keys[k]].size();
+  }
+
+  cout << "objects,depth,branching,moving,layout,threads,moving_objects,packets,culled,"
+          "update_ms,transform_ms,cull_ms,submit_ms,total_ms\n";
+  Profiler& profiler = Profiler::instance();
+  vector<float> staging;
+  for (size_t point = 0; point < numPoints; ++point) {
+    // Decode the point's value of each parameter, the last key varying fastest
+    string value[numKeys];
+    size_t rest = point;
+    for (int k = numKeys - 1; k >= 0; --k) {
+      const vector<string>& values = axes[keys[k]];
+      value[k] = values[rest % values.size()];
+      rest /= values.size();
+    }
+    const SceneGenParams gen = makeGenParams(value[0], value[1], value[2], value[3], value[4]);
+    SceneStore scene;
+    GeneratedScene generated;
+    generateScene(gen, scene, generated);
+
+    JobSystem js(atoi(value[5].c_str()));
+    FrameBuildParams params;
+    params.invEyeTransform = inv(Matrix4::makeTranslation(Cvec3(0, gen.extent * 0.2, gen.extent * 1.5)));
+    params.projection = Matrix4::makeProjection(60, 16.0 / 9.0, -0.1, -500);
+    RenderQueue queue;
+
+    // one warm-up frame sizes the queue
+    buildObjectPacketsParallel(js, queue, scene, params);
+    profiler.endFrame();
+
+    double update = 0, transform = 0, cull = 0, submit = 0, total = 0;
+    int culled = 0;
+    for (int f = 0; f < g_numFrames; ++f) {
+      const long long t0 = nowNanos();
+      {
+        ProfileScope scope("update");
+        animateGeneratedScene(scene, generated, f / 60.0);
+      }
+      queue.clear();
+      culled = buildObjectPacketsParallel(js, queue, scene, params);
+      simulateSubmission(queue, staging);
+      total += nanosToMillis(nowNanos() - t0);
+
+      profiler.endFrame();
+      const vector<ProfileNode>& frame = profiler.lastFrame();
+      update += scopeMillis(frame, "update");
+      transform += scopeMillis(frame, "transforms");
+      cull += scopeMillis(frame, "culling") + scopeMillis(frame, "compaction");
+      submit += scopeMillis(frame, "submission");
+    }
+
+    cout << gen.numObjects << "," << gen.depth << "," << gen.branching << "," << value[3] << ","
+         << sceneLayoutName(gen.layout) << "," << js.numThreads() << "," << generated.moving.size() << ","
+         << queue.size() << "," << culled << fixed << setprecision(3)
+         << "," << update / g_numFrames << "," << transform / g_numFrames << "," << cull / g_numFrames
+         << "," << submit / g_numFrames << "," << total / g_numFrames << "\n" << flush;
+    cout.unsetf(ios::floatfield);
+  }
+}
+
+// Writes a generated scene to a file the viewer loads with -scene
+static void generateSceneFile(const string& file, const int argc, char *argv[]) {
+  map<string, vector<string> > axes;
+  axes["objects"] = splitList("10000");
+  axes["depth"] = splitList("0");
+  axes["branching"] = splitList("4");
+  axes["layout"] = splitList("uniform");
+  parseSweepArgs(argc, argv, axes);
+
+  // Scene files hold no motion, so nothing moves
+  const SceneGenParams gen = makeGenParams(axes["objects"][0], axes["depth"][0], axes["branching"][0],
+                                           "0", axes["layout"][0]);
+  SceneStore scene;
+  GeneratedScene generated;
+  generateScene(gen, scene, generated);
+  const bool binary = file.size() > 5 && file.compare(file.size() - 5, 5, ".scnb") == 0;
+  saveScene(scene, file, binary);
+  cout << "Wrote " << scene.size() << " objects to " << file << (binary ? " (binary)" : "") << "\n";
+}
+
+static vector<int> parseInts(const int argc, char *argv[]) {
+  vector<int> r;
+  for (int i = 0; i < argc; ++i) {
+    r.push_back(atoi(argv[i]));
+  }
+  return r;
+}
+
+int main(int argc, char *argv[]) {
+  try {
+    const char *which = argc > 1 ? argv[1] : NULL;
+
+    // Thread counts past the cores online share them, so their timings
+    // show scheduling overhead rather than scaling
+    cout << "cores online: " << sysconf(_SC_NPROCESSORS_ONLN) << "\n";
+
+    if (!which || strcmp(which, "pipeline") == 0) {
+      vector<int> threadCounts = which ? parseInts(argc - 2, argv + 2) : vector<int>();
+      if (threadCounts.empty()) {
+        const int defaults[] = {1, 2, 4, 8, 16};
+        threadCounts.assign(defaults, defaults + 5);
+      }
+      benchFramePipeline(threadCounts);
+    }
+    if (!which || strcmp(which, "pool") == 0)
+      benchPool();
+    if (!which || strcmp(which, "anim") == 0) {
+      vector<int> threadCounts = which ? parseInts(argc - 2, argv + 2) : vector<int>();
+      if (threadCounts.empty()) {
+        const int defaults[] = {1, 2, 4, 8};
+        threadCounts.assign(defaults, defaults + 4);
+      }
+      benchAnimation(threadCounts);
+    }
+    if (!which || strcmp(which, "shadow") == 0) {
+      vector<int> movingCounts = which ? parseInts(argc - 2, argv + 2) : vector<int>();
+      if (movingCounts.empty()) {
+        const int defaults[] = {0, 100, 1000, 10000};
+        movingCounts.assign(defaults, defaults + 4);
+      }
+      benchShadowCasters(movingCounts);
+    }
+    if (!which || strcmp(which, "hierarchy") == 0)
+      benchHierarchy();
+    if (!which || strcmp(which, "reuse") == 0) {
+      vector<int> movingCounts = which ? parseInts(argc - 2, argv + 2) : vector<int>();
+      if (movingCounts.empty()) {
+        const int defaults[] = {0, 100, 1000, 10000, 100000};
+        movingCounts.assign(defaults, defaults + 5);
+      }
+      benchPacketCache(movingCounts);
+    }
+    if (!which || strcmp(which, "precision") == 0) {
+      vector<int> distances = which ? parseInts(argc - 2, argv + 2) : vector<int>();
+      if (distances.empty()) {
+        const int defaults[] = {0, 1000, 10000, 100000};
+        distances.assign(defaults, defaults + 4);
+      }
+      benchPrecision(distances);
+    }
+    if (!which || strcmp(which, "occlusion") == 0) {
+      vector<int> threadCounts = which ? parseInts(argc - 2, argv + 2) : vector<int>();
+      if (threadCounts.empty()) {
+        const int defaults[] = {1, 4};
+        threadCounts.assign(defaults, defaults + 2);
+      }
+      benchOcclusion(threadCounts);
+    }
+    if (!which || strcmp(which, "raster") == 0) {
+      vector<int> threadCounts = which ? parseInts(argc - 2, argv + 2) : vector<int>();
+      if (threadCounts.empty()) {
+        const int defaults[] = {1, 2, 4};
+        threadCounts.assign(defaults, defaults + 3);
+      }
+      benchSoftRaster(threadCounts);
+    }
+    if (!which || strcmp(which, "trace") == 0) {
+      vector<int> threadCounts = which ? parseInts(argc - 2, argv + 2) : vector<int>();
+      if (threadCounts.empty()) {
+        const int defaults[] = {1, 2, 4};
+        threadCounts.assign(defaults, defaults + 3);
+      }
+      benchRayTrace(threadCounts);
+    }
+    if (!which || strcmp(which, "load") == 0) {
+      vector<int> nodeCounts = which ? parseInts(argc - 2, argv + 2) : vector<int>();
+      if (nodeCounts.empty()) {
+        const int defaults[] = {100000, 1000000};
+        nodeCounts.assign(defaults, defaults + 2);
+      }
+      benchSceneLoad(nodeCounts);
+    }
+    if (!which || strcmp(which, "snapshot") == 0) {
+      vector<int> movingCounts = which ? parseInts(argc - 2, argv + 2) : vector<int>();
+      if (movingCounts.empty()) {
+        const int defaults[] = {0, 100, 1000, 10000};
+        movingCounts.assign(defaults, defaults + 4);
+      }
+      benchSnapshot(movingCounts);
+    }
+    if (!which || strcmp(which, "sweep") == 0)
+      benchSweep(which ? argc - 2 : 0, argv + 2);
+    if (which && strcmp(which, "generate") == 0) {
+      if (argc < 3)
+        throw runtime_error("generate needs a file name");
+      generateSceneFile(argv[2], argc - 3, argv + 3);
+    }
+    if (which && strcmp(which, "regress") == 0) {
+      if (argc < 3)
+        throw runtime_error("regress needs the directory of the golden images");
+      if (!benchRegression(argv[2], argc > 3 && strcmp(argv[3], "update") == 0))
+        return 1;
+    }
+    if (which && strcmp(which, "replay") == 0) {
+      if (argc < 3)
+        throw runtime_error("replay needs the name of a recording");
+      benchReplay(argv[2]);
+    }
+    return 0;
+  }
+  catch (const runtime_error& e) {
+    cout << "Exception caught: " << e.what() << endl;
+    return -1;
+  }
+}
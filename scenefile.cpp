@@ -0,0 +1,463 @@
+#include <vector>
+#include <deque>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <stdexcept>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+
+#include <pthread.h>
+
+#include "cvec.h"
+#include "quat.h"
+#include "rigtform.h"
+#include "visobj.h"
+#include "scenefile.h"
+
+using namespace std;
+
+static const char g_binaryMagic[4] = {'S', 'C', 'N', 'B'};
+static const unsigned g_formatVersion = 1;
+static const int g_recordBytes = 60;
+static const int g_maxQueuedChunks = 8;   // how far the parser may run ahead
+
+static const char *geometryName(const GeometryId g) {
+  switch (g) {
+    case GEOMETRY_CUBE: return "cube";
+    case GEOMETRY_SPHERE: return "sphere";
+    default: return NULL;
+  }
+}
+
+static bool parseGeometryName(const char *name, GeometryId& g) {
+  if (strcmp(name, "cube") == 0)
+    g = GEOMETRY_CUBE;
+  else if (strcmp(name, "sphere") == 0)
+    g = GEOMETRY_SPHERE;
+  else
+    return false;
+  return true;
+}
+
+// Bounding radius of the geometry in the node's frame: the unit cube, or the
+// sphere of diameter 1 drawn for GEOMETRY_SPHERE
+static double geometryRadius(const GeometryId g) {
+  return g == GEOMETRY_SPHERE ? 0.5 : VISOBJ_CUBE_RADIUS;
+}
+
+// --------- Writing
+
+void collectSceneNodes(const SceneStore& scene, vector<SceneFileNode>& nodes) {
+  const int n = scene.numSlots();
+  vector<int> fileIndex(n, -1);
+  vector<int> pending;
+  nodes.clear();
+  nodes.reserve(scene.size());
+  for (int i = 0; i < n; ++i) {
+    // ancestors not written yet go first, root most first
+    for (int s = i; s >= 0 && scene.isAlive(s) && fileIndex[s] < 0; s = scene.parentSlot(s)) {
+      pending.push_back(s);
+    }
+    while (!pending.empty()) {
+      const int s = pending.back();
+      pending.pop_back();
+      const int p = scene.parentSlot(s);
+      SceneFileNode node;
+      node.parent = p >= 0 ? fileIndex[p] : -1;
+      node.geometry = scene.geometry(s);
+      node.local = scene.local(s);
+      node.scale = scene.scale(s);
+      node.color = scene.color(s);
+      fileIndex[s] = (int)nodes.size();
+      nodes.push_back(node);
+    }
+  }
+}
+
+void writeSceneText(ostream& os, const vector<SceneFileNode>& nodes) {
+  os << "scene " << g_formatVersion << "\n";
+  os << "# geometry parent  translation  rotation (w x y z)  scale  color\n";
+  os.precision(9);
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    const SceneFileNode& n = nodes[i];
+    const Cvec3 t = n.local.getTranslation();
+    const Quat q = n.local.getRotation();
+    os << geometryName(n.geometry) << " " << n.parent
+       << "  " << t[0] << " " << t[1] << " " << t[2]
+       << "  " << q[0] << " " << q[1] << " " << q[2] << " " << q[3]
+       << "  " << n.scale[0] << " " << n.scale[1] << " " << n.scale[2]
+       << "  " << n.color[0] << " " << n.color[1] << " " << n.color[2] << "\n";
+  }
+}
+
+// Little endian, as are all hosts the viewer runs on
+static void putU32(char *&p, const unsigned v) {
+  memcpy(p, &v, 4);
+  p += 4;
+}
+
+static void putF32(char *&p, const double v) {
+  const float f = (float)v;
+  memcpy(p, &f, 4);
+  p += 4;
+}
+
+void writeSceneBinary(ostream& os, const vector<SceneFileNode>& nodes) {
+  char header[12];
+  char *p = header + 4;
+  memcpy(header, g_binaryMagic, 4);
+  putU32(p, g_formatVersion);
+  putU32(p, (unsigned)nodes.size());
+  os.write(header, sizeof(header));
+
+  char record[g_recordBytes];
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    const SceneFileNode& n = nodes[i];
+    const Cvec3 t = n.local.getTranslation();
+    const Quat q = n.local.getRotation();
+    p = record;
+    putU32(p, (unsigned)n.parent);
+    putU32(p, (unsigned)n.geometry);
+    for (int k = 0; k < 3; ++k) putF32(p, t[k]);
+    for (int k = 0; k < 4; ++k) putF32(p, q[k]);
+    for (int k = 0; k < 3; ++k) putF32(p, n.scale[k]);
+    for (int k = 0; k < 3; ++k) putF32(p, n.color[k]);
+    os.write(record, g_recordBytes);
+  }
+}
+
+void saveScene(const SceneStore& scene, const string& filename, const bool binary) {
+  vector<SceneFileNode> nodes;
+  collectSceneNodes(scene, nodes);
+  ofstream f(filename.c_str(), binary ? ios::binary : ios::out);
+  if (!f)
+    throw runtime_error("Cannot open " + filename + " for writing");
+  if (binary)
+    writeSceneBinary(f, nodes);
+  else
+    writeSceneText(f, nodes);
+  f.close();
+  if (!f)
+    throw runtime_error("Error writing " + filename);
+}
+
+// --------- Loading
+
+SceneLoader::SceneLoader(const string& filename, const int chunkNodes)
+  : filename_(filename), file_(NULL), binary_(false), chunkNodes_(chunkNodes),
+    parsed_(false), stop_(false), currentPos_(0), failed_(false) {
+  file_ = fopen(filename.c_str(), "rb");
+  if (!file_)
+    throw runtime_error("Cannot open scene file " + filename);
+  char magic[4];
+  binary_ = fread(magic, 1, 4, file_) == 4 && memcmp(magic, g_binaryMagic, 4) == 0;
+  if (!binary_)
+    rewind(file_);
+
+  pthread_mutex_init(&lock_, NULL);
+  pthread_cond_init(&changed_, NULL);
+  if (pthread_create(&thread_, NULL, threadMain, this) != 0) {
+    fclose(file_);
+    throw runtime_error("pthread_create fails");
+  }
+}
+
+SceneLoader::~SceneLoader() {
+  pthread_mutex_lock(&lock_);
+  stop_ = true;
+  pthread_cond_broadcast(&changed_);
+  pthread_mutex_unlock(&lock_);
+  pthread_join(thread_, NULL);
+  fclose(file_);
+  pthread_cond_destroy(&changed_);
+  pthread_mutex_destroy(&lock_);
+}
+
+int SceneLoader::insert(SceneStore& scene, const int maxNodes) {
+  return insertNodes(scene, maxNodes, false);
+}
+
+int SceneLoader::insertAll(SceneStore& scene) {
+  return insertNodes(scene, INT_MAX, true);
+}
+
+bool SceneLoader::finished() {
+  if (failed_)
+    return true;
+  if (currentPos_ < current_.size())
+    return false;
+  pthread_mutex_lock(&lock_);
+  const bool done = parsed_ && chunks_.empty() && error_.empty();
+  pthread_mutex_unlock(&lock_);
+  return done;
+}
+
+int SceneLoader::insertNodes(SceneStore& scene, const int maxNodes, const bool wait) {
+  int n = 0;
+  while (n < maxNodes) {
+    if (currentPos_ == current_.size() && !takeChunk(wait))
+      break;
+    const int end = min(current_.size(), currentPos_ + (maxNodes - n));
+    for (; (int)currentPos_ < end; ++currentPos_, ++n) {
+      const SceneFileNode& node = current_[currentPos_];
+      const NodeHandle parent = node.parent >= 0 ? handles_[node.parent] : NodeHandle();
+      handles_.push_back(scene.create(node.local, node.scale, node.color, parent,
+                                      geometryRadius(node.geometry), node.geometry));
+    }
+  }
+  return n;
+}
+
+// Makes the next parsed chunk current. Returns false if there is none yet
+// (and wait is off) or the file is done; throws the parse error, if any,
+// once everything before it has been taken.
+bool SceneLoader::takeChunk(const bool wait) {
+  if (failed_)
+    return false;
+  pthread_mutex_lock(&lock_);
+  while (wait && chunks_.empty() && !parsed_) {
+    pthread_cond_wait(&changed_, &lock_);
+  }
+  const bool taken = !chunks_.empty();
+  if (taken) {
+    current_.swap(chunks_.front());
+    chunks_.pop_front();
+    currentPos_ = 0;
+    pthread_cond_broadcast(&changed_);
+  }
+  const string error = parsed_ && chunks_.empty() ? error_ : string();
+  pthread_mutex_unlock(&lock_);
+
+  if (!taken && !error.empty()) {
+    failed_ = true;
+    throw runtime_error(error);
+  }
+  return taken;
+}
+
+void *SceneLoader::threadMain(void *arg) {
+  static_cast<SceneLoader*>(arg)->parse();
+  return NULL;
+}
+
+void SceneLoader::parse() {
+  vector<SceneFileNode> chunk;
+  chunk.reserve(chunkNodes_);
+  string error;
+  try {
+    if (binary_)
+      parseBinary(chunk);
+    else
+      parseText(chunk);
+  }
+  catch (const runtime_error& e) {
+    error = e.what();
+  }
+  // the nodes before an error still go in
+  if (!chunk.empty())
+    push(chunk);
+  pthread_mutex_lock(&lock_);
+  parsed_ = true;
+  error_ = error;
+  pthread_cond_broadcast(&changed_);
+  pthread_mutex_unlock(&lock_);
+}
+
+// Queues a parsed chunk, leaving chunk empty, after waiting for room.
+// Returns false if the loader is being destroyed.
+bool SceneLoader::push(vector<SceneFileNode>& chunk) {
+  pthread_mutex_lock(&lock_);
+  while ((int)chunks_.size() >= g_maxQueuedChunks && !stop_) {
+    pthread_cond_wait(&changed_, &lock_);
+  }
+  const bool stopping = stop_;
+  if (!stopping) {
+    chunks_.push_back(vector<SceneFileNode>());
+    chunks_.back().swap(chunk);
+    pthread_cond_broadcast(&changed_);
+  }
+  pthread_mutex_unlock(&lock_);
+  chunk.clear();
+  chunk.reserve(chunkNodes_);
+  return !stopping;
+}
+
+// Error in a text file line, or for line 0 in a binary file's node
+static runtime_error parseError(const string& filename, const int line, const int index,
+                                const string& what) {
+  ostringstream msg;
+  msg << filename << ":";
+  if (line > 0)
+    msg << line << ": ";
+  else
+    msg << " node " << index << ": ";
+  msg << what;
+  return runtime_error(msg.str());
+}
+
+void SceneLoader::checkNode(const SceneFileNode& node, const int index, const int line) const {
+  if (node.parent < -1 || node.parent >= index) {
+    ostringstream msg;
+    msg << "parent " << node.parent << " is not an earlier node";
+    throw parseError(filename_, line, index, msg.str());
+  }
+  if (!geometryName(node.geometry))
+    throw parseError(filename_, line, index, "unknown geometry");
+}
+
+// Parses numbers with strtod, much faster than istream extraction
+static bool parseDoubles(char *&p, double *out, const int n) {
+  for (int i = 0; i < n; ++i) {
+    char *end;
+    out[i] = strtod(p, &end);
+    if (end == p)
+      return false;
+    p = end;
+  }
+  return true;
+}
+
+// Rotation from the file's quaternion, which need not be normalized
+static bool makeRotation(const double q[4], Quat& r) {
+  const Quat raw(q[0], q[1], q[2], q[3]);
+  if (norm2(raw) < 1e-12)
+    return false;
+  r = normalize(raw);
+  return true;
+}
+
+void SceneLoader::parseText(vector<SceneFileNode>& chunk) {
+  vector<char> buf(1 << 20);
+  size_t have = 0;
+  int lineNo = 0, index = 0;
+  bool header = false;
+
+  for (;;) {
+    // the last byte of buf is kept free to end an unterminated last line
+    const size_t got = fread(&buf[have], 1, buf.size() - 1 - have, file_);
+    if (ferror(file_))
+      throw runtime_error("Error reading " + filename_);
+    have += got;
+    const bool atEnd = got == 0;
+    if (atEnd && have > 0)
+      buf[have++] = '\n';
+
+    size_t start = 0;
+    char *nl;
+    while ((nl = (char*)memchr(&buf[start], '\n', have - start)) != NULL) {
+      char *p = &buf[start];
+      start = nl - &buf[0] + 1;
+      *nl = '\0';
+      ++lineNo;
+      char *comment = strchr(p, '#');
+      if (comment)
+        *comment = '\0';
+      p += strspn(p, " \t\r");
+      if (*p == '\0')
+        continue;
+
+      char *word = p;
+      p += strcspn(p, " \t\r");
+      if (*p)
+        *p++ = '\0';
+
+      if (!header) {
+        char *end;
+        const long version = strtol(p, &end, 10);
+        if (strcmp(word, "scene") != 0 || end == p)
+          throw parseError(filename_, lineNo, index, "expected \"scene <version>\"");
+        if (version != (long)g_formatVersion)
+          throw parseError(filename_, lineNo, index, "unsupported version");
+        header = true;
+        continue;
+      }
+
+      SceneFileNode node;
+      if (!parseGeometryName(word, node.geometry))
+        throw parseError(filename_, lineNo, index, string("unknown geometry \"") + word + "\"");
+      char *end;
+      node.parent = (int)strtol(p, &end, 10);
+      double v[13];
+      Quat rotation;
+      if (end == p || !parseDoubles(p = end, v, 13))
+        throw parseError(filename_, lineNo, index, "expected parent, translation, rotation, scale and color");
+      if (p[strspn(p, " \t\r")] != '\0')
+        throw parseError(filename_, lineNo, index, "unexpected text after the color");
+      if (!makeRotation(v + 3, rotation))
+        throw parseError(filename_, lineNo, index, "zero rotation quaternion");
+      node.local = RigTForm(Cvec3(v[0], v[1], v[2]), rotation);
+      node.scale = Cvec3(v[7], v[8], v[9]);
+      node.color = Cvec3f(v[10], v[11], v[12]);
+      checkNode(node, index++, lineNo);
+
+      chunk.push_back(node);
+      if ((int)chunk.size() == chunkNodes_ && !push(chunk))
+        return;
+    }
+    memmove(&buf[0], &buf[start], have - start);
+    have -= start;
+    if (atEnd)
+      break;
+    if (have == buf.size() - 1)
+      throw runtime_error(filename_ + ": line too long");
+  }
+  if (!header)
+    throw runtime_error(filename_ + ": not a scene file");
+}
+
+static unsigned getU32(const char *&p) {
+  unsigned v;
+  memcpy(&v, p, 4);
+  p += 4;
+  return v;
+}
+
+static double getF32(const char *&p) {
+  float f;
+  memcpy(&f, p, 4);
+  p += 4;
+  return f;
+}
+
+void SceneLoader::parseBinary(vector<SceneFileNode>& chunk) {
+  char header[8];
+  if (fread(header, 1, sizeof(header), file_) != sizeof(header))
+    throw runtime_error(filename_ + ": truncated header");
+  const char *p = header;
+  if (getU32(p) != g_formatVersion)
+    throw runtime_error(filename_ + ": unsupported version");
+  const int count = (int)getU32(p);
+
+  vector<char> buf((size_t)chunkNodes_ * g_recordBytes);
+  for (int index = 0; index < count; ) {
+    const int n = min(chunkNodes_, count - index);
+    if (fread(&buf[0], g_recordBytes, n, file_) != (size_t)n) {
+      ostringstream msg;
+      msg << filename_ << ": truncated, " << count << " nodes expected";
+      throw runtime_error(msg.str());
+    }
+    p = &buf[0];
+    for (int i = 0; i < n; ++i, ++index) {
+      SceneFileNode node;
+      double v[13];
+      node.parent = (int)getU32(p);
+      node.geometry = (GeometryId)getU32(p);
+      for (int k = 0; k < 13; ++k) {
+        v[k] = getF32(p);
+      }
+      Quat rotation;
+      if (!makeRotation(v + 3, rotation))
+        throw parseError(filename_, 0, index, "zero rotation quaternion");
+      node.local = RigTForm(Cvec3(v[0], v[1], v[2]), rotation);
+      node.scale = Cvec3(v[7], v[8], v[9]);
+      node.color = Cvec3f(v[10], v[11], v[12]);
+      checkNode(node, index, 0);
+      chunk.push_back(node);
+    }
+    if ((int)chunk.size() == chunkNodes_ && !push(chunk))
+      return;
+  }
+}
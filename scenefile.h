@@ -0,0 +1,129 @@
+#ifndef SCENEFILE_H
+#define SCENEFILE_H
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <cstdio>
+#include <iosfwd>
+
+#include <pthread.h>
+
+#include "cvec.h"
+#include "rigtform.h"
+#include "rendercmd.h"
+#include "scenestore.h"
+
+//--------------------------------------------------------------------------------
+// Scene files: a flat list of nodes, each with its geometry, parent, local
+// transform, scale and color. A parent is referenced by its index in the
+// file and always comes before its children, so a file can be inserted into
+// a SceneStore front to back while it is still being read.
+//
+// Text files are meant to be written by hand. '#' starts a comment and blank
+// lines are skipped. The first line is "scene 1", then one line per node:
+//
+//   <geometry> <parent> <tx ty tz> <qw qx qy qz> <sx sy sz> <r g b>
+//
+// with geometry "cube" or "sphere", parent -1 for roots, and the rotation a
+// quaternion (normalized on load).
+//
+// Binary files start with the magic "SCNB", a version (1) and the node
+// count, as little endian 32 bit integers, followed by one 60 byte record
+// per node: int32 parent, uint32 geometry id, then translation, rotation,
+// scale and color as 32 bit floats in the order of the text format.
+//--------------------------------------------------------------------------------
+
+struct SceneFileNode {
+  int parent;            // index of an earlier node, -1 for roots
+  GeometryId geometry;
+  RigTForm local;
+  Cvec3 scale;
+  Cvec3f color;
+};
+
+// Nodes of the scene's live slots, parents before children
+void collectSceneNodes(const SceneStore& scene, std::vector<SceneFileNode>& nodes);
+
+void writeSceneText(std::ostream& os, const std::vector<SceneFileNode>& nodes);
+void writeSceneBinary(std::ostream& os, const std::vector<SceneFileNode>& nodes);
+
+// Writes the scene to a file in either format; throws on I/O errors
+void saveScene(const SceneStore& scene, const std::string& filename, const bool binary);
+
+// Reads a scene file on a background thread and hands the nodes over in
+// chunks. The owner inserts them into its scene at its own pace with
+// insert(), for example a bounded number per frame, so a large scene starts
+// rendering long before it is read in full. The parser runs at most a few
+// chunks ahead of insertion.
+class SceneLoader {
+public:
+  // Opens the file, telling the format from its first bytes, and starts the
+  // parser thread. Throws if the file cannot be opened.
+  explicit SceneLoader(const std::string& filename, const int chunkNodes = 4096);
+
+  // Stops the parser if it is still running
+  ~SceneLoader();
+
+  // Creates up to maxNodes nodes from the chunks parsed so far, without
+  // waiting for more, and returns how many it created. After a parse error,
+  // the nodes before it are inserted and then the error is thrown.
+  int insert(SceneStore& scene, const int maxNodes);
+
+  // Waits for the parser and inserts everything that is left
+  int insertAll(SceneStore& scene);
+
+  // Every node of the file is in the scene (or a parse error was thrown)
+  bool finished();
+
+  int nodesInserted() const {
+    return (int)handles_.size();
+  }
+
+  // Handle of the node with the given index in the file, once inserted
+  NodeHandle handle(const int index) const {
+    return handles_[index];
+  }
+
+  bool binary() const {
+    return binary_;
+  }
+
+private:
+  std::string filename_;
+  FILE *file_;
+  bool binary_;
+  int chunkNodes_;
+  pthread_t thread_;
+
+  // Shared with the parser thread, guarded by lock_
+  pthread_mutex_t lock_;
+  pthread_cond_t changed_;
+  std::deque<std::vector<SceneFileNode> > chunks_;
+  bool parsed_;
+  bool stop_;
+  std::string error_;
+
+  // Owned by the inserting thread
+  std::vector<SceneFileNode> current_;
+  size_t currentPos_;
+  std::vector<NodeHandle> handles_;
+  bool failed_;
+
+  SceneLoader(const SceneLoader&);
+  const SceneLoader& operator= (const SceneLoader&);
+
+  int insertNodes(SceneStore& scene, const int maxNodes, const bool wait);
+  bool takeChunk(const bool wait);
+
+  // Parser thread
+  void parse();
+  void parseText(std::vector<SceneFileNode>& chunk);
+  void parseBinary(std::vector<SceneFileNode>& chunk);
+  bool push(std::vector<SceneFileNode>& chunk);
+  void checkNode(const SceneFileNode& node, const int index, const int line) const;
+
+  static void *threadMain(void *arg);
+};
+
+#endif
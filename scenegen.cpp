@@ -0,0 +1,151 @@
+#include <vector>
+#include <string>
+#include <cmath>
+#include <stdexcept>
+
+#include "cvec.h"
+#include "quat.h"
+#include "rigtform.h"
+#include "rendercmd.h"
+#include "visobj.h"
+#include "scenestore.h"
+#include "scenegen.h"
+
+using namespace std;
+
+static const char *const g_layoutNames[NUM_LAYOUTS] = {"uniform", "clustered", "grid"};
+static const int g_numClusters = 16;
+
+// Bounding radius of the sphere of diameter 1 drawn for GEOMETRY_SPHERE
+static const double g_sphereRadius = 0.5;
+
+// Deterministic pseudo random numbers in [0, 1)
+static double random01(unsigned& state) {
+  state = state * 1664525u + 1013904223u;
+  return (state >> 8) * (1.0 / 16777216.0);
+}
+
+static Cvec3 randomInBox(unsigned& rng, const double halfSize) {
+  return Cvec3(random01(rng) * 2 - 1, random01(rng) * 2 - 1, random01(rng) * 2 - 1) * halfSize;
+}
+
+static Cvec3 randomDirection(unsigned& rng) {
+  for (;;) {
+    const Cvec3 d = randomInBox(rng, 1);
+    const double n2 = norm2(d);
+    if (n2 > 0.01 && n2 <= 1)
+      return d / std::sqrt(n2);
+  }
+}
+
+// Objects in one tree of the given shape, capped at limit
+static int treeSize(const int depth, const int branching, const int limit) {
+  long long size = 1, level = 1;
+  for (int d = 0; d < depth && size < limit; ++d) {
+    level *= branching;
+    size += level;
+  }
+  return (int)std::min(size, (long long)limit);
+}
+
+static Cvec3 rootPosition(const SceneGenParams& params, const int root, const int numRoots,
+                          const vector<Cvec3>& clusters, unsigned& rng) {
+  switch (params.layout) {
+  case LAYOUT_CLUSTERED: {
+    // Sum of three uniforms: roughly normal around the cluster center
+    const Cvec3& c = clusters[(int)(random01(rng) * clusters.size())];
+    const double sigma = params.extent * 0.05;
+    return c + (randomInBox(rng, 1) + randomInBox(rng, 1) + randomInBox(rng, 1)) * sigma;
+  }
+  case LAYOUT_GRID: {
+    const int side = (int)std::ceil(std::sqrt((double)numRoots));
+    const double spacing = 2 * params.extent / side;
+    return Cvec3(-params.extent + (root % side + 0.5) * spacing, 0,
+                 -params.extent + (root / side + 0.5) * spacing);
+  }
+  default:
+    return randomInBox(rng, params.extent);
+  }
+}
+
+static NodeHandle addObject(const SceneGenParams& params, SceneStore& scene, GeneratedScene& out,
+                            const RigTForm& local, const NodeHandle parent, unsigned& rng) {
+  const Cvec3f color(random01(rng), random01(rng), random01(rng));
+  NodeHandle h;
+  if (random01(rng) < params.sphereFraction)
+    h = scene.create(local, Cvec3(1, 1, 1), color, parent, g_sphereRadius, GEOMETRY_SPHERE);
+  else
+    h = VisObj(&scene, local, color, parent).getHandle();
+  out.nodes.push_back(h);
+  if (random01(rng) < params.movingFraction) {
+    out.moving.push_back(h);
+    out.movingRest.push_back(local);
+  }
+  return h;
+}
+
+void generateScene(const SceneGenParams& params, SceneStore& scene, GeneratedScene& out) {
+  if (params.numObjects < 0 || params.depth < 0 || (params.depth > 0 && params.branching < 1))
+    throw runtime_error("generateScene: bad object count or tree shape");
+  if (params.movingFraction < 0 || params.movingFraction > 1 ||
+      params.sphereFraction < 0 || params.sphereFraction > 1)
+    throw runtime_error("generateScene: fractions must be in [0, 1]");
+
+  unsigned rng = params.seed;
+  const int n = params.numObjects;
+  const int perTree = treeSize(params.depth, params.branching, std::max(n, 1));
+  const int numRoots = (n + perTree - 1) / perTree;
+  vector<Cvec3> clusters;
+  for (int i = 0; i < g_numClusters; ++i) {
+    clusters.push_back(randomInBox(rng, params.extent));
+  }
+
+  scene.reserve(scene.size() + n);
+  out.nodes.reserve(out.nodes.size() + n);
+  vector<NodeHandle> level, next;
+  int created = 0;
+  for (int r = 0; r < numRoots && created < n; ++r) {
+    const RigTForm rootLocal(rootPosition(params, r, numRoots, clusters, rng),
+                             Quat::makeZRotation(random01(rng) * 360));
+    level.assign(1, addObject(params, scene, out, rootLocal, NodeHandle(), rng));
+    ++created;
+
+    // Children further up the tree sit further from their parent, so the
+    // subtrees below them do not overlap much
+    for (int d = 1; d <= params.depth && created < n; ++d) {
+      const double spread = 1.5 * (params.depth - d + 1);
+      next.clear();
+      for (size_t p = 0; p < level.size() && created < n; ++p) {
+        for (int k = 0; k < params.branching && created < n; ++k) {
+          const RigTForm local(randomDirection(rng) * spread, Quat::makeZRotation(random01(rng) * 360));
+          next.push_back(addObject(params, scene, out, local, level[p], rng));
+          ++created;
+        }
+      }
+      level.swap(next);
+    }
+  }
+}
+
+void animateGeneratedScene(SceneStore& scene, const GeneratedScene& generated, const double t) {
+  for (size_t i = 0; i < generated.moving.size(); ++i) {
+    const double phase = i * 0.618;
+    const RigTForm offset(Cvec3(0, 0.5 * std::sin(CS175_PI * t + phase), 0),
+                          Quat::makeZRotation(90 * t + phase * 57.3));
+    scene.setLocal(generated.moving[i], generated.movingRest[i] * offset);
+  }
+}
+
+const char *sceneLayoutName(const SceneLayout layout) {
+  return layout >= 0 && layout < NUM_LAYOUTS ? g_layoutNames[layout] : "unknown";
+}
+
+bool parseSceneLayout(const string& name, SceneLayout& layout) {
+  for (int i = 0; i < NUM_LAYOUTS; ++i) {
+    if (name == g_layoutNames[i]) {
+      layout = (SceneLayout)i;
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,64 @@
+#ifndef SCENEGEN_H
+#define SCENEGEN_H
+
+#include <vector>
+#include <string>
+
+#include "rigtform.h"
+#include "scenestore.h"
+
+//--------------------------------------------------------------------------------
+// Procedural scenes for benchmarks. A generated scene is a forest of
+// identical trees of cubes and spheres: every root has `branching` children,
+// each of those has `branching` children of its own, and so on for `depth`
+// levels, until the requested number of objects is reached. The roots are
+// spread out by a layout; descendants stay near their root. A fraction of
+// the objects moves, every frame, through animateGeneratedScene().
+//
+// Generation is deterministic for a given seed, so runs with the same
+// parameters see the same scene.
+//--------------------------------------------------------------------------------
+
+// How the roots are placed
+enum SceneLayout {
+  LAYOUT_UNIFORM,        // uniformly in a cube of half size extent
+  LAYOUT_CLUSTERED,      // in 16 tight clusters scattered through that cube
+  LAYOUT_GRID,           // on a square grid of side 2 extent in the x-z plane
+  NUM_LAYOUTS
+};
+
+struct SceneGenParams {
+  int numObjects;
+  int depth;             // levels below the roots, 0 for a flat scene
+  int branching;         // children of every node above the leaves
+  double movingFraction; // of all objects, in [0, 1]
+  double sphereFraction; // objects drawn as spheres, the others are cubes
+  SceneLayout layout;
+  double extent;
+  unsigned seed;
+
+  SceneGenParams()
+    : numObjects(10000), depth(0), branching(4), movingFraction(0), sphereFraction(0.25),
+      layout(LAYOUT_UNIFORM), extent(100), seed(12345) {}
+};
+
+struct GeneratedScene {
+  std::vector<NodeHandle> nodes;       // parents before their children
+  std::vector<NodeHandle> moving;
+  std::vector<RigTForm> movingRest;    // local transform each moving node started at
+};
+
+// Adds the objects to the scene; throws on nonsensical parameters
+void generateScene(const SceneGenParams& params, SceneStore& scene, GeneratedScene& out);
+
+// Sets the local transforms of the moving objects for time t in seconds:
+// each one spins about its z axis and bobs up and down around where it
+// started, out of phase with the others
+void animateGeneratedScene(SceneStore& scene, const GeneratedScene& generated, const double t);
+
+const char *sceneLayoutName(const SceneLayout layout);
+
+// Looks up a layout by name; false if there is none
+bool parseSceneLayout(const std::string& name, SceneLayout& layout);
+
+#endif
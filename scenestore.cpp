@@ -0,0 +1,408 @@
+#include <vector>
+#include <algorithm>
+#include <cassert>
+
+#include "cvec.h"
+#include "matrix4.h"
+#include "rigtform.h"
+#include "scenestore.h"
+
+using namespace std;
+
+void SceneStore::reserve(const int n) {
+  slots_.reserve(n);
+  local_.reserve(n);
+  scale_.reserve(n);
+  world_.reserve(n);
+  renderWorld_.reserve(n);
+  color_.reserve(n);
+  radius_.reserve(n);
+  geometry_.reserve(n);
+  parent_.reserve(n);
+  slotVersion_.reserve(n);
+  worldStamp_.reserve(n);
+  orderPos_.reserve(n);
+  numChildren_.reserve(n);
+}
+
+// Model matrix world * makeScale(scale), written straight from the unit
+// quaternion: the scale multiplies the rotation's columns, and the
+// translation is the last column
+static Matrix4f makeRenderWorld(const RigTForm& world, const Cvec3& scale) {
+  const Quat q = world.getRotation();
+  const Cvec3 t = world.getTranslation();
+  const double w = q[0], x = q[1], y = q[2], z = q[3];
+  const double sx = scale[0], sy = scale[1], sz = scale[2];
+  return Matrix4f(Cvec4f((1 - 2*(y*y + z*z)) * sx, 2*(x*y + w*z) * sx, 2*(x*z - w*y) * sx, 0),
+                  Cvec4f(2*(x*y - w*z) * sy, (1 - 2*(x*x + z*z)) * sy, 2*(y*z + w*x) * sy, 0),
+                  Cvec4f(2*(x*z + w*y) * sz, 2*(y*z - w*x) * sz, (1 - 2*(x*x + y*y)) * sz, 0),
+                  Cvec4f(t[0], t[1], t[2], 1));
+}
+
+NodeHandle SceneStore::create(const RigTForm& local, const Cvec3& scale, const Cvec3f& color,
+                              const NodeHandle parent, const double radius,
+                              const GeometryId geometry) {
+  const NodeHandle h = slots_.allocate();
+  // The world arrays are filled in by the next world update; the new stamp
+  // of the slot marks them stale
+  if (h.index == local_.size()) {
+    local_.push_back(local);
+    scale_.push_back(scale);
+    world_.push_back(RigTForm());
+    renderWorld_.push_back(Matrix4f());
+    color_.push_back(color);
+    radius_.push_back(radius);
+    geometry_.push_back(geometry);
+    parent_.push_back(parent);
+    slotVersion_.push_back(0);
+    const WorldStamp none = {0, 0, 0};
+    worldStamp_.push_back(none);
+    orderPos_.push_back(-1);
+    numChildren_.push_back(0);
+  } else {
+    local_[h.index] = local;
+    scale_[h.index] = scale;
+    color_[h.index] = color;
+    radius_[h.index] = radius;
+    geometry_[h.index] = geometry;
+    parent_[h.index] = parent;
+    numChildren_[h.index] = 0;   // children of the slot's last node are roots now
+  }
+  touch(h.index);
+  if (contains(parent))
+    ++numChildren_[parent.index];
+  // the parent, if any, is in the order already
+  if (!orderDirty_)
+    appendToOrder(h.index);
+  return h;
+}
+
+void SceneStore::destroy(const NodeHandle& h) {
+  const int p = parentSlot(h.index);
+  if (p >= 0)
+    --numChildren_[p];
+  slots_.release(h);
+  touch(h.index);
+  if (!orderDirty_)
+    removeFromOrder(h.index);
+}
+
+void SceneStore::clear() {
+  slots_.clear();
+  order_.clear();
+  levelStart_.clear();
+  std::fill(orderPos_.begin(), orderPos_.end(), -1);
+  std::fill(numChildren_.begin(), numChildren_.end(), 0);
+  orderChanges_ = 0;
+  orderDirty_ = false;
+  ++version_;
+  std::fill(slotVersion_.begin(), slotVersion_.end(), version_);
+}
+
+const RigTForm& SceneStore::getLocal(const NodeHandle& h) const {
+  assert(contains(h));
+  return local_[h.index];
+}
+
+void SceneStore::setLocal(const NodeHandle& h, const RigTForm& local) {
+  assert(contains(h));
+  local_[h.index] = local;
+  touch(h.index);
+}
+
+const Cvec3& SceneStore::getScale(const NodeHandle& h) const {
+  assert(contains(h));
+  return scale_[h.index];
+}
+
+void SceneStore::setScale(const NodeHandle& h, const Cvec3& scale) {
+  assert(contains(h));
+  scale_[h.index] = scale;
+  touch(h.index);
+}
+
+const Cvec3f& SceneStore::getColor(const NodeHandle& h) const {
+  assert(contains(h));
+  return color_[h.index];
+}
+
+void SceneStore::setColor(const NodeHandle& h, const Cvec3f& color) {
+  assert(contains(h));
+  color_[h.index] = color;
+  touch(h.index);
+}
+
+GeometryId SceneStore::getGeometry(const NodeHandle& h) const {
+  assert(contains(h));
+  return (GeometryId)geometry_[h.index];
+}
+
+NodeHandle SceneStore::getParent(const NodeHandle& h) const {
+  assert(contains(h));
+  return parent_[h.index];
+}
+
+void SceneStore::setParent(const NodeHandle& h, const NodeHandle& parent) {
+  assert(contains(h));
+  const int old = parentSlot(h.index);
+  if (old >= 0)
+    --numChildren_[old];
+  parent_[h.index] = parent;
+  touch(h.index);
+  if (!contains(parent))
+    return;
+  ++numChildren_[parent.index];
+
+  // Under a parent that does not come before the node's depth level, a leaf
+  // moves to the end; a node with children would have to take its whole
+  // subtree along
+  if (orderDirty_ || orderPos_[parent.index] < orderLimit(h.index))
+    return;
+  if (numChildren_[h.index] == 0) {
+    removeFromOrder(h.index);
+    appendToOrder(h.index);
+  } else {
+    orderDirty_ = true;
+  }
+}
+
+void SceneStore::setParentKeepWorld(const NodeHandle& h, const NodeHandle& parent) {
+  assert(contains(h));
+  const RigTForm world = getWorld(h);
+  RigTForm parentWorld;
+  if (contains(parent)) {
+    for (int s = parent.index; s >= 0; s = parentSlot(s)) {
+      assert(s != (int)h.index);   // no cycles
+    }
+    parentWorld = getWorld(parent);
+  }
+  setLocal(h, inv(parentWorld) * world);
+  setParent(h, parent);
+}
+
+void SceneStore::saveSlot(const int slot, SlotState& s) const {
+  const NodeHandle h = slots_.handleAt(slot);
+  s.generation = h.generation;
+  s.alive = slots_.isAlive(slot);
+  s.local = local_[slot];
+  s.scale = scale_[slot];
+  s.color = color_[slot];
+  s.radius = radius_[slot];
+  s.parent = parent_[slot];
+  s.geometry = (GeometryId)geometry_[slot];
+}
+
+void SceneStore::resizeSlots(const int numSlots) {
+  slots_.resize(numSlots);
+  local_.resize(numSlots);
+  scale_.resize(numSlots);
+  world_.resize(numSlots);
+  renderWorld_.resize(numSlots);
+  color_.resize(numSlots);
+  radius_.resize(numSlots);
+  geometry_.resize(numSlots);
+  parent_.resize(numSlots);
+  slotVersion_.resize(numSlots, version_);
+  const WorldStamp none = {0, 0, 0};
+  worldStamp_.resize(numSlots, none);
+  orderPos_.resize(numSlots, -1);
+  numChildren_.resize(numSlots, 0);
+  orderDirty_ = true;
+}
+
+void SceneStore::restoreSlot(const int slot, const SlotState& s) {
+  if (slot >= numSlots())
+    resizeSlots(slot + 1);
+  slots_.restore(slot, s.generation, s.alive);
+  local_[slot] = s.local;
+  scale_[slot] = s.scale;
+  color_[slot] = s.color;
+  radius_[slot] = s.radius;
+  parent_[slot] = s.parent;
+  geometry_[slot] = s.geometry;
+  touch(slot);
+  orderDirty_ = true;
+}
+
+void SceneStore::endRestore(const vector<int>& freeSlots) {
+  slots_.setFreeSlots(freeSlots);
+  orderDirty_ = true;
+}
+
+RigTForm SceneStore::computeWorld(const NodeHandle& h) const {
+  assert(contains(h));
+  const int p = parentSlot(h.index);
+  if (p < 0)
+    return local_[h.index];
+  return computeWorld(slots_.handleAt(p)) * local_[h.index];
+}
+
+// Position in the order the slot's parent must come before for the world
+// update: the start of the slot's depth level, or the slot's own position
+// among the appended slots, which are updated serially
+int SceneStore::orderLimit(const int slot) const {
+  const int pos = orderPos_[slot];
+  if (pos >= appendedStart())
+    return pos;
+  return *(upper_bound(levelStart_.begin(), levelStart_.end(), pos) - 1);
+}
+
+// Past a quarter of the order changed, it is cheaper to rebuild it once
+// than to keep it up
+void SceneStore::noteOrderChange() {
+  if (++orderChanges_ > (int)order_.size() / 4)
+    orderDirty_ = true;
+}
+
+void SceneStore::appendToOrder(const int slot) {
+  orderPos_[slot] = order_.size();
+  order_.push_back(slot);
+  noteOrderChange();
+}
+
+void SceneStore::removeFromOrder(const int slot) {
+  const int pos = orderPos_[slot];
+  if (pos < 0)
+    return;
+  order_[pos] = -1;
+  orderPos_[slot] = -1;
+  noteOrderChange();
+}
+
+void SceneStore::rebuildOrder() {
+  const int n = numSlots();
+
+  // depth of every live slot, -1 while unknown
+  vector<int> depth(n, -1);
+  vector<int> stack;
+  int maxDepth = 0;
+  for (int i = 0; i < n; ++i) {
+    if (!isAlive(i) || depth[i] >= 0)
+      continue;
+    // walk up until a node of known depth or a root, then assign on the way back
+    int s = i;
+    while (depth[s] < 0) {
+      stack.push_back(s);
+      const int p = parentSlot(s);
+      if (p < 0)
+        break;
+      assert(stack.size() <= (size_t)n); // no cycles
+      s = p;
+    }
+    int d = depth[s] >= 0 ? depth[s] : -1;
+    while (!stack.empty()) {
+      depth[stack.back()] = ++d;
+      stack.pop_back();
+    }
+    maxDepth = max(maxDepth, d);
+  }
+
+  // counting sort by depth
+  vector<int> start(maxDepth + 2, 0);
+  for (int i = 0; i < n; ++i) {
+    if (depth[i] >= 0)
+      ++start[depth[i] + 1];
+  }
+  for (int d = 0; d <= maxDepth; ++d) {
+    start[d + 1] += start[d];
+  }
+  order_.resize(start[maxDepth + 1]);
+  levelStart_.assign(start.begin(), start.end() - 1);
+  levelStart_.push_back(start[maxDepth + 1]);
+  std::fill(orderPos_.begin(), orderPos_.end(), -1);
+  std::fill(numChildren_.begin(), numChildren_.end(), 0);
+  for (int i = 0; i < n; ++i) {
+    if (depth[i] < 0)
+      continue;
+    orderPos_[i] = start[depth[i]];
+    order_[start[depth[i]]++] = i;
+    const int p = parentSlot(i);
+    if (p >= 0)
+      ++numChildren_[p];
+  }
+  orderChanges_ = 0;
+  orderDirty_ = false;
+}
+
+// The slot's cached world transform is missing, or was computed from an
+// older version of the slot or of its parent's world transform
+bool SceneStore::worldStale(const int slot, const int parent) const {
+  const WorldStamp& s = worldStamp_[slot];
+  return s.version == 0 || s.source != slotVersion_[slot] ||
+    s.parentSeen != (parent < 0 ? 0 : worldStamp_[parent].version);
+}
+
+// The parent's world transform must be current. version must not have been
+// given to any world transform before.
+void SceneStore::recomputeWorld(const int slot, const int parent, const unsigned version) {
+  world_[slot] = parent < 0 ? local_[slot] : world_[parent] * local_[slot];
+  renderWorld_[slot] = makeRenderWorld(world_[slot], scale_[slot]);
+  WorldStamp& s = worldStamp_[slot];
+  s.version = version;
+  s.source = slotVersion_[slot];
+  s.parentSeen = parent < 0 ? 0 : worldStamp_[parent].version;
+}
+
+const RigTForm& SceneStore::getWorld(const NodeHandle& h) {
+  assert(contains(h));
+  chain_.clear();
+  for (int i = h.index; i >= 0; i = parentSlot(i)) {
+    chain_.push_back(i);
+    assert(chain_.size() <= (size_t)numSlots());   // no cycles
+  }
+  // root first, so a recomputed ancestor makes its child stale in turn
+  for (int k = (int)chain_.size() - 1; k >= 0; --k) {
+    const int i = chain_[k];
+    const int p = k + 1 < (int)chain_.size() ? chain_[k + 1] : -1;
+    if (worldStale(i, p))
+      recomputeWorld(i, p, ++worldCounter_);
+  }
+  return world_[h.index];
+}
+
+// Updates order_[begin, end). The slot at order position k gets world
+// version versionBase + k, so the ranges of a parallel update need no
+// shared counter.
+int SceneStore::updateWorldRange(const int begin, const int end, const unsigned versionBase) {
+  int recomputed = 0;
+  for (int k = begin; k < end; ++k) {
+    const int i = order_[k];
+    if (i < 0)
+      continue;
+    const int p = parentSlot(i);
+    if (!worldStale(i, p))
+      continue;
+    recomputeWorld(i, p, versionBase + k);
+    ++recomputed;
+  }
+  return recomputed;
+}
+
+void SceneStore::updateWorldJob(int begin, int end, void *data) {
+  WorldChunk& c = *static_cast<WorldChunk*>(data);
+  const int recomputed = c.store->updateWorldRange(begin, end, c.versionBase);
+  __sync_fetch_and_add(&c.recomputed, recomputed);
+}
+
+int SceneStore::updateWorldTransforms() {
+  if (orderDirty_)
+    rebuildOrder();
+  const unsigned base = worldCounter_ + 1;
+  worldCounter_ += order_.size();
+  return updateWorldRange(0, order_.size(), base);
+}
+
+int SceneStore::updateWorldTransforms(JobSystem& js, const int grain) {
+  if (orderDirty_)
+    rebuildOrder();
+  WorldChunk chunk;
+  chunk.store = this;
+  chunk.versionBase = worldCounter_ + 1;
+  chunk.recomputed = 0;
+  worldCounter_ += order_.size();
+  for (int d = 0; d + 1 < (int)levelStart_.size(); ++d) {
+    js.parallelFor(levelStart_[d], levelStart_[d + 1], grain, updateWorldJob, &chunk);
+  }
+  chunk.recomputed += updateWorldRange(appendedStart(), order_.size(), chunk.versionBase);
+  return chunk.recomputed;
+}
@@ -0,0 +1,263 @@
+#ifndef SCENESTORE_H
+#define SCENESTORE_H
+
+#include <vector>
+
+#include "cvec.h"
+#include "matrix4.h"
+#include "matrix4f.h"
+#include "rigtform.h"
+#include "pool.h"
+#include "rendercmd.h"
+#include "jobsystem.h"
+
+typedef PoolHandle NodeHandle;
+
+//--------------------------------------------------------------------------------
+// Structure-of-arrays storage for scene nodes. Each component lives in its
+// own array indexed by slot, so a pass only streams through the data it
+// needs: world transform propagation reads parents and local transforms,
+// culling reads world transforms and bounds, and packet building reads
+// colors and geometry ids. Node transforms are rigid (RigTForm); a per-node
+// scale shapes the node's own geometry only and is not inherited by its
+// children. Slots are managed like a Pool: generational handles, free list,
+// dead slots skipped during iteration.
+//
+// Every edit bumps the store's version and stamps the edited slot with it,
+// so the slots changed since some point are those stamped after the version
+// read at that point. Edits of different nodes may run concurrently.
+//
+// World transforms are cached. Each slot's world transform carries a world
+// version, bumped whenever it is recomputed, and remembers the slot version
+// and the parent's world version it was computed from. It is only
+// recomputed when one of those no longer matches, i.e. when the node itself
+// or any of its ancestors changed.
+//--------------------------------------------------------------------------------
+class SceneStore {
+public:
+  SceneStore() : orderChanges_(0), orderDirty_(false), version_(0), worldCounter_(0) {}
+
+  void reserve(const int n);
+
+  // `radius` is the radius of the node's bounding sphere in its own frame,
+  // before `scale` is applied
+  NodeHandle create(const RigTForm& local, const Cvec3& scale, const Cvec3f& color,
+                    const NodeHandle parent, const double radius,
+                    const GeometryId geometry = GEOMETRY_CUBE);
+
+  // Children of a destroyed node become roots
+  void destroy(const NodeHandle& h);
+
+  // Destroys all nodes at once
+  void clear();
+
+  bool contains(const NodeHandle& h) const {
+    return slots_.contains(h);
+  }
+
+  int size() const {
+    return slots_.size();
+  }
+
+  // Per node access
+  const RigTForm& getLocal(const NodeHandle& h) const;
+  void setLocal(const NodeHandle& h, const RigTForm& local);
+  const Cvec3& getScale(const NodeHandle& h) const;
+  void setScale(const NodeHandle& h, const Cvec3& scale);
+  const Cvec3f& getColor(const NodeHandle& h) const;
+  void setColor(const NodeHandle& h, const Cvec3f& color);
+  GeometryId getGeometry(const NodeHandle& h) const;
+  NodeHandle getParent(const NodeHandle& h) const;
+  void setParent(const NodeHandle& h, const NodeHandle& parent);
+
+  // Moves the node under a new parent (NodeHandle() for none) without
+  // moving it in the world: its local transform becomes the one relative to
+  // the new parent. The parent must not be the node or one of its
+  // descendants.
+  void setParentKeepWorld(const NodeHandle& h, const NodeHandle& parent);
+
+  // World transform computed from the local transforms of the node and its
+  // ancestors, walking the whole chain without using the cache
+  RigTForm computeWorld(const NodeHandle& h) const;
+
+  // Current world transform from the cache. Checks the versions up the
+  // node's ancestry and recomputes only the stale entries of that chain, so
+  // querying every child of a parent multiplies out the ancestry once. It
+  // writes the cache: like an edit, it must not overlap a pass reading or
+  // updating the world arrays, such as a frame build running on the job
+  // system (sync the frame pipeline first).
+  const RigTForm& getWorld(const NodeHandle& h);
+
+  // Brings the world transform arrays up to date, parents before children,
+  // recomputing only the slots whose local transform, scale, color or
+  // parent, or any ancestor's world transform, changed since. Returns the
+  // number of slots recomputed.
+  int updateWorldTransforms();
+
+  // The same on the job system: the nodes of each depth only read world
+  // transforms of shallower ones, so every depth level is split into chunks
+  // of grain slots that run concurrently. Nodes added or moved under a
+  // later parent since the order was last rebuilt follow serially.
+  int updateWorldTransforms(JobSystem& js, const int grain);
+
+  // Slot level access for passes; dead slots must be skipped. The world
+  // array is as of the last updateWorldTransforms().
+  int numSlots() const {
+    return slots_.numSlots();
+  }
+
+  bool isAlive(const int slot) const {
+    return slots_.isAlive(slot);
+  }
+
+  NodeHandle handleAt(const int slot) const {
+    return slots_.handleAt(slot);
+  }
+
+  const RigTForm& local(const int slot) const {
+    return local_[slot];
+  }
+
+  const Cvec3& scale(const int slot) const {
+    return scale_[slot];
+  }
+
+  const RigTForm& world(const int slot) const {
+    return world_[slot];
+  }
+
+  // Bumped whenever the slot's world transform is recomputed, so anything
+  // derived from it can tell whether it is stale
+  unsigned worldVersion(const int slot) const {
+    return worldStamp_[slot].version;
+  }
+
+  // Single precision model matrix for the render path: world(slot) with the
+  // node's scale applied, converted to a matrix only here
+  const Matrix4f& renderWorld(const int slot) const {
+    return renderWorld_[slot];
+  }
+
+  const Cvec3f& color(const int slot) const {
+    return color_[slot];
+  }
+
+  double radius(const int slot) const {
+    return radius_[slot];
+  }
+
+  GeometryId geometry(const int slot) const {
+    return (GeometryId)geometry_[slot];
+  }
+
+  // Slot of the parent, or -1 for roots
+  int parentSlot(const int slot) const {
+    return slots_.contains(parent_[slot]) ? (int)parent_[slot].index : -1;
+  }
+
+  unsigned version() const {
+    return version_;
+  }
+
+  // Version of the last edit of the slot, including its creation and
+  // destruction
+  unsigned slotVersion(const int slot) const {
+    return slotVersion_[slot];
+  }
+
+  // Complete state of a slot, dead or alive, for snapshots. Dead slots keep
+  // their generation so handles to destroyed nodes stay stale on restore.
+  struct SlotState {
+    unsigned generation;
+    bool alive;
+    RigTForm local;
+    Cvec3 scale;
+    Cvec3f color;
+    double radius;
+    NodeHandle parent;
+    GeometryId geometry;
+  };
+
+  void saveSlot(const int slot, SlotState& s) const;
+
+  // Free slots in the order create() reuses them
+  void freeSlots(std::vector<int>& out) const {
+    slots_.freeSlots(out);
+  }
+
+  // Restoring: resizeSlots() to the saved slot count, if it is known, then
+  // restoreSlot() for each saved slot (growing the store past its end if
+  // needed) and endRestore() with the saved free list. World transforms are
+  // current after the next updateWorldTransforms().
+  void resizeSlots(const int numSlots);
+  void restoreSlot(const int slot, const SlotState& s);
+  void endRestore(const std::vector<int>& freeSlots);
+
+private:
+  SlotAllocator slots_;
+  std::vector<RigTForm> local_;
+  std::vector<Cvec3> scale_;
+  std::vector<RigTForm> world_;
+  std::vector<Matrix4f> renderWorld_;
+  std::vector<Cvec3f> color_;
+  std::vector<double> radius_;
+  std::vector<unsigned char> geometry_;
+  std::vector<NodeHandle> parent_;
+  std::vector<unsigned> slotVersion_;
+
+  // What each slot's cached world transform was computed from
+  struct WorldStamp {
+    unsigned version;      // of this world transform, 0 before the first
+    unsigned source;       // slot version of the node
+    unsigned parentSeen;   // world version of the parent, 0 for roots
+  };
+  std::vector<WorldStamp> worldStamp_;
+
+  // Live slots ordered so that parents come before their children, with
+  // holes (-1) where destroyed slots were. Kept up incrementally: created
+  // nodes and leaves moved under a later parent go to the end. Moving a node
+  // with children under a later parent or a restore marks it for a rebuild,
+  // and so does changing a quarter of it: the rebuild puts it back in slot
+  // order within each depth, which keeps the world update streaming.
+  std::vector<int> order_;
+  std::vector<int> orderPos_;      // index of the slot in order_, -1 if none
+  std::vector<int> numChildren_;   // live children of the slot
+  std::vector<int> levelStart_;    // where each depth starts in order_ as rebuilt;
+                                   // the last entry is where appended slots start
+  int orderChanges_;               // holes plus appended slots since the rebuild
+  bool orderDirty_;
+  unsigned version_;
+  unsigned worldCounter_;
+
+  std::vector<int> chain_;   // scratch for getWorld
+
+  // A chunk of the parallel world update
+  struct WorldChunk {
+    SceneStore *store;
+    unsigned versionBase;
+    int recomputed;
+  };
+
+  bool worldStale(const int slot, const int parent) const;
+  void recomputeWorld(const int slot, const int parent, const unsigned version);
+  int updateWorldRange(const int begin, const int end, const unsigned versionBase);
+  static void updateWorldJob(int begin, int end, void *data);
+
+  // Atomic, as setLocal() and setScale() on different nodes may run on
+  // several threads at once (see Animator::evaluate())
+  void touch(const int slot) {
+    slotVersion_[slot] = __sync_add_and_fetch(&version_, 1);
+  }
+
+  int appendedStart() const {
+    return levelStart_.empty() ? 0 : levelStart_.back();
+  }
+
+  int orderLimit(const int slot) const;
+  void noteOrderChange();
+  void appendToOrder(const int slot);
+  void removeFromOrder(const int slot);
+  void rebuildOrder();
+};
+
+#endif
@@ -0,0 +1,68 @@
+#include <stdexcept>
+
+#include "glsupport.h"
+#include "shadowmap.h"
+
+using namespace std;
+
+bool shadowMapsSupported() {
+  return GLEW_VERSION_3_0 || GLEW_ARB_framebuffer_object;
+}
+
+static void initDepthTarget(GlTexture& texture, GlFramebufferObject& fbo, const int size, const char *label) {
+  GlStateCache& gl = glState();
+  gl.bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  gl.activeTexture(GL_TEXTURE0);
+  gl.bindTexture(GL_TEXTURE_2D, texture);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, size, size, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_GEQUAL);
+  texture.setLabel(label);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, texture, 0);
+  glDrawBuffer(GL_NONE);
+  glReadBuffer(GL_NONE);
+  const GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  if (status != GL_FRAMEBUFFER_COMPLETE)
+    throw runtime_error("shadow map framebuffer is incomplete");
+  fbo.setLabel(label);
+}
+
+ShadowMap::ShadowMap(const int size)
+  : size_(size), valid_(false), staticVersion_(0), useWorking_(false) {
+  initDepthTarget(staticDepth_, staticFbo_, size, "static shadow map");
+  initDepthTarget(depth_, fbo_, size, "shadow map");
+  checkGlErrors();
+}
+
+void ShadowMap::beginStatic(const unsigned staticVersion) {
+  glBindFramebuffer(GL_FRAMEBUFFER, staticFbo_);
+  glViewport(0, 0, size_, size_);
+  glClear(GL_DEPTH_BUFFER_BIT);
+  valid_ = true;
+  staticVersion_ = staticVersion;
+  useWorking_ = false;
+}
+
+void ShadowMap::beginDynamic() {
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, staticFbo_);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo_);
+  glBlitFramebuffer(0, 0, size_, size_, 0, 0, size_, size_, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo_);
+  glViewport(0, 0, size_, size_);
+  useWorking_ = true;
+}
+
+void ShadowMap::useStatic() {
+  useWorking_ = false;
+}
+
+void ShadowMap::end(const GLuint framebuffer) {
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+}
@@ -0,0 +1,61 @@
+#ifndef SHADOWMAP_H
+#define SHADOWMAP_H
+
+#include "glsupport.h"
+
+//--------------------------------------------------------------------------------
+// Render target of one shadow map, split for caching: a static depth map
+// holding the casters that do not move, redrawn only when that set changes,
+// and a working map that starts each frame as a copy of it (one blit) and
+// gets the moving casters drawn on top. When nothing moves the static map is
+// sampled directly. Depth textures compare against the reference depth
+// (GL_GEQUAL, as nearer is greater here) with linear filtering, so sampling
+// through a sampler2DShadow already gives 2x2 percentage closer filtering.
+//--------------------------------------------------------------------------------
+
+// Shadow maps need framebuffer objects (GL 3.0 or ARB_framebuffer_object)
+bool shadowMapsSupported();
+
+class ShadowMap : Noncopyable {
+public:
+  explicit ShadowMap(const int size);
+
+  int size() const {
+    return size_;
+  }
+
+  // staticVersion of the casters in the cached static map
+  bool isCached(const unsigned staticVersion) const {
+    return valid_ && staticVersion_ == staticVersion;
+  }
+
+  // Binds the static map as the render target, sets the viewport and clears
+  // it; draw the static casters next
+  void beginStatic(const unsigned staticVersion);
+
+  // Binds the working map, initialized with the static casters; draw the
+  // dynamic casters next
+  void beginDynamic();
+
+  // Samples the static map alone this frame
+  void useStatic();
+
+  // Depth texture to sample this frame
+  GLuint texture() const {
+    return useWorking_ ? depth_ : staticDepth_;
+  }
+
+  // Back to the given framebuffer, the window by default; the caller
+  // restores its viewport
+  static void end(const GLuint framebuffer = 0);
+
+private:
+  int size_;
+  GlTexture staticDepth_, depth_;
+  GlFramebufferObject staticFbo_, fbo_;
+  bool valid_;
+  unsigned staticVersion_;
+  bool useWorking_;
+};
+
+#endif
@@ -0,0 +1,291 @@
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cvec.h"
+#include "quat.h"
+#include "rigtform.h"
+#include "scenestore.h"
+#include "snapshot.h"
+
+using namespace std;
+
+static const char g_snapshotMagic[4] = {'S', 'N', 'A', 'P'};
+static const char g_deltaMagic[4] = {'S', 'D', 'L', 'T'};
+static const unsigned g_snapshotVersion = 1;
+
+namespace {
+// One slot as stored in both file types. Multiples of 8 bytes, like the
+// headers, so records stay aligned for reading in place.
+struct SlotRecord {
+  unsigned slot;
+  unsigned generation;
+  unsigned parentIndex, parentGeneration;
+  unsigned char alive, geometry, pad[2];
+  float color[3];
+  double local[7];       // translation, then rotation w x y z
+  double scale[3];
+  double radius;
+};
+
+struct SnapshotHeader {
+  char magic[4];
+  unsigned version;
+  unsigned numSlots;     // SlotRecords following, one per slot
+  unsigned numFree;      // then the free list, padded to an even count
+  int selected;
+  unsigned pad;
+  double eye[7];
+};
+
+struct DeltaHeader {
+  unsigned numSlots;     // records of the changed slots following
+  unsigned numFree;
+  int selected;
+  unsigned pad;
+  double eye[7];
+};
+}
+
+// sizeof(char[-1]) fails to compile if a layout gets padded
+typedef char SlotRecordSize[sizeof(SlotRecord) == 120 ? 1 : -1];
+typedef char SnapshotHeaderSize[sizeof(SnapshotHeader) == 80 ? 1 : -1];
+typedef char DeltaHeaderSize[sizeof(DeltaHeader) == 72 ? 1 : -1];
+
+static void packTransform(const RigTForm& t, double out[7]) {
+  const Cvec3 p = t.getTranslation();
+  const Quat q = t.getRotation();
+  for (int i = 0; i < 3; ++i) out[i] = p[i];
+  for (int i = 0; i < 4; ++i) out[3 + i] = q[i];
+}
+
+static RigTForm unpackTransform(const double in[7]) {
+  return RigTForm(Cvec3(in[0], in[1], in[2]), Quat(in[3], in[4], in[5], in[6]));
+}
+
+static void packSlot(const SceneStore& scene, const int slot, SlotRecord& r) {
+  SceneStore::SlotState s;
+  scene.saveSlot(slot, s);
+  memset(&r, 0, sizeof(r));
+  r.slot = slot;
+  r.generation = s.generation;
+  r.parentIndex = s.parent.index;
+  r.parentGeneration = s.parent.generation;
+  r.alive = s.alive;
+  r.geometry = s.geometry;
+  for (int i = 0; i < 3; ++i) {
+    r.color[i] = s.color[i];
+    r.scale[i] = s.scale[i];
+  }
+  packTransform(s.local, r.local);
+  r.radius = s.radius;
+}
+
+static void unpackSlot(const SlotRecord& r, SceneStore& scene) {
+  SceneStore::SlotState s;
+  s.generation = r.generation;
+  s.alive = r.alive != 0;
+  s.local = unpackTransform(r.local);
+  s.scale = Cvec3(r.scale[0], r.scale[1], r.scale[2]);
+  s.color = Cvec3f(r.color[0], r.color[1], r.color[2]);
+  s.radius = r.radius;
+  s.parent = NodeHandle(r.parentIndex, r.parentGeneration);
+  s.geometry = (GeometryId)r.geometry;
+  scene.restoreSlot(r.slot, s);
+}
+
+// Free list padded to an even count, which keeps what follows 8 byte aligned
+static void writeFreeSlots(ostream& os, const vector<int>& freeSlots) {
+  vector<unsigned> padded(freeSlots.begin(), freeSlots.end());
+  if (padded.size() % 2)
+    padded.push_back(0);
+  if (!padded.empty())
+    os.write(reinterpret_cast<const char*>(&padded[0]), padded.size() * sizeof(unsigned));
+}
+
+static size_t freeSlotBytes(const unsigned numFree) {
+  return (numFree + numFree % 2) * sizeof(unsigned);
+}
+
+// --------- MappedFile
+
+MappedFile::MappedFile(const string& filename) : data_(NULL), size_(0) {
+  const int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw runtime_error("Cannot open " + filename);
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw runtime_error("Cannot stat " + filename);
+  }
+  size_ = st.st_size;
+  if (size_ > 0) {
+    void *p = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+      close(fd);
+      throw runtime_error("Cannot map " + filename);
+    }
+    data_ = static_cast<const char*>(p);
+  }
+  close(fd);   // the mapping keeps the file open
+}
+
+MappedFile::~MappedFile() {
+  if (data_)
+    munmap(const_cast<char*>(data_), size_);
+}
+
+// --------- Writing
+
+SnapshotWriter::SnapshotWriter(const SceneStore& scene)
+  : scene_(scene), savedVersion_(scene.version()) {}
+
+void SnapshotWriter::writeSnapshot(const string& filename, const ViewState& view) {
+  ofstream f(filename.c_str(), ios::binary);
+  if (!f)
+    throw runtime_error("Cannot open " + filename + " for writing");
+  scene_.freeSlots(freeSlots_);
+
+  SnapshotHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, g_snapshotMagic, 4);
+  h.version = g_snapshotVersion;
+  h.numSlots = scene_.numSlots();
+  h.numFree = freeSlots_.size();
+  h.selected = view.selected;
+  packTransform(view.eye, h.eye);
+  f.write(reinterpret_cast<const char*>(&h), sizeof(h));
+
+  SlotRecord r;
+  for (int i = 0, n = scene_.numSlots(); i < n; ++i) {
+    packSlot(scene_, i, r);
+    f.write(reinterpret_cast<const char*>(&r), sizeof(r));
+  }
+  writeFreeSlots(f, freeSlots_);
+  f.close();
+  if (!f)
+    throw runtime_error("Error writing " + filename);
+  savedVersion_ = scene_.version();
+}
+
+void SnapshotWriter::writeDeltaStreamHeader(ostream& os) {
+  char h[8];
+  memcpy(h, g_deltaMagic, 4);
+  memcpy(h + 4, &g_snapshotVersion, 4);
+  os.write(h, sizeof(h));
+}
+
+int SnapshotWriter::writeDelta(ostream& os, const ViewState& view) {
+  // Slot versions are scanned rather than kept in a dirty list: 4 bytes per
+  // slot, and edits need no bookkeeping beyond the stamp
+  vector<SlotRecord> records;
+  for (int i = 0, n = scene_.numSlots(); i < n; ++i) {
+    if (scene_.slotVersion(i) > savedVersion_) {
+      records.push_back(SlotRecord());
+      packSlot(scene_, i, records.back());
+    }
+  }
+  scene_.freeSlots(freeSlots_);
+
+  DeltaHeader h;
+  memset(&h, 0, sizeof(h));
+  h.numSlots = records.size();
+  h.numFree = freeSlots_.size();
+  h.selected = view.selected;
+  packTransform(view.eye, h.eye);
+  os.write(reinterpret_cast<const char*>(&h), sizeof(h));
+  if (!records.empty())
+    os.write(reinterpret_cast<const char*>(&records[0]), records.size() * sizeof(SlotRecord));
+  writeFreeSlots(os, freeSlots_);
+  savedVersion_ = scene_.version();
+  return records.size();
+}
+
+// --------- Restoring
+
+static void readFreeSlots(const char *p, const unsigned numFree, vector<int>& freeSlots) {
+  const unsigned *slots = reinterpret_cast<const unsigned*>(p);
+  freeSlots.assign(slots, slots + numFree);
+}
+
+void restoreSnapshot(const string& filename, SceneStore& scene, ViewState& view) {
+  const MappedFile file(filename);
+  if (file.size() < sizeof(SnapshotHeader))
+    throw runtime_error(filename + ": not a snapshot");
+  const SnapshotHeader& h = *reinterpret_cast<const SnapshotHeader*>(file.data());
+  if (memcmp(h.magic, g_snapshotMagic, 4) != 0 || h.version != g_snapshotVersion)
+    throw runtime_error(filename + ": not a snapshot, or an unsupported version");
+  const size_t size = sizeof(h) + (size_t)h.numSlots * sizeof(SlotRecord) + freeSlotBytes(h.numFree);
+  if (file.size() < size)
+    throw runtime_error(filename + ": truncated");
+
+  const SlotRecord *records = reinterpret_cast<const SlotRecord*>(file.data() + sizeof(h));
+  scene.resizeSlots(h.numSlots);
+  for (unsigned i = 0; i < h.numSlots; ++i) {
+    unpackSlot(records[i], scene);
+  }
+  vector<int> freeSlots;
+  readFreeSlots(reinterpret_cast<const char*>(records + h.numSlots), h.numFree, freeSlots);
+  scene.endRestore(freeSlots);
+
+  view.eye = unpackTransform(h.eye);
+  view.selected = h.selected;
+}
+
+DeltaReader::DeltaReader(const string& filename)
+  : filename_(filename), file_(filename), pos_(8), applied_(0) {
+  if (file_.size() < 8 || memcmp(file_.data(), g_deltaMagic, 4) != 0 ||
+      memcmp(file_.data() + 4, &g_snapshotVersion, 4) != 0)
+    throw runtime_error(filename + ": not a delta stream, or an unsupported version");
+}
+
+bool DeltaReader::applyNext(SceneStore& scene, ViewState& view) {
+  if (pos_ == file_.size())
+    return false;
+  const char *p = file_.data() + pos_;
+  const size_t left = file_.size() - pos_;
+  const DeltaHeader& h = *reinterpret_cast<const DeltaHeader*>(p);
+  if (left < sizeof(h) ||
+      left < sizeof(h) + (size_t)h.numSlots * sizeof(SlotRecord) + freeSlotBytes(h.numFree)) {
+    ostringstream msg;
+    msg << filename_ << ": delta " << applied_ << " is truncated";
+    throw runtime_error(msg.str());
+  }
+  const size_t size = sizeof(h) + (size_t)h.numSlots * sizeof(SlotRecord) + freeSlotBytes(h.numFree);
+
+  const SlotRecord *records = reinterpret_cast<const SlotRecord*>(p + sizeof(h));
+  for (unsigned i = 0; i < h.numSlots; ++i) {
+    unpackSlot(records[i], scene);
+  }
+  vector<int> freeSlots;
+  readFreeSlots(reinterpret_cast<const char*>(records + h.numSlots), h.numFree, freeSlots);
+  scene.endRestore(freeSlots);
+
+  view.eye = unpackTransform(h.eye);
+  view.selected = h.selected;
+  pos_ += size;
+  ++applied_;
+  return true;
+}
+
+unsigned sceneChecksum(const SceneStore& scene) {
+  // FNV-1a over the packed records
+  unsigned hash = 2166136261u;
+  SlotRecord r;
+  for (int i = 0, n = scene.numSlots(); i < n; ++i) {
+    packSlot(scene, i, r);
+    const unsigned char *bytes = reinterpret_cast<const unsigned char*>(&r);
+    for (size_t k = 0; k < sizeof(r); ++k) {
+      hash = (hash ^ bytes[k]) * 16777619u;
+    }
+  }
+  return hash;
+}
@@ -0,0 +1,108 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <iosfwd>
+
+#include "rigtform.h"
+#include "scenestore.h"
+
+//--------------------------------------------------------------------------------
+// Checkpoints of the scene state. A snapshot file holds every slot of a
+// SceneStore (dead ones too, so handles keep their meaning) plus the viewer
+// state; a delta holds only the slots edited since the previous snapshot or
+// delta, found through the store's slot versions. Deltas are appended to a
+// delta stream, so a base snapshot plus a stream with one delta per frame is
+// a recording that replays the scene exactly, frame by frame.
+//
+// Both files are binary, host endian, with fixed size records laid out so
+// they can be read in place from a memory mapping: restoring reads the slot
+// records straight out of the mapped file, with no parse step or read buffer.
+//--------------------------------------------------------------------------------
+
+// Viewer state saved along with the scene
+struct ViewState {
+  RigTForm eye;
+  int selected;          // index of the selected object
+
+  ViewState() : selected(0) {}
+};
+
+// Read-only memory mapping of a whole file
+class MappedFile {
+public:
+  explicit MappedFile(const std::string& filename);
+  ~MappedFile();
+
+  const char *data() const {
+    return data_;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+private:
+  const char *data_;
+  size_t size_;
+
+  MappedFile(const MappedFile&);
+  const MappedFile& operator= (const MappedFile&);
+};
+
+class SnapshotWriter {
+public:
+  // Deltas are relative to the scene's state at construction until the
+  // first snapshot is written
+  explicit SnapshotWriter(const SceneStore& scene);
+
+  // Writes every slot to a snapshot file; throws on I/O errors
+  void writeSnapshot(const std::string& filename, const ViewState& view);
+
+  // Starts a delta stream
+  static void writeDeltaStreamHeader(std::ostream& os);
+
+  // Appends the slots edited since the last snapshot or delta, the free
+  // list and the view to a delta stream. Returns the number of slots written.
+  int writeDelta(std::ostream& os, const ViewState& view);
+
+  // Counts the scene's current state as saved, e.g. after restoring it
+  void markSaved() {
+    savedVersion_ = scene_.version();
+  }
+
+private:
+  const SceneStore& scene_;
+  unsigned savedVersion_;
+  std::vector<int> freeSlots_;
+};
+
+// Replaces the scene's contents and the view with a snapshot file's
+void restoreSnapshot(const std::string& filename, SceneStore& scene, ViewState& view);
+
+// Applies the deltas of a delta stream in order
+class DeltaReader {
+public:
+  explicit DeltaReader(const std::string& filename);
+
+  // Applies the next delta; false once the stream is exhausted
+  bool applyNext(SceneStore& scene, ViewState& view);
+
+  int deltasApplied() const {
+    return applied_;
+  }
+
+private:
+  std::string filename_;
+  MappedFile file_;
+  size_t pos_;
+  int applied_;
+};
+
+// Hash of the saved state of every slot, for checking that a restore or
+// replay reproduced a scene exactly
+unsigned sceneChecksum(const SceneStore& scene);
+
+#endif
@@ -0,0 +1,457 @@
+#include <vector>
+#include <cmath>
+#include <cstring>
+#include <cassert>
+#include <algorithm>
+
+#include "cvec.h"
+#include "matrix4f.h"
+#include "geometrymaker.h"
+#include "jobsystem.h"
+#include "rendercmd.h"
+#include "image.h"
+#include "lanes.h"
+#include "timer.h"
+#include "profiler.h"
+#include "softraster.h"
+
+using namespace std;
+
+// Vertices snap to 1/16 pixel, so the edge functions of the two triangles
+// sharing an edge are exact negatives of each other
+static const float SUBPIXELS = 16;
+
+// Smallest w accepted after clipping
+static const float MIN_W = 1e-6f;
+
+// --------- Clipping
+
+namespace {
+struct ClipVertex {
+  Cvec4f clip;
+  Cvec3f eye, normal;
+};
+}
+
+static ClipVertex lerp(const ClipVertex& a, const ClipVertex& b, const float t) {
+  ClipVertex r;
+  r.clip = a.clip + (b.clip - a.clip) * t;
+  r.eye = a.eye + (b.eye - a.eye) * t;
+  r.normal = a.normal + (b.normal - a.normal) * t;
+  return r;
+}
+
+// Signed distance to the near (side 0) or far plane in clip space, -w <= z <= w
+static float planeDistance(const ClipVertex& v, const int side) {
+  return side == 0 ? v.clip[3] + v.clip[2] : v.clip[3] - v.clip[2];
+}
+
+// Sutherland-Hodgman against one plane; returns the new vertex count
+static int clipPolygon(const ClipVertex *in, const int n, const int side, ClipVertex *out) {
+  int m = 0;
+  for (int i = 0; i < n; ++i) {
+    const ClipVertex& a = in[i];
+    const ClipVertex& b = in[(i + 1) % n];
+    const float da = planeDistance(a, side), db = planeDistance(b, side);
+    if (da >= 0)
+      out[m++] = a;
+    if ((da >= 0) != (db >= 0))
+      out[m++] = lerp(a, b, da / (da - db));
+  }
+  return m;
+}
+
+// Bits of the clip planes a vertex is outside of: x, y and z below -w, then above w
+static int outcode(const Cvec4f& c) {
+  const float w = c[3];
+  return (c[0] < -w) | (c[0] > w) << 1 | (c[1] < -w) << 2 | (c[1] > w) << 3 |
+    (c[2] < -w) << 4 | (c[2] > w) << 5;
+}
+
+static const int Z_OUTCODES = 3 << 4;
+
+static Matrix4f columnMajorMatrix(const float m[16]) {
+  return Matrix4f(Cvec4f(m[0], m[1], m[2], m[3]), Cvec4f(m[4], m[5], m[6], m[7]),
+                  Cvec4f(m[8], m[9], m[10], m[11]), Cvec4f(m[12], m[13], m[14], m[15]));
+}
+
+// --------- SoftRasterizer
+
+SoftRasterizer::SoftRasterizer(JobSystem& js, const int width, const int height, const int tileSize)
+  : js_(js), width_(width), height_(height), tileSize_(tileSize),
+    tilesX_((width + tileSize - 1) / tileSize), tilesY_((height + tileSize - 1) / tileSize),
+    image_(width, height), depth_(width * height + 4), meshes_(NUM_GEOMETRIES),
+    clearColor_(128.f / 255, 200.f / 255, 1), queue_(NULL), grain_(64), numBins_(0), shaded_(0) {
+  assert(tileSize % 4 == 0);
+}
+
+void SoftRasterizer::setMesh(const int geometry, const vector<RasterVertex>& vertices,
+                             const vector<unsigned short>& indices) {
+  if (geometry >= (int)meshes_.size())
+    meshes_.resize(geometry + 1);
+  meshes_[geometry].vertices = vertices;
+  meshes_[geometry].indices = indices;
+}
+
+void SoftRasterizer::setShading(const int shader, const RasterShading shading) {
+  if (shader >= (int)shading_.size())
+    shading_.resize(shader + 1, SHADE_DIFFUSE);
+  shading_[shader] = shading;
+}
+
+void SoftRasterizer::render(const RenderQueue& queue) {
+  ProfileScope scope("software raster");
+  const int n = queue.size();
+  queue_ = &queue;
+  projection_ = columnMajorMatrix(queue.globals.proj);
+  numBins_ = (n + grain_ - 1) / grain_;
+  if ((int)bins_.size() < numBins_)
+    bins_.resize(numBins_);
+  shaded_ = 0;
+
+  const long long t0 = nowNanos();
+  if (n > 0)
+    js_.parallelFor(0, n, grain_, geometryJob, this);
+  const long long t1 = nowNanos();
+  js_.parallelFor(0, tilesX_ * tilesY_, 1, rasterJob, this);
+  const long long t2 = nowNanos();
+
+  stats_ = SoftRasterStats();
+  stats_.packets = n;
+  for (int k = 0; k < numBins_; ++k) {
+    stats_.triangles += bins_[k].meshTriangles;
+    stats_.trianglesDrawn += bins_[k].drawn;
+    stats_.binEntries += bins_[k].binEntries;
+  }
+  stats_.pixelsShaded = shaded_;
+  stats_.geometryNanos = t1 - t0;
+  stats_.rasterNanos = t2 - t1;
+}
+
+void SoftRasterizer::geometryJob(int begin, int end, void *data) {
+  ProfileScope scope("raster geometry");
+  SoftRasterizer& r = *static_cast<SoftRasterizer*>(data);
+  // parallelFor may hand out several grains at once, e.g. on one thread;
+  // each still gets its own bins
+  for (int first = begin; first < end; first += r.grain_) {
+    Bins& bins = r.bins_[first / r.grain_];
+    bins.tiles.resize(r.tilesX_ * r.tilesY_);
+    for (size_t t = 0; t < bins.tiles.size(); ++t) {
+      bins.tiles[t].clear();
+    }
+    bins.meshTriangles = 0;
+    bins.drawn = 0;
+    bins.binEntries = 0;
+    for (int i = first; i < min(end, first + r.grain_); ++i) {
+      r.drawPacket((*r.queue_)[i], bins);
+    }
+  }
+}
+
+void SoftRasterizer::drawPacket(const DrawPacket& p, Bins& bins) {
+  if (p.geometry >= meshes_.size())
+    return;
+  const Mesh& mesh = meshes_[p.geometry];
+  const Matrix4f MVM = columnMajorMatrix(p.mvm);
+  const Matrix4f NMVM = columnMajorMatrix(p.nmvm);
+  const Matrix4f MVP = projection_ * MVM;
+  const int shading = p.shader < shading_.size() ? shading_[p.shader] : SHADE_DIFFUSE;
+
+  // Every vertex is transformed and, unless it is beyond the near or far
+  // plane, projected once; triangles then only look their vertices up
+  const int numVertices = mesh.vertices.size();
+  bins.clip.resize(numVertices);
+  bins.outcodes.resize(numVertices);
+  bins.screen.resize(numVertices);
+  for (int v = 0; v < numVertices; ++v) {
+    const Cvec3f& pos = mesh.vertices[v].p;
+    const Cvec3f& n = mesh.vertices[v].n;
+    const Cvec4f p4(pos[0], pos[1], pos[2], 1);
+    const Cvec4f e = MVM * p4;
+    const Cvec4f en = NMVM * Cvec4f(n[0], n[1], n[2], 0);
+    bins.clip[v] = MVP * p4;
+    bins.outcodes[v] = outcode(bins.clip[v]);
+    if (!(bins.outcodes[v] & Z_OUTCODES))
+      project(bins.clip[v], Cvec3f(e[0], e[1], e[2]), Cvec3f(en[0], en[1], en[2]), bins.screen[v]);
+  }
+
+  const int numIndices = mesh.indices.size();
+  bins.meshTriangles += numIndices / 3;
+  for (int k = 0; k + 2 < numIndices; k += 3) {
+    const int i0 = mesh.indices[k], i1 = mesh.indices[k + 1], i2 = mesh.indices[k + 2];
+    const int o0 = bins.outcodes[i0], o1 = bins.outcodes[i1], o2 = bins.outcodes[i2];
+    if (o0 & o1 & o2)
+      continue;   // all outside one plane
+    if (((o0 | o1 | o2) & Z_OUTCODES) == 0) {
+      setupTriangle(bins.screen[i0], bins.screen[i1], bins.screen[i2], p, shading, bins);
+      continue;
+    }
+
+    // Crosses the near or far plane: clip and draw the rest as a fan. The
+    // other planes are left to the screen bounds of the triangles.
+    ClipVertex a[5], b[5];
+    const int idx[3] = {i0, i1, i2};
+    for (int j = 0; j < 3; ++j) {
+      const Cvec3f& pos = mesh.vertices[idx[j]].p;
+      const Cvec3f& n = mesh.vertices[idx[j]].n;
+      const Cvec4f e = MVM * Cvec4f(pos[0], pos[1], pos[2], 1);
+      const Cvec4f en = NMVM * Cvec4f(n[0], n[1], n[2], 0);
+      a[j].clip = bins.clip[idx[j]];
+      a[j].eye = Cvec3f(e[0], e[1], e[2]);
+      a[j].normal = Cvec3f(en[0], en[1], en[2]);
+    }
+    int m = clipPolygon(a, 3, 0, b);
+    m = clipPolygon(b, m, 1, a);
+    ScreenVertex v[5];
+    for (int j = 0; j < m; ++j) {
+      project(a[j].clip, a[j].eye, a[j].normal, v[j]);
+    }
+    for (int j = 1; j + 1 < m; ++j) {
+      setupTriangle(v[0], v[j], v[j + 1], p, shading, bins);
+    }
+  }
+}
+
+void SoftRasterizer::project(const Cvec4f& clip, const Cvec3f& eye, const Cvec3f& normal,
+                             ScreenVertex& v) const {
+  const float invW = 1 / max(clip[3], MIN_W);
+  v.x = std::floor(((clip[0] * invW + 1) * 0.5f * width_) * SUBPIXELS + 0.5f) / SUBPIXELS;
+  v.y = std::floor(((clip[1] * invW + 1) * 0.5f * height_) * SUBPIXELS + 0.5f) / SUBPIXELS;
+  v.attrib[0] = clip[2] * invW * 0.5f + 0.5f;
+  v.attrib[1] = invW;
+  for (int c = 0; c < 3; ++c) {
+    v.attrib[2 + c] = eye[c] * invW;
+    v.attrib[5 + c] = normal[c] * invW;
+  }
+}
+
+// Culls the triangle if it faces away or covers no pixel center, else sets
+// it up and bins it. Edge i runs from vertex i + 1 to vertex i + 2; its
+// function is positive on the inside of counterclockwise triangles, which
+// like GL's default front faces are the ones kept.
+void SoftRasterizer::setupTriangle(const ScreenVertex& a, const ScreenVertex& b, const ScreenVertex& c,
+                                   const DrawPacket& p, const int shading, Bins& bins) {
+  const ScreenVertex *v[3] = {&a, &b, &c};
+  const float dx1 = b.x - a.x, dy1 = b.y - a.y, dx2 = c.x - a.x, dy2 = c.y - a.y;
+  const float area = dx1 * dy2 - dx2 * dy1;
+  if (!(area > 0))
+    return;
+
+  Triangle t;
+  t.x0 = max(0, (int)std::ceil(min(a.x, min(b.x, c.x)) - 0.5f));
+  t.x1 = min(width_ - 1, (int)std::floor(max(a.x, max(b.x, c.x)) - 0.5f));
+  t.y0 = max(0, (int)std::ceil(min(a.y, min(b.y, c.y)) - 0.5f));
+  t.y1 = min(height_ - 1, (int)std::floor(max(a.y, max(b.y, c.y)) - 0.5f));
+  if (t.x0 > t.x1 || t.y0 > t.y1)
+    return;
+
+  // Pixels on an edge belong to the triangle to its right or below it
+  // (top-left rule), so shared edges are drawn once
+  t.inclusive = 0;
+  for (int i = 0; i < 3; ++i) {
+    const ScreenVertex& j = *v[(i + 1) % 3];
+    const ScreenVertex& k = *v[(i + 2) % 3];
+    t.edgeA[i] = j.y - k.y;
+    t.edgeB[i] = k.x - j.x;
+    t.edgeC[i] = j.x * k.y - k.x * j.y;
+    if (t.edgeA[i] > 0 || (t.edgeA[i] == 0 && t.edgeB[i] < 0))
+      t.inclusive |= 1 << i;
+  }
+
+  t.originX = a.x;
+  t.originY = a.y;
+  const float invArea = 1 / area;
+  for (int i = 0; i < 8; ++i) {
+    const float d1 = b.attrib[i] - a.attrib[i], d2 = c.attrib[i] - a.attrib[i];
+    t.plane[i][0] = a.attrib[i];
+    t.plane[i][1] = (d1 * dy2 - d2 * dy1) * invArea;
+    t.plane[i][2] = (dx1 * d2 - dx2 * d1) * invArea;
+  }
+  for (int i = 0; i < 3; ++i) {
+    t.color[i] = p.color[i];
+  }
+  t.shading = shading;
+
+  ++bins.drawn;
+  for (int ty = t.y0 / tileSize_; ty <= t.y1 / tileSize_; ++ty) {
+    for (int tx = t.x0 / tileSize_; tx <= t.x1 / tileSize_; ++tx) {
+      bins.tiles[ty * tilesX_ + tx].push_back(t);
+      ++bins.binEntries;
+    }
+  }
+}
+
+void SoftRasterizer::rasterJob(int begin, int end, void *data) {
+  ProfileScope scope("raster tiles");
+  SoftRasterizer& r = *static_cast<SoftRasterizer*>(data);
+  long long shaded = 0;
+  for (int tile = begin; tile < end; ++tile) {
+    r.drawTile(tile, shaded);
+  }
+  __sync_fetch_and_add(&r.shaded_, shaded);
+}
+
+void SoftRasterizer::drawTile(const int tile, long long& shaded) {
+  const int x0 = (tile % tilesX_) * tileSize_, y0 = (tile / tilesX_) * tileSize_;
+  const int x1 = min(width_, x0 + tileSize_) - 1, y1 = min(height_, y0 + tileSize_) - 1;
+
+  unsigned char clear[4];
+  for (int c = 0; c < 3; ++c) {
+    clear[c] = (unsigned char)(min(max(clearColor_[c], 0.f), 1.f) * 255 + 0.5f);
+  }
+  clear[3] = 255;
+  for (int y = y0; y <= y1; ++y) {
+    std::fill(&depth_[y * width_ + x0], &depth_[y * width_ + x1] + 1, 0.f);
+    for (int x = x0; x <= x1; ++x) {
+      memcpy(image_.pixel(x, y), clear, 4);
+    }
+  }
+
+  // Bins in job order and triangles in bin order are packet order
+  for (int k = 0; k < numBins_; ++k) {
+    const vector<Triangle>& list = bins_[k].tiles[tile];
+    for (size_t i = 0; i < list.size(); ++i) {
+      const Triangle& t = list[i];
+      drawTriangle(t, max(x0, t.x0), max(y0, t.y0), min(x1, t.x1), min(y1, t.y1), shaded);
+    }
+  }
+}
+
+// Draws the part of the triangle inside the pixel rectangle, which lies
+// within one tile. Quads start at multiples of 4 so they never straddle two
+// tiles; lanes past the right edge of the image are masked off.
+void SoftRasterizer::drawTriangle(const Triangle& t, const int x0, const int y0, const int x1, const int y1,
+                                  long long& shaded) {
+  const FrameGlobals& globals = queue_->globals;
+  const Cvec4f laneOffset(0.5f, 1.5f, 2.5f, 3.5f);
+  for (int y = y0; y <= y1; ++y) {
+    const float py = y + 0.5f;
+    float rowEdge[3], rowPlane[8];
+    for (int i = 0; i < 3; ++i) {
+      rowEdge[i] = t.edgeB[i] * py + t.edgeC[i];
+    }
+    for (int a = 0; a < 8; ++a) {
+      rowPlane[a] = t.plane[a][0] + t.plane[a][2] * (py - t.originY);
+    }
+    // Narrow the row to the span inside all three edges, a pixel wider on
+    // each side against rounding, so empty quads are not visited
+    float spanX0 = (float)x0, spanX1 = (float)x1;
+    for (int i = 0; i < 3; ++i) {
+      if (t.edgeA[i] != 0) {
+        const float cross = -rowEdge[i] / t.edgeA[i] - 0.5f;
+        if (t.edgeA[i] > 0)
+          spanX0 = std::max(spanX0, cross - 1);
+        else
+          spanX1 = std::min(spanX1, cross + 1);
+      } else if (rowEdge[i] < 0) {
+        spanX1 = -1;
+      }
+    }
+    if (spanX0 > spanX1)
+      continue;
+    const int rowX1 = (int)spanX1;
+    float *depthRow = &depth_[y * width_];
+
+    for (int x = (int)spanX0 & ~3; x <= rowX1; x += 4) {
+      const Cvec4f px = Cvec4f((float)x) + laneOffset;
+      int bits = x + 4 <= width_ ? 15 : (1 << (width_ - x)) - 1;
+      bits &= greaterLanes(px * t.edgeA[0] + Cvec4f(rowEdge[0]), Cvec4f(0), (t.inclusive & 1) != 0) &
+              greaterLanes(px * t.edgeA[1] + Cvec4f(rowEdge[1]), Cvec4f(0), (t.inclusive & 2) != 0) &
+              greaterLanes(px * t.edgeA[2] + Cvec4f(rowEdge[2]), Cvec4f(0), (t.inclusive & 4) != 0);
+      if (!bits)
+        continue;
+
+      const Cvec4f dx = px - Cvec4f(t.originX);
+      const Cvec4f z = Cvec4f(rowPlane[0]) + dx * t.plane[0][1];
+      float *depth = depthRow + x;
+      bits &= greaterLanes(z, loadLanes(depth), false);
+      if (!bits)
+        continue;
+
+      Cvec4f intensity(1);
+      if (t.shading != SHADE_SOLID) {
+        // perspective correct eye position and normal
+        const Cvec4f w = divLanes(Cvec4f(1), Cvec4f(rowPlane[1]) + dx * t.plane[1][1]);
+        Vec3Lanes pos, n;
+        pos.x = mulLanes(Cvec4f(rowPlane[2]) + dx * t.plane[2][1], w);
+        pos.y = mulLanes(Cvec4f(rowPlane[3]) + dx * t.plane[3][1], w);
+        pos.z = mulLanes(Cvec4f(rowPlane[4]) + dx * t.plane[4][1], w);
+        n.x = Cvec4f(rowPlane[5]) + dx * t.plane[5][1];
+        n.y = Cvec4f(rowPlane[6]) + dx * t.plane[6][1];
+        n.z = Cvec4f(rowPlane[7]) + dx * t.plane[7][1];
+        n.normalize();
+        if (globals.sunMode) {
+          Vec3Lanes sun;
+          sun.x = Cvec4f(globals.eyeLight1[0]);
+          sun.y = Cvec4f(globals.eyeLight1[1]);
+          sun.z = Cvec4f(globals.eyeLight1[2]);
+          intensity = maxLanes(dotLanes(n, sun), Cvec4f(0));
+        } else {
+          intensity = pointLightLanes(n, pos, globals.eyeLight1) + pointLightLanes(n, pos, globals.eyeLight2);
+        }
+      }
+
+      unsigned char rgb[3][4];
+      for (int c = 0; c < 3; ++c) {
+        const Cvec4f v = minLanes(intensity * t.color[c], Cvec4f(1)) * 255.f + Cvec4f(0.5f);
+        for (int l = 0; l < 4; ++l) {
+          rgb[c][l] = (unsigned char)v[l];
+        }
+      }
+      for (int l = 0; l < 4; ++l) {
+        if (!(bits >> l & 1))
+          continue;
+        depth[l] = z[l];
+        unsigned char *out = image_.pixel(x + l, y);
+        out[0] = rgb[0][l], out[1] = rgb[1][l], out[2] = rgb[2][l], out[3] = 255;
+        ++shaded;
+      }
+    }
+  }
+}
+
+void makeViewerMesh(const int geometry, const float groundY, const float groundSize,
+                    vector<RasterVertex>& vertices, vector<unsigned short>& indices) {
+  int vbLen, ibLen;
+  switch (geometry) {
+  case GEOMETRY_GROUND: {
+    // as initGround(), without texture coordinates
+    const float s = groundSize;
+    const GenericVertex ground[4] = {
+      GenericVertex(-s, groundY, -s, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0),
+      GenericVertex(-s, groundY,  s, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0),
+      GenericVertex( s, groundY,  s, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0),
+      GenericVertex( s, groundY, -s, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0)
+    };
+    const unsigned short groundIdx[6] = {0, 1, 2, 0, 2, 3};
+    vertices.assign(ground, ground + 4);
+    indices.assign(groundIdx, groundIdx + 6);
+    break;
+  }
+  case GEOMETRY_CUBE:
+    getCubeVbIbLen(vbLen, ibLen);
+    vertices.resize(vbLen);
+    indices.resize(ibLen);
+    makeCube(1, vertices.begin(), indices.begin());
+    break;
+  case GEOMETRY_SPHERE:
+    // the viewer's g_sphereSlices and g_sphereStacks
+    getSphereVbIbLen(24, 12, vbLen, ibLen);
+    vertices.resize(vbLen);
+    indices.resize(ibLen);
+    makeSphere(0.5, 24, 12, vertices.begin(), indices.begin());
+    break;
+  default:
+    vertices.clear();
+    indices.clear();
+  }
+}
+
+void setViewerMeshes(SoftRasterizer& r, const float groundY, const float groundSize) {
+  vector<RasterVertex> vtx;
+  vector<unsigned short> idx;
+  for (int g = 0; g < NUM_GEOMETRIES; ++g) {
+    makeViewerMesh(g, groundY, groundSize, vtx, idx);
+    r.setMesh(g, vtx, idx);
+  }
+}
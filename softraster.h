@@ -0,0 +1,176 @@
+#ifndef SOFTRASTER_H
+#define SOFTRASTER_H
+
+#include <vector>
+
+#include "cvec.h"
+#include "matrix4f.h"
+#include "geometrymaker.h"
+#include "jobsystem.h"
+#include "rendercmd.h"
+#include "image.h"
+
+//--------------------------------------------------------------------------------
+// Software render backend, for machines without a GPU and for deterministic
+// images in regression tests. It draws a RenderQueue like the GL backend
+// does: the same meshes, the packets' model view and normal matrices and the
+// queue's projection, back faces culled, a depth buffer where nearer is
+// greater, and shading as in shaders/: diffuse lighting from the two point
+// lights or the sun, or a solid color. Shadows are not drawn and textures
+// are not sampled, so the textured shader shades like the diffuse one.
+//
+// A frame runs in two parallel passes. The geometry pass transforms the
+// packets' vertices, clips triangles against the near and far planes, sets
+// them up and bins them into the screen tiles their bounds overlap, each
+// job for its own range of packets. The raster pass then draws every tile in
+// one job, going through the bins in packet order, so the image does not
+// depend on the number of threads. Pixels are covered, depth tested and
+// shaded four at a time in SSE registers.
+//--------------------------------------------------------------------------------
+
+// Vertex of a mesh: position and normal. Assignable from GenericVertex, so
+// the make* functions of geometrymaker.h can fill it.
+struct RasterVertex {
+  Cvec3f p, n;
+
+  RasterVertex() {}
+
+  RasterVertex(const GenericVertex& v) {
+    *this = v;
+  }
+
+  RasterVertex& operator = (const GenericVertex& v) {
+    p = v.pos;
+    n = v.normal;
+    return *this;
+  }
+};
+
+// How the fragments of a shader are colored
+enum RasterShading {
+  SHADE_DIFFUSE,         // packet color times the diffuse light, as diffuse-gl3.fshader
+  SHADE_SOLID            // packet color, as solid-gl3.fshader
+};
+
+// Counters and timings of the last frame
+struct SoftRasterStats {
+  int packets;
+  long long triangles;           // in the packets' meshes
+  long long trianglesDrawn;      // set up after culling and clipping
+  long long binEntries;          // triangles times the tiles they were binned into
+  long long pixelsShaded;        // fragments that passed the depth test
+  long long geometryNanos, rasterNanos;
+
+  SoftRasterStats()
+    : packets(0), triangles(0), trianglesDrawn(0), binEntries(0), pixelsShaded(0),
+      geometryNanos(0), rasterNanos(0) {}
+};
+
+class SoftRasterizer {
+public:
+  // Renders width x height images with the given job system. Tiles are
+  // tileSize pixels square; tileSize must be a multiple of 4.
+  SoftRasterizer(JobSystem& js, const int width, const int height, const int tileSize = 64);
+
+  // Mesh drawn for packets of the given GeometryId, as an indexed triangle list
+  void setMesh(const int geometry, const std::vector<RasterVertex>& vertices,
+               const std::vector<unsigned short>& indices);
+
+  // Shading of packets with the given shader id; SHADE_DIFFUSE by default
+  void setShading(const int shader, const RasterShading shading);
+
+  void setClearColor(const Cvec3f& color) {
+    clearColor_ = color;
+  }
+
+  // Draws the queue's packets over the clear color
+  void render(const RenderQueue& queue);
+
+  // RGBA, rows bottom to top
+  const Image& image() const {
+    return image_;
+  }
+
+  const SoftRasterStats& stats() const {
+    return stats_;
+  }
+
+private:
+  struct Mesh {
+    std::vector<RasterVertex> vertices;
+    std::vector<unsigned short> indices;
+  };
+
+  // A vertex projected to pixels, snapped to the subpixel grid, with the
+  // attributes interpolated across triangles: window depth, 1/w, and eye
+  // position and normal divided by w
+  struct ScreenVertex {
+    float x, y;
+    float attrib[8];
+  };
+
+  // A set up triangle. Edge functions and attribute planes are in pixels;
+  // the planes are relative to (originX, originY).
+  struct Triangle {
+    float edgeA[3], edgeB[3], edgeC[3];
+    int inclusive;                 // bit i: pixels exactly on edge i are inside
+    int x0, y0, x1, y1;            // pixel bounds, inclusive, clipped to the screen
+    float originX, originY;
+    float plane[8][3];             // depth, 1/w, eye position / w, normal / w
+    float color[3];
+    int shading;
+  };
+
+  // What one geometry job produced, and its scratch space. Triangles are
+  // copied into every tile they overlap, so each tile reads its own
+  // triangles front to back; most small triangles overlap only one.
+  struct Bins {
+    std::vector<std::vector<Triangle> > tiles;   // by tile, in packet order
+    long long meshTriangles, drawn, binEntries;
+    std::vector<Cvec4f> clip;                    // vertices of the packet being drawn
+    std::vector<int> outcodes;
+    std::vector<ScreenVertex> screen;
+  };
+
+  JobSystem& js_;
+  int width_, height_, tileSize_, tilesX_, tilesY_;
+  Image image_;
+  std::vector<float> depth_;
+  std::vector<Mesh> meshes_;
+  std::vector<int> shading_;
+  Cvec3f clearColor_;
+  std::vector<Bins> bins_;
+  SoftRasterStats stats_;
+
+  // State of the frame being rendered, read by the jobs
+  const RenderQueue *queue_;
+  Matrix4f projection_;
+  int grain_;            // packets per geometry job
+  int numBins_;          // geometry jobs of the frame
+  long long shaded_;
+
+  static void geometryJob(int begin, int end, void *data);
+  static void rasterJob(int begin, int end, void *data);
+  void drawPacket(const DrawPacket& p, Bins& bins);
+  void project(const Cvec4f& clip, const Cvec3f& eye, const Cvec3f& normal, ScreenVertex& v) const;
+  void setupTriangle(const ScreenVertex& a, const ScreenVertex& b, const ScreenVertex& c,
+                     const DrawPacket& p, const int shading, Bins& bins);
+  void drawTriangle(const Triangle& t, const int x0, const int y0, const int x1, const int y1,
+                    long long& shaded);
+  void drawTile(const int tile, long long& shaded);
+
+  SoftRasterizer(const SoftRasterizer&);
+  const SoftRasterizer& operator= (const SoftRasterizer&);
+};
+
+// Fills vertices and indices with the viewer's mesh of the given GeometryId:
+// the ground plane of half size groundSize at height groundY, the unit cube
+// or the sphere of diameter 1, made with the same geometrymaker.h calls and
+// parameters. Unknown ids get an empty mesh.
+void makeViewerMesh(const int geometry, const float groundY, const float groundSize,
+                    std::vector<RasterVertex>& vertices, std::vector<unsigned short>& indices);
+
+// Gives the rasterizer the viewer's meshes, see makeViewerMesh()
+void setViewerMeshes(SoftRasterizer& r, const float groundY, const float groundSize);
+
+#endif
@@ -0,0 +1,239 @@
+#include <vector>
+#include <string>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <stdexcept>
+
+#include <pthread.h>
+
+#include "glsupport.h"
+#include "image.h"
+#include "texture.h"
+
+using namespace std;
+using namespace tr1;
+
+TextureManager::TextureManager(const size_t residentBudget, const size_t uploadBudget)
+  : nextPbo_(0), usePbos_(GLEW_ARB_pixel_buffer_object),
+    residentBudget_(residentBudget), uploadBudget_(uploadBudget),
+    residentBytes_(0), bytesUploaded_(0), evictions_(0), frame_(1), stop_(false) {
+  GlStateCache& gl = glState();
+  const unsigned char white[4] = {255, 255, 255, 255};
+  gl.bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  gl.activeTexture(GL_TEXTURE0);
+  gl.bindTexture(GL_TEXTURE_2D, fallback_);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, white);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  fallback_.setLabel("fallback texture");
+  checkGlErrors();
+
+  pthread_mutex_init(&lock_, NULL);
+  pthread_cond_init(&requested_, NULL);
+  if (pthread_create(&loader_, NULL, loaderMain, this) != 0)
+    throw runtime_error("pthread_create fails");
+}
+
+TextureManager::~TextureManager() {
+  pthread_mutex_lock(&lock_);
+  stop_ = true;
+  pthread_cond_broadcast(&requested_);
+  pthread_mutex_unlock(&lock_);
+  pthread_join(loader_, NULL);
+  pthread_cond_destroy(&requested_);
+  pthread_mutex_destroy(&lock_);
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    delete entries_[i];
+  }
+}
+
+TextureId TextureManager::add(const string& fileName) {
+  Entry *e = new Entry();
+  e->fileName = fileName;
+  e->state = UNLOADED;
+  e->uploaded = 0;
+  e->gpuBytes = 0;
+  e->lastUsed = 0;
+  entries_.push_back(e);
+  return entries_.size() - 1;
+}
+
+void *TextureManager::loaderMain(void *arg) {
+  static_cast<TextureManager*>(arg)->loadRequests();
+  return NULL;
+}
+
+// The loader thread: loads requested files in order until stopped
+void TextureManager::loadRequests() {
+  for (;;) {
+    pthread_mutex_lock(&lock_);
+    while (!stop_ && requests_.empty())
+      pthread_cond_wait(&requested_, &lock_);
+    if (stop_) {
+      pthread_mutex_unlock(&lock_);
+      return;
+    }
+    Entry *e = requests_.front();
+    requests_.pop_front();
+    pthread_mutex_unlock(&lock_);
+    load(*e);
+  }
+}
+
+// Runs on the loader thread. Publishes the mip chain by setting the state
+// last, after a full barrier.
+void TextureManager::load(Entry& e) {
+  int state = LOADED;
+  try {
+    buildMipChain(readPpm(e.fileName), e.levels);
+  }
+  catch (const exception& ex) {
+    e.levels.clear();
+    e.error = ex.what();
+    state = FAILED;
+  }
+  __sync_synchronize();
+  e.state = state;
+}
+
+void TextureManager::bind(const TextureId id, const int unit) {
+  Entry& e = *entries_[id];
+  e.lastUsed = frame_;
+  if (e.state == UNLOADED) {
+    e.state = LOADING;
+    pthread_mutex_lock(&lock_);
+    requests_.push_back(&e);
+    pthread_cond_signal(&requested_);
+    pthread_mutex_unlock(&lock_);
+  }
+
+  // The GL texture only exists once the load is done, and then the
+  // levels are no longer written
+  const bool ready = e.texture && e.uploaded < (int)e.levels.size();
+  GlStateCache& gl = glState();
+  gl.activeTexture(GL_TEXTURE0 + unit);
+  gl.bindTexture(GL_TEXTURE_2D, ready ? *e.texture : fallback_);
+}
+
+int TextureManager::texturesResident() const {
+  int n = 0;
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    n += entries_[i]->texture ? 1 : 0;
+  }
+  return n;
+}
+
+// Creates the texture with storage for every level, none of it filled in;
+// BASE_LEVEL keeps sampling off the levels still missing
+void TextureManager::allocate(Entry& e) {
+  GlStateCache& gl = glState();
+  e.texture.reset(new GlTexture());
+  gl.bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  gl.activeTexture(GL_TEXTURE0);
+  gl.bindTexture(GL_TEXTURE_2D, *e.texture);
+  e.texture->setLabel(e.fileName.c_str());
+
+  const int numLevels = e.levels.size();
+  e.gpuBytes = 0;
+  for (int i = 0; i < numLevels; ++i) {
+    const Image& img = e.levels[i];
+    glTexImage2D(GL_TEXTURE_2D, i, GL_RGBA8, img.width, img.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    e.gpuBytes += img.bytes();
+  }
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, numLevels - 1);
+  e.uploaded = numLevels;
+  residentBytes_ += e.gpuBytes;
+}
+
+// Copies the level into a pixel buffer and lets the driver transfer it from
+// there, so glTexSubImage2D returns without waiting for the copy. The two
+// buffers alternate and are orphaned before mapping, so mapping never waits
+// for the previous transfer out of the same buffer either.
+void TextureManager::uploadLevel(Entry& e, const int level) {
+  GlStateCache& gl = glState();
+  const Image& img = e.levels[level];
+  gl.activeTexture(GL_TEXTURE0);
+  gl.bindTexture(GL_TEXTURE_2D, *e.texture);
+
+  const GLvoid *src = &img.pixels[0];
+  if (usePbos_) {
+    gl.bindBuffer(GL_PIXEL_UNPACK_BUFFER, pbos_[nextPbo_]);
+    nextPbo_ ^= 1;
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, img.bytes(), NULL, GL_STREAM_DRAW);
+    void *dst = glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+    if (dst) {
+      memcpy(dst, src, img.bytes());
+      if (glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER))
+        src = NULL;   // offset 0 into the pixel buffer
+    }
+    if (src)
+      gl.bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);   // mapping failed, upload from memory
+  }
+  glTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, img.width, img.height, GL_RGBA, GL_UNSIGNED_BYTE, src);
+  gl.bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level);
+
+  e.uploaded = level;
+  bytesUploaded_ += img.bytes();
+}
+
+// Frees the least recently used textures that were not used last frame
+// until the resident ones fit the budget
+void TextureManager::evict() {
+  while (residentBytes_ > residentBudget_) {
+    Entry *victim = NULL;
+    for (size_t i = 0; i < entries_.size(); ++i) {
+      Entry *e = entries_[i];
+      if (e->texture && e->lastUsed < frame_ && (!victim || e->lastUsed < victim->lastUsed))
+        victim = e;
+    }
+    if (!victim)
+      return;
+    victim->texture.reset();
+    victim->uploaded = victim->levels.size();
+    residentBytes_ -= victim->gpuBytes;
+    victim->gpuBytes = 0;
+    ++evictions_;
+  }
+}
+
+bool TextureManager::streaming() const {
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    const Entry& e = *entries_[i];
+    if (e.lastUsed == frame_ && (e.state == LOADING || (e.state == LOADED && e.uploaded > 0)))
+      return true;
+  }
+  return false;
+}
+
+void TextureManager::update() {
+  bytesUploaded_ = 0;
+  evict();
+
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    Entry& e = *entries_[i];
+    const int state = e.state;
+    __sync_synchronize();   // pairs with load(): levels are complete once LOADED is seen
+    if (state == FAILED && !e.error.empty()) {
+      cerr << "Texture " << e.fileName << " failed to load: " << e.error << endl;
+      e.error.clear();
+    }
+    if (state != LOADED || e.lastUsed != frame_)
+      continue;
+
+    if (!e.texture)
+      allocate(e);
+    while (e.uploaded > 0) {
+      const size_t bytes = e.levels[e.uploaded - 1].bytes();
+      if (bytesUploaded_ > 0 && bytesUploaded_ + bytes > uploadBudget_)
+        break;
+      uploadLevel(e, e.uploaded - 1);
+    }
+  }
+  ++frame_;
+}
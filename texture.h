@@ -0,0 +1,118 @@
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+#include <vector>
+#include <deque>
+#include <string>
+#if __GNUG__
+#   include <tr1/memory>
+#endif
+
+#include <pthread.h>
+
+#include "glsupport.h"
+#include "image.h"
+
+//--------------------------------------------------------------------------------
+// Streamed, mipmapped textures. Image files are decoded and their mip chains
+// built on a loader thread of the manager's own, never on the GL thread or
+// by a job it could end up running while it waits; the GL thread then uploads a few levels
+// per frame, smallest first, through a pair of pixel buffer objects, and
+// clamps GL_TEXTURE_BASE_LEVEL to the finest level that has arrived. So the
+// render thread never waits for a file or a large upload: a texture is drawn
+// blurry at first and sharpens over the following frames. Until its first
+// level is in, a 1x1 white texture is bound instead.
+//
+// GPU memory is capped by a residency budget. Textures not used in the last
+// frame are evicted, least recently used first, when it is exceeded; their
+// CPU copy is kept so they stream back in when used again.
+//--------------------------------------------------------------------------------
+
+typedef int TextureId;
+static const TextureId NO_TEXTURE = -1;
+
+class TextureManager : Noncopyable {
+public:
+  // Both budgets in bytes. At least one mip level is uploaded per frame, even
+  // if it alone is over uploadBudget.
+  TextureManager(const size_t residentBudget, const size_t uploadBudget);
+
+  // Waits for the file being loaded, if any; queued loads are dropped
+  ~TextureManager();
+
+  // Registers a PPM file. Nothing is read until the texture is first bound.
+  TextureId add(const std::string& fileName);
+
+  // Binds the texture, or the best stand-in available, to the given unit and
+  // marks it used this frame. A first bind starts loading the file.
+  void bind(const TextureId id, const int unit);
+
+  // Once per frame on the GL thread: evicts textures over the residency
+  // budget and streams pending mip levels of textures used last frame
+  void update();
+
+  int texturesResident() const;
+
+  // A texture bound last frame is still loading or has mip levels left to
+  // upload, so frames keep changing without anything else changing
+  bool streaming() const;
+
+  size_t residentBytes() const {
+    return residentBytes_;
+  }
+
+  // Uploaded by the last update()
+  size_t bytesUploaded() const {
+    return bytesUploaded_;
+  }
+
+  int evictions() const {
+    return evictions_;
+  }
+
+private:
+  enum State {
+    UNLOADED,     // not requested yet, or failed to load
+    LOADING,      // queued for or being read by the loader thread
+    LOADED,       // CPU mip chain ready, GL texture may be partially uploaded
+    FAILED
+  };
+
+  struct Entry {
+    std::string fileName;
+    volatile int state;            // State, set by the loader thread
+    std::vector<Image> levels;     // written by the loader thread before state turns LOADED
+    std::string error;
+    std::tr1::shared_ptr<GlTexture> texture;
+    int uploaded;                  // finest level uploaded, levels.size() when none
+    size_t gpuBytes;
+    unsigned lastUsed;             // frame of the last bind
+  };
+
+  std::vector<Entry*> entries_;
+  GlTexture fallback_;
+  GlBufferObject pbos_[2];
+  int nextPbo_;
+  bool usePbos_;
+  size_t residentBudget_, uploadBudget_;
+  size_t residentBytes_, bytesUploaded_;
+  int evictions_;
+  unsigned frame_;
+
+  // Load requests, shared with the loader thread and guarded by lock_
+  pthread_t loader_;
+  pthread_mutex_t lock_;
+  pthread_cond_t requested_;
+  std::deque<Entry*> requests_;
+  bool stop_;
+
+  static void *loaderMain(void *arg);
+  void loadRequests();
+  static void load(Entry& e);
+
+  void allocate(Entry& e);
+  void uploadLevel(Entry& e, const int level);
+  void evict();
+};
+
+#endif
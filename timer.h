@@ -0,0 +1,39 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <time.h>
+#ifdef __MAC__
+#   include <mach/mach_time.h>
+#endif
+
+// Monotonic clock in nanoseconds. Only differences between two readings are
+// meaningful.
+inline long long nowNanos() {
+#ifdef __MAC__
+  static mach_timebase_info_data_t tb;
+  if (tb.denom == 0)
+    mach_timebase_info(&tb);
+  return (long long)(mach_absolute_time() * tb.numer / tb.denom);
+#else
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#endif
+}
+
+inline double nanosToMillis(const long long ns) {
+  return ns * 1e-6;
+}
+
+// Sleeps for at least ns nanoseconds; the OS may oversleep by a scheduler
+// tick
+inline void sleepNanos(const long long ns) {
+  if (ns <= 0)
+    return;
+  timespec ts;
+  ts.tv_sec = (time_t)(ns / 1000000000LL);
+  ts.tv_nsec = (long)(ns % 1000000000LL);
+  nanosleep(&ts, NULL);
+}
+
+#endif
@@ -1,34 +1,56 @@
 #include "cvec.h"
 #include "matrix4.h"
+#include "rigtform.h"
 #include "visobj.h"
 
+VisObj::VisObj() {
+  this -> store = NULL;
+}
+
+VisObj::VisObj(SceneStore* store, VisObjHandle handle) {
+  this -> store = store;
+  this -> handle = handle;
+}
+
 // VisObj constructor
-VisObj::VisObj(Matrix4 transform, Cvec3f color, VisObj* parent) {
-  this -> transform = transform;
-  this -> color = color;
-  this -> parent = parent;
+VisObj::VisObj(SceneStore* store, RigTForm transform, Cvec3f color, VisObjHandle parent,
+               Cvec3 scale) {
+  this -> store = store;
+  this -> handle = store -> create(transform, scale, color, parent, VISOBJ_CUBE_RADIUS);
+}
+
+VisObjHandle VisObj::getHandle() const {
+  return handle;
 }
 
-void VisObj::setTransform(Matrix4 offset) {
-  transform = transform * offset;
+void VisObj::setTransform(RigTForm offset) {
+  store -> setLocal(handle, store -> getLocal(handle) * offset);
 }
 
-Cvec3f VisObj::getColor() {
-  return color;
+Cvec3f VisObj::getColor() const {
+  return store -> getColor(handle);
 }
 
 void VisObj::setColor(Cvec3f newColor) {
-  color = newColor;
+  store -> setColor(handle, newColor);
+}
+
+VisObjHandle VisObj::getParent() const {
+  return store -> getParent(handle);
+}
+
+void VisObj::setParent(VisObjHandle newParent) {
+  store -> setParent(handle, newParent);
+}
+
+void VisObj::reparent(VisObjHandle newParent) {
+  store -> setParentKeepWorld(handle, newParent);
 }
 
-void VisObj::setParent(VisObj* newParent) {
-  parent = newParent;
+RigTForm VisObj::getTransform() const {
+  return store -> getWorld(handle);
 }
 
-Matrix4 VisObj::getTransform() {
-  if (parent == NULL){
-    return transform;
-  } else {
-    return Matrix4(parent -> getTransform() * transform);
-  }
+Cvec3 VisObj::getScale() const {
+  return store -> getScale(handle);
 }
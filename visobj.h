@@ -1,22 +1,46 @@
 #ifndef VISOBJ_H
 #define VISOBJ_H
 
+#include "cvec.h"
+#include "matrix4.h"
+#include "rigtform.h"
+#include "scenestore.h"
+
+typedef NodeHandle VisObjHandle;
+
+// Thin facade over a node in a SceneStore. The node's components live in
+// the store's arrays; a VisObj only remembers where. Copies refer to the same
+// node.
 class VisObj {
 
   // Instance variables private by default
   private:
-    Matrix4 transform;
-    Cvec3f color;
-    VisObj* parent;
+    SceneStore* store;
+    VisObjHandle handle;
 
   public:
-    VisObj(Matrix4 transform, Cvec3f color, VisObj* parent);
-    Cvec3f getColor();
+    VisObj();
+    VisObj(SceneStore* store, VisObjHandle handle);
+    // Creates a new cube node in store. The scale only shapes this cube and
+    // is not inherited by children.
+    VisObj(SceneStore* store, RigTForm transform, Cvec3f color, VisObjHandle parent,
+           Cvec3 scale = Cvec3(1, 1, 1));
+    VisObjHandle getHandle() const;
+    Cvec3f getColor() const;
     void setColor(Cvec3f newColor);
-    VisObj* getParent();
-    void setParent(VisObj* newParent);
-    void setTransform(Matrix4 offset);
-    Matrix4 getTransform();
+    VisObjHandle getParent() const;
+    // Keeps the local transform, so the object moves with its new parent
+    void setParent(VisObjHandle newParent);
+    // Keeps the world transform instead
+    void reparent(VisObjHandle newParent);
+    void setTransform(RigTForm offset);
+    // World transform. Updates the store's cache of it, so it must not run
+    // while a frame build is using the store.
+    RigTForm getTransform() const;
+    Cvec3 getScale() const;
 };
 
+// Radius of the bounding sphere of the unit cube every VisObj is drawn with
+static const double VISOBJ_CUBE_RADIUS = 0.8660254037844386;
+
 #endif